@@ -10,23 +10,34 @@ the LICENSE file.
 
 #include <Arduino.h>
 
+#include <atomic>
 #include <functional>
 #include <optional>
-#include <queue>
+#include <vector>
 
 #ifdef ESP8266
 #include <espnow.h>
 #endif
 #ifdef ESP32
+#include <esp_idf_version.h>
 #include <esp_now.h>
 #endif
 
+#include "QuackConcurrency.h"
+
+class QuackRecorder;
+
 namespace QuackMeshESPNow {
 
+// The maximum length of an ESP-Now frame
+constexpr uint16_t MAX_DATA_LENGTH = 250;
+
 struct ReceivedData {
   uint8_t srcAddress[6] = {};
-  uint8_t data[250] = {};
-  uint8_t dataLength = 0;
+  uint8_t data[MAX_DATA_LENGTH] = {};
+  uint16_t dataLength = 0;
+  u_long receivedTs = 0;  // The value of micros() in the receive callback
+  int8_t rssi = 0;        // The RSSI of the frame in dBm, 0 if unknown
 
   /**
    * Constructor
@@ -40,8 +51,8 @@ struct ReceivedData {
    * @param data The data that was received
    * @param dataLength The length of the data that was received
    */
-  ReceivedData(const uint8_t srcAddress[6], const uint8_t data[250],
-               uint8_t dataLength);
+  ReceivedData(const uint8_t srcAddress[6], const uint8_t *data,
+               uint16_t dataLength);
 };
 
 /**
@@ -73,26 +84,61 @@ typedef std::function<void(ESPNowSentStatus)>
  */
 struct SendingData {
   uint8_t destAddress[6];
-  uint8_t data[250];
-  uint8_t dataLength;
+  uint8_t data[MAX_DATA_LENGTH];
+  uint16_t dataLength;
   uint8_t maxTriesLeft;
   int channel;
+  bool paced;  // Whether the minimum interval between frames applies
+  u_long deadline;  // The micros() from which on no try is started, 0 if the
+                    // frame may be sent any time
+};
+
+/**
+ * This struct is used to store the link state of a neighbour
+ */
+struct PeerLink {
+  uint8_t address[6];
+  int16_t rssi;            // The smoothed RSSI in dBm
+  uint8_t rateStep;        // The index of the PHY rate used for this peer
+  u_long rateHoldTs;       // The rate is not raised again before this time
+  u_long lastSeenTs;
 };
 
 // Checks if the given addresses are equal
-bool isAddressMatching(const uint8_t actualAddress[6],
-                       const uint8_t expectedAddress[6]);
+inline bool isAddressMatching(const uint8_t actualAddress[6],
+                              const uint8_t expectedAddress[6]) {
+  return memcmp(actualAddress, expectedAddress, 6) == 0;
+}
+
+/**
+ * The states of the send state machine of an ESPNowClient
+ * SendIdle: No frame is handed to the driver
+ * SendWaitingForStatus: A frame was handed to the driver, waiting for the
+ * sent callback
+ * SendStatusAvailable: The sent callback stored a new status that update() has
+ * not processed yet
+ */
+enum ESPNowSendState : uint8_t {
+  SendIdle = 0,
+  SendWaitingForStatus,
+  SendStatusAvailable
+};
 
 /**
  * This class provides a arduino-like interface for sending and receiving data
- * over ESP-Now
+ * over ESP-Now.
+ * All state shared with the driver callbacks is owned by the instance and
+ * exchanged through atomics, so several clients can exist in one process
+ * (e.g. when simulating many nodes on a host).
  */
 class ESPNowClient {
  public:
   /**
    * This method initializes the ESP-Now-Client
+   * @return 0 on success, -1 if MAX_ACTIVE_CLIENTS clients are started
+   * already
    */
-  void begin();
+  int begin();
 
   void stop();
 
@@ -104,14 +150,19 @@ class ESPNowClient {
    * @param maxSendTries The maximum number of tries to send the message on the
    * link-layer
    * @param channel The wifi channel to send the message on
+   * @param paced Whether the frame waits for the minimum send interval, a
+   * frame the caller schedules itself is sent as soon as the radio is idle
+   * @param deadline The micros() from which on no (re)try is started, the
+   * frame then fails. 0 if the frame may be sent any time
    * @return status indicating whether the message was successfully queued
    */
   int send(uint8_t macAddress[6], uint8_t *data, int dataLength,
-           int maxSendTries, int channel);
+           int maxSendTries, int channel, bool paced = true,
+           u_long deadline = 0);
 
   /**
    * Checks if the client is able to queue a new message
-   * @return
+   * @return Whether no frame is pending, i.e. the last one got its final status
    */
   bool sendingPossible() const;
 
@@ -127,6 +178,44 @@ class ESPNowClient {
    */
   void setMessageProcessInterval(u_long interval);
 
+  /**
+   * Set the channel the client listens on. Frames for another channel make
+   * the radio switch to it until their final status, then it returns to the
+   * home channel
+   * @param channel The home channel, 0 to leave the radio's channel untouched
+   */
+  void setHomeChannel(uint8_t channel);
+
+  /**
+   * Get the channel the client listens on
+   * @return The home channel, 0 if the radio's channel is not managed
+   */
+  uint8_t getHomeChannel() const;
+
+  /**
+   * This method sets the minimum interval between two frames handed to the
+   * driver
+   * @param interval The interval in milliseconds
+   */
+  void setMessageSendInterval(u_long interval);
+
+  /**
+   * Enable the adaptation of the PHY rate per neighbour (ESP32 only).
+   * Strong neighbours are sent to with higher rates to cut the airtime, weak
+   * ones with lower rates, a failed try lowers the rate of the peer for a
+   * while. Broadcasts always use the default rate
+   * @param longRange Whether the long range mode may be used for the weakest
+   * links, every device of the mesh has to enable it
+   */
+  void enableRateAdaptation(bool longRange = false);
+
+  /**
+   * Get the smoothed RSSI of a neighbour
+   * @param peer The MAC-Address of the neighbour
+   * @return The RSSI in dBm, 0 if unknown
+   */
+  int8_t getPeerRssi(const uint8_t peer[6]) const;
+
   /**
    * Set the callback for when a new message arrived
    * @param callback The callback to be called
@@ -140,6 +229,35 @@ class ESPNowClient {
    */
   void setOnDataSentCallback(OnESPNowSentCallback callback);
 
+  /**
+   * Set the recorder that logs the frames and send statuses of the client,
+   * has to be called before begin()
+   * @param recorder The recorder, nullptr to stop recording
+   */
+  void setRecorder(QuackRecorder *recorder);
+
+  /**
+   * Detach the client from the radio, has to be called before begin(). The
+   * driver is not started and never dispatches to the client. Frames are
+   * only handed to the recorder and wait for a status passed to
+   * processDataSent(), e.g. by the QuackReplayer
+   * @param enabled Whether the client is detached
+   */
+  void setReplayMode(bool enabled);
+
+  /**
+   * Get the destination of the frame that was handed to the driver and waits
+   * for its status
+   * @return The MAC-Address of the destination, nullptr if no frame waits
+   */
+  const uint8_t *getWaitingDestination() const;
+
+  /**
+   * Get the time the last frame left the radio
+   * @return The value of micros() taken in the last sent callback
+   */
+  u_long getLastSentTimestamp() const;
+
   /**
    * Get the MAC-Address of the ESP-Now-Client as a String
    * @return The MAC-Address as a String
@@ -152,11 +270,38 @@ class ESPNowClient {
    */
   uint8_t *getMACAddress();
 
+  /**
+   * This method is called when a new message is received.
+   * It is called by the driver callback for every started client and can be
+   * used to inject frames into a client directly (e.g. by the QuackReplayer)
+   * @param macAddress The MAC-Address of the sender
+   * @param data The data that was received
+   * @param dataLength The length of the data that was received
+   * @param rssi The RSSI of the frame in dBm, 0 if unknown
+   */
+  void IRAM_ATTR processReceivedData(const uint8_t *macAddress,
+                                     const uint8_t *data, uint16_t dataLength,
+                                     int8_t rssi = 0);
+
+  /**
+   * This method is called when a new status update for a sent message is
+   * available.
+   * It is called by the driver callback for the client waiting for a status
+   * @param macAddress The MAC-Address of the destination
+   * @param status The status of the sent message
+   */
+  void IRAM_ATTR processDataSent(const uint8_t *macAddress, int status);
+
   /**
    * This address represents the broadcast address for ESP-Now
    */
   static uint8_t BROADCAST_ADDRESS[6];
 
+  /**
+   * The maximum number of clients that can be started at the same time
+   */
+  static constexpr size_t MAX_ACTIVE_CLIENTS = 4;
+
  private:
   /**
    * This is the ISR that is called when a new message is received
@@ -169,27 +314,14 @@ class ESPNowClient {
                                        uint8_t data_len);
 #endif
 #ifdef ESP32
+#if ESP_IDF_VERSION_MAJOR >= 5
+  static void IRAM_ATTR onDataReceived(const esp_now_recv_info_t *info,
+                                       const uint8_t *data, int data_len);
+#else
   static void IRAM_ATTR onDataReceived(const uint8_t *mac_addr,
                                        const uint8_t *data, int data_len);
 #endif
-
-  /**
-   * This method is called when a new message is received
-   * @param macAddress The MAC-Address of the sender
-   * @param data The data that was received
-   * @param dataLength The length of the data that was received
-   */
-  static void IRAM_ATTR processReceivedData(const uint8_t *macAddress,
-                                            const uint8_t *data,
-                                            uint8_t dataLength);
-
-  /**
-   * This method is called when a new status update for a sent message is
-   * available
-   * @param macAddress The MAC-Address of the destination
-   * @param status The status of the sent message
-   */
-  static void IRAM_ATTR processDataSent(const uint8_t *macAddress, int status);
+#endif
 
   /**
    * This is the ISR when a new message is sent and the client has a new
@@ -208,6 +340,21 @@ class ESPNowClient {
    */
   void initMacAddress();
 
+  /**
+   * Check whether a received frame is meant for this client
+   * @param destAddress The MAC-Address the frame was sent to, nullptr if the
+   * driver does not report it
+   * @return Whether it is addressed to this client or to everyone
+   */
+  bool IRAM_ATTR isFrameReceiver(const uint8_t *destAddress) const;
+
+  /**
+   * Check whether a sent status belongs to the frame of this client
+   * @param macAddress The MAC-Address the frame was sent to
+   * @return Whether this client waits for the status of a frame to it
+   */
+  bool IRAM_ATTR isFrameSender(const uint8_t *macAddress) const;
+
   /**
    * This method sends the next message in the queue
    * @param macAddress The MAC-Address of the destination
@@ -223,25 +370,78 @@ class ESPNowClient {
    */
   void processMessage();
 
-  static std::queue<ReceivedData>
-      RECEIVED_DATA;  // The queue of received messages
+  /**
+   * Tune the radio to the given channel
+   * @param channel The channel
+   */
+  void switchChannel(uint8_t channel);
 
-  static ReceivedData NEW_RECEIVED_DATA;  // The new received message
+  /**
+   * This method processes a status stored by the sent callback
+   */
+  void processSentStatus();
 
-  static bool RECIEVED_DATA_ACCESS_MUTEX;  // Mutex for accessing the queue of
-                                           // received messages
+  /**
+   * Find the link state of the given peer
+   * @param peer The MAC-Address of the peer
+   * @return The link state or nullptr if the peer is unknown
+   */
+  PeerLink *findPeerLink(const uint8_t peer[6]);
+  const PeerLink *findPeerLink(const uint8_t peer[6]) const;
 
-  static bool WAITING_FOR_DATA_SENT_MUTEX;  // Mutex for waiting for a new
-                                            // status update for a sent message
+  /**
+   * Find or create the link state of the given peer
+   * @param peer The MAC-Address of the peer
+   * @return The link state
+   */
+  PeerLink &getOrCreatePeerLink(const uint8_t peer[6]);
 
-  static bool DATA_SENT_UPDATE_MUTEX;  // Mutex for updating the status of a
-                                       // sent message
+  /**
+   * Update the link state of the sender of a received frame
+   * @param data The received frame
+   */
+  void updatePeerLink(const ReceivedData &data);
 
-  static bool
-      NEW_DATA_RECEIVED_MUTEX;  // Mutex for accessing the new received message
+  /**
+   * Lower the rate of a peer after a failed try
+   * @param peer The MAC-Address of the peer
+   */
+  void lowerPeerRate(const uint8_t peer[6]);
 
-  static ESPNowSentStatus
-      LAST_SENT_STATUS;  // The last status of a sent message
+  /**
+   * Configure the PHY rate for the next frame to the given peer
+   * @param peer The MAC-Address of the peer
+   */
+  void applyPeerRate(const uint8_t peer[6]);
+
+  /**
+   * Register the client, so the driver callbacks are dispatched to it
+   * @return 1 if it is the first started client, 0 if others are started or
+   * it is registered already, -1 if no slot is free
+   */
+  int registerClient();
+
+  /**
+   * Unregister the client from the driver callbacks
+   */
+  void unregisterClient();
+
+  static std::atomic<ESPNowClient *> ACTIVE_CLIENTS
+      [MAX_ACTIVE_CLIENTS];  // The clients the driver callbacks dispatch to
+
+  QuackMeshTypes::SPSCRing<ReceivedData, 8>
+      mReceivedData = {};  // Frames from the receive callback, consumed by
+                           // update()
+
+  std::atomic<uint8_t> mSendState = {
+      ESPNowSendState::SendIdle};  // The state of the send state machine
+
+  std::atomic<uint8_t> mLastSentStatus = {
+      ESPNowSentStatus::Undetermined};  // The last status of a sent message,
+                                        // published by mSendState
+
+  std::atomic<u_long> mLastSentTs = {
+      0};  // The value of micros() in the last sent callback
 
   std::optional<SendingData> mNextDataToSend =
       std::nullopt;  // The next message to be sent
@@ -254,8 +454,21 @@ class ESPNowClient {
       100;  // The interval in which the next message is sent
   u_long mLastMessageSentTs = 0;  // The timestamp of the last message sent
 
+  bool mRateAdaptation = false;  // Whether the PHY rate is adapted per peer
+  bool mLongRange = false;       // Whether the long range mode may be used
+  int mAppliedRateStep = -1;     // The rate step the driver is configured to
+  std::vector<PeerLink> mPeerLinks = {};  // The link state of the neighbours
+  size_t mMaxPeerLinks = 16;  // The maximum number of tracked neighbours
+  u_long mRateHoldTime = 5000;  // The time a lowered rate is not raised again
+
+  uint8_t mHomeChannel = 0;     // The channel the client listens on
+  uint8_t mCurrentChannel = 0;  // The channel the radio is tuned to
+
   uint8_t mMACAddress[6] = {};  // The MAC-Address of the ESP-Now-Client
 
+  QuackRecorder *mRecorder = nullptr;  // The recorder of the traffic
+  bool mReplayMode = false;  // Whether the client is detached from the radio
+
   OnESPNowDataReceivedCallback
       mOnDataReceivedCallback;  // The callback for when a new message is
                                 // received
@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class combines the aggregate reports that travel up the collection
+ * tree. Reports with the same key and operator are held for a window after
+ * the first one arrives and then sent on as one report, which counts the
+ * reports it combines. The root hands the finished aggregates to the
+ * application.
+ */
+class QuackAggregation {
+ public:
+  // Sends a combined report up the tree, the payload starts with the
+  // collection header
+  typedef std::function<void(const uint8_t *payload, size_t length)>
+      SendCallback;
+
+  /**
+   * Configure the aggregation, has to be called before begin()
+   * @param window The time reports are held in milliseconds
+   */
+  void configure(u_long window);
+
+  /**
+   * Start combining reports
+   * @param send The callback that sends the combined reports
+   */
+  void begin(SendCallback send);
+
+  /**
+   * Send on the held reports whose window is over
+   */
+  void update();
+
+  /**
+   * Combine a report with the held reports of its key
+   * @param message The report
+   * @return Whether the report is held, otherwise it has to be sent on
+   */
+  bool hold(const QuackMeshTypes::Message &message);
+
+  /**
+   * Call the aggregate callback with a report that reached the root
+   * @param message The report
+   */
+  void deliver(const QuackMeshTypes::Message &message);
+
+  /**
+   * Register the merge callback of a custom aggregate
+   * @param key The key of the aggregate
+   * @param merge The callback that combines two reports
+   * @return 0 on success, -1 if too many aggregates are registered
+   */
+  int registerAggregate(uint16_t key,
+                        QuackMeshTypes::AggregateMergeCallback merge);
+
+  /**
+   * Set the callback that is called on the root for every aggregate
+   * @param callback The callback
+   */
+  void setOnAggregateCallback(QuackMeshTypes::OnAggregateCallback callback);
+
+ private:
+  SendCallback mSend = nullptr;  // Sends the combined reports
+
+  u_long mWindow = 500;  // How long reports are held
+  std::vector<QuackMeshTypes::PendingAggregate> mPendingAggregates =
+      {};  // The reports being held
+  size_t mMaxPendingAggregates = 8;  // The maximum number of held keys
+  std::vector<QuackMeshTypes::RegisteredAggregate> mRegisteredAggregates =
+      {};  // The custom aggregates the application registered
+  size_t mMaxRegisteredAggregates = 8;  // The maximum number of custom ones
+  QuackMeshTypes::OnAggregateCallback mOnAggregateCallback =
+      nullptr;  // The callback that is called for aggregates at the root
+};
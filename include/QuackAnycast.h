@@ -0,0 +1,124 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class keeps the routes to the sinks of anycast services. A sink
+ * periodically announces itself with its load in numbered rounds, every
+ * device keeps the first or shortest path of the newest round, forwarding
+ * devices relay each round once. A message to a service goes to the sink
+ * with the lowest cost, i.e. hops weighted with the load.
+ */
+class QuackAnycast {
+ public:
+  // Sends an advertisement of the given sink to the neighbours
+  typedef std::function<void(const uint8_t sink[6], const uint8_t *payload,
+                             size_t length)>
+      SendCallback;
+
+  /**
+   * Make this device a sink of a service, has to be called before begin()
+   * @param service The service
+   * @param advertInterval The interval of the advertisements in milliseconds
+   */
+  void enableSink(uint16_t service, u_long advertInterval);
+
+  /**
+   * Set the load the sink advertises
+   * @param load The load, 0 idle to 255 saturated
+   */
+  void setSinkLoad(uint8_t load);
+
+  /**
+   * Relay the advertisements of the sinks, for devices that forward
+   * anycast messages. Has to be called before begin()
+   * @param forwarding Whether the device forwards anycast messages
+   */
+  void setForwarding(bool forwarding);
+
+  /**
+   * Start the advertisements
+   * @param ownAddress The MAC-Address of this device
+   * @param send The callback that sends the advertisements
+   */
+  void begin(const uint8_t ownAddress[6], SendCallback send);
+
+  /**
+   * Remove sinks that stopped advertising and advertise the own service
+   * @param queueLoad The load of the queues of this device, advertised
+   * instead of the set load if it is higher
+   */
+  void update(uint8_t queueLoad);
+
+  /**
+   * Update the route to a sink with the advertisement of a neighbour and
+   * relay a new round
+   * @param neighbour The MAC-Address of the neighbour
+   * @param message The advertisement
+   * @param relayLoad The load a relayed advertisement carries at least
+   * @return The updated route, nullptr if the route did not change
+   */
+  const QuackMeshTypes::SinkEntry *onMessageReceived(
+      const uint8_t neighbour[6], const QuackMeshTypes::Message &message,
+      uint8_t relayLoad);
+
+  /**
+   * Check if this device is a sink of a service
+   * @param service The service
+   * @return Whether this device provides the service
+   */
+  bool isSinkOf(uint16_t service) const;
+
+  /**
+   * Get the sink of a service with the lowest cost
+   * @param service The service
+   * @return The route to the sink, nullptr if no sink is known
+   */
+  QuackMeshTypes::SinkEntry *findBestSink(uint16_t service);
+
+  /**
+   * Check if a device is a known sink of a service
+   * @param service The service
+   * @param address The MAC-Address of the device
+   * @return Whether a route to the device as a sink of the service is known
+   */
+  bool isKnownSink(uint16_t service, const uint8_t address[6]) const;
+
+ private:
+  /**
+   * Relay the advertisement of a new round of a sink
+   * @param sink The route to the sink
+   * @param relayLoad The load the advertisement carries at least
+   */
+  void relayAdvertisement(const QuackMeshTypes::SinkEntry &sink,
+                          uint8_t relayLoad);
+
+  SendCallback mSend = nullptr;  // Sends the advertisements
+  uint8_t mOwnAddress[6] = {};   // The MAC-Address of this device
+
+  bool mSink = false;         // Whether this device is a sink
+  uint16_t mService = 0;      // The service this sink provides
+  u_long mAdvertInterval = 1000;  // The interval of the advertisements
+  u_long mLastAdvertTs = 0;   // The time of the last advertisement
+  uint16_t mSequence = 0;     // The advertisement round of this sink
+  uint8_t mLoad = 0;          // The load set by the application
+  bool mForwarding = false;   // Whether advertisements are relayed
+  std::vector<QuackMeshTypes::SinkEntry> mSinks =
+      {};  // The routes to the known sinks
+  size_t mMaxSinks = 8;       // The maximum number of known sinks
+  uint8_t mHopLimit = 3;      // The hops a sink advertisement travels
+  uint8_t mHopCost = 64;      // The cost of a hop compared to the load
+};
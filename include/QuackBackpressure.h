@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class signals the congestion of a device to its neighbours and
+ * spaces out the messages to neighbours that signalled one. A device is
+ * congested from the high watermark of queued messages on until the queue
+ * drained to the low watermark, the signal is repeated while it lasts.
+ */
+class QuackBackpressure {
+ public:
+  // Sends a congestion signal to the neighbours
+  typedef std::function<void(const uint8_t *payload, size_t length)>
+      SendCallback;
+  // Called with every congestion signal of a neighbour
+  typedef std::function<void(const uint8_t neighbour[6], bool congested)>
+      OnNeighbourCallback;
+
+  /**
+   * Configure the watermarks, has to be called before begin()
+   * @param highWatermark The queued messages from which on the device is
+   * congested
+   * @param lowWatermark The queued messages at which the congestion ends
+   * @param interval The shortest time between two messages to a congested
+   * neighbour in milliseconds
+   */
+  void configure(size_t highWatermark, size_t lowWatermark, u_long interval);
+
+  /**
+   * Start signalling
+   * @param send The callback that sends the signals
+   * @param onNeighbour The callback that is called with the signals of the
+   * neighbours
+   */
+  void begin(SendCallback send, OnNeighbourCallback onNeighbour);
+
+  /**
+   * Signal a congestion that started or ended and repeat the signal while it
+   * lasts, expire the neighbours that stopped signalling
+   * @param queued The number of queued messages
+   * @param load The load of the queues, 0 idle to 255 saturated
+   */
+  void update(size_t queued, uint8_t load);
+
+  /**
+   * Process the congestion signal of a neighbour
+   * @param neighbour The MAC-Address of the neighbour
+   * @param message The signal
+   */
+  void onMessageReceived(const uint8_t neighbour[6],
+                         const QuackMeshTypes::Message &message);
+
+  /**
+   * Check if a message may be sent to a next hop now, a congested neighbour
+   * gets one message per interval
+   * @param nextHop The MAC-Address of the next hop
+   * @return Whether the message may be sent, its interval starts if it does
+   */
+  bool mayTransmitTo(const uint8_t nextHop[6]);
+
+  /**
+   * Check if the device is congested. May be called from any task
+   * @return Whether the device is congested
+   */
+  bool isCongested() const;
+
+ private:
+  /**
+   * Send a congestion signal
+   * @param load The load of the queues
+   */
+  void sendSignal(uint8_t load);
+
+  SendCallback mSend = nullptr;  // Sends the signals
+  OnNeighbourCallback mOnNeighbour =
+      nullptr;  // Called with the signals of the neighbours
+
+  size_t mHighWatermark =
+      8;  // The queued messages from which on the device is congested
+  size_t mLowWatermark = 2;  // The queued messages at which the congestion ends
+  u_long mCongestedLinkInterval =
+      500;  // The shortest time between messages to a congested neighbour
+  u_long mSignalInterval =
+      1000;  // The interval the signal is repeated in while congested
+  u_long mLastSignalTs = 0;  // The time the last signal was sent
+  std::atomic<bool> mCongested = {
+      false};  // Whether the device is congested, read by any task
+  std::vector<QuackMeshTypes::CongestedNeighbour> mCongestedNeighbours =
+      {};  // The neighbours that asked to slow down
+  size_t mMaxCongestedNeighbours = 8;  // The maximum number of them
+};
@@ -0,0 +1,175 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class keeps the channel a device listens on. In the multi-channel
+ * mode every device picks a home channel and announces it, so frames are
+ * sent on the home channel of the next hop. With the channel discovery a
+ * device associated to an access point pins the mesh to its channel and
+ * all others scan the channels until they hear an announcement.
+ */
+class QuackChannels {
+ public:
+  // Sends an announcement on a channel, 0 for the home channel
+  typedef std::function<void(const uint8_t *payload, size_t length,
+                             uint8_t channel)>
+      AnnounceCallback;
+  // Changes the channel the radio listens on
+  typedef std::function<void(uint8_t channel)> SwitchCallback;
+
+  /**
+   * Enable the multi-channel mode, has to be called before begin()
+   * @param channels The channels that may be used
+   * @param channelCount The number of channels, at least one
+   * @param announceInterval The interval of the announcements in milliseconds
+   */
+  void enableMultiChannel(const uint8_t *channels, size_t channelCount,
+                          u_long announceInterval);
+
+  /**
+   * Set a fixed home channel instead of picking one automatically
+   * @param channel The channel the device listens on
+   */
+  void setHomeChannel(uint8_t channel);
+
+  /**
+   * Enable the channel discovery, has to be called before begin()
+   * @param announceInterval The interval of the announcements in milliseconds
+   * @param lostTimeout The time without any frame after which the mesh is
+   * considered lost in milliseconds
+   */
+  void enableDiscovery(u_long announceInterval, u_long lostTimeout);
+
+  /**
+   * Start the announcements or the scan for the mesh
+   * @param ownAddress The MAC-Address of this device
+   * @param announce The callback that sends the announcements
+   * @param switchChannel The callback that changes the home channel
+   */
+  void begin(const uint8_t ownAddress[6], AnnounceCallback announce,
+             SwitchCallback switchChannel);
+
+  /**
+   * Announce the home channel, pick one if it is not assigned yet and follow
+   * the access point or scan for the mesh if it is lost
+   */
+  void update();
+
+  /**
+   * Process the announcement of a neighbour
+   * @param neighbour The MAC-Address of the neighbour
+   * @param message The announcement
+   */
+  void onMessageReceived(const uint8_t neighbour[6],
+                         const QuackMeshTypes::Message &message);
+
+  /**
+   * Note that a frame of the mesh other than an announcement was heard
+   */
+  void onMeshHeard();
+
+  /**
+   * Check if the multi-channel mode is used
+   * @return Whether frames are sent on the channels of the neighbours
+   */
+  bool isMultiChannel() const;
+
+  /**
+   * Check if the device currently scans for the channel of the mesh
+   * @return Whether the device is scanning, nothing is sent while scanning
+   */
+  bool isScanning() const;
+
+  /**
+   * Get the channel this device listens on
+   * @return The channel, 0 if unset
+   */
+  uint8_t getHomeChannel() const;
+
+  /**
+   * Get the channel a frame for the given next hop has to be sent on
+   * @param nextHop The MAC-Address of the next hop
+   * @return The channel, 0 for the home channel
+   */
+  uint8_t getChannelForNextHop(const uint8_t nextHop[6]) const;
+
+  /**
+   * Get the channels a broadcast has to be repeated on
+   * @return The home channel and the home channels of all neighbours
+   */
+  std::vector<uint8_t> getBroadcastChannels() const;
+
+ private:
+  /**
+   * Expire the neighbours and pick the least used channel once
+   */
+  void updateMultiChannel();
+
+  /**
+   * Follow the channel of the access point or scan for the mesh if it is lost
+   */
+  void updateDiscovery();
+
+  /**
+   * Start scanning all channels for the mesh
+   * @param newerRoundOnly Whether only a newer round than the lost one ends the
+   * scan
+   */
+  void startScan(bool newerRoundOnly);
+
+  /**
+   * Change the channel this device listens on
+   * @param channel The new home channel
+   */
+  void switchHomeChannel(uint8_t channel);
+
+  /**
+   * Send an announcement of the home channel on every usable channel
+   */
+  void sendAnnouncement();
+
+  AnnounceCallback mAnnounce = nullptr;    // Sends the announcements
+  SwitchCallback mSwitchChannel = nullptr;  // Changes the home channel
+  uint8_t mOwnAddress[6] = {};             // The MAC-Address of this device
+
+  bool mMultiChannel = false;  // Whether the multi-channel mode is used
+  std::vector<uint8_t> mChannels = {};  // The channels that may be used
+  uint8_t mHomeChannel = 0;  // The channel this device listens on, 0 if unset
+  bool mHomeChannelFixed = false;  // Whether the home channel was set manually
+  bool mHomeChannelAssigned = false;  // Whether the home channel was picked
+  u_long mAnnounceInterval = 5000;  // The interval of announcements
+  u_long mLastAnnounceTs = 0;  // The timestamp of the last announcement
+  u_long mStartedTs = 0;  // The timestamp the multi-channel mode began
+  std::vector<QuackMeshTypes::NeighbourChannel> mNeighbourChannels =
+      {};  // The home channels of the neighbours
+  size_t mMaxNeighbourChannels = 16;  // The maximum number of neighbours
+
+  bool mDiscovery = false;  // Whether the channel discovery is used
+  u_long mLostTimeout = 5000;  // The time after which the mesh is lost
+  u_long mLastMeshHeardTs = 0;  // The timestamp of the last frame of the mesh
+  bool mScanning = false;  // Whether the channels are scanned
+  bool mScanForNewerRound =
+      false;  // Whether the scan ignores the round that was lost
+  uint8_t mScanStartChannel = 1;  // The channel the scan started on
+  uint8_t mScanChannelCount = 13;  // The number of channels that are scanned
+  size_t mScannedChannels = 0;  // The number of channels visited by the scan
+  u_long mScanChannelTs = 0;  // The timestamp the current channel was entered
+  u_long mScanDwellTime = 1500;  // The time spent on each channel
+  bool mSourceKnown =
+      false;  // Whether a device on the channel of an access point was heard
+  uint16_t mEpoch = 0;  // The newest announcement round of that device
+};
@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class delivers a block of data reliably to every node of the mesh
+ * with random linear network coding over GF(256). The data is split into
+ * packets, and nodes never send the packets themselves but random
+ * combinations of all combinations they hold. A combination is useful to
+ * every neighbour that misses any part of what the sender knows, so one
+ * transmission repairs different losses at several neighbours. Every node
+ * forwards one combination for each useful one it received and announces
+ * its rank on a Trickle timer; a neighbour with a higher rank answers a
+ * lower one with as many combinations as are missing, unless other
+ * neighbours are heard doing so.
+ */
+class QuackCodedBroadcast {
+ public:
+  // Sends a message of the protocol to all neighbours
+  typedef std::function<void(const uint8_t *payload, size_t length)>
+      SendCallback;
+
+  /**
+   * Configure the Trickle timer of the rank announcements
+   * @param minInterval The shortest interval in milliseconds
+   * @param maxInterval The longest interval in milliseconds
+   */
+  void configure(u_long minInterval, u_long maxInterval);
+
+  /**
+   * Start the coded broadcasts
+   * @param ownAddress The MAC-Address of this node
+   * @param send The callback that sends the messages
+   */
+  void begin(const uint8_t ownAddress[6], SendCallback send);
+
+  /**
+   * Send the due announcements and combinations, forget idle generations
+   * @param sendingPossible Whether a combination may be sent now, they are
+   * handed over one at a time
+   */
+  void update(bool sendingPossible);
+
+  /**
+   * Process a message of the protocol
+   * @param message The message
+   */
+  void onMessageReceived(const QuackMeshTypes::Message &message);
+
+  /**
+   * Start a reliable broadcast, a newer one from this node replaces it
+   * @param data The data
+   * @param dataLength The length of the data, at most
+   * MAX_RELIABLE_BROADCAST_LENGTH
+   * @return 0 on success, -1 if the data is too long
+   */
+  int broadcast(const uint8_t *data, size_t dataLength);
+
+  /**
+   * Set the callback that is called with the data of broadcasts from other
+   * nodes
+   * @param callback The callback to be called
+   */
+  void setOnDataCallback(QuackMeshTypes::OnReliableBroadcastCallback callback);
+
+ private:
+  /**
+   * Find the generation of a broadcast or make room for it
+   * @param header The header of a received packet
+   * @return The generation, nullptr if it is older than the one held of the
+   * same source
+   */
+  QuackMeshTypes::CodedGeneration *getGeneration(
+      const QuackMeshTypes::CodedHeader &header);
+
+  /**
+   * Reduce a combination against the held ones and keep it if it is
+   * innovative
+   * @param generation The generation
+   * @param row The coefficients followed by the data, changed in place
+   * @return Whether the rank increased
+   */
+  bool addCombination(QuackMeshTypes::CodedGeneration &generation,
+                      uint8_t *row);
+
+  /**
+   * Hand the decoded data to the application
+   * @param generation The generation with full rank
+   */
+  void deliver(QuackMeshTypes::CodedGeneration &generation);
+
+  /**
+   * Start the Trickle interval of a generation from its shortest length
+   * @param generation The generation
+   */
+  void resetStatus(QuackMeshTypes::CodedGeneration &generation);
+
+  /**
+   * Start a new Trickle interval of a generation
+   * @param generation The generation
+   */
+  void scheduleStatus(QuackMeshTypes::CodedGeneration &generation);
+
+  /**
+   * Send a random combination of the held ones
+   * @param generation The generation
+   */
+  void sendCombination(QuackMeshTypes::CodedGeneration &generation);
+
+  /**
+   * Announce the rank of a generation without data
+   * @param generation The generation
+   */
+  void sendStatus(const QuackMeshTypes::CodedGeneration &generation);
+
+  /**
+   * Fill the header of a packet of a generation
+   * @param generation The generation
+   * @param payload The payload the header is written to
+   */
+  void fillHeader(const QuackMeshTypes::CodedGeneration &generation,
+                  uint8_t *payload) const;
+
+  /**
+   * Get the length of a row of a generation
+   * @param generation The generation
+   * @return The coefficients and the data in bytes
+   */
+  static size_t getRowLength(const QuackMeshTypes::CodedGeneration &generation);
+
+  uint8_t mOwnAddress[6] = {};   // The MAC-Address of this node
+  SendCallback mSend = nullptr;  // Sends the messages
+  QuackMeshTypes::OnReliableBroadcastCallback mOnDataCallback =
+      nullptr;  // The callback that is called with decoded data
+
+  std::vector<QuackMeshTypes::CodedGeneration> mGenerations =
+      {};                         // The broadcasts this node takes part in
+  size_t mMaxGenerations = 2;     // The most broadcasts kept at once
+  uint16_t mNextGeneration = 0;   // The number of the next own broadcast
+  u_long mMinStatusInterval = 1000;   // The shortest Trickle interval
+  u_long mMaxStatusInterval = 60000;  // The longest Trickle interval
+  uint8_t mStatusRedundancy =
+      1;  // The matching statuses after which the own one is suppressed
+  u_long mGenerationTimeout =
+      600000;  // The time without changes after which a broadcast is dropped
+};
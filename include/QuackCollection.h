@@ -0,0 +1,202 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class keeps the route of a device to the root of the collection tree.
+ * Every device picks the neighbour with the lowest cost to the root as its
+ * parent, the cost being the expected transmissions estimated from lost
+ * beacons and failed frames. Beacons are sent with an interval that doubles
+ * while the tree is stable and starts over when a route changes, a loop is
+ * detected or a neighbour without a route asks for it.
+ */
+class QuackCollection {
+ public:
+  // Sends a beacon to the neighbours
+  typedef std::function<void(const uint8_t *payload, size_t length)>
+      BeaconCallback;
+  // Sends collection data to the parent
+  typedef std::function<void(const QuackMeshTypes::Message &message,
+                             const uint8_t parent[6], uint8_t retries)>
+      ForwardCallback;
+  // Hands collection data that reached the root to the application
+  typedef std::function<void(const QuackMeshTypes::Message &message)>
+      DeliverCallback;
+
+  /**
+   * Configure the tree, has to be called before begin()
+   * @param root Whether this device collects the data of the tree
+   * @param minBeaconInterval The shortest interval of the beacons in
+   * milliseconds
+   * @param maxBeaconInterval The longest interval of the beacons in
+   * milliseconds
+   */
+  void configure(bool root, u_long minBeaconInterval, u_long maxBeaconInterval);
+
+  /**
+   * Advertise the own route in the beacons, for devices that forward the
+   * data of their children. Has to be called before begin()
+   * @param forwarding Whether the device forwards collection data
+   */
+  void setForwarding(bool forwarding);
+
+  /**
+   * Look for a route and start the beacons
+   * @param ownAddress The MAC-Address of this device
+   * @param sendBeacon The callback that sends the beacons
+   * @param forward The callback that sends data to the parent
+   * @param deliver The callback that takes the data at the root
+   */
+  void begin(const uint8_t ownAddress[6], BeaconCallback sendBeacon,
+             ForwardCallback forward, DeliverCallback deliver);
+
+  /**
+   * Remove neighbours that stopped sending beacons and send the beacon of
+   * the current interval when it is due
+   * @param congested Whether the device asks its children to slow down
+   */
+  void update(bool congested);
+
+  /**
+   * Update a neighbour and the route with a beacon
+   * @param neighbour The MAC-Address of the neighbour
+   * @param message The beacon
+   */
+  void onMessageReceived(const uint8_t neighbour[6],
+                         const QuackMeshTypes::Message &message);
+
+  /**
+   * Count the hop of collection data received from a child that is
+   * forwarded, a loop starts the beacons over
+   * @param message The collection data, updated for the next hop
+   * @return Whether the data may be forwarded
+   */
+  bool prepareForwarding(QuackMeshTypes::Message &message);
+
+  /**
+   * Send collection data to the parent, or keep it until there is one
+   * @param message The collection data
+   * @param retries The number of times the data was sent again
+   */
+  void routeMessage(const QuackMeshTypes::Message &message, uint8_t retries);
+
+  /**
+   * Update the link to the parent with the status of sent collection data
+   * and send it again if the link failed
+   * @param message The sent collection data
+   * @param success Whether the parent received the frame
+   */
+  void onMessageSent(const QuackMeshTypes::EnqueuedMessage &message,
+                     bool success);
+
+  /**
+   * Update the congestion of a neighbour, a congested one is avoided as parent
+   * @param neighbour The MAC-Address of the neighbour
+   * @param congested Whether the neighbour signalled a long queue
+   */
+  void setNeighbourCongested(const uint8_t neighbour[6], bool congested);
+
+  /**
+   * Get the cost of the route to the root
+   * @return The expected transmissions in tenths, NO_COLLECTION_ROUTE if
+   * there is no route
+   */
+  uint16_t getCost() const;
+
+  /**
+   * Check if this device is the root
+   * @return Whether this device collects the data of the tree
+   */
+  bool isRoot() const;
+
+ private:
+  /**
+   * Start the beacon intervals over with the shortest one
+   */
+  void resetBeacons();
+
+  /**
+   * Pick the time the beacon of the current interval is sent at
+   */
+  void scheduleBeacon();
+
+  /**
+   * Send a new beacon
+   * @param congested Whether the device asks its children to slow down
+   */
+  void sendBeacon(bool congested);
+
+  /**
+   * Get the cost this device advertises in its beacons
+   * @return The cost, NO_COLLECTION_ROUTE if it does not forward data
+   */
+  uint16_t getAdvertisedCost() const;
+
+  /**
+   * Get the neighbour with the given address
+   * @param address The MAC-Address of the neighbour
+   * @return The neighbour or nullptr if it is unknown
+   */
+  QuackMeshTypes::CollectionNeighbour *findNeighbour(const uint8_t address[6]);
+
+  /**
+   * Add a sample of the transmissions a frame needed to a link estimate
+   * @param neighbour The neighbour at the other end of the link
+   * @param sample The transmissions in tenths
+   */
+  void addLinkEtxSample(QuackMeshTypes::CollectionNeighbour &neighbour,
+                        uint16_t sample);
+
+  /**
+   * Pick the parent with the lowest cost, a new parent has to be better by
+   * mParentSwitchThreshold
+   */
+  void updateRoute();
+
+  BeaconCallback mSendBeacon = nullptr;  // Sends the beacons
+  ForwardCallback mForward = nullptr;    // Sends data to the parent
+  DeliverCallback mDeliver = nullptr;    // Takes the data at the root
+  uint8_t mOwnAddress[6] = {};           // The MAC-Address of this device
+
+  bool mRoot = false;        // Whether this device is the root
+  bool mForwarding = false;  // Whether the own route is advertised
+  uint16_t mCost =
+      QuackMeshTypes::NO_COLLECTION_ROUTE;  // The cost of the route to the root
+  uint8_t mParent[6] = {};  // The parent, valid if there is a route
+  std::vector<QuackMeshTypes::CollectionNeighbour> mNeighbours =
+      {};  // The neighbours that may become the parent
+  size_t mMaxNeighbours = 8;  // The maximum number of neighbours
+  std::deque<QuackMeshTypes::Message> mBacklog =
+      {};  // The data waiting for a parent
+  size_t mMaxBacklog = 8;  // The maximum number of waiting messages
+  u_long mMinBeaconInterval = 1000;   // The shortest beacon interval
+  u_long mMaxBeaconInterval = 60000;  // The longest beacon interval
+  u_long mBeaconInterval = 1000;      // The current beacon interval
+  u_long mIntervalStartTs = 0;        // The start of the current interval
+  u_long mBeaconDelay =
+      0;  // The time after the start of the interval the beacon is sent at
+  bool mBeaconSent = false;     // Whether the interval's beacon is sent
+  uint8_t mBeaconSequence = 0;  // The number of the last beacon
+  uint16_t mParentSwitchThreshold =
+      15;  // The cost a new parent has to be better by
+  uint16_t mMaxLinkEtx =
+      40;  // The estimate above which a link is not used as parent
+  uint16_t mCongestionPenalty =
+      30;  // The cost added to a congested parent when choosing one
+  uint8_t mRetries = 3;   // The times data is sent again to a parent
+  uint8_t mMaxHops = 16;  // The hops after which data is dropped
+};
@@ -0,0 +1,203 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+
+#ifdef ESP32
+#include <freertos/FreeRTOS.h>
+#endif
+
+namespace QuackMeshTypes {
+
+/**
+ * A short critical section that can be entered from any task.
+ * On the ESP32 this is a FreeRTOS spinlock that also excludes the other core,
+ * on the ESP8266 interrupts are disabled while the section is held.
+ * Must not be entered from an ISR and must only guard a few instructions.
+ */
+class CriticalSection {
+ public:
+  void enter() {
+#ifdef ESP32
+    portENTER_CRITICAL(&mMux);
+#elif defined(ESP8266)
+    noInterrupts();
+#else
+    while (mFlag.test_and_set(std::memory_order_acquire)) {
+    }
+#endif
+  }
+
+  void exit() {
+#ifdef ESP32
+    portEXIT_CRITICAL(&mMux);
+#elif defined(ESP8266)
+    interrupts();
+#else
+    mFlag.clear(std::memory_order_release);
+#endif
+  }
+
+ private:
+#ifdef ESP32
+  portMUX_TYPE mMux = portMUX_INITIALIZER_UNLOCKED;  // The FreeRTOS spinlock
+#elif !defined(ESP8266)
+  std::atomic_flag mFlag = ATOMIC_FLAG_INIT;  // The host spinlock
+#endif
+};
+
+/**
+ * Holds the given critical section for the lifetime of the guard
+ */
+class CriticalSectionGuard {
+ public:
+  explicit CriticalSectionGuard(CriticalSection &section) : mSection(section) {
+    mSection.enter();
+  }
+
+  ~CriticalSectionGuard() { mSection.exit(); }
+
+  CriticalSectionGuard(const CriticalSectionGuard &) = delete;
+  CriticalSectionGuard &operator=(const CriticalSectionGuard &) = delete;
+
+ private:
+  CriticalSection &mSection;  // The held critical section
+};
+
+/**
+ * A bounded, lock-free single-producer/single-consumer ring buffer.
+ * Exactly one context may call push() and exactly one (other) context may
+ * call pop(). Elements are copied in and out of the ring.
+ * @tparam T The type of the stored elements
+ * @tparam Capacity The number of slots, has to be a power of two
+ */
+template <typename T, size_t Capacity>
+class SPSCRing {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "SPSCRing capacity has to be a power of two");
+
+ public:
+  /**
+   * Copy the given item into the ring (producer side)
+   * @param item The item to be stored
+   * @return Whether the item was stored, false if the ring is full
+   */
+  bool push(const T &item) {
+    size_t head = mHead.load(std::memory_order_relaxed);
+    if (head - mTail.load(std::memory_order_acquire) >= Capacity) {
+      return false;
+    }
+    mSlots[head & (Capacity - 1)] = item;
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Take the oldest item out of the ring (consumer side)
+   * @param item The item the oldest element is copied into
+   * @return Whether an item was taken, false if the ring is empty
+   */
+  bool pop(T &item) {
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    if (mHead.load(std::memory_order_acquire) == tail) {
+      return false;
+    }
+    item = mSlots[tail & (Capacity - 1)];
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Remove all items, must only be called while neither side is active
+   */
+  void clear() {
+    mTail.store(mHead.load(std::memory_order_acquire),
+                std::memory_order_release);
+  }
+
+  /**
+   * Get the number of items currently stored
+   * @return The number of items, exact only when called from one of the sides
+   */
+  size_t size() const {
+    return mHead.load(std::memory_order_acquire) -
+           mTail.load(std::memory_order_acquire);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  bool full() const { return size() >= Capacity; }
+
+ private:
+  T mSlots[Capacity] = {};  // The storage of the ring
+
+  std::atomic<size_t> mHead = {0};  // The next slot written by the producer
+  std::atomic<size_t> mTail = {0};  // The next slot read by the consumer
+};
+
+/**
+ * A bounded multi-producer/single-consumer queue.
+ * Any task may call push(), exactly one context may call pop(). Both only hold
+ * a CriticalSection for the time it takes to copy a single element.
+ * @tparam T The type of the stored elements
+ * @tparam Capacity The number of slots
+ */
+template <typename T, size_t Capacity>
+class MPSCQueue {
+  static_assert(Capacity > 0, "MPSCQueue capacity has to be positive");
+
+ public:
+  /**
+   * Copy the given item into the queue (any producer)
+   * @param item The item to be stored
+   * @return Whether the item was stored, false if the queue is full
+   */
+  bool push(const T &item) {
+    CriticalSectionGuard guard(mLock);
+    if (mCount >= Capacity) {
+      return false;
+    }
+    mSlots[(mStart + mCount) % Capacity] = item;
+    mCount++;
+    return true;
+  }
+
+  /**
+   * Take the oldest item out of the queue (consumer)
+   * @param item The item the oldest element is copied into
+   * @return Whether an item was taken, false if the queue is empty
+   */
+  bool pop(T &item) {
+    CriticalSectionGuard guard(mLock);
+    if (mCount == 0) {
+      return false;
+    }
+    item = mSlots[mStart];
+    mStart = (mStart + 1) % Capacity;
+    mCount--;
+    return true;
+  }
+
+  size_t size() {
+    CriticalSectionGuard guard(mLock);
+    return mCount;
+  }
+
+ private:
+  T mSlots[Capacity] = {};  // The storage of the queue
+
+  size_t mStart = 0;  // The slot of the oldest element
+  size_t mCount = 0;  // The number of stored elements
+
+  CriticalSection mLock = {};  // Guards all fields above
+};
+}  // namespace QuackMeshTypes
@@ -0,0 +1,244 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#if !defined(__cpp_impl_coroutine)
+#error "QuackCoroutines.h needs C++20 coroutines, build with -std=gnu++20"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+
+#include "QuackMeshDevice.h"
+
+// The number of coroutine frames that can exist at the same time
+#ifndef QUACK_COROUTINE_FRAMES
+#define QUACK_COROUTINE_FRAMES 4
+#endif
+
+// The size of a coroutine frame, larger coroutines fail to start
+#ifndef QUACK_COROUTINE_FRAME_SIZE
+#define QUACK_COROUTINE_FRAME_SIZE 1024
+#endif
+
+class QuackCoroutineMesh;
+
+namespace QuackMeshCoroutines {
+
+/**
+ * Take a frame from the fixed pool
+ * @param size The size the coroutine needs
+ * @return The frame or nullptr if the pool is empty or the frame too small
+ */
+void *allocateFrame(size_t size) noexcept;
+
+/**
+ * Give a frame back to the pool
+ * @param frame The frame
+ */
+void freeFrame(void *frame) noexcept;
+
+/**
+ * Get the number of frames left in the pool
+ * @return The number of free frames
+ */
+size_t getFreeFrames();
+
+/**
+ * The return type of a coroutine using the mesh. The coroutine starts right
+ * away when it is called and frees its frame when it returns. Its frame is
+ * taken from a fixed pool instead of the heap, if the pool is empty the
+ * coroutine does not start at all
+ */
+class MeshTask {
+ public:
+  struct promise_type {
+    static void *operator new(size_t size) noexcept {
+      return allocateFrame(size);
+    }
+    static void operator delete(void *frame) noexcept { freeFrame(frame); }
+    static MeshTask get_return_object_on_allocation_failure() {
+      return MeshTask(false);
+    }
+
+    MeshTask get_return_object() { return MeshTask(true); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+
+  /**
+   * Check if the coroutine got a frame and started
+   * @return Whether the coroutine started
+   */
+  bool isStarted() const { return mStarted; }
+
+ private:
+  explicit MeshTask(bool started) : mStarted(started) {}
+
+  bool mStarted;  // Whether the coroutine got a frame
+};
+
+/**
+ * The result of an awaited remote procedure call
+ */
+struct RpcResult {
+  int8_t status;  // The status of the handler, RPC_TIMEOUT or RPC_NOT_QUEUED
+  uint8_t data[QuackMeshTypes::MAX_RPC_DATA_LENGTH];
+  size_t length;
+};
+
+/**
+ * Awaits the status of a confirmed message
+ */
+class SendAwaiter {
+ public:
+  SendAwaiter(QuackMeshDevice &device, uint8_t destination[6], uint8_t *data,
+              size_t dataLength);
+
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> handle);
+  int await_resume() const noexcept { return mStatus; }
+
+ private:
+  QuackMeshDevice &mDevice;
+  uint8_t *mDestination;
+  uint8_t *mData;
+  size_t mDataLength;
+  int mStatus = QuackMeshESPNow::ESPNowSentStatus::Fail;
+};
+
+/**
+ * Awaits the response of a remote procedure call
+ */
+class RpcAwaiter {
+ public:
+  RpcAwaiter(QuackMeshDevice &device, uint8_t destination[6], uint16_t method,
+             const uint8_t *request, size_t requestLength, u_long timeout);
+
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> handle);
+  const RpcResult &await_resume() const noexcept { return mResult; }
+
+ private:
+  QuackMeshDevice &mDevice;
+  uint8_t *mDestination;
+  uint16_t mMethod;
+  const uint8_t *mRequest;
+  size_t mRequestLength;
+  u_long mTimeout;
+  RpcResult mResult = {};
+};
+
+/**
+ * Awaits the end of a delay
+ */
+class DelayAwaiter {
+ public:
+  DelayAwaiter(QuackCoroutineMesh &mesh, u_long duration);
+
+  bool await_ready() const noexcept { return mDuration == 0; }
+  bool await_suspend(std::coroutine_handle<> handle);
+  void await_resume() const noexcept {}
+
+ private:
+  QuackCoroutineMesh &mMesh;
+  u_long mDuration;
+};
+
+/**
+ * This struct is used to store a coroutine waiting for a delay
+ */
+struct SleepingCoroutine {
+  std::coroutine_handle<> handle;
+  u_long startTs;
+  u_long duration;
+};
+}  // namespace QuackMeshCoroutines
+
+/**
+ * This class lets coroutines await the results of the mesh instead of
+ * registering callbacks. The coroutines are resumed from within the device's
+ * update() (and the update() of this class for delays), so they run on the
+ * mesh task, which also has to start them. A coroutine returns
+ * QuackMeshCoroutines::MeshTask:
+ *
+ *   QuackMeshCoroutines::MeshTask configure(QuackCoroutineMesh &mesh) {
+ *     int status = co_await mesh.sendConfirmed(address, data, length);
+ *     const auto &result = co_await mesh.call(address, METHOD, nullptr, 0);
+ *     co_await mesh.delay(1000);
+ *   }
+ */
+class QuackCoroutineMesh {
+ public:
+  /**
+   * Constructor
+   * @param device The device the coroutines use
+   */
+  explicit QuackCoroutineMesh(QuackMeshDevice &device);
+
+  /**
+   * Resume the coroutines whose delay is over, has to be called from the
+   * task that calls the device's update()
+   */
+  void update();
+
+  /**
+   * Send a confirmed message, the coroutine resumes with the status once the
+   * message is acknowledged or failed
+   * @param destination The MAC-Address of the destination
+   * @param data The data to be sent
+   * @param dataLength The length of the data to be sent
+   * @return The awaitable status
+   */
+  QuackMeshCoroutines::SendAwaiter sendConfirmed(uint8_t destination[6],
+                                                 uint8_t *data,
+                                                 size_t dataLength);
+
+  /**
+   * Call a method on another device, the coroutine resumes with the response
+   * or the timeout
+   * @param destination The MAC-Address of the device
+   * @param method The method
+   * @param request The data of the request
+   * @param requestLength The length of the request
+   * @param timeout The timeout of the call in milliseconds
+   * @return The awaitable result, valid until the next co_await
+   */
+  QuackMeshCoroutines::RpcAwaiter call(uint8_t destination[6], uint16_t method,
+                                       const uint8_t *request,
+                                       size_t requestLength,
+                                       u_long timeout = 1000);
+
+  /**
+   * Wait without blocking the mesh task
+   * @param duration The duration in milliseconds
+   * @return The awaitable delay
+   */
+  QuackMeshCoroutines::DelayAwaiter delay(u_long duration);
+
+ private:
+  friend class QuackMeshCoroutines::DelayAwaiter;
+
+  /**
+   * Keep a coroutine until its delay is over
+   * @param handle The coroutine
+   * @param duration The delay in milliseconds
+   * @return Whether the coroutine is kept, false if too many are waiting
+   */
+  bool addSleeper(std::coroutine_handle<> handle, u_long duration);
+
+  QuackMeshDevice &mDevice;  // The device the coroutines use
+
+  QuackMeshCoroutines::SleepingCoroutine
+      mSleepers[QUACK_COROUTINE_FRAMES] = {};  // The coroutines in a delay
+};
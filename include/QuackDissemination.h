@@ -0,0 +1,226 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+
+#include "QuackImageStore.h"
+#include "QuackMeshTypes.h"
+
+/**
+ * This class spreads firmware images through the mesh in the style of
+ * Deluge. An image is split into pages of packets. Every node advertises
+ * the version of its image and the number of pages it has completely in
+ * summaries, which are sent on a Trickle timer and suppressed if enough
+ * neighbours already said the same. A node that hears a neighbour with more
+ * pages asks it for the next page with a bitmap of the missing packets, the
+ * neighbour broadcasts them. Other nodes that miss the same page take the
+ * packets as well and hold back their own requests, so a neighbourhood
+ * receives each page about once. Pages are taken in order, written to the
+ * store as soon as they are complete and served from then on.
+ */
+class QuackDissemination {
+ public:
+  // Sends a message of the protocol to all neighbours
+  typedef std::function<void(uint8_t type, const uint8_t *payload,
+                             size_t length)>
+      SendCallback;
+
+  /**
+   * Configure the dissemination
+   * @param store The storage of the images
+   * @param runningVersion The version of the running firmware, only newer
+   * images are taken
+   * @param minInterval The shortest interval of the summaries in
+   * milliseconds
+   * @param maxInterval The longest interval of the summaries in milliseconds
+   */
+  void configure(QuackImageStore *store, uint16_t runningVersion,
+                 u_long minInterval, u_long maxInterval);
+
+  /**
+   * Start the dissemination
+   * @param ownAddress The MAC-Address of this node
+   * @param send The callback that sends the messages
+   */
+  void begin(const uint8_t ownAddress[6], SendCallback send);
+
+  /**
+   * Send the due summaries, requests and packets
+   * @param sendingPossible Whether a packet may be sent now, packets are
+   * only handed over one at a time
+   */
+  void update(bool sendingPossible);
+
+  /**
+   * Process a message of the protocol
+   * @param srcAddress The MAC-Address of the neighbour
+   * @param message The message
+   */
+  void onMessageReceived(const uint8_t srcAddress[6],
+                         const QuackMeshTypes::Message &message);
+
+  /**
+   * Start spreading an image that was written to the store completely
+   * @param version The version of the image, newer than the running one
+   * @param size The size of the image
+   * @return 0 on success, -1 if the version is not newer or the image could
+   * not be read
+   */
+  int publishImage(uint16_t version, size_t size);
+
+  /**
+   * Set the callback that is called once an image is complete and verified
+   * @param callback The callback to be called
+   */
+  void setOnImageCallback(QuackMeshTypes::OnImageCallback callback);
+
+  /**
+   * Get the number of pages this node has of the current image
+   * @return The number of complete pages
+   */
+  uint16_t getCompletePages() const;
+
+  /**
+   * Get the number of pages of the current image
+   * @return The number of pages, 0 if no image is known
+   */
+  uint16_t getTotalPages() const;
+
+ private:
+  /**
+   * Start the Trickle interval from its shortest length
+   */
+  void resetSummaries();
+
+  /**
+   * Start a new Trickle interval
+   */
+  void scheduleSummary();
+
+  /**
+   * Process the summary of a neighbour
+   * @param srcAddress The MAC-Address of the neighbour
+   * @param payload The summary
+   */
+  void handleSummary(const uint8_t srcAddress[6],
+                     const QuackMeshTypes::ImageSummaryPayload &payload);
+
+  /**
+   * Process a request, either for this node or overheard
+   * @param payload The request
+   */
+  void handleRequest(const QuackMeshTypes::ImageRequestPayload &payload);
+
+  /**
+   * Process a packet, either for the page this node misses or overheard
+   * @param srcAddress The MAC-Address of the neighbour
+   * @param message The packet
+   */
+  void handleData(const uint8_t srcAddress[6],
+                  const QuackMeshTypes::Message &message);
+
+  /**
+   * Drop the current image and prepare the store for a newer one
+   * @param payload The summary of the newer image
+   * @return Whether the store took the image
+   */
+  bool startImage(const QuackMeshTypes::ImageSummaryPayload &payload);
+
+  /**
+   * Start asking a neighbour for the next page
+   * @param srcAddress The MAC-Address of the neighbour
+   */
+  void startPage(const uint8_t srcAddress[6]);
+
+  /**
+   * Write the received page to the store and verify the image once it is
+   * complete
+   */
+  void completePage();
+
+  /**
+   * Send the summary of this node
+   */
+  void sendSummary();
+
+  /**
+   * Ask the source of the page for the missing packets
+   */
+  void sendRequest();
+
+  /**
+   * Broadcast the next requested packet
+   */
+  void sendPacket();
+
+  /**
+   * Get the length of a page, the last one may be shorter
+   * @param page The page
+   * @return The length in bytes
+   */
+  size_t getPageLength(uint16_t page) const;
+
+  /**
+   * Get the bitmap of all packets of a page
+   * @param page The page
+   * @return The bitmap
+   */
+  uint8_t getPacketMask(uint16_t page) const;
+
+  /**
+   * Get the version this node advertises
+   * @return The version of the image or of the running firmware
+   */
+  uint16_t getVersion() const;
+
+  QuackImageStore *mStore = nullptr;  // The storage of the images
+  uint8_t mOwnAddress[6] = {};        // The MAC-Address of this node
+  SendCallback mSend = nullptr;       // Sends the messages
+  QuackMeshTypes::OnImageCallback mOnImageCallback =
+      nullptr;  // The callback that is called when an image is complete
+
+  uint16_t mRunningVersion = 0;  // The version of the running firmware
+  bool mHasImage = false;  // Whether an image newer than the running one is
+                           // known, complete or not
+  uint16_t mImageVersion = 0;   // The version of the image
+  uint32_t mImageSize = 0;      // The size of the image
+  uint32_t mImageCrc = 0;       // The CRC-32 the image has to match
+  uint32_t mReceivedCrc = 0;    // The CRC-32 of the complete pages
+  uint16_t mTotalPages = 0;     // The number of pages of the image
+  uint16_t mCompletePages = 0;  // The number of pages this node has
+
+  u_long mMinSummaryInterval = 1000;   // The shortest Trickle interval
+  u_long mMaxSummaryInterval = 60000;  // The longest Trickle interval
+  u_long mSummaryInterval = 1000;      // The current Trickle interval
+  u_long mSummaryIntervalStartTs = 0;  // The start of the current interval
+  u_long mSummaryDelay = 0;  // The time in the interval the summary is sent
+  bool mSummarySent = false;  // Whether the interval's summary is done
+  uint8_t mConsistentSummaries =
+      0;  // The summaries in this interval that matched the own one
+  uint8_t mSummaryRedundancy =
+      1;  // The matching summaries after which the own one is suppressed
+
+  bool mReceiving = false;     // Whether a page is being received
+  uint8_t mPageSource[6] = {};  // The neighbour the page is requested from
+  uint16_t mReceivingPage = 0;  // The page being received
+  uint8_t mReceivedPackets = 0;  // The bitmap of the received packets
+  uint8_t mPage[QuackMeshTypes::IMAGE_PAGE_SIZE] =
+      {};                        // The packets of the page being received
+  u_long mLastPageActivityTs = 0;  // The last request or packet of the page
+  u_long mRequestDelay = 0;  // The time after the activity a request is due
+  uint8_t mRequests = 0;     // The requests without packets in between
+  uint8_t mMaxRequests = 4;  // The requests after which the page is dropped
+  u_long mRequestTimeout = 500;  // The time without packets before a request
+
+  uint16_t mServedPage = 0;      // The page whose packets are requested
+  uint8_t mRequestedPackets = 0;  // The bitmap of the packets to be sent
+};
@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Arithmetic in GF(256) and a systematic Reed-Solomon erasure code on top of
+ * it. A block of data symbols is sent as is, followed by repair symbols that
+ * are combinations of all of them with the coefficients of a Cauchy matrix.
+ * Any data symbols that are lost can be recovered from as many repair
+ * symbols. Multiplications use log and exp tables, so coding a byte costs a
+ * few table lookups.
+ */
+namespace QuackMeshFec {
+
+// The maximum number of data symbols in a block and of repairs for it
+constexpr uint8_t MAX_SYMBOLS = 16;
+
+/**
+ * Multiply two elements of GF(256)
+ * @param a The first factor
+ * @param b The second factor
+ * @return The product
+ */
+uint8_t multiply(uint8_t a, uint8_t b);
+
+/**
+ * Get the multiplicative inverse of an element of GF(256)
+ * @param a The element, not 0
+ * @return The inverse
+ */
+uint8_t invert(uint8_t a);
+
+/**
+ * Add a multiple of a buffer to another one, element-wise in GF(256)
+ * @param target The buffer that is added to
+ * @param source The buffer that is multiplied
+ * @param coefficient The factor
+ * @param length The length of both buffers
+ */
+void addScaled(uint8_t *target, const uint8_t *source, uint8_t coefficient,
+               size_t length);
+
+/**
+ * Multiply a buffer with a factor, element-wise in GF(256)
+ * @param data The buffer
+ * @param coefficient The factor, not 0
+ * @param length The length of the buffer
+ */
+void scale(uint8_t *data, uint8_t coefficient, size_t length);
+
+/**
+ * Calculate a repair symbol of a block
+ * @param symbols The data symbols of the block
+ * @param count The number of data symbols, at most MAX_SYMBOLS
+ * @param index The index of the repair symbol, below MAX_SYMBOLS
+ * @param length The length of every symbol
+ * @param repair The repair symbol, length bytes
+ */
+void encodeRepair(const uint8_t *const *symbols, uint8_t count, uint8_t index,
+                  size_t length, uint8_t *repair);
+
+/**
+ * Recover the missing data symbols of a block
+ * @param symbols The data symbols of the block, the buffers of the missing
+ * ones are overwritten with the recovered data
+ * @param present Whether each data symbol was received
+ * @param count The number of data symbols, at most MAX_SYMBOLS
+ * @param repairs The received repair symbols
+ * @param indices The indices of the received repair symbols
+ * @param repairCount The number of received repair symbols
+ * @param length The length of every symbol
+ * @return The number of recovered symbols, -1 if there are fewer repairs
+ * than missing symbols
+ */
+int decodeSymbols(uint8_t *const *symbols, const bool *present, uint8_t count,
+                  const uint8_t *const *repairs, const uint8_t *indices,
+                  uint8_t repairCount, size_t length);
+
+/**
+ * Get the number of repair symbols that makes a block survive a loss rate
+ * @param count The number of data symbols
+ * @param loss The probability that a frame is lost
+ * @param maxRepairs The upper bound of the result
+ * @return The smallest number of repairs for which the block fails to
+ * decode in at most 30 % of the cases, 0 on links with hardly any loss
+ */
+uint8_t getRepairCount(uint8_t count, float loss, uint8_t maxRepairs);
+
+}  // namespace QuackMeshFec
@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+
+namespace QuackMeshGateway {
+
+// The size of a packet before encoding, without the trailing CRC
+constexpr size_t MAX_PACKET_SIZE = 512;
+
+// The size of the header every batch starts with (type, sequence, dropped)
+constexpr size_t COMMON_HEADER_SIZE = 4;
+
+/**
+ * Encode a buffer with Consistent Overhead Byte Stuffing, the output contains
+ * no zero bytes and is terminated by a zero delimiter
+ * @param input The buffer to be encoded
+ * @param length The length of the buffer
+ * @param output The encoded frame, at least length + length / 254 + 2 bytes
+ * @return The length of the encoded frame including the delimiter
+ */
+size_t encodeCOBS(const uint8_t *input, size_t length, uint8_t *output);
+
+/**
+ * Decode a frame encoded with Consistent Overhead Byte Stuffing
+ * @param input The frame without the delimiter
+ * @param length The length of the frame
+ * @param output The decoded buffer, at least length bytes
+ * @return The length of the decoded buffer, 0 if the frame is malformed
+ */
+size_t decodeCOBS(const uint8_t *input, size_t length, uint8_t *output);
+
+/**
+ * Calculate the CRC-16/CCITT-FALSE of a buffer
+ * @param data The buffer
+ * @param length The length of the buffer
+ * @return The checksum
+ */
+uint16_t crc16(const uint8_t *data, size_t length);
+
+// The callback that fills the type specific header of a batch
+typedef std::function<void(uint8_t *header)> BatchHeaderCallback;
+
+/**
+ * This class collects records into batches and writes them to a stream.
+ * A batch is a packet of `type, sequence, dropped (u16 LE)`, a type specific
+ * header and the records, followed by a CRC-16 (LE) and COBS framed.
+ * Encoded batches wait in a buffer that is only written as far as the stream
+ * accepts without blocking; batches that do not fit are dropped and counted
+ * in the next batch.
+ */
+class BatchWriter {
+ public:
+  /**
+   * Constructor
+   * @param type The packet type of the batches
+   * @param headerSize The size of the type specific header
+   */
+  BatchWriter(uint8_t type, size_t headerSize);
+
+  /**
+   * Set the callback that fills the type specific header when a batch is sent
+   * @param callback The callback to be called
+   */
+  void setHeaderCallback(BatchHeaderCallback callback);
+
+  /**
+   * Drop the current batch and all buffered output
+   */
+  void reset();
+
+  /**
+   * Reserve space for a record in the current batch, the batch is sent first
+   * if the record does not fit. A new batch is started if none is open
+   * @param length The length of the record
+   * @return Where the record has to be written, nullptr if it is too long
+   */
+  uint8_t *reserve(size_t length);
+
+  /**
+   * Encode the current batch into the output buffer
+   */
+  void flush();
+
+  /**
+   * Check if a batch is open
+   * @return Whether a batch was started and not sent yet
+   */
+  bool isBatchOpen() const;
+
+  /**
+   * Get the time since the current batch was started
+   * @return The age in milliseconds
+   */
+  u_long getBatchAge() const;
+
+  /**
+   * Get the time since the last batch was sent
+   * @return The time in milliseconds
+   */
+  u_long getIdleTime() const;
+
+  /**
+   * Write as much of the output buffer as the stream accepts without blocking
+   * @param stream The stream to be written to
+   * @param blocking Whether everything is written at once, e.g. for files that
+   * do not report availableForWrite()
+   */
+  void writeTo(Print &stream, bool blocking = false);
+
+  /**
+   * Get the number of batches dropped since the start
+   * @return The number of dropped batches
+   */
+  uint32_t getDroppedBatches() const;
+
+ private:
+  uint8_t mType;        // The packet type of the batches
+  size_t mHeaderSize;   // The size of the complete header
+  BatchHeaderCallback mHeaderCallback =
+      nullptr;  // Fills the type specific header
+
+  uint8_t mBatch[MAX_PACKET_SIZE + 2] =
+      {};                   // The batch that is being filled, with its CRC
+  size_t mBatchLength = 0;  // The length of the batch including the header
+  u_long mBatchStartedTs = 0;  // The timestamp the batch was started
+  u_long mLastBatchTs = 0;     // The timestamp of the last sent batch
+  uint8_t mNextSequence = 0;   // The sequence number of the next batch
+
+  uint8_t mOutput[4096] = {};  // The encoded batches waiting for the stream
+  size_t mOutputStart = 0;     // The first byte in the output buffer
+  size_t mOutputLength = 0;    // The number of bytes in the output buffer
+  uint32_t mDroppedBatches = 0;   // The number of dropped batches
+  uint16_t mUnreportedDrops = 0;  // The drops not reported to the host yet
+};
+}  // namespace QuackMeshGateway
@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "QuackFraming.h"
+#include "QuackMeshDevice.h"
+
+namespace QuackMeshGateway {
+
+// The packet types sent to the host
+constexpr uint8_t PACKET_BATCH = 0x01;  // A batch of records
+
+// The packet types sent by the host
+constexpr uint8_t PACKET_SEND = 0x81;    // Send a message into the mesh
+constexpr uint8_t PACKET_PAUSE = 0x82;   // Stop sending batches to the host
+constexpr uint8_t PACKET_RESUME = 0x83;  // Continue sending batches
+constexpr uint8_t PACKET_PING = 0x84;    // Ask for a result record
+
+// The record kinds inside a batch
+constexpr uint8_t RECORD_MESSAGE = 0x01;  // A message for the gateway
+constexpr uint8_t RECORD_STATUS = 0x02;   // The status of a sent message
+constexpr uint8_t RECORD_RESULT = 0x03;   // The result of a host command
+constexpr uint8_t RECORD_FRAME = 0x04;    // A mesh frame heard by the gateway
+
+// The flags of a send packet
+constexpr uint8_t SEND_FLAG_CONFIRMED = 0x01;
+constexpr uint8_t SEND_FLAG_CONTROL = 0x02;
+
+// The size of the header of a batch (type, sequence, dropped, credits)
+constexpr size_t BATCH_HEADER_SIZE = COMMON_HEADER_SIZE + 1;
+
+/**
+ * A command of the host waiting for the mesh to accept it
+ */
+struct HostCommand {
+  uint8_t sequence;
+  uint8_t flags;
+  uint8_t destination[6];
+  uint8_t dataLength;
+  uint8_t data[232];
+};
+}  // namespace QuackMeshGateway
+
+/**
+ * This class bridges a mesh device to a host over a serial stream.
+ * Every mesh frame the device receives, the messages for the device and the
+ * status of sent messages are collected as records into batches, which are
+ * COBS framed with a CRC and written to the stream without ever blocking the
+ * mesh. The host sends commands over the
+ * same protocol, e.g. to send messages into the mesh.
+ *
+ * Flow control works in both directions: every batch carries the number of
+ * host commands the gateway can still buffer (credits), and the host can
+ * pause the batches. If the output buffer overflows, batches are dropped and
+ * counted in the next batch.
+ *
+ * The gateway installs the message and frame callbacks of the device and
+ * keeps calling the ones set before its begin(), so the application sets its
+ * callbacks first. begin() has to be called before the device's begin().
+ * Debug output has to be disabled if the stream is the debug serial.
+ */
+class QuackGateway {
+ public:
+  /**
+   * Constructor
+   * @param device The device that is bridged
+   * @param stream The stream to the host, e.g. Serial
+   */
+  QuackGateway(QuackMeshDevice &device, Stream &stream);
+
+  /**
+   * Start the gateway
+   */
+  void begin();
+
+  /**
+   * Process the commands of the host and write pending batches, has to be
+   * called from the task that calls the device's update()
+   */
+  void update();
+
+  /**
+   * Set whether every received mesh frame is bridged, not only the messages
+   * for the device, enabled by default
+   * @param enabled Whether the frames are bridged
+   */
+  void setFrameBridging(bool enabled);
+
+  /**
+   * Set the time after which an incomplete batch is sent
+   * @param timeout The timeout in milliseconds
+   */
+  void setBatchTimeout(u_long timeout);
+
+  /**
+   * Get the number of batches dropped since the start
+   * @return The number of dropped batches
+   */
+  uint32_t getDroppedBatches() const;
+
+ private:
+  /**
+   * Append a record to the current batch
+   * @param kind The kind of the record
+   * @param data The content of the record
+   * @param length The length of the content
+   */
+  void appendRecord(uint8_t kind, const uint8_t *data, size_t length);
+
+  /**
+   * Read the bytes sent by the host and process complete packets
+   */
+  void readInput();
+
+  /**
+   * Process a decoded packet of the host
+   * @param packet The packet including the CRC
+   * @param length The length of the packet
+   */
+  void processPacket(const uint8_t *packet, size_t length);
+
+  /**
+   * Hand the oldest buffered host command to the mesh
+   */
+  void processCommand();
+
+  /**
+   * Queue a result record for a host command
+   * @param sequence The sequence number of the command
+   * @param result The result, 0 on success
+   */
+  void sendResult(uint8_t sequence, int8_t result);
+
+  /**
+   * Get the number of host commands that can still be buffered
+   * @return The number of free command slots
+   */
+  uint8_t getCredits() const;
+
+  QuackMeshDevice &mDevice;  // The bridged device
+  Stream &mStream;           // The stream to the host
+
+  QuackMeshGateway::BatchWriter mWriter = {
+      QuackMeshGateway::PACKET_BATCH, 1};  // Collects the records for the host
+  u_long mBatchTimeout = 5;  // The time after which a batch is sent
+  u_long mKeepAliveInterval =
+      1000;  // The interval of empty batches that report the credits
+  bool mPaused = false;  // Whether the host paused the batches
+  bool mFrameBridging = true;  // Whether every received frame is bridged
+
+  uint8_t mInput[QuackMeshGateway::MAX_PACKET_SIZE + 8] =
+      {};                   // The encoded packet that is being received
+  size_t mInputLength = 0;  // The number of bytes of the packet
+  bool mInputOverflow = false;  // Whether the packet is too long
+
+  static constexpr size_t MAX_COMMANDS = 8;
+  QuackMeshGateway::HostCommand mCommands[MAX_COMMANDS] =
+      {};                      // The buffered host commands
+  size_t mCommandStart = 0;    // The oldest buffered host command
+  size_t mCommandCount = 0;    // The number of buffered host commands
+};
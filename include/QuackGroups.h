@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class keeps the multicast groups a device and its neighbours are
+ * members of. Devices advertise the groups they joined, forwarding devices
+ * also the groups of their branches with the distance to the nearest
+ * member. Every neighbour owns a bit, a group keeps one bitmap of the
+ * neighbours per distance, so the links of a group message are found with
+ * a few bit operations.
+ */
+class QuackGroups {
+ public:
+  // Sends an advertisement to the neighbours
+  typedef std::function<void(const uint8_t *payload, size_t length)>
+      SendCallback;
+
+  /**
+   * Configure the advertisements, has to be called before begin()
+   * @param advertInterval The interval of the advertisements in milliseconds
+   */
+  void configure(u_long advertInterval);
+
+  /**
+   * Advertise the groups of the neighbours as well, for devices that forward
+   * group messages. Has to be called before begin()
+   * @param forwarding Whether the device forwards group messages
+   */
+  void setForwarding(bool forwarding);
+
+  /**
+   * Start the advertisements
+   * @param send The callback that sends the advertisements
+   */
+  void begin(SendCallback send);
+
+  /**
+   * Remove neighbours that stopped advertising and advertise the own groups
+   * when they changed or the interval is over
+   */
+  void update();
+
+  /**
+   * Replace the groups of a neighbour with the ones it advertised
+   * @param neighbour The MAC-Address of the neighbour
+   * @param message The advertisement
+   */
+  void onMessageReceived(const uint8_t neighbour[6],
+                         const QuackMeshTypes::Message &message);
+
+  /**
+   * Join a group
+   * @param group The group
+   * @param callback The callback to be called for every message to the group
+   * @return 0 on success, -1 if too many groups are joined
+   */
+  int join(uint16_t group, QuackMeshTypes::OnGroupMessageCallback callback);
+
+  /**
+   * Leave a group
+   * @param group The group
+   */
+  void leave(uint16_t group);
+
+  /**
+   * Call the callback of the group of a message if the device joined it
+   * @param message The message for the group
+   */
+  void deliver(const QuackMeshTypes::Message &message);
+
+  /**
+   * Get the neighbours a group message has to be sent to
+   * @param message The message with the hop count it is sent with
+   * @param previousHop The neighbour it came from, nullptr for own ones
+   * @return The MAC-Addresses of the neighbours that lead to members
+   */
+  std::vector<const uint8_t *> getLinks(const QuackMeshTypes::Message &message,
+                                        const uint8_t *previousHop) const;
+
+ private:
+  /**
+   * Collect the groups this device advertises
+   * @param groups The list the groups are added to
+   */
+  void fillAdvertisement(
+      std::vector<QuackMeshTypes::GroupAdvertisement> &groups) const;
+
+  /**
+   * Check if an advertisement has to be sent
+   * @param changed Whether the advertised groups changed
+   * @param empty Whether the advertisement is empty
+   * @return Whether an advertisement is due
+   */
+  bool isAdvertisementDue(bool changed, bool empty) const;
+
+  SendCallback mSend = nullptr;  // Sends the advertisements
+
+  bool mForwarding = false;  // Whether the groups of the branches count
+  u_long mAdvertInterval =
+      2000;  // The interval of the membership advertisements
+  u_long mMinAdvertGap =
+      100;  // The minimum time between two advertisements of changed groups
+  u_long mLastAdvertTs = 0;  // The time of the last advertisement
+  std::vector<QuackMeshTypes::GroupAdvertisement> mLastAdvertisement =
+      {};  // The groups that were advertised last
+  std::vector<QuackMeshTypes::JoinedGroup> mJoinedGroups =
+      {};  // The groups the application joined
+  size_t mMaxJoinedGroups = 8;  // The maximum number of joined groups
+  QuackMeshTypes::GroupNeighbour
+      mNeighbours[QuackMeshTypes::MAX_GROUP_NEIGHBOURS] =
+          {};  // The neighbours the bits of the bitmaps stand for
+  std::vector<QuackMeshTypes::GroupMembership> mMemberships =
+      {};  // The neighbours leading to the members of each group
+  size_t mMaxMemberships = 16;  // The maximum number of known groups
+};
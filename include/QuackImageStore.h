@@ -0,0 +1,77 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#ifdef ESP32
+#include <esp_ota_ops.h>
+#endif
+
+/**
+ * The storage of a disseminated firmware image. Pages are written in order,
+ * completed pages are read back to serve neighbours.
+ */
+class QuackImageStore {
+ public:
+  virtual ~QuackImageStore() = default;
+
+  /**
+   * Prepare the storage for a new image, the previous one is dropped
+   * @param version The version of the image
+   * @param size The size of the image
+   * @return 0 on success, -1 if the image does not fit
+   */
+  virtual int begin(uint16_t version, size_t size) = 0;
+
+  /**
+   * Write a part of the image
+   * @param offset The offset of the data in the image
+   * @param data The data
+   * @param length The length of the data
+   * @return 0 on success, -1 on failure
+   */
+  virtual int write(size_t offset, const uint8_t *data, size_t length) = 0;
+
+  /**
+   * Read a part of the image that was written before
+   * @param offset The offset of the data in the image
+   * @param data The buffer the data is read into
+   * @param length The length of the data
+   * @return 0 on success, -1 on failure
+   */
+  virtual int read(size_t offset, uint8_t *data, size_t length) = 0;
+
+  /**
+   * Complete the image after its CRC was verified, e.g. make it bootable
+   * @return 0 on success, -1 if the image was rejected
+   */
+  virtual int finish() = 0;
+};
+
+#ifdef ESP32
+/**
+ * Stores the image in the next OTA partition and makes it the boot partition
+ * once it is complete. The application decides when to restart.
+ */
+class QuackOtaStore : public QuackImageStore {
+ public:
+  ~QuackOtaStore() override;
+
+  int begin(uint16_t version, size_t size) override;
+  int write(size_t offset, const uint8_t *data, size_t length) override;
+  int read(size_t offset, uint8_t *data, size_t length) override;
+  int finish() override;
+
+ private:
+  const esp_partition_t *mPartition = nullptr;  // The partition written to
+  esp_ota_handle_t mHandle = 0;  // The handle of the running update
+  bool mUpdating = false;        // Whether an update was begun and not ended
+};
+#endif
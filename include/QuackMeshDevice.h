@@ -10,27 +10,72 @@ the LICENSE file.
 
 #include <Arduino.h>
 
+#include <atomic>
 #include <functional>
 #include <queue>
 #include <vector>
 
+#ifdef ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
 #include "ESPNowClient.h"
+#include "QuackAggregation.h"
+#include "QuackAnycast.h"
+#include "QuackBackpressure.h"
+#include "QuackChannels.h"
+#include "QuackCodedBroadcast.h"
+#include "QuackCollection.h"
+#include "QuackConcurrency.h"
+#include "QuackDissemination.h"
+#include "QuackGroups.h"
 #include "QuackMeshTypes.h"
+#include "QuackPublishSubscribe.h"
+#include "QuackRpc.h"
+#include "QuackSlots.h"
+#include "QuackStreams.h"
+#include "QuackTimeSync.h"
 
 /**
  * A Mesh-Device is a device that is able to send and receive messages over
  * ESP-Now and communicate in a mesh network with other devices.
  * It uses the implementation of a ESPNowClient to send and receive messages.
+ *
+ * Threading contract:
+ * - sendMessage() and sendConfirmedMessage() may be called from any task
+ *   (not from an ISR). They only copy the message into a bounded submission
+ *   queue under a short critical section and never block on the radio.
+ * - update() has to be called from exactly one task, the mesh task.
+ * - All callbacks are invoked from within update(), i.e. on the mesh task,
+ *   and must not call update() themselves.
+ * - The callbacks have to be set before begin().
  */
 class QuackMeshDevice {
  public:
   /**
    * Start the Mesh device
+   * @return 0 on success, -1 if the radio could not be started, e.g. because
+   * ESPNowClient::MAX_ACTIVE_CLIENTS devices are started already. Nothing
+   * else is started then
    */
-  void begin();
+  int begin();
 
   void stop();
 
+#ifdef ESP32
+  /**
+   * Enable the dual-core pipeline mode, has to be called before begin().
+   * In this mode a dedicated task pinned to radioCore owns the ESP-Now client
+   * (draining received frames, the send window and the retries) while update()
+   * only runs the mesh logic (dedup, routing, ARQ and the callbacks).
+   * Both sides are connected by lock-free rings, so a slow callback can not
+   * delay the radio.
+   * @param radioCore The core the radio task is pinned to
+   */
+  void enablePipeline(BaseType_t radioCore = 0);
+#endif
+
   /**
    * Update the Mesh device state
    */
@@ -41,18 +86,55 @@ class QuackMeshDevice {
    * @param data The data to be sent
    * @param dataLength The length of the data to be sent
    * @param destination The MAC-Address of the destination
+   * @return 0 if the message was queued, -1 if the data is too long, -2 if
+   * the submission queue is full or the device is congested, see
+   * enableBackpressure(). Only -2 is worth a retry
    */
-  void sendMessage(uint8_t data[232], size_t dataLength,
-                   uint8_t destination[6]);
+  int sendMessage(uint8_t data[232], size_t dataLength,
+                  uint8_t destination[6]);
 
   /**
-   * Enqueue a new confirmed-message to be sent
+   * Enqueue a new confirmed-message to be sent. Group messages cannot be
+   * confirmed, use sendGroupMessage()
    * @param data The data to be sent
    * @param dataLength The length of the data to be sent
    * @param destination The MAC-Address of the destination
+   * @return 0 if the message was queued, -1 if the data is too long or the
+   * destination is a group, -2 if the submission queue is full or the device
+   * is congested, see enableBackpressure(). Only -2 is worth a retry
    */
-  void sendConfirmedMessage(uint8_t data[232], size_t dataLength,
-                            uint8_t destination[6]);
+  int sendConfirmedMessage(uint8_t data[232], size_t dataLength,
+                           uint8_t destination[6]);
+
+  /**
+   * Enqueue a new confirmed-message and call the given callback with its
+   * status, in addition to the status callback. The callback is called on
+   * the mesh task
+   * @param data The data to be sent
+   * @param dataLength The length of the data to be sent
+   * @param destination The MAC-Address of the destination
+   * @param callback The callback to be called once the message is
+   * acknowledged or failed
+   * @return 0 if the message was queued, -1 if the data is too long or the
+   * destination is a group, -2 if the submission queue is full, too many
+   * messages wait for their status or the device is congested
+   */
+  int sendConfirmedMessage(
+      uint8_t data[232], size_t dataLength, uint8_t destination[6],
+      QuackMeshTypes::OnESPNowDataSentStatusCallback callback);
+
+  /**
+   * Enqueue a new control-class message. Control messages are sent before
+   * any other message and, in slotted mode, only in the own transmit slot.
+   * The receiver gets them with type MESSAGE_TYPE_CONTROL, unconfirmed
+   * @param data The data to be sent
+   * @param dataLength The length of the data to be sent
+   * @param destination The MAC-Address of the destination
+   * @return 0 if the message was queued, -1 if the data is too long, -2 if
+   * the submission queue is full
+   */
+  int sendControlMessage(uint8_t data[232], size_t dataLength,
+                         uint8_t destination[6]);
 
   /**
    * Set the callback that is called when a message is sent
@@ -68,18 +150,675 @@ class QuackMeshDevice {
   void setOnMessageCallback(
       QuackMeshTypes::OnNewMessageReceivedCallback callback);
 
+  /**
+   * Get the callback that is called when a message is sent
+   * @return The callback, nullptr if none is set
+   */
+  QuackMeshTypes::OnESPNowDataSentStatusCallback getOnMessageStatusCallback()
+      const;
+
+  /**
+   * Get the callback that is called when a message is received
+   * @return The callback, nullptr if none is set
+   */
+  QuackMeshTypes::OnNewMessageReceivedCallback getOnMessageCallback() const;
+
+  /**
+   * Set the callback that is called with every mesh frame received from a
+   * neighbour, including the ones that are forwarded or handled internally
+   * @param callback The callback to be called
+   */
+  void setOnFrameCallback(QuackMeshTypes::OnFrameReceivedCallback callback);
+
+  /**
+   * Get the callback that is called with every received mesh frame
+   * @return The callback, nullptr if none is set
+   */
+  QuackMeshTypes::OnFrameReceivedCallback getOnFrameCallback() const;
+
   uint8_t *getMACAddress();
 
+  /**
+   * Enable the duty-cycled end-device mode.
+   * Once idle for awakeWindow milliseconds the device puts its radio to sleep
+   * for sleepInterval milliseconds, then polls its parent router which
+   * delivers the frames it buffered in the meantime.
+   * Should not be combined with the pipeline mode.
+   * @param parent The MAC-Address of the router buffering frames for the device
+   * @param sleepInterval How long the device sleeps in milliseconds, 0 disables
+   * the duty cycle
+   * @param awakeWindow How long the device stays awake after the last activity
+   */
+  void setSleepSchedule(uint8_t parent[6], u_long sleepInterval,
+                        u_long awakeWindow);
+
+  /**
+   * Set the time after which a confirmed message without acknowledgement is
+   * reported as failed. Has to be longer than the sleep interval of the
+   * destination when sending to duty-cycled devices
+   * @param timeout The timeout in milliseconds
+   */
+  void setConfirmationTimeout(u_long timeout);
+
+  /**
+   * Enable the mesh time synchronisation, has to be called before begin()
+   * @param beaconInterval The interval in which beacons are sent in
+   * milliseconds, 0 to only listen (e.g. for duty-cycled devices)
+   * @param canBeRoot Whether this device may provide the reference time
+   */
+  void enableTimeSync(u_long beaconInterval, bool canBeRoot = true);
+
+  /**
+   * Get the mesh time, which is the same on all synchronised devices.
+   * Falls back to the local time while not synchronised
+   * @return The mesh time in milliseconds
+   */
+  u_long meshMillis();
+
+  /**
+   * Get the mesh time in microseconds
+   * @return The mesh time in microseconds
+   */
+  uint64_t meshMicros();
+
+  /**
+   * Check if the mesh time is available
+   * @return Whether the device is synchronised to the mesh time
+   */
+  bool isTimeSynced() const;
+
+  /**
+   * Enable the slotted (TDMA) mode, has to be combined with the time
+   * synchronisation. The mesh time is divided into repeating superframes of
+   * slotCount transmit slots followed by a contention period. Control messages
+   * are only sent in the own slot, all other messages only in the contention
+   * period, so neighbours with different slots never collide on control
+   * traffic. The devices claim their slots in broadcasts that list the slots
+   * of their neighbours as well, a device that shares its slot with a device
+   * within two hops that has a lower address moves to a free one. While the
+   * mesh time is not synchronised all messages are sent immediately.
+   * @param slotCount The number of transmit slots per superframe, at least 1
+   * @param slotLength The length of a slot in milliseconds, longer than the
+   * guard times of 2 ms at both of its ends
+   * @param contentionLength The length of the contention period in
+   * milliseconds, longer than the guard time of 2 ms at its end
+   * @return 0 on success, -1 if a window would be empty
+   */
+  int enableSlottedMode(uint8_t slotCount, u_long slotLength,
+                        u_long contentionLength);
+
+  /**
+   * Set the transmit slot of this device, has to be called after
+   * enableSlottedMode(). Without a slot set, it starts with one derived from
+   * the MAC-Address and moves on a collision. A set slot is kept, so it has
+   * to be unique within two hops
+   * @param slot The slot, smaller than the slot count
+   * @return 0 on success, -1 if the slotted mode is not enabled or the slot
+   * does not exist
+   */
+  int setTransmitSlot(uint8_t slot);
+
+  /**
+   * Get the transmit slot of this device
+   * @return The slot, -1 before the slotted mode started
+   */
+  int16_t getTransmitSlot() const;
+
+  /**
+   * Enable the multi-channel mode, has to be called before begin().
+   * Every device listens on a home channel picked from the given channels and
+   * periodically announces it on all of them. Unicast frames are sent on the
+   * home channel of the next hop, broadcasts on every channel a neighbour
+   * listens on, so disjoint parts of the mesh can use different channels.
+   * Without setHomeChannel() the least used channel among the neighbours is
+   * picked after a few announcements
+   * @param channels The channels that may be used
+   * @param channelCount The number of channels
+   * @param announceInterval The interval of the announcements in milliseconds
+   */
+  void enableMultiChannel(const uint8_t *channels, size_t channelCount,
+                          u_long announceInterval = 5000);
+
+  /**
+   * Set a fixed home channel instead of picking one automatically
+   * @param channel The channel the device listens on
+   */
+  void setHomeChannel(uint8_t channel);
+
+  /**
+   * Enable the automatic channel discovery, has to be called before begin().
+   * A device associated to a Wi-Fi access point keeps the mesh on the channel
+   * of the access point and follows it when it changes. All other devices
+   * scan all channels after start-up and whenever nothing was heard for
+   * lostTimeout milliseconds, until they hear the channel announcement of a
+   * neighbour. Can not be combined with the multi-channel mode
+   * @param announceInterval The interval of the announcements in milliseconds
+   * @param lostTimeout The time without any frame after which the mesh is
+   * considered lost in milliseconds
+   */
+  void enableChannelDiscovery(u_long announceInterval = 1000,
+                              u_long lostTimeout = 5000);
+
+  /**
+   * Check if the device currently scans for the channel of the mesh
+   * @return Whether the device is scanning, nothing is sent while scanning
+   */
+  bool isChannelScanning() const;
+
+  /**
+   * Enable the adaptation of the PHY rate per neighbour, has to be called
+   * before begin(). See ESPNowClient::enableRateAdaptation()
+   * @param longRange Whether the long range mode may be used for weak links
+   */
+  void enableRateAdaptation(bool longRange = false);
+
+  /**
+   * Record the frames and send statuses of the device, has to be called
+   * before begin(). See QuackRecorder
+   * @param recorder The recorder, nullptr to stop recording
+   */
+  void setRecorder(QuackRecorder *recorder);
+
+  /**
+   * Enable the publish/subscribe layer, has to be called before begin() on
+   * every device that publishes, subscribes or forwards publications.
+   * Devices advertise the topics they subscribed to to their neighbours,
+   * routers also the topics of their branches. Publications are only sent
+   * towards neighbours that lead to a subscriber, to a single one as unicast
+   * @param advertInterval The interval of the advertisements in milliseconds
+   */
+  void enablePublishSubscribe(u_long advertInterval = 2000);
+
+  /**
+   * Subscribe to a topic, has to be called before begin() or from the task
+   * that calls update()
+   * @param topic The name of the topic
+   * @param callback The callback to be called for every publication
+   * @return 0 on success, -1 if too many topics are subscribed
+   */
+  int subscribe(const char *topic,
+                QuackMeshTypes::OnPublicationCallback callback);
+
+  /**
+   * Cancel all subscriptions of a topic, has to be called from the task that
+   * calls update()
+   * @param topic The name of the topic
+   */
+  void unsubscribe(const char *topic);
+
+  /**
+   * Enqueue a new publication, it reaches the subscribers up to three hops
+   * away. May be called from any task
+   * @param topic The name of the topic
+   * @param data The data to be published
+   * @param dataLength The length of the data, at most 228 bytes
+   * @return 0 if the publication was queued, -1 if the data is too long or
+   * publish/subscribe is not enabled, -2 if the submission queue is full
+   */
+  int publish(const char *topic, const uint8_t *data, size_t dataLength);
+
+  /**
+   * Get the hash that identifies a topic on the air
+   * @param topic The name of the topic
+   * @return The 32 bit FNV-1a hash of the name
+   */
+  static uint32_t hashTopic(const char *topic);
+
+  /**
+   * Enable the multicast groups, has to be called before begin() on every
+   * device that joins, sends to or forwards for groups.
+   * Devices advertise the groups they joined to their neighbours, routers
+   * also the groups of their branches. Routers keep a bitmap of the
+   * neighbours leading to members per group and replicate group messages
+   * only onto those links
+   * @param advertInterval The interval of the advertisements in milliseconds
+   */
+  void enableGroups(u_long advertInterval = 2000);
+
+  /**
+   * Join a multicast group, has to be called before begin() or from the task
+   * that calls update()
+   * @param group The group
+   * @param callback The callback to be called for every message to the group
+   * @return 0 on success, -1 if too many groups are joined
+   */
+  int joinGroup(uint16_t group, QuackMeshTypes::OnGroupMessageCallback callback);
+
+  /**
+   * Leave a multicast group, has to be called from the task that calls
+   * update()
+   * @param group The group
+   */
+  void leaveGroup(uint16_t group);
+
+  /**
+   * Enqueue a new unconfirmed message to all members of a group up to three
+   * hops away. May be called from any task
+   * @param group The group
+   * @param data The data to be sent
+   * @param dataLength The length of the data to be sent
+   * @return 0 if the message was queued, -1 if the data is too long, -2 if
+   * the submission queue is full or the device is congested, see
+   * enableBackpressure()
+   */
+  int sendGroupMessage(uint16_t group, uint8_t data[232], size_t dataLength);
+
+  /**
+   * Get the destination address of a group, messages sent to it with
+   * sendMessage() reach the group as well
+   * @param group The group
+   * @param address The address of the group
+   */
+  static void getGroupAddress(uint16_t group, uint8_t address[6]);
+
+  /**
+   * Make this device a sink of an anycast service, has to be called before
+   * begin(). The sink periodically announces itself with its load, messages
+   * to the anycast address of the service are routed to the sink with the
+   * lowest cost, i.e. hops weighted with the load
+   * @param service The service
+   * @param advertInterval The interval of the advertisements in milliseconds,
+   * a sink is dropped after three missed ones
+   */
+  void enableSink(uint16_t service, u_long advertInterval = 1000);
+
+  /**
+   * Set the load the sink advertises, the length of the queue of messages to
+   * be sent is advertised instead if it is higher
+   * @param load The load, 0 idle to 255 saturated
+   */
+  void setSinkLoad(uint8_t load);
+
+  /**
+   * Enqueue a new message to the best sink of a service. May be called from
+   * any task
+   * @param service The service
+   * @param data The data to be sent
+   * @param dataLength The length of the data to be sent
+   * @param confirmed Whether the sink acknowledges the message
+   * @return 0 if the message was queued, -1 if the data is too long, -2 if
+   * the submission queue is full or the device is congested, see
+   * enableBackpressure()
+   */
+  int sendAnycastMessage(uint16_t service, uint8_t data[232],
+                         size_t dataLength, bool confirmed = false);
+
+  /**
+   * Get the destination address of an anycast service
+   * @param service The service
+   * @param address The address of the service
+   */
+  static void getAnycastAddress(uint16_t service, uint8_t address[6]);
+
+  /**
+   * Enable the collection tree, has to be called before begin() on every
+   * device that sends, forwards or collects data for the root.
+   * Every device picks the neighbour with the lowest cost to the root as its
+   * parent, the cost being the expected transmissions estimated from lost
+   * beacons and failed frames. Data is sent up the tree as unicast from
+   * parent to parent. Beacons are sent with an interval that doubles from
+   * minBeaconInterval to maxBeaconInterval while the tree is stable and
+   * starts over when a route changes, a loop is detected or a neighbour
+   * without a route asks for it
+   * @param root Whether this device collects the data of the tree
+   * @param minBeaconInterval The shortest interval of the beacons in
+   * milliseconds
+   * @param maxBeaconInterval The longest interval of the beacons in
+   * milliseconds
+   */
+  void enableCollection(bool root = false, u_long minBeaconInterval = 1000,
+                        u_long maxBeaconInterval = 60000);
+
+  /**
+   * Enqueue new data for the root of the collection tree, it is handed to the
+   * root's message callback with type MESSAGE_TYPE_COLLECTION_DATA. Data
+   * sent while there is no parent waits until one is found. May be called
+   * from any task
+   * @param data The data to be sent
+   * @param dataLength The length of the data, at most 228 bytes
+   * @return 0 if the data was queued, -1 if the data is too long or the
+   * collection tree is not enabled, -2 if the submission queue is full or the
+   * device is congested
+   */
+  int sendCollectionMessage(const uint8_t *data, size_t dataLength);
+
+  /**
+   * Get the cost of the route to the root of the collection tree
+   * @return The expected transmissions in tenths, NO_COLLECTION_ROUTE if
+   * there is no route
+   */
+  uint16_t getCollectionCost() const;
+
+  /**
+   * Enable the aggregation of reports, has to be called before begin() on
+   * the root and on the routers that combine reports. Reports with the same
+   * key and operator are held for the window after the first one arrives and
+   * then sent on as one report. Needs the collection tree
+   * @param window How long reports are held in milliseconds
+   */
+  void enableAggregation(u_long window = 500);
+
+  /**
+   * Register the merge callback of a custom aggregate, has to be called
+   * before begin(). Routers without it send the reports on unchanged
+   * @param key The key of the aggregate
+   * @param merge The callback that combines two reports
+   * @return 0 on success, -1 if too many aggregates are registered
+   */
+  int registerAggregate(uint16_t key,
+                        QuackMeshTypes::AggregateMergeCallback merge);
+
+  /**
+   * Set the callback that is called on the root for every aggregate
+   * @param callback The callback to be called
+   */
+  void setOnAggregateCallback(QuackMeshTypes::OnAggregateCallback callback);
+
+  /**
+   * Enqueue a new report for a built-in operator. May be called from any task
+   * @param key The key of the aggregate
+   * @param op The operator, AGGREGATE_MIN to AGGREGATE_AVERAGE
+   * @param value The value
+   * @return 0 if the report was queued, -1 if the operator is unknown or the
+   * collection tree is not enabled, -2 if the submission queue is full
+   */
+  int sendAggregateReport(uint16_t key, uint8_t op, int32_t value);
+
+  /**
+   * Enqueue a new report for a custom aggregate. May be called from any task
+   * @param key The key of the aggregate
+   * @param data The value
+   * @param dataLength The length of the value, at most 222 bytes
+   * @return 0 if the report was queued, -1 if the value is too long or the
+   * collection tree is not enabled, -2 if the submission queue is full
+   */
+  int sendAggregateReport(uint16_t key, const uint8_t *data,
+                          size_t dataLength);
+
+  /**
+   * Register the handler of a remote procedure call, has to be called before
+   * begin()
+   * @param method The method
+   * @param handler The handler
+   * @return 0 on success, -1 if too many methods are registered
+   */
+  int registerRpcMethod(uint16_t method, QuackMeshTypes::RpcHandler handler);
+
+  /**
+   * Call a method on another device. The response doubles as the
+   * acknowledgement of the request, so a call takes one frame each way.
+   * The callback is called once, with the status of the handler or
+   * RPC_TIMEOUT. Has to be called from the task that calls update()
+   * @param destination The MAC-Address of the device
+   * @param method The method
+   * @param request The data of the request
+   * @param requestLength The length of the request, at most
+   * MAX_RPC_DATA_LENGTH bytes
+   * @param callback The callback to be called with the response
+   * @param timeout The time without response after which the call failed in
+   * milliseconds
+   * @return 0 if the call was queued, -1 if the request is too long, -2 if
+   * too many calls are pending. Only -2 is worth a retry
+   */
+  int callRpc(uint8_t destination[6], uint16_t method, const uint8_t *request,
+              size_t requestLength,
+              QuackMeshTypes::OnRpcCompletedCallback callback,
+              u_long timeout = 1000);
+
+  /**
+   * Open a reliable, ordered stream to another device. The data is split
+   * into segments, of which up to the smaller of the own and the receiver's
+   * window are in flight. The receiver acknowledges them cumulatively and
+   * reports the segments it buffers out of order, so only missing segments
+   * are sent again. Has to be called from the task that calls update()
+   * @param destination The MAC-Address of the receiver
+   * @param callback The callback to be called once the stream was closed and
+   * all data acknowledged, or failed
+   * @return The id of the stream, -1 if too many streams are open
+   */
+  int openStream(uint8_t destination[6],
+                 QuackMeshTypes::OnStreamClosedCallback callback);
+
+  /**
+   * Append data to a stream. Has to be called from the task that calls
+   * update()
+   * @param streamId The id of the stream
+   * @param data The data
+   * @param dataLength The length of the data
+   * @return The number of bytes taken, less than dataLength if the send
+   * buffer is full, -1 if the stream is not open or already closed
+   */
+  int writeStream(uint8_t streamId, const uint8_t *data, size_t dataLength);
+
+  /**
+   * Close a stream once all written data is acknowledged. Has to be called
+   * from the task that calls update()
+   * @param streamId The id of the stream
+   * @return 0 on success, -1 if the stream is not open
+   */
+  int closeStream(uint8_t streamId);
+
+  /**
+   * Set the callback that is called with the data of streams to this device
+   * @param callback The callback to be called
+   */
+  void setOnStreamDataCallback(QuackMeshTypes::OnStreamDataCallback callback);
+
+  /**
+   * Set the number of segments a stream has in flight and a receiver buffers
+   * out of order, has to be called before begin()
+   * @param segments The window in segments, 1 to MAX_STREAM_WINDOW
+   */
+  void setStreamWindow(uint8_t segments);
+
+  /**
+   * Enable forward error correction for the streams this device sends, has
+   * to be called before begin(). After every block of full segments, repair
+   * segments calculated with a Reed-Solomon code are sent right away, the
+   * receiver recovers as many lost segments of the block from them without
+   * waiting for a retransmission. The number of repairs follows the loss the
+   * stream measures, a link without loss gets none
+   * @param blockSegments The segments of a block, a power of two up to
+   * MAX_STREAM_CODING_BLOCK and at most the stream window
+   * @param maxRepairs The most repair segments sent for a block
+   */
+  void enableStreamFec(uint8_t blockSegments = 4, uint8_t maxRepairs = 4);
+
+  /**
+   * Enable the dissemination of firmware images, has to be called before
+   * begin(). Nodes advertise their version on a Trickle timer and fetch a
+   * newer image page by page from their neighbours, so it spreads over the
+   * whole mesh without being flooded
+   * @param store The storage the images are written to and served from, has
+   * to live as long as the device
+   * @param runningVersion The version of the running firmware
+   * @param minInterval The shortest interval of the summaries in
+   * milliseconds
+   * @param maxInterval The longest interval of the summaries in milliseconds
+   */
+  void enableDissemination(QuackImageStore &store, uint16_t runningVersion,
+                           u_long minInterval = 1000,
+                           u_long maxInterval = 60000);
+
+  /**
+   * Start spreading an image that was written to the store completely. Has
+   * to be called from the task that calls update()
+   * @param version The version of the image, newer than the running one
+   * @param size The size of the image in bytes
+   * @return 0 on success, -1 if the version is not newer, the image could
+   * not be read or the dissemination is not enabled
+   */
+  int publishImage(uint16_t version, size_t size);
+
+  /**
+   * Set the callback that is called once an image from the mesh is complete
+   * and verified, the store already switched to it
+   * @param callback The callback to be called
+   */
+  void setOnImageCallback(QuackMeshTypes::OnImageCallback callback);
+
+  /**
+   * Enable reliable broadcasts, has to be called before begin(). The data is
+   * sent as random linear combinations that every node combines again, so
+   * one transmission repairs different losses at several neighbours. Nodes
+   * announce how much they decoded on a Trickle timer and neighbours fill
+   * the gaps
+   * @param minInterval The shortest interval of the announcements in
+   * milliseconds
+   * @param maxInterval The longest interval of the announcements in
+   * milliseconds
+   */
+  void enableReliableBroadcast(u_long minInterval = 1000,
+                               u_long maxInterval = 60000);
+
+  /**
+   * Deliver data to every node of the mesh, a newer broadcast from this node
+   * replaces an unfinished one. Has to be called from the task that calls
+   * update()
+   * @param data The data
+   * @param dataLength The length of the data, at most
+   * MAX_RELIABLE_BROADCAST_LENGTH
+   * @return 0 on success, -1 if the data is too long or reliable broadcasts
+   * are not enabled
+   */
+  int sendReliableBroadcast(const uint8_t *data, size_t dataLength);
+
+  /**
+   * Set the callback that is called with the data of reliable broadcasts
+   * from other nodes, once for each broadcast
+   * @param callback The callback to be called
+   */
+  void setOnReliableBroadcastCallback(
+      QuackMeshTypes::OnReliableBroadcastCallback callback);
+
+  /**
+   * Enable hop-by-hop backpressure, has to be called before begin(). A device
+   * whose queue reaches highWatermark asks its neighbours to slow down, they
+   * send to it at most once per interval until the queue is down to
+   * lowWatermark. The messages they hold back fill their own queues, so the
+   * signal travels back to the sources, where the send methods refuse new
+   * messages with -2 while the device is congested. Congested parents in the
+   * collection tree are avoided if another one is about as good, and routers
+   * advertise sinks behind them with their own load
+   * @param highWatermark The queued messages from which on the device is
+   * congested
+   * @param lowWatermark The queued messages at which the congestion ends
+   * @param interval The shortest time between two messages to a congested
+   * neighbour in milliseconds
+   */
+  void enableBackpressure(size_t highWatermark = 8, size_t lowWatermark = 2,
+                          u_long interval = 500);
+
+  /**
+   * Check if the device is congested, new messages are refused until the
+   * queue drained. May be called from any task
+   * @return Whether the device is congested
+   */
+  bool isCongested() const;
+
+  /**
+   * Enable the active queue management of forwarded messages in the style of
+   * CoDel, has to be called before begin(). Once the forwarded message at
+   * the head of the queue waited longer than target for a whole interval,
+   * forwarded messages are dropped at increasing rate until the delay is
+   * below the target again. Forwarded confirmed messages that waited longer
+   * than the confirmation timeout are always dropped, their source gave up
+   * on them already. The own messages of the device are never dropped
+   * @param target The queueing delay that is accepted in milliseconds, a few
+   * times the time a message takes to send
+   * @param interval The time the delay may stay above the target in
+   * milliseconds, about the round trip time of the mesh
+   */
+  void enableQueueManagement(u_long target = 300, u_long interval = 1000);
+
+  /**
+   * Get the number of forwarded messages dropped by the queue management
+   * @return The number of dropped messages
+   */
+  uint32_t getDroppedMessages() const;
+
  protected:
+  friend class QuackReplayer;
+
   /**
    * This method enqueues a new message
    * @param data The data to be sent
    * @param dataLength The length of the data to be sent
    * @param destination The MAC-Address of the destination
    * @param confirmed Whether the message should be confirmed or not
+   * @return 0 if the message was queued, -1 if the data is too long or a
+   * confirmed message is for a group, -2 if the submission queue is full or
+   * the device is congested
    */
-  void enqueueNewMessage(uint8_t *data, size_t dataLength,
-                         uint8_t destination[6], bool confirmed);
+  int enqueueNewMessage(uint8_t *data, size_t dataLength,
+                        uint8_t destination[6], bool confirmed);
+
+  /**
+   * Hand a new message of this device to the submission queue
+   * @param type The message type
+   * @param data The data to be sent
+   * @param dataLength The length of the data to be sent
+   * @param destination The MAC-Address of the destination
+   * @param callback The callback to be called with the status of a confirmed
+   * message, registered once the mesh task takes the message
+   * @return 0 if the message was queued, -1 if the data is too long, -2 if
+   * the submission queue is full or too many messages wait for their status
+   */
+  int submitNewMessage(
+      uint8_t type, uint8_t *data, size_t dataLength, uint8_t destination[6],
+      QuackMeshTypes::OnESPNowDataSentStatusCallback callback = nullptr);
+
+  /**
+   * Enqueue a new aggregate report
+   * @param key The key of the aggregate
+   * @param op The operator
+   * @param data The value
+   * @param dataLength The length of the value
+   * @return 0 if the report was queued, -1 if the value is too long, -2 if the
+   * submission queue is full
+   */
+  int enqueueAggregateReport(uint16_t key, uint8_t op, const uint8_t *data,
+                             size_t dataLength);
+
+  /**
+   * Move the messages submitted by the application tasks into the queue of
+   * messages to be sent
+   */
+  void drainSubmissionQueue();
+
+  /**
+   * Put the given message into the queue of its traffic class
+   * @param message The message to be sent
+   */
+  virtual void enqueueMessage(const QuackMeshTypes::EnqueuedMessage &message);
+
+  /**
+   * Drop the forwarded messages at the head of the queue that waited too
+   * long, called right before a message is sent
+   */
+  void manageQueue();
+
+  /**
+   * Run the CoDel state machine for the forwarded message at the head of the
+   * queue
+   * @param now The current time
+   * @param sojourn The time the message waited
+   * @return Whether the message has to be dropped
+   */
+  bool isQueueDropDue(u_long now, u_long sojourn);
+
+  /**
+   * Select the queue the next message is sent from
+   * @return The queue or nullptr if nothing may be sent right now
+   */
+  std::queue<QuackMeshTypes::EnqueuedMessage> *selectNextQueue();
+
+  /**
+   * Check if the schedule allows sending a message right now
+   * @param control Whether the message is a control message
+   * @return Whether the message may be sent
+   */
+  bool isTransmissionAllowed(bool control);
 
   /**
    * This method processes the next message in the queue of messages to be sent
@@ -98,6 +837,119 @@ class QuackMeshDevice {
    */
   virtual void handleForeignMessage(const QuackMeshTypes::Message &message);
 
+  /**
+   * Process a protocol message sent to this device that is not handled by
+   * handleOwnMessage() itself
+   * @param message The message to be processed
+   * @return Whether the message was consumed, otherwise it is handed to the
+   * application
+   */
+  virtual bool handleControlMessage(const QuackMeshTypes::Message &message);
+
+  /**
+   * Process a message that only concerns direct neighbours (e.g. beacons),
+   * before any deduplication or forwarding happens
+   * @param data The received frame, including link address and timestamp
+   * @param message The message contained in the frame
+   * @return Whether the message was consumed
+   */
+  virtual bool handleNeighbourMessage(const QuackMeshESPNow::ReceivedData &data,
+                                      const QuackMeshTypes::Message &message);
+
+  /**
+   * Process a publication received from a neighbour
+   * @param data The received frame, including the link address
+   * @param message The publication
+   */
+  virtual void handlePublication(const QuackMeshESPNow::ReceivedData &data,
+                                 const QuackMeshTypes::Message &message);
+
+  /**
+   * Enqueue a publication towards the neighbours that lead to subscribers
+   * @param message The publication with the hop count it is sent with
+   * @param previousHop The neighbour it came from, nullptr for own ones
+   */
+  void routePublication(const QuackMeshTypes::Message &message,
+                        const uint8_t *previousHop);
+
+  /**
+   * Enqueue a message once per link, or once as a broadcast if there are
+   * more links than mMaxUnicastReplicas
+   * @param message The message to be sent
+   * @param links The MAC-Addresses of the neighbours it is for
+   */
+  void enqueueReplicas(const QuackMeshTypes::EnqueuedMessage &message,
+                       const std::vector<const uint8_t *> &links);
+
+  /**
+   * Check if an address is the address of a group
+   * @param address The address
+   * @return Whether the address is a group address
+   */
+  static bool isGroupAddress(const uint8_t address[6]);
+
+  /**
+   * Process a message for a group received from a neighbour
+   * @param data The received frame, including the link address
+   * @param message The message
+   */
+  virtual void handleGroupMessage(const QuackMeshESPNow::ReceivedData &data,
+                                  const QuackMeshTypes::Message &message);
+
+  /**
+   * Enqueue a group message onto the links that lead to members
+   * @param message The message with the hop count it is sent with
+   * @param previousHop The neighbour it came from, nullptr for own ones
+   */
+  void routeGroupMessage(const QuackMeshTypes::Message &message,
+                         const uint8_t *previousHop);
+
+  /**
+   * Check if an address is the address of an anycast service
+   * @param address The address
+   * @return Whether the address is an anycast address
+   */
+  static bool isAnycastAddress(const uint8_t address[6]);
+
+  /**
+   * Called when the route to a sink changed
+   * @param sink The route
+   */
+  virtual void onSinkRouteUpdated(const QuackMeshTypes::SinkEntry &sink);
+
+  /**
+   * Process collection data received from a child
+   * @param data The received frame, including the link address
+   * @param message The collection data
+   */
+  virtual void handleCollectionData(const QuackMeshESPNow::ReceivedData &data,
+                                    const QuackMeshTypes::Message &message);
+
+  /**
+   * Hand collection data that reached the root to the application
+   * @param message The collection data
+   */
+  void deliverCollectionMessage(const QuackMeshTypes::Message &message);
+
+  /**
+   * Enqueue a new time synchronisation beacon
+   */
+  void sendTimeSyncBeacon();
+
+  /**
+   * Change the channel this device listens on. While the radio task runs it
+   * owns the client, so the change is handed over and applied between two
+   * frames
+   * @param channel The new home channel
+   */
+  void switchHomeChannel(uint8_t channel);
+
+  /**
+   * Get the load of the queues of this device
+   * @return The load, 0 idle to 255 saturated
+   */
+  uint8_t getQueueLoad() const;
+
   /**
    * Send an acknowledgement for the given message
    * @param message The message to be acknowledged
@@ -110,6 +962,15 @@ class QuackMeshDevice {
    */
   void processReceivedAcknowledgement(const QuackMeshTypes::Message &message);
 
+  /**
+   * Call the status callback and the callback of the message, if any
+   * @param id The id of the confirmed message
+   * @param destAddress The MAC-Address of its destination
+   * @param status The status
+   */
+  void reportMessageStatus(uint8_t id, const uint8_t destAddress[6],
+                           int status);
+
   /**
    * Update the last-seen messages store
    */
@@ -140,7 +1001,24 @@ class QuackMeshDevice {
    * @param destination The MAC-Address of the destination
    * @return The MAC-Address where a message has to be sent to reach destination
    */
-  uint8_t *getMACAddressForDestination(uint8_t destination[6]);
+  virtual uint8_t *getMACAddressForDestination(uint8_t destination[6]);
+
+  /**
+   * Send a poll to the parent router to request the buffered frames
+   */
+  void sendPoll();
+
+  /**
+   * Put the device to sleep if the duty cycle is enabled and it is idle
+   */
+  void updateSleepSchedule();
+
+  /**
+   * Turn off the radio and sleep for the given duration
+   * @param duration The duration in milliseconds
+   * @return 0 if the radio was started again, -1 otherwise
+   */
+  int sleepRadio(u_long duration);
 
   /**
    * Callback that is called when a message is received
@@ -156,12 +1034,81 @@ class QuackMeshDevice {
 
   void rememberMessage(const QuackMeshTypes::Message &message);
 
+  /**
+   * Check if the radio is able to take a new frame
+   * @return Whether a new frame can be handed to the radio
+   */
+  bool radioSendingPossible() const;
+
+  /**
+   * Hand a new frame to the radio, either directly to the ESPNowClient or,
+   * in pipeline mode, to the radio task
+   * @param macAddress The MAC-Address of the next hop
+   * @param data The frame to be sent
+   * @param dataLength The length of the frame
+   * @param maxSendTries The maximum number of link-layer tries
+   * @param channel The wifi channel to send the frame on
+   * @param paced Whether the frame waits for the minimum send interval
+   * @param deadline The micros() from which on no try is started, 0 for none
+   * @return 0 if the frame was accepted
+   */
+  int submitToRadio(uint8_t macAddress[6], uint8_t *data, int dataLength,
+                    int maxSendTries, int channel, bool paced = true,
+                    u_long deadline = 0);
+
+#ifdef ESP32
+  /**
+   * Drain the rings filled by the radio task and process their content
+   */
+  void drainRadioRings();
+
+  /**
+   * Service the ESP-Now client once, called from the radio task
+   */
+  void serviceRadio();
+
+  /**
+   * The entry point of the radio task
+   * @param parameter The QuackMeshDevice owning the task
+   */
+  static void radioTask(void *parameter);
+#endif
+
   std::queue<QuackMeshTypes::EnqueuedMessage> mMessageQueue =
-      {};  // The queue of messages to be sent
+      {};  // The queue of messages to be sent, only touched by the mesh task
+
+  std::queue<QuackMeshTypes::EnqueuedMessage> mControlQueue =
+      {};  // The queue of control messages, sent before mMessageQueue
+
+  std::queue<QuackMeshTypes::EnqueuedMessage> mMailboxQueue =
+      {};  // The buffered frames for an awake child, sent unpaced before
+           // mMessageQueue
+
+  std::queue<QuackMeshTypes::EnqueuedMessage> *mInFlightQueue =
+      nullptr;  // The queue whose front message is being sent
+
+  QuackMeshTypes::MPSCQueue<QuackMeshTypes::SubmittedMessage, 8>
+      mSubmissionQueue = {};  // Messages submitted by any application task
+
+  QuackMeshTypes::CriticalSection
+      mMessageIdLock = {};     // Guards the message id counter
+  uint8_t mNextMessageId = 0;  // The id of the next message
 
   std::vector<QuackMeshTypes::ConfirmedMessage> mMessagesLeftToConfirm =
       {};  // The messages that are waiting for an acknowledgement
 
+  std::vector<QuackMeshTypes::MessageCompletion> mMessageCompletions =
+      {};  // The callbacks of messages waiting for their status
+  std::atomic<size_t> mPendingCompletions = {
+      0};  // The callbacks submitted or registered, counted by any task
+  QuackMeshTypes::OnESPNowDataSentStatusCallback
+      mSubmittedCallbacks[QuackMeshTypes::MAX_MESSAGE_COMPLETIONS] =
+          {};  // The callbacks of submitted messages, until the mesh task
+               // takes them. They are not copied under the critical section
+  std::atomic<bool>
+      mSubmittedCallbackUsed[QuackMeshTypes::MAX_MESSAGE_COMPLETIONS] =
+          {};  // Whether a slot of mSubmittedCallbacks is taken
+
   std::vector<QuackMeshTypes::SeenMessageEntry> mSeenMessages =
       {};  // The messages that were already seen
 
@@ -176,6 +1123,70 @@ class QuackMeshDevice {
 
   u_long mLastTimeoutCheckTs = 0;  // The timestamp of the last timeout check
                                    // for messages to be confirmed
+  u_long mConfirmationTimeout =
+      1000;  // The timeout after which a confirmed message failed
+
+  uint8_t mParentAddress[6] = {};  // The router buffering frames while asleep
+  u_long mSleepInterval = 0;       // How long the device sleeps, 0 if never
+  u_long mAwakeWindow = 0;  // How long the device stays awake after activity
+  u_long mLastActivityTs = 0;  // The timestamp of the last own activity
+
+  bool mTimeSyncEnabled = false;  // Whether the time synchronisation is used
+  QuackTimeSync mTimeSync = {};   // The mesh time synchronisation
+
+  bool mDisseminationEnabled =
+      false;  // Whether firmware images are disseminated
+  QuackDissemination mDissemination = {};  // The firmware dissemination
+
+  bool mReliableBroadcastEnabled =
+      false;  // Whether reliable broadcasts are used
+  QuackCodedBroadcast mCodedBroadcast = {};  // The network-coded broadcasts
+
+  QuackStreams mStreams = {};  // The reliable streams to other devices
+
+  QuackRpc mRpc = {};  // The remote procedure calls to other devices
+
+  bool mBackpressureEnabled = false;  // Whether congestion is signalled
+  QuackBackpressure mBackpressure = {};  // The congestion of the neighbourhood
+
+  bool mQueueManagement = false;  // Whether forwarded messages are dropped
+  u_long mQueueTarget = 300;      // The accepted queueing delay
+  u_long mQueueInterval = 1000;   // The time the delay may stay above it
+  bool mQueueAboveTarget = false;  // Whether the delay is above the target
+  u_long mQueueDropAllowedTs =
+      0;  // The time from which on a delay above the target drops messages
+  bool mQueueDropping = false;  // Whether messages are being dropped
+  u_long mQueueNextDropTs = 0;  // The time the next message is dropped
+  uint32_t mQueueDropCount = 0;  // The drops since dropping started
+  uint32_t mQueueLastDropCount =
+      0;  // The drop count when the previous dropping started
+  uint32_t mDroppedMessages = 0;  // The forwarded messages dropped in total
+
+  bool mSlotsEnabled = false;  // Whether the slotted mode is used
+  QuackSlots mSlots = {};       // The transmit slots within two hops
+
+  QuackChannels mChannels = {};  // The home channels of the neighbourhood
+  std::vector<uint8_t> mBroadcastChannels =
+      {};  // The channels the in-flight broadcast is repeated on
+  size_t mBroadcastChannelIndex = 0;  // The channel of the in-flight broadcast
+
+  bool mPublishSubscribeEnabled = false;  // Whether publish/subscribe is used
+  QuackPublishSubscribe mPublishSubscribe = {};  // The topic subscriptions
+
+  bool mGroupsEnabled = false;  // Whether multicast groups are used
+  QuackGroups mGroups = {};  // The multicast group memberships
+
+  QuackAnycast mAnycast = {};  // The routes to the sinks of the services
+
+  bool mCollectionEnabled = false;  // Whether the collection tree is used
+  QuackCollection mCollection = {};  // The route to the root of the tree
+
+  bool mAggregationEnabled = false;  // Whether reports are combined
+  QuackAggregation mAggregation = {};  // The reports held for combining
+
+  size_t mMaxUnicastReplicas =
+      2;  // The number of links a message is sent to one by one, more links
+          // get a single broadcast
 
   bool mMessageSendingInProgress =
       false;  // Whether a message is currently being sent
@@ -187,4 +1198,26 @@ class QuackMeshDevice {
 
   QuackMeshTypes::OnNewMessageReceivedCallback mOnMessageCallback =
       nullptr;  // The callback that is called when a message is received
+
+  QuackMeshTypes::OnFrameReceivedCallback mOnFrameCallback =
+      nullptr;  // The callback that is called with every received frame
+
+#ifdef ESP32
+  bool mPipelineEnabled = false;  // Whether the pipeline mode is used
+  BaseType_t mRadioCore = 0;      // The core the radio task is pinned to
+
+  std::atomic<bool> mRadioTaskRunning = {
+      false};  // Whether the radio task should keep running
+  std::atomic<bool> mRadioTaskActive = {
+      false};  // Whether the radio task has not exited yet
+
+  QuackMeshTypes::SPSCRing<QuackMeshESPNow::ReceivedData, 16>
+      mRadioRxRing = {};  // Frames received by the radio task
+  QuackMeshTypes::SPSCRing<QuackMeshESPNow::ESPNowSentStatus, 4>
+      mRadioSentRing = {};  // Sent status updates from the radio task
+  QuackMeshTypes::SPSCRing<QuackMeshESPNow::SendingData, 4>
+      mRadioTxRing = {};  // Frames to be sent by the radio task
+  std::atomic<uint8_t> mPendingHomeChannel = {
+      0};  // The home channel the radio task has to apply, 0 if none
+#endif
 };
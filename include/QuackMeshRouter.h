@@ -20,20 +20,97 @@ the LICENSE file.
  */
 class QuackMeshRouter : public QuackMeshDevice {
  public:
-    void begin();
+    int begin();
   void update();
 
+  /**
+   * Set the number of frames buffered per sleeping child
+   * @param size The maximum number of frames, the oldest frame is dropped
+   */
+  void setMailboxSize(size_t size);
+
+  /**
+   * Get the number of frames dropped because the mailbox of a sleeping child
+   * was full
+   * @return The number of dropped frames
+   */
+  uint32_t getDroppedMailboxMessages() const;
+
  protected:
   void handleForeignMessage(const QuackMeshTypes::Message &message);
 
+  bool handleControlMessage(const QuackMeshTypes::Message &message) override;
+
+  void handlePublication(const QuackMeshESPNow::ReceivedData &data,
+                         const QuackMeshTypes::Message &message) override;
+
+  void handleGroupMessage(const QuackMeshESPNow::ReceivedData &data,
+                          const QuackMeshTypes::Message &message) override;
+
+  /**
+   * Add the route to a sink to the routing table
+   * @param sink The route
+   */
+  void onSinkRouteUpdated(const QuackMeshTypes::SinkEntry &sink) override;
+
+  /**
+   * Forward collection data to the parent, unless this router is the root
+   * @param data The received frame, including the link address
+   * @param message The collection data
+   */
+  void handleCollectionData(const QuackMeshESPNow::ReceivedData &data,
+                            const QuackMeshTypes::Message &message) override;
+
+  /**
+   * Register or refresh the polling child, its buffered frames are delivered
+   * while it is awake
+   * @param message The poll message
+   */
+  void handlePoll(const QuackMeshTypes::Message &message);
+
+  /**
+   * Put the given message into the queue of its traffic class, or into the
+   * mailbox if it is for a child that is currently asleep
+   * @param message The message to be sent
+   */
+  void enqueueMessage(const QuackMeshTypes::EnqueuedMessage &message) override;
+
+  /**
+   * Buffer the given message if it is for a child that is currently asleep
+   * or still has buffered frames. When the mailbox is full its oldest frame is dropped, a confirmed one of
+   * this router is reported as failed
+   * @param message The message to be sent
+   * @return Whether the message was buffered
+   */
+  bool storeForSleepingChild(const QuackMeshTypes::EnqueuedMessage &message);
+
+  /**
+   * Remove sleeping children that stopped polling
+   */
+  void updateSleepingChildren();
+
+  /**
+   * Hand the next buffered frame of an awake child to the mailbox queue,
+   * which is sent unpaced before all other messages. Frames left when the
+   * awake window is over wait for the next poll
+   */
+  void deliverMailboxes();
+
+  /**
+   * Get the sleeping child with the given address
+   * @param address The MAC-Address of the child
+   * @return The child or nullptr if it is unknown
+   */
+  QuackMeshTypes::SleepingChild *findSleepingChild(const uint8_t address[6]);
+
   /**
    * Add or update a routing entry
    * @param destination The MAC-Address of the destination
    * @param link The MAC-Address of the link to the destination
    * @param hops The number of hops to the destination
    */
-  void addOrUpdateRoutingInfo(uint8_t destination[6], uint8_t link[6],
-                              uint8_t hops);
+  void addOrUpdateRoutingInfo(const uint8_t destination[6],
+                              const uint8_t link[6], uint8_t hops);
 
   /**
    * Forward a message to the next hop
@@ -47,7 +124,7 @@ class QuackMeshRouter : public QuackMeshDevice {
    */
   void updateRoutingTable();
 
-  uint8_t *getMACAddressForDestination(uint8_t destination[6]);
+  uint8_t *getMACAddressForDestination(uint8_t destination[6]) override;
 
   u_long mLastRoutingTableUpdateTs =
       0;  // The timestamp of the last routing table update
@@ -62,4 +139,12 @@ class QuackMeshRouter : public QuackMeshDevice {
       {};  // The routing table
 
   size_t mMaxRoutingEntries = 10;  // The maximum number of routing entries
+
+  std::vector<QuackMeshTypes::SleepingChild> mSleepingChildren =
+      {};  // The duty-cycled children buffering through this router
+
+  size_t mMaxSleepingChildren = 4;  // The maximum number of sleeping children
+  size_t mMaxMailboxSize = 8;  // The maximum number of frames per child
+  uint32_t mDroppedMailboxMessages =
+      0;  // The frames dropped because a mailbox was full
 };
@@ -10,8 +10,133 @@ the LICENSE file.
 
 #include <Arduino.h>
 
+#include <deque>
+#include <vector>
+
 namespace QuackMeshTypes {
 
+// The values of Message::type used by the protocol
+constexpr uint8_t MESSAGE_TYPE_UNCONFIRMED = 0;
+constexpr uint8_t MESSAGE_TYPE_CONFIRMED = 1;
+constexpr uint8_t MESSAGE_TYPE_ACKNOWLEDGEMENT = 3;
+constexpr uint8_t MESSAGE_TYPE_POLL = 4;  // A sleeping device polls its parent
+constexpr uint8_t MESSAGE_TYPE_TIME_SYNC = 5;  // A time synchronisation beacon
+constexpr uint8_t MESSAGE_TYPE_CONTROL = 6;  // Unconfirmed control-class data
+constexpr uint8_t MESSAGE_TYPE_CHANNEL_ANNOUNCE =
+    7;  // A node announces its home channel
+constexpr uint8_t MESSAGE_TYPE_PUBLISH = 8;  // A publication on a topic
+constexpr uint8_t MESSAGE_TYPE_SUBSCRIBE =
+    9;  // A node advertises the topics it and its branches subscribed to
+constexpr uint8_t MESSAGE_TYPE_GROUP_MEMBERSHIP =
+    10;  // A node advertises the groups it and its branches joined
+constexpr uint8_t MESSAGE_TYPE_SINK_ADVERTISEMENT =
+    11;  // A sink announces itself and its load
+constexpr uint8_t MESSAGE_TYPE_COLLECTION_BEACON =
+    12;  // A node announces its cost to the collection root
+constexpr uint8_t MESSAGE_TYPE_COLLECTION_DATA =
+    13;  // Data sent up the collection tree
+constexpr uint8_t MESSAGE_TYPE_AGGREGATE =
+    14;  // A report that routers combine on the way up the collection tree
+constexpr uint8_t MESSAGE_TYPE_RPC_REQUEST = 15;  // A remote procedure call
+constexpr uint8_t MESSAGE_TYPE_RPC_RESPONSE =
+    16;  // The result of a call, also its acknowledgement
+constexpr uint8_t MESSAGE_TYPE_STREAM_DATA = 17;  // A segment of a stream
+constexpr uint8_t MESSAGE_TYPE_STREAM_ACK =
+    18;  // Acknowledges the segments of a stream received in order
+constexpr uint8_t MESSAGE_TYPE_IMAGE_SUMMARY =
+    19;  // A node advertises the firmware image it holds
+constexpr uint8_t MESSAGE_TYPE_IMAGE_REQUEST =
+    20;  // A node asks a neighbour for the packets of a page it misses
+constexpr uint8_t MESSAGE_TYPE_IMAGE_DATA = 21;  // A packet of an image page
+constexpr uint8_t MESSAGE_TYPE_STREAM_REPAIR =
+    22;  // A combination of a block of stream segments, repairs lost ones
+constexpr uint8_t MESSAGE_TYPE_CODED_BROADCAST =
+    23;  // A combination of the packets of a reliable broadcast, or the rank
+         // of the sender only
+constexpr uint8_t MESSAGE_TYPE_CONGESTION =
+    24;  // A node asks its neighbours to slow down, or lifts the request
+constexpr uint8_t MESSAGE_TYPE_SLOT_CLAIM =
+    25;  // The transmit slot of the sender and those of its neighbours
+
+// The highest wifi channel used by ESP-Now
+constexpr uint8_t MAX_WIFI_CHANNEL = 14;
+
+// The first bytes of a group address, followed by the group (u16 BE). The
+// first byte has the multicast and the locally administered bit set
+constexpr uint8_t GROUP_ADDRESS_PREFIX[4] = {0x03, 'Q', 'M', 'G'};
+
+// The first bytes of an anycast address, followed by the service (u16 BE)
+constexpr uint8_t ANYCAST_ADDRESS_PREFIX[4] = {0x03, 'Q', 'M', 'A'};
+
+// The number of neighbours the membership bitmaps of a router cover
+constexpr size_t MAX_GROUP_NEIGHBOURS = 32;
+
+// The number of hops a group message travels
+constexpr uint8_t GROUP_HOP_COUNT = 3;
+
+// The cost of a node without a route to the collection root
+constexpr uint16_t NO_COLLECTION_ROUTE = 0xFFFF;
+
+// The flags of a collection beacon
+constexpr uint8_t COLLECTION_FLAG_PULL =
+    0x01;  // The sender has no route and asks for beacons
+constexpr uint8_t COLLECTION_FLAG_CONGESTED =
+    0x02;  // The queue of the sender is long, children should pick another
+           // parent if they can
+
+// The operators of aggregate reports, the value of a report is an int32_t
+// unless the operator is AGGREGATE_CUSTOM
+constexpr uint8_t AGGREGATE_MIN = 0;
+constexpr uint8_t AGGREGATE_MAX = 1;
+constexpr uint8_t AGGREGATE_SUM = 2;
+constexpr uint8_t AGGREGATE_COUNT = 3;
+constexpr uint8_t AGGREGATE_AVERAGE = 4;  // Summed up, divided at the root
+constexpr uint8_t AGGREGATE_CUSTOM = 5;   // Combined by a registered callback
+
+// The status of a remote procedure call, handlers may return own positive
+// values
+constexpr int8_t RPC_OK = 0;
+constexpr int8_t RPC_TIMEOUT = -1;         // No response within the timeout
+constexpr int8_t RPC_UNKNOWN_METHOD = -2;  // The callee has no such method
+constexpr int8_t RPC_NOT_QUEUED =
+    -3;  // The call was not sent, e.g. too many calls are pending
+
+// The confirmed messages with a status callback that may wait at once
+constexpr size_t MAX_MESSAGE_COMPLETIONS = 8;
+
+// The longest request or response of a remote procedure call
+constexpr size_t MAX_RPC_DATA_LENGTH = 226;
+
+// The status a stream reports to its sender when it ends
+constexpr int8_t STREAM_CLOSED = 0;   // All data was acknowledged
+constexpr int8_t STREAM_FAILED = -1;  // A segment was never acknowledged
+
+// The flags of a stream segment
+constexpr uint8_t STREAM_FLAG_FIN = 0x01;  // The last segment of the stream
+
+// The most data a stream segment carries
+constexpr size_t MAX_STREAM_SEGMENT_LENGTH = 228;
+
+// The largest window of a stream, limited by the bits of
+// StreamAckPayload::received
+constexpr uint8_t MAX_STREAM_WINDOW = 17;
+
+// The largest block of stream segments repair segments are calculated for
+constexpr uint8_t MAX_STREAM_CODING_BLOCK = 8;
+
+// Firmware images are disseminated in pages of packets, a node only serves
+// the pages it has completely
+constexpr size_t IMAGE_PACKET_SIZE = 200;
+constexpr uint8_t IMAGE_PACKETS_PER_PAGE = 8;  // The bits of a page bitmap
+constexpr size_t IMAGE_PAGE_SIZE = IMAGE_PACKET_SIZE * IMAGE_PACKETS_PER_PAGE;
+
+// A reliable broadcast is split into packets that are sent as random linear
+// combinations
+constexpr size_t CODED_PACKET_SIZE = 200;
+constexpr uint8_t MAX_CODED_PACKETS = 16;
+constexpr size_t MAX_RELIABLE_BROADCAST_LENGTH =
+    CODED_PACKET_SIZE * MAX_CODED_PACKETS;
+
 // The callback that is called when a message is sent
 typedef std::function<void(int)> OnESPNowDataSentStatusCallback;
 
@@ -20,6 +145,65 @@ typedef std::function<void(uint8_t type, const uint8_t srcAddress[6],
                            const uint8_t *data, size_t dataLength)>
     OnNewMessageReceivedCallback;
 
+// The callback that is called with every mesh frame a neighbour sent to this
+// device, whoever it is for
+typedef std::function<void(const uint8_t *frame, size_t frameLength)>
+    OnFrameReceivedCallback;
+
+// The callback that is called when a publication on a subscribed topic arrives
+typedef std::function<void(const uint8_t srcAddress[6], const uint8_t *data,
+                           size_t dataLength)>
+    OnPublicationCallback;
+
+// The callback that is called when a message for a joined group arrives
+typedef std::function<void(uint16_t group, const uint8_t srcAddress[6],
+                           const uint8_t *data, size_t dataLength)>
+    OnGroupMessageCallback;
+
+// The callback that combines two reports of a custom aggregate, it writes
+// the result (at most 222 bytes) into aggregate and returns its length
+typedef std::function<size_t(uint8_t *aggregate, size_t aggregateLength,
+                             const uint8_t *data, size_t dataLength)>
+    AggregateMergeCallback;
+
+// The callback that is called when an aggregate reaches the root, for the
+// built-in operators data is the result as int32_t
+typedef std::function<void(uint16_t key, uint16_t count, const uint8_t *data,
+                           size_t dataLength)>
+    OnAggregateCallback;
+
+// The handler of a remote procedure call, it writes the response (at most
+// MAX_RPC_DATA_LENGTH bytes) and its length and returns the status
+typedef std::function<int8_t(const uint8_t srcAddress[6],
+                             const uint8_t *request, size_t requestLength,
+                             uint8_t *response, size_t &responseLength)>
+    RpcHandler;
+
+// The callback that is called when a remote procedure call completed
+typedef std::function<void(int8_t status, const uint8_t *response,
+                           size_t responseLength)>
+    OnRpcCompletedCallback;
+
+// The callback that is called with the data of a stream in order, finished
+// is set with the last data of the stream
+typedef std::function<void(const uint8_t srcAddress[6], uint8_t streamId,
+                           const uint8_t *data, size_t dataLength,
+                           bool finished)>
+    OnStreamDataCallback;
+
+// The callback that is called when a stream of this device ended
+typedef std::function<void(uint8_t streamId, int8_t status)>
+    OnStreamClosedCallback;
+
+// The callback that is called once a firmware image is complete and verified
+typedef std::function<void(uint16_t version, size_t size)> OnImageCallback;
+
+// The callback that is called once the data of a reliable broadcast is
+// decoded
+typedef std::function<void(const uint8_t srcAddress[6], const uint8_t *data,
+                           size_t dataLength)>
+    OnReliableBroadcastCallback;
+
 struct Message {
   uint8_t networkID[2] = {0};
   uint8_t type = 0;
@@ -48,9 +232,19 @@ struct Message {
 
 struct ConfirmedMessage {
   bool isSent;
-  int16_t timestamp;
+  int32_t timestamp;
+  uint8_t id;
+  uint8_t destAddress[6];
+};
+
+/**
+ * This struct is used to store the callback of a confirmed message that
+ * waits for its status
+ */
+struct MessageCompletion {
   uint8_t id;
   uint8_t destAddress[6];
+  OnESPNowDataSentStatusCallback callback;
 };
 
 enum EnqueuedMessageType {
@@ -64,6 +258,20 @@ struct EnqueuedMessage {
   EnqueuedMessageType type;
   int channel;
   Message message;
+  uint8_t nextHop[6];  // The link the message is sent to, all zero to route
+                       // it by its destination
+  uint8_t retries;     // The number of times the message was queued again
+                       // after its link failed
+  u_long enqueuedTs;   // The time enqueueMessage() queued the message
+};
+
+/**
+ * This struct is used to hand a new message of an application task to the
+ * mesh task
+ */
+struct SubmittedMessage {
+  EnqueuedMessage message;
+  int8_t callbackSlot;  // The slot of the status callback, -1 if none
 };
 
 struct SendingMessage {
@@ -93,4 +301,492 @@ struct RoutingEntry {
   uint8_t hops;
   int16_t timestamp;
 };
+
+/**
+ * The payload of a poll message sent by a duty-cycled device to its parent
+ */
+struct PollPayload {
+  uint32_t sleepInterval;  // How long the device sleeps in milliseconds
+  uint32_t awakeWindow;    // How long the device stays awake after a poll
+};
+
+/**
+ * This struct is used to store a message for a sleeping device
+ */
+struct MailboxEntry {
+  u_long storedTs;
+  EnqueuedMessage message;
+};
+
+/**
+ * This struct is used to store the state of a duty-cycled child of a router
+ */
+struct SleepingChild {
+  uint8_t address[6];
+  u_long sleepInterval;
+  u_long awakeWindow;
+  u_long lastPollTs;
+  std::deque<MailboxEntry> mailbox;
+};
+
+/**
+ * The payload of a time synchronisation beacon.
+ * The send time of a beacon is only known once its sent callback fired, so it
+ * is carried by the next beacon of the same sender (two-step)
+ */
+struct TimeSyncPayload {
+  uint64_t previousSendTime;  // Mesh time in us the previous beacon was sent
+  uint8_t rootAddress[6];     // The root the sender is synchronised to
+  uint16_t sequence;          // The newest synchronisation round of the root
+  uint8_t beaconId;           // The id of this beacon at the sender
+  uint8_t previousBeaconId;   // The id of the beacon previousSendTime is for
+  uint8_t hasPrevious;        // Whether previousSendTime is valid
+};
+
+/**
+ * This struct is used to store the two-step send state of beacons sent on
+ * one channel
+ */
+struct TimeSyncSendState {
+  uint8_t inFlightBeaconId;  // The id of the beacon being sent
+  uint8_t lastSentBeaconId;  // The id of the beacon sent last
+  bool lastSendTimeValid;    // Whether lastSendTime is valid
+  uint64_t lastSendTime;     // The mesh time the last beacon was sent
+};
+
+/**
+ * This struct is used to store a reference point of the mesh clock
+ */
+struct TimeSyncPoint {
+  int64_t localTime;  // The local time in us
+  int64_t offset;     // The mesh time minus the local time in us
+};
+
+/**
+ * The payload of a channel announcement
+ */
+struct ChannelAnnouncePayload {
+  uint8_t homeChannel;  // The channel the sender listens on
+  uint8_t hasSource;    // Whether the sender follows a device on an AP channel
+  uint16_t epoch;       // The newest announcement round of that device
+};
+
+/**
+ * This struct is used to store the home channel of a neighbour
+ */
+struct NeighbourChannel {
+  uint8_t address[6];
+  uint8_t channel;
+  u_long lastSeenTs;
+};
+
+/**
+ * The header of a publication, followed by the published data
+ */
+struct PublicationHeader {
+  uint32_t topicHash;  // The FNV-1a hash of the topic name
+};
+
+/**
+ * A topic in a subscription advertisement, which carries a list of them
+ */
+struct TopicAdvertisement {
+  uint32_t topicHash;  // The FNV-1a hash of the topic name
+  uint8_t distance;    // The hops from the sender to the nearest subscriber
+};
+
+/**
+ * This struct is used to store a topic a neighbour advertised
+ */
+struct SubscriptionEntry {
+  uint32_t topicHash;
+  uint8_t neighbour[6];  // The neighbour that leads to the subscribers
+  uint8_t distance;      // The hops from the neighbour to the subscribers
+  u_long lastSeenTs;
+};
+
+/**
+ * This struct is used to store a topic the application subscribed to
+ */
+struct LocalSubscription {
+  uint32_t topicHash;
+  OnPublicationCallback callback;
+};
+
+/**
+ * A group in a membership advertisement, which carries a list of them
+ */
+struct GroupAdvertisement {
+  uint16_t group;
+  uint8_t distance;  // The hops from the sender to the nearest member
+};
+
+/**
+ * This struct is used to store a neighbour that advertised groups, its index
+ * is its bit in the membership bitmaps
+ */
+struct GroupNeighbour {
+  uint8_t address[6];
+  bool active;
+  u_long lastSeenTs;
+};
+
+/**
+ * This struct is used to store which neighbours lead to members of a group
+ */
+struct GroupMembership {
+  uint16_t group;
+  uint32_t members[GROUP_HOP_COUNT];  // A bitmap of the neighbours per
+                                      // distance to their nearest member
+};
+
+/**
+ * This struct is used to store a group the application joined
+ */
+struct JoinedGroup {
+  uint16_t group;
+  OnGroupMessageCallback callback;
+};
+
+/**
+ * The payload of a sink advertisement, the sink is the source of the message
+ */
+struct SinkAdvertisementPayload {
+  uint32_t interval;  // The interval of the advertisements in milliseconds
+  uint16_t service;   // The anycast service the sink provides
+  uint16_t sequence;  // The newest advertisement round of the sink
+  uint8_t load;       // The load of the sink, 0 idle to 255 saturated
+  uint8_t hops;       // The hops from the sender of the message to the sink
+};
+
+/**
+ * This struct is used to store the best known route to a sink
+ */
+struct SinkEntry {
+  uint8_t sink[6];
+  uint8_t nextHop[6];
+  uint16_t service;
+  uint16_t sequence;
+  uint8_t hops;
+  uint8_t load;
+  u_long interval;
+  u_long lastSeenTs;
+};
+
+/**
+ * The payload of a collection beacon. Costs are expected transmissions (ETX)
+ * to the root in tenths
+ */
+struct CollectionBeaconPayload {
+  uint16_t cost;      // The cost of the sender, NO_COLLECTION_ROUTE if none
+  uint8_t parent[6];  // The parent of the sender
+  uint8_t sequence;   // The number of the beacon, gaps are lost beacons
+  uint8_t flags;      // COLLECTION_FLAG_*
+};
+
+/**
+ * The header of collection data, followed by the data of the origin, which
+ * is the source of the message
+ */
+struct CollectionHeader {
+  uint16_t cost;         // The cost of the sender, has to decrease every hop
+  uint8_t timeHasLived;  // The hops the data travelled
+};
+
+/**
+ * The header of an aggregate report, follows the collection header and is
+ * followed by the value
+ */
+struct AggregateHeader {
+  uint16_t key;    // The quantity that is aggregated, e.g. a sensor type
+  uint16_t count;  // The number of reports combined into this one
+  uint8_t op;      // AGGREGATE_*
+};
+
+/**
+ * This struct is used to store the reports of a key held during the window
+ */
+struct PendingAggregate {
+  AggregateHeader header;
+  uint8_t timeHasLived;  // The most hops any of the combined reports took
+  uint8_t length;        // The length of the value
+  uint8_t value[222];
+  u_long startTs;  // The time the first report arrived
+};
+
+/**
+ * This struct is used to store a custom aggregate the application registered
+ */
+struct RegisteredAggregate {
+  uint16_t key;
+  AggregateMergeCallback merge;
+};
+
+/**
+ * The header of the requests and responses of remote procedure calls,
+ * followed by their data
+ */
+struct RpcHeader {
+  uint16_t callId;  // Correlates the response with the request
+  uint16_t method;
+  int8_t status;  // The status of the call, only used in responses
+};
+
+/**
+ * This struct is used to store a method the application registered
+ */
+struct RpcMethod {
+  uint16_t method;
+  RpcHandler handler;
+};
+
+/**
+ * This struct is used to store a call waiting for its response
+ */
+struct PendingRpcCall {
+  uint16_t callId;
+  uint8_t destination[6];
+  u_long startTs;
+  u_long timeout;
+  OnRpcCompletedCallback callback;
+};
+
+/**
+ * The header of a stream segment, followed by its data
+ */
+struct StreamHeader {
+  uint16_t sequence;  // The number of the segment, counted from 0
+  uint8_t streamId;
+  uint8_t flags;  // STREAM_FLAG_*
+};
+
+/**
+ * The payload of a stream acknowledgement
+ */
+struct StreamAckPayload {
+  uint16_t nextSequence;  // All segments before this one arrived
+  uint8_t streamId;
+  uint8_t window;     // The segments the receiver buffers from nextSequence on
+  uint16_t received;  // Bit i is set if segment nextSequence + 1 + i arrived
+  uint8_t recovered;  // The segments recovered from repairs so far, wraps
+};
+
+/**
+ * The header of a repair segment, followed by the combination of the data of
+ * a block of full segments
+ */
+struct StreamRepairHeader {
+  uint16_t firstSequence;  // The first segment of the block
+  uint8_t streamId;
+  uint8_t coding;  // The segments of the block in the upper four bits, the
+                   // index of the repair in the lower four
+};
+
+/**
+ * This struct is used to store a repair segment until its block is decoded
+ */
+struct StreamRepair {
+  uint16_t firstSequence;
+  uint8_t blockSegments;
+  uint8_t index;
+  uint8_t data[MAX_STREAM_SEGMENT_LENGTH];
+};
+
+/**
+ * This struct is used to store a segment of a stream
+ */
+struct StreamSegment {
+  uint16_t sequence;
+  uint8_t flags;
+  uint8_t length;
+  uint8_t data[MAX_STREAM_SEGMENT_LENGTH];
+  uint8_t transmissions;  // The number of times the segment was sent
+  bool received;          // Whether the receiver buffers the segment
+  u_long sentTs;          // The time the segment was last sent
+};
+
+/**
+ * This struct is used to store the state of a stream this device sends
+ */
+struct OutgoingStream {
+  uint8_t streamId;
+  uint8_t destination[6];
+  std::deque<StreamSegment> segments;  // The unacknowledged segments in order
+  uint16_t firstSequence;  // The sequence of the oldest unacknowledged segment
+  uint16_t sendSequence;   // The sequence of the next segment sent first
+  uint16_t nextSequence;   // The sequence of the next segment written
+  uint8_t peerWindow;      // The window the receiver advertised
+  uint8_t timeouts;  // Retransmission timeouts since the last progress
+  bool closing;            // Whether the application closed the stream
+  u_long smoothedRtt;      // The smoothed round trip time in milliseconds
+  u_long rttVariation;     // The variation of the round trip time
+  u_long retransmitTimeout;
+  u_long retransmitTs;  // The time the retransmission timer started
+  uint16_t lossRate;    // The estimated frame loss in 1/1024
+  uint8_t recovered;    // The recovered segments the receiver last reported
+  uint16_t repairSequence;  // The first segment of the block being repaired
+  uint8_t repairIndex;      // The index of the next repair of the block
+  uint8_t repairsLeft;      // The repairs of the block still to be sent
+  OnStreamClosedCallback callback;
+};
+
+/**
+ * This struct is used to store the state of a stream this device receives
+ */
+struct IncomingStream {
+  uint8_t streamId;
+  uint8_t source[6];
+  uint16_t nextSequence;  // The sequence of the next segment delivered
+  std::vector<StreamSegment> reordered;  // Segments that arrived too early
+  uint8_t unacknowledged;  // Segments received since the last acknowledgement
+  bool finished;           // Whether the last segment was delivered
+  u_long ackDueTs;  // The time the oldest unacknowledged segment arrived
+  u_long lastSeenTs;
+  uint8_t blockSegments;  // The size of the coded blocks, 0 until a repair
+                          // arrived
+  std::vector<StreamSegment>
+      delivered;  // The delivered segments of the block of nextSequence
+  std::vector<StreamRepair> repairs;  // Repairs of blocks not decoded yet
+  uint8_t recovered;  // The segments recovered from repairs, wraps
+};
+
+/**
+ * The payload of an image summary
+ */
+struct ImageSummaryPayload {
+  uint32_t size;     // The size of the image, 0 if the node holds none
+  uint32_t crc;      // The CRC-32 of the whole image
+  uint16_t version;  // The version of the image or the running firmware
+  uint16_t pages;    // The number of pages the node has completely
+};
+
+/**
+ * The payload of an image request, a negative acknowledgement of the
+ * packets of a page. It is broadcast so other nodes can suppress theirs
+ */
+struct ImageRequestPayload {
+  uint8_t source[6];  // The neighbour that is asked for the packets
+  uint16_t version;
+  uint16_t page;
+  uint8_t missing;  // Bit i is set if packet i of the page is missing
+};
+
+/**
+ * The header of an image packet, followed by its data
+ */
+struct ImageDataHeader {
+  uint16_t version;
+  uint16_t page;
+  uint8_t packet;
+};
+
+/**
+ * The header of a coded broadcast packet. Unless only the rank is
+ * announced, it is followed by one coefficient for every packet of the
+ * generation and the combined data (CODED_PACKET_SIZE bytes)
+ */
+struct CodedHeader {
+  uint8_t source[6];    // The device that started the broadcast
+  uint16_t generation;  // The number of the broadcast at its source
+  uint16_t length;      // The length of the data
+  uint8_t packets;      // The number of packets the data is split into
+  uint8_t rank;         // The independent combinations the sender holds
+};
+
+/**
+ * This struct is used to store a reliable broadcast this device takes part
+ * in. The received combinations are kept in reduced row echelon form, so a
+ * new one is innovative if it is not eliminated completely and the data is
+ * decoded once the rank is full
+ */
+struct CodedGeneration {
+  uint8_t source[6];
+  uint16_t generation;
+  uint16_t length;
+  uint8_t packets;
+  uint8_t rank;
+  uint16_t pivots;  // Bit i is set if a row has its leading 1 in column i
+  std::vector<uint8_t> rows;  // Row i holds the coefficients and the data
+                              // of the combination with its pivot in i
+  bool delivered;         // Whether the data was handed to the application
+  uint8_t forwardCredit;  // The combinations owed for innovative packets
+  uint8_t repairCredit;   // The combinations a neighbour is missing
+  u_long lastChangeTs;    // The last time the rank or a neighbour changed
+  u_long statusInterval;  // The current Trickle interval of the status
+  u_long intervalStartTs;
+  u_long statusDelay;       // The time in the interval the status is sent
+  bool statusSent;          // Whether the interval's status is done
+  uint8_t consistentStatus;  // The statuses with the own rank heard
+};
+
+/**
+ * This struct is used to store a neighbour that may become the parent in the
+ * collection tree
+ */
+struct CollectionNeighbour {
+  uint8_t address[6];
+  uint8_t parent[6];  // The parent of the neighbour
+  uint16_t cost;      // The cost the neighbour advertised
+  uint16_t linkEtx;   // The estimated transmissions to the neighbour in tenths
+  uint8_t sequence;   // The number of the last beacon of the neighbour
+  bool congested;     // Whether the neighbour signalled a long queue
+  u_long lastSeenTs;
+};
+
+/**
+ * The payload of a congestion signal
+ */
+struct CongestionPayload {
+  uint8_t load;       // The queue of the sender, 0 idle to 255 saturated
+  uint8_t congested;  // 1 while the sender asks its neighbours to slow down
+};
+
+// The most neighbours a slot claim lists
+constexpr uint8_t MAX_SLOT_CLAIM_ENTRIES = 16;
+
+/**
+ * The payload of a slot claim, followed by the entries of the neighbours
+ */
+struct SlotClaimPayload {
+  uint8_t slot;   // The transmit slot of the sender
+  uint8_t count;  // The number of entries that follow
+};
+
+/**
+ * A neighbour of the sender of a slot claim
+ */
+struct SlotClaimEntry {
+  uint8_t address[6];
+  uint8_t slot;
+};
+
+/**
+ * This struct is used to store the transmit slot of a device within two hops
+ */
+struct SlotNeighbour {
+  uint8_t address[6];
+  uint8_t slot;
+  uint8_t hops;       // 1 if its own claim was heard, 2 if a neighbour's was
+  u_long lastSeenTs;  // The last claim that carried the slot
+};
+
+/**
+ * This struct is used to store a neighbour that asked to slow down
+ */
+struct CongestedNeighbour {
+  uint8_t address[6];
+  uint8_t load;        // The load the neighbour signalled
+  u_long lastSentTs;   // The last message sent to the neighbour
+  u_long lastSeenTs;   // The last signal of the neighbour
+};
+
+/**
+ * This struct is used to store the last beacon received from a neighbour
+ */
+struct TimeSyncNeighbour {
+  uint8_t address[6];
+  uint8_t beaconId;
+  uint16_t sequence;
+  uint64_t receivedTime;  // The local time in us the beacon was received
+};
 }  // namespace QuackMeshTypes
@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class keeps the topic subscriptions of a device and its neighbours.
+ * Devices advertise the topics they subscribed to, forwarding devices also
+ * the topics of their branches with the distance to the nearest subscriber.
+ * The links of a publication are the neighbours that lead to a subscriber
+ * within the hops it has left.
+ */
+class QuackPublishSubscribe {
+ public:
+  // Sends an advertisement to the neighbours
+  typedef std::function<void(const uint8_t *payload, size_t length)>
+      SendCallback;
+
+  /**
+   * Configure the advertisements, has to be called before begin()
+   * @param advertInterval The interval of the advertisements in milliseconds
+   */
+  void configure(u_long advertInterval);
+
+  /**
+   * Advertise the topics of the neighbours as well, for devices that forward
+   * publications. Has to be called before begin()
+   * @param forwarding Whether the device forwards publications
+   */
+  void setForwarding(bool forwarding);
+
+  /**
+   * Start the advertisements
+   * @param send The callback that sends the advertisements
+   */
+  void begin(SendCallback send);
+
+  /**
+   * Remove expired subscriptions of neighbours and advertise the own topics
+   * when they changed or the interval is over
+   */
+  void update();
+
+  /**
+   * Replace the topics of a neighbour with the ones it advertised
+   * @param neighbour The MAC-Address of the neighbour
+   * @param message The advertisement
+   */
+  void onMessageReceived(const uint8_t neighbour[6],
+                         const QuackMeshTypes::Message &message);
+
+  /**
+   * Subscribe to a topic
+   * @param topic The name of the topic
+   * @param callback The callback to be called for every publication
+   * @return 0 on success, -1 if too many topics are subscribed
+   */
+  int subscribe(const char *topic,
+                QuackMeshTypes::OnPublicationCallback callback);
+
+  /**
+   * Cancel all subscriptions of a topic
+   * @param topic The name of the topic
+   */
+  void unsubscribe(const char *topic);
+
+  /**
+   * Call the callbacks subscribed to the topic of a publication
+   * @param message The publication
+   */
+  void deliver(const QuackMeshTypes::Message &message);
+
+  /**
+   * Get the neighbours a publication has to be sent to
+   * @param message The publication with the hop count it is sent with
+   * @param previousHop The neighbour it came from, nullptr for own ones
+   * @return The MAC-Addresses of the neighbours that lead to subscribers
+   */
+  std::vector<const uint8_t *> getLinks(const QuackMeshTypes::Message &message,
+                                        const uint8_t *previousHop) const;
+
+  /**
+   * Get the hop count own publications are sent with
+   * @return The hop count
+   */
+  uint8_t getHopCount() const;
+
+  /**
+   * Get the hash that identifies a topic on the air
+   * @param topic The name of the topic
+   * @return The 32 bit FNV-1a hash of the name
+   */
+  static uint32_t hashTopic(const char *topic);
+
+ private:
+  /**
+   * Collect the topics this device advertises
+   * @param topics The list the topics are added to
+   */
+  void fillAdvertisement(
+      std::vector<QuackMeshTypes::TopicAdvertisement> &topics) const;
+
+  /**
+   * Check if an advertisement has to be sent
+   * @param changed Whether the advertised topics changed
+   * @param empty Whether the advertisement is empty
+   * @return Whether an advertisement is due
+   */
+  bool isAdvertisementDue(bool changed, bool empty) const;
+
+  SendCallback mSend = nullptr;  // Sends the advertisements
+
+  bool mForwarding = false;  // Whether the topics of the branches count
+  u_long mAdvertInterval = 2000;  // The interval of the advertisements
+  u_long mMinAdvertGap =
+      100;  // The minimum time between two advertisements of changed topics
+  u_long mLastAdvertTs = 0;  // The time of the last advertisement
+  std::vector<QuackMeshTypes::TopicAdvertisement> mLastAdvertisement =
+      {};  // The topics that were advertised last
+  std::vector<QuackMeshTypes::LocalSubscription> mLocalSubscriptions =
+      {};  // The topics the application subscribed to
+  size_t mMaxLocalSubscriptions = 8;  // The maximum number of subscriptions
+  std::vector<QuackMeshTypes::SubscriptionEntry> mSubscriptionTable =
+      {};  // The topics the neighbours advertised
+  size_t mMaxSubscriptionEntries = 32;  // The maximum number of entries
+  uint8_t mHopCount = 3;  // The hop count of own publications
+};
@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+
+#include "QuackConcurrency.h"
+#include "QuackFraming.h"
+
+namespace QuackMeshGateway {
+
+// The packet type of a batch of recorded events
+constexpr uint8_t PACKET_RECORDING = 0x03;
+
+// The kinds of recorded events
+constexpr uint8_t EVENT_RECEIVED = 0x01;  // A frame entered the client
+constexpr uint8_t EVENT_TRANSMIT = 0x02;  // A frame was handed to the driver
+constexpr uint8_t EVENT_SENT = 0x03;      // The driver reported a send status
+
+// The size of an event record without the frame and the length field
+// (kind, timestamp, address, value)
+constexpr size_t EVENT_RECORD_HEADER_SIZE = 12;
+
+// The longest frame that is recorded
+constexpr size_t MAX_RECORDED_DATA_LENGTH = 250;
+
+/**
+ * This struct is used to store an event of the radio
+ */
+struct RecordedEvent {
+  uint8_t kind;        // The kind of the event
+  uint32_t timestamp;  // The value of micros() when the event happened
+  uint8_t address[6];  // The sender of a received frame, else the destination
+  uint8_t value;  // The RSSI (received), the channel (transmit) or the status
+  uint16_t dataLength;
+  uint8_t data[MAX_RECORDED_DATA_LENGTH];
+};
+}  // namespace QuackMeshGateway
+
+/**
+ * This class records the traffic of an ESPNowClient, so a workload seen in
+ * the field can be replayed on a host with the QuackReplayer.
+ * Every frame that enters the client, every frame handed to the driver and
+ * every send status is stored with its timestamp. The events are collected
+ * into batches and COBS framed like the batches of the QuackGateway.
+ *
+ * Every batch has a 4 byte header (u32 LE) with the total of events dropped
+ * because update() was too slow, followed by records of
+ * `length (u16 LE), kind, timestamp (u32 LE), address (6), value, frame`.
+ * Frames longer than 250 bytes are counted as dropped.
+ */
+class QuackRecorder {
+ public:
+  /**
+   * Constructor
+   * @param stream The stream the events are written to, e.g. Serial or a file
+   * @param blocking Whether the stream is written without waiting for
+   * availableForWrite(), e.g. for files
+   */
+  explicit QuackRecorder(Print &stream, bool blocking = false);
+
+  /**
+   * Start recording, previously recorded events are dropped
+   */
+  void begin();
+
+  /**
+   * Write the recorded events to the stream, has to be called frequently
+   */
+  void update();
+
+  /**
+   * Set the time after which an incomplete batch is sent
+   * @param timeout The timeout in milliseconds
+   */
+  void setBatchTimeout(u_long timeout);
+
+  /**
+   * Get the number of events dropped because update() was not called often
+   * enough
+   * @return The number of dropped events
+   */
+  uint32_t getDroppedEvents() const;
+
+  /**
+   * Record a frame that entered the client
+   * @param srcAddress The MAC-Address of the sender
+   * @param data The frame
+   * @param dataLength The length of the frame
+   * @param rssi The RSSI in dBm
+   */
+  void IRAM_ATTR recordReceived(const uint8_t srcAddress[6],
+                                const uint8_t *data, uint16_t dataLength,
+                                int8_t rssi);
+
+  /**
+   * Record a frame handed to the driver
+   * @param destAddress The MAC-Address of the destination
+   * @param data The frame
+   * @param dataLength The length of the frame
+   * @param channel The channel the frame is sent on
+   */
+  void recordTransmit(const uint8_t destAddress[6], const uint8_t *data,
+                      uint16_t dataLength, uint8_t channel);
+
+  /**
+   * Record the status the driver reported for a sent frame
+   * @param destAddress The MAC-Address of the destination
+   * @param status The status, 0 on success
+   */
+  void IRAM_ATTR recordSent(const uint8_t destAddress[6], int status);
+
+ private:
+  /**
+   * Store an event for update()
+   * @param event The event
+   */
+  void IRAM_ATTR pushEvent(const QuackMeshGateway::RecordedEvent &event);
+
+  /**
+   * Append an event to the current batch
+   * @param event The event
+   */
+  void appendRecord(const QuackMeshGateway::RecordedEvent &event);
+
+  Print &mStream;  // The stream the events are written to
+  bool mBlocking;  // Whether the stream is written at once
+
+  QuackMeshTypes::MPSCQueue<QuackMeshGateway::RecordedEvent, 16>
+      mEvents = {};  // Events of the driver callbacks and the sending task,
+                     // consumed by update()
+  std::atomic<uint32_t> mDroppedEvents = {0};  // The events that were lost
+
+  QuackMeshGateway::BatchWriter mWriter = {
+      QuackMeshGateway::PACKET_RECORDING, 4};  // Collects the events
+  u_long mBatchTimeout = 20;  // The time after which a batch is sent
+};
@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <deque>
+#include <vector>
+
+#include "QuackMeshDevice.h"
+#include "QuackRecorder.h"
+
+/**
+ * This class feeds a recording of the QuackRecorder back into a device, so a
+ * workload seen in the field can be reproduced and profiled on a bench
+ * device. The replayed device is detached from the radio: it neither hears
+ * live frames nor transmits, its frames only go to its recorder, if any.
+ * Received frames are injected into the device's client at their recorded
+ * time, scaled by the replay speed. Recorded send statuses stand in for the
+ * radio: once due, they complete the frames the device sends to the same
+ * destination in order. Recorded transmissions are not injected, they are
+ * produced by the device itself. Messages the application sent while
+ * recording are not part of the recording and have to be sent by the harness
+ * that runs the replay. The device's own timers keep running on millis(), so
+ * a replay faster than recorded shifts the injected frames against them.
+ *
+ * update() has to be called from the task that calls the device's update().
+ */
+class QuackReplayer {
+ public:
+  /**
+   * Constructor, detaches the device from the radio, so it has to be created
+   * before the device's begin()
+   * @param device The device the recording is fed into
+   */
+  explicit QuackReplayer(QuackMeshDevice &device);
+
+  /**
+   * Load a recording, batches that are broken or of another type are skipped
+   * @param recording The bytes written by the recorder
+   * @param length The number of bytes
+   * @return The number of loaded events, -1 if the recording has no events
+   */
+  int load(const uint8_t *recording, size_t length);
+
+  /**
+   * Start the replay from the first event
+   * @param speed The factor the recorded time is accelerated by, 0 to inject
+   * the events as fast as the device consumes them
+   */
+  void start(float speed = 1.0f);
+
+  /**
+   * Inject the events that are due
+   * @return Whether events are left
+   */
+  bool update();
+
+  /**
+   * Get the number of events injected since the start
+   * @return The number of injected events
+   */
+  size_t getReplayedEvents() const;
+
+  /**
+   * Get the number of events the recorder dropped, the replay misses them
+   * @return The number of dropped events
+   */
+  uint32_t getDroppedEvents() const;
+
+  /**
+   * Get the number of recorded statuses no frame of the device matched, e.g.
+   * of messages the application sent while recording
+   * @return The number of skipped statuses
+   */
+  size_t getSkippedStatuses() const;
+
+ private:
+  /**
+   * Parse a decoded batch and store its events
+   * @param packet The batch including the CRC
+   * @param length The length of the batch
+   */
+  void parseBatch(const uint8_t *packet, size_t length);
+
+  QuackMeshDevice &mDevice;  // The device the recording is fed into
+
+  std::vector<QuackMeshGateway::RecordedEvent>
+      mEvents = {};                 // The recorded events in order
+  std::vector<uint64_t> mOffsets = {};  // The time of each event in us
+                                        // after the first one
+  uint32_t mDroppedEvents = 0;  // The events the recorder dropped
+
+  std::deque<QuackMeshGateway::RecordedEvent>
+      mDueStatuses = {};  // Statuses waiting for the device to send
+  size_t mNextEvent = 0;  // The next event to be injected
+  size_t mReplayedEvents = 0;  // The number of injected events
+  size_t mSkippedStatuses = 0;  // The statuses no frame matched
+  float mSpeed = 1.0f;         // The factor the time is accelerated by
+  uint64_t mElapsed = 0;       // The replayed time in us
+  u_long mLastUpdateTs = 0;    // The value of micros() in the last update
+};
@@ -0,0 +1,96 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class provides remote procedure calls between two devices. A call is
+ * a request that carries a correlation id, the response of the callee
+ * carries the same id and doubles as the acknowledgement of the request, so
+ * a call takes one frame each way. Calls without a response fail after
+ * their timeout.
+ */
+class QuackRpc {
+ public:
+  // Sends a request or a response to another device
+  typedef std::function<void(uint8_t type, const uint8_t destination[6],
+                             const uint8_t *payload, size_t length)>
+      SendCallback;
+
+  /**
+   * Start the calls
+   * @param send The callback that sends the messages
+   */
+  void begin(SendCallback send);
+
+  /**
+   * Fail the calls whose timeout is over
+   */
+  void update();
+
+  /**
+   * Process a request or a response
+   * @param message The message
+   */
+  void onMessageReceived(const QuackMeshTypes::Message &message);
+
+  /**
+   * Register the handler of a method
+   * @param method The method
+   * @param handler The handler
+   * @return 0 on success, -1 if too many methods are registered
+   */
+  int registerMethod(uint16_t method, QuackMeshTypes::RpcHandler handler);
+
+  /**
+   * Call a method on another device
+   * @param destination The MAC-Address of the device
+   * @param method The method
+   * @param request The data of the request
+   * @param requestLength The length of the request, at most
+   * MAX_RPC_DATA_LENGTH bytes
+   * @param callback The callback to be called with the response
+   * @param timeout The time without response after which the call failed in
+   * milliseconds
+   * @return 0 if the call was queued, -1 if the request is too long, -2 if
+   * too many calls are pending
+   */
+  int call(const uint8_t destination[6], uint16_t method,
+           const uint8_t *request, size_t requestLength,
+           QuackMeshTypes::OnRpcCompletedCallback callback, u_long timeout);
+
+ private:
+  /**
+   * Run the handler of a request and send the response
+   * @param message The request
+   */
+  void handleRequest(const QuackMeshTypes::Message &message);
+
+  /**
+   * Complete the call a response is for
+   * @param message The response
+   */
+  void handleResponse(const QuackMeshTypes::Message &message);
+
+  SendCallback mSend = nullptr;  // Sends the messages
+
+  std::vector<QuackMeshTypes::RpcMethod> mMethods =
+      {};  // The methods the application registered
+  size_t mMaxMethods = 8;  // The maximum number of methods
+  std::vector<QuackMeshTypes::PendingRpcCall> mPendingCalls =
+      {};  // The calls waiting for their response
+  size_t mMaxPendingCalls = 8;  // The maximum number of pending calls
+  uint16_t mNextCallId = 0;  // The id of the next call
+};
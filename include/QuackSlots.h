@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class keeps the TDMA schedule of a device. The mesh time is divided
+ * into repeating superframes of transmit slots followed by a contention
+ * period. The devices claim their slots in broadcasts that list the slots of
+ * their neighbours as well, a device that shares its slot with a device within
+ * two hops that has a lower address moves to a free one.
+ */
+class QuackSlots {
+ public:
+  // Sends a slot claim to the neighbours
+  typedef std::function<void(const uint8_t *payload, size_t length)>
+      SendCallback;
+
+  /**
+   * Configure the superframe, has to be called before begin()
+   * @param slotCount The number of transmit slots per superframe, at least 1
+   * @param slotLength The length of a slot in milliseconds, longer than the
+   * guard times at both of its ends
+   * @param contentionLength The length of the contention period in
+   * milliseconds, longer than the guard time at its end
+   * @return 0 on success, -1 if a window would be empty
+   */
+  int configure(uint8_t slotCount, u_long slotLength, u_long contentionLength);
+
+  /**
+   * Set a fixed transmit slot, has to be called after configure()
+   * @param slot The slot, smaller than the slot count
+   * @return 0 on success, -1 if the slot does not exist
+   */
+  int setTransmitSlot(uint8_t slot);
+
+  /**
+   * Get the transmit slot of this device
+   * @return The slot, -1 before begin()
+   */
+  int16_t getTransmitSlot() const;
+
+  /**
+   * Pick the first transmit slot
+   * @param ownAddress The MAC-Address of this device
+   * @param send The callback that sends the claims
+   */
+  void begin(const uint8_t ownAddress[6], SendCallback send);
+
+  /**
+   * Claim the slot periodically and forget the slots of devices that are no
+   * longer heard
+   */
+  void update();
+
+  /**
+   * Process the slot claim of a neighbour
+   * @param neighbour The MAC-Address of the neighbour
+   * @param message The claim
+   */
+  void onMessageReceived(const uint8_t neighbour[6],
+                         const QuackMeshTypes::Message &message);
+
+  /**
+   * Get the time left in the part of the superframe a message may be sent in
+   * @param meshTime The synchronised mesh time in microseconds
+   * @param control Whether the message is a control message, those are sent
+   * in the own slot and all others in the contention period
+   * @return The time in microseconds, 0 if the message may not be sent now
+   */
+  uint64_t getTimeLeft(uint64_t meshTime, bool control) const;
+
+ private:
+  /**
+   * Broadcast the own transmit slot and those of the neighbours
+   */
+  void sendClaim();
+
+  /**
+   * Add or refresh the slot of a device within two hops
+   * @param address The MAC-Address of the device
+   * @param slot Its transmit slot
+   * @param hops 1 for a neighbour, 2 for a neighbour of a neighbour
+   */
+  void updateNeighbour(const uint8_t address[6], uint8_t slot, uint8_t hops);
+
+  /**
+   * Move to a free transmit slot if a device with a lower address uses the
+   * own one
+   */
+  void resolveCollision();
+
+  SendCallback mSend = nullptr;  // Sends the claims
+  uint8_t mOwnAddress[6] = {};   // The MAC-Address of this device
+
+  uint8_t mSlotCount = 0;        // The number of transmit slots
+  int16_t mTransmitSlot = -1;    // The own slot, -1 until it is picked
+  bool mTransmitSlotFixed = false;  // Whether the slot was set manually
+  u_long mSlotLength = 0;        // The length of a slot in milliseconds
+  u_long mContentionLength = 0;  // The length of the contention period
+  u_long mGuardTime =
+      2;  // The time at both ends of a slot nothing is sent in milliseconds
+  std::vector<QuackMeshTypes::SlotNeighbour> mNeighbours =
+      {};  // The slots of the devices within two hops
+  size_t mMaxNeighbours = 24;  // The maximum number of known slots
+  u_long mClaimInterval = 5000;  // The interval of the slot claims
+  u_long mLastClaimTs = 0;       // The timestamp of the last slot claim
+};
@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+
+#ifdef ESP32
+#include <esp_wifi.h>
+#endif
+
+#include "QuackConcurrency.h"
+#include "QuackFraming.h"
+
+namespace QuackMeshGateway {
+
+// The packet type of a batch of captured frames
+constexpr uint8_t PACKET_CAPTURE = 0x02;
+
+// The size of a capture record without the frame and the length field
+// (timestamp, rssi, channel, destination, source)
+constexpr size_t CAPTURE_RECORD_HEADER_SIZE = 18;
+
+/**
+ * This struct is used to store a captured ESP-Now frame
+ */
+struct CaptureRecord {
+  uint32_t timestamp;  // The receive time of the radio in microseconds
+  int8_t rssi;         // The RSSI in dBm
+  uint8_t channel;     // The channel the frame was received on
+  uint8_t destAddress[6];
+  uint8_t srcAddress[6];
+  uint8_t dataLength;
+  uint8_t data[250];
+};
+}  // namespace QuackMeshGateway
+
+/**
+ * This class turns a dedicated node into a sniffer for the mesh.
+ * The radio is put into promiscuous mode and every ESP-Now frame on the
+ * channel is captured with its timestamp, RSSI and channel. The captures are
+ * collected into batches of records and COBS framed like the batches of the
+ * QuackGateway, so tools/quack_pcap.py can convert the stream into a pcap file.
+ *
+ * Every batch has a 4 byte header (u32 LE) with the number of frames dropped
+ * because update() was too slow, followed by records of
+ * `length (u16 LE), timestamp (u32 LE), rssi (i8), channel, destination (6),
+ * source (6), frame`.
+ *
+ * Capturing requires an ESP32, the ESP8266 truncates frames in promiscuous
+ * mode. The node must not run a mesh device at the same time.
+ */
+class QuackSniffer {
+ public:
+  /**
+   * Constructor
+   * @param stream The stream the captures are written to, e.g. Serial
+   */
+  explicit QuackSniffer(Stream &stream);
+
+  /**
+   * Start capturing, WiFi has to be started in station mode before
+   * @param channel The channel to capture on
+   * @return 0 on success, -1 if capturing is not supported or a sniffer is
+   * already running
+   */
+  int begin(uint8_t channel);
+
+  void stop();
+
+  /**
+   * Write the captured frames to the stream, has to be called frequently
+   */
+  void update();
+
+  /**
+   * Change the channel that is captured
+   * @param channel The channel
+   */
+  void setChannel(uint8_t channel);
+
+  /**
+   * Set the time after which an incomplete batch is sent
+   * @param timeout The timeout in milliseconds
+   */
+  void setBatchTimeout(u_long timeout);
+
+  /**
+   * Get the number of frames dropped because update() was not called often
+   * enough
+   * @return The number of dropped frames
+   */
+  uint32_t getDroppedFrames() const;
+
+  /**
+   * Store a captured frame (e.g. to inject frames on a host)
+   * @param destAddress The MAC-Address of the receiver
+   * @param srcAddress The MAC-Address of the sender
+   * @param data The ESP-Now payload
+   * @param dataLength The length of the payload
+   * @param rssi The RSSI in dBm
+   * @param channel The channel the frame was received on
+   * @param timestamp The receive time in microseconds
+   */
+  void IRAM_ATTR processFrame(const uint8_t destAddress[6],
+                              const uint8_t srcAddress[6], const uint8_t *data,
+                              uint8_t dataLength, int8_t rssi, uint8_t channel,
+                              uint32_t timestamp);
+
+ private:
+#ifdef ESP32
+  /**
+   * This is the promiscuous callback of the driver, it extracts ESP-Now
+   * frames from vendor specific action frames
+   * @param buffer The received packet
+   * @param type The type of the packet
+   */
+  static void IRAM_ATTR onPromiscuousFrame(void *buffer,
+                                           wifi_promiscuous_pkt_type_t type);
+#endif
+
+  /**
+   * Append a captured frame to the current batch
+   * @param capture The captured frame
+   */
+  void appendRecord(const QuackMeshGateway::CaptureRecord &capture);
+
+  static std::atomic<QuackSniffer *>
+      ACTIVE_SNIFFER;  // The sniffer the driver callback dispatches to
+
+  Stream &mStream;  // The stream the captures are written to
+
+  QuackMeshTypes::SPSCRing<QuackMeshGateway::CaptureRecord, 16>
+      mCaptures = {};  // Frames from the driver callback, consumed by update()
+  std::atomic<uint32_t> mDroppedFrames = {0};  // The frames the ring lost
+
+  QuackMeshGateway::BatchWriter mWriter = {
+      QuackMeshGateway::PACKET_CAPTURE, 4};  // Collects the captures
+  u_long mBatchTimeout = 20;  // The time after which a batch is sent
+  uint8_t mChannel = 1;       // The channel that is captured
+};
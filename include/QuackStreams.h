@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class provides reliable, ordered streams between two devices. The
+ * data is split into segments, of which up to the smaller of the own and
+ * the receiver's window are in flight. The receiver acknowledges them
+ * cumulatively and reports the segments it buffers out of order, so only
+ * missing segments are sent again. The retransmission timeout follows the
+ * measured round trip time. With forward error correction, repair segments
+ * calculated with a Reed-Solomon code follow every block of full segments,
+ * as many as the loss the stream measures needs.
+ */
+class QuackStreams {
+ public:
+  // Sends a message of the protocol to the other end of a stream
+  typedef std::function<void(uint8_t type, const uint8_t destination[6],
+                             const uint8_t *payload, size_t length)>
+      SendCallback;
+
+  /**
+   * Set the number of segments a stream has in flight and a receiver buffers
+   * out of order, has to be called before begin()
+   * @param segments The window in segments, 1 to MAX_STREAM_WINDOW
+   */
+  void setWindow(uint8_t segments);
+
+  /**
+   * Enable forward error correction for the streams this device sends, has
+   * to be called before begin()
+   * @param blockSegments The segments of a block, a power of two up to
+   * MAX_STREAM_CODING_BLOCK and at most the stream window
+   * @param maxRepairs The most repair segments sent for a block
+   */
+  void enableFec(uint8_t blockSegments, uint8_t maxRepairs);
+
+  /**
+   * Start the streams
+   * @param send The callback that sends the messages
+   */
+  void begin(SendCallback send);
+
+  /**
+   * Send the segments the windows allow, retransmit the segments of the
+   * streams whose timer expired, fail the streams that made no progress and
+   * send delayed acknowledgements
+   * @param sendingPossible Whether a repair segment may be sent now, they
+   * are handed over one at a time
+   */
+  void update(bool sendingPossible);
+
+  /**
+   * Process a message of the protocol
+   * @param message The message
+   */
+  void onMessageReceived(const QuackMeshTypes::Message &message);
+
+  /**
+   * Open a stream to another device
+   * @param destination The MAC-Address of the receiver
+   * @param callback The callback to be called once the stream was closed and
+   * all data acknowledged, or failed
+   * @return The id of the stream, -1 if too many streams are open
+   */
+  int open(const uint8_t destination[6],
+           QuackMeshTypes::OnStreamClosedCallback callback);
+
+  /**
+   * Append data to a stream
+   * @param streamId The id of the stream
+   * @param data The data
+   * @param dataLength The length of the data
+   * @return The number of bytes taken, less than dataLength if the send
+   * buffer is full, -1 if the stream is not open or already closed
+   */
+  int write(uint8_t streamId, const uint8_t *data, size_t dataLength);
+
+  /**
+   * Close a stream once all written data is acknowledged
+   * @param streamId The id of the stream
+   * @return 0 on success, -1 if the stream is not open
+   */
+  int close(uint8_t streamId);
+
+  /**
+   * Set the callback that is called with the data of streams to this device
+   * @param callback The callback to be called
+   */
+  void setOnDataCallback(QuackMeshTypes::OnStreamDataCallback callback);
+
+ private:
+  /**
+   * Enqueue a segment of a stream, a retransmission counts as a loss
+   * @param stream The stream
+   * @param segment The segment
+   */
+  void sendSegment(QuackMeshTypes::OutgoingStream &stream,
+                   QuackMeshTypes::StreamSegment &segment);
+
+  /**
+   * Plan the repair segments of a block that was sent completely, as many
+   * as the measured loss needs. Blocks with a partial segment or whose
+   * first segments were acknowledged already are not coded
+   * @param stream The stream
+   * @param firstSequence The first segment of the block
+   */
+  void startRepairs(QuackMeshTypes::OutgoingStream &stream,
+                    uint16_t firstSequence);
+
+  /**
+   * Send the next planned repair segment if sending is possible, the
+   * remaining ones are dropped when the receiver has the whole block
+   * @param stream The stream
+   * @param sendingPossible Whether a repair segment may be sent now
+   * @return Whether repairs are still due, new segments wait for them
+   */
+  bool updateRepairs(QuackMeshTypes::OutgoingStream &stream,
+                     bool sendingPossible);
+
+  /**
+   * Add a sample to the loss estimation of a stream
+   * @param stream The stream
+   * @param lost Whether a frame was lost
+   */
+  void addLossSample(QuackMeshTypes::OutgoingStream &stream, bool lost);
+
+  /**
+   * Find the state of a stream this device receives, it is created for an
+   * unknown stream
+   * @param source The MAC-Address of the sender
+   * @param streamId The id of the stream
+   * @return The stream or nullptr if too many streams are received
+   */
+  QuackMeshTypes::IncomingStream *getIncomingStream(const uint8_t source[6],
+                                                    uint8_t streamId);
+
+  /**
+   * Process a received segment
+   * @param message The segment
+   */
+  void handleData(const QuackMeshTypes::Message &message);
+
+  /**
+   * Buffer a received or recovered segment and deliver the segments that are
+   * in order
+   * @param stream The stream
+   * @param sequence The sequence of the segment
+   * @param flags The flags of the segment
+   * @param data The data of the segment
+   * @param length The length of the data
+   */
+  void acceptSegment(QuackMeshTypes::IncomingStream &stream, uint16_t sequence,
+                     uint8_t flags, const uint8_t *data, uint8_t length);
+
+  /**
+   * Hand the next segment of a stream to the application and keep it while
+   * its block may still be decoded
+   * @param stream The stream
+   * @param flags The flags of the segment
+   * @param data The data of the segment
+   * @param length The length of the data
+   */
+  void deliverSegment(QuackMeshTypes::IncomingStream &stream, uint8_t flags,
+                      const uint8_t *data, uint8_t length);
+
+  /**
+   * Buffer a received repair segment and try to decode its block
+   * @param message The repair segment
+   */
+  void handleRepair(const QuackMeshTypes::Message &message);
+
+  /**
+   * Recover the missing segments of the blocks with enough repairs and drop
+   * the repairs that are no longer needed
+   * @param stream The stream
+   */
+  void recoverSegments(QuackMeshTypes::IncomingStream &stream);
+
+  /**
+   * Remove the acknowledged segments of a stream and retransmit the segments
+   * the receiver misses
+   * @param message The acknowledgement
+   */
+  void handleAck(const QuackMeshTypes::Message &message);
+
+  /**
+   * Enqueue the acknowledgement of a stream this device receives
+   * @param stream The stream
+   */
+  void sendAck(QuackMeshTypes::IncomingStream &stream);
+
+  SendCallback mSend = nullptr;  // Sends the messages
+  QuackMeshTypes::OnStreamDataCallback mOnDataCallback =
+      nullptr;  // The callback that is called with the data of streams
+
+  std::vector<QuackMeshTypes::OutgoingStream> mOutgoingStreams =
+      {};  // The streams this device sends
+  std::vector<QuackMeshTypes::IncomingStream> mIncomingStreams =
+      {};  // The streams this device receives
+  size_t mMaxStreams = 4;  // The maximum number of streams in each direction
+  uint8_t mNextStreamId = 0;  // The id of the next opened stream
+  uint8_t mWindow = 8;        // The segments in flight and buffered
+  size_t mBufferSegments = 16;  // The segments a stream buffers, sent or not
+  u_long mAckDelay = 200;  // How long an acknowledgement may be delayed
+  u_long mIdleTimeout =
+      30000;  // The time after which a silent incoming stream is removed
+  uint8_t mMaxTimeouts =
+      8;  // The timeouts without progress after which a stream fails
+  uint8_t mCodingBlock =
+      0;  // The segments of a block repairs are sent for, 0 if disabled
+  uint8_t mMaxRepairs = 4;  // The most repairs sent for a block
+  size_t mMaxRepairsBuffered =
+      16;  // The repairs a receiver keeps of each stream
+};
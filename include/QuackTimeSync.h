@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <vector>
+
+#include "QuackMeshTypes.h"
+
+/**
+ * This class keeps a mesh-wide clock in the style of FTSP.
+ * The node with the lowest MAC-Address that is allowed to be root provides the
+ * reference time and periodically broadcasts beacons. Every synchronised node
+ * re-broadcasts beacons with its own estimate of the mesh time, so the time
+ * floods through the mesh hop by hop.
+ * Receive timestamps are taken in the ESP-Now receive callback, send
+ * timestamps in the sent callback. Since the send time of a beacon is only
+ * known after it left, it is carried by the next beacon of the same sender.
+ * Offset and drift to the mesh time are estimated by a linear regression over
+ * the last reference points.
+ */
+class QuackTimeSync {
+ public:
+  /**
+   * Configure the time synchronisation
+   * @param beaconInterval The interval in which beacons are sent in
+   * milliseconds, 0 to only listen
+   * @param canBeRoot Whether this node may provide the reference time
+   */
+  void configure(u_long beaconInterval, bool canBeRoot);
+
+  /**
+   * Start the time synchronisation
+   * @param ownAddress The MAC-Address of this node
+   */
+  void begin(const uint8_t ownAddress[6]);
+
+  /**
+   * Update the root election and check if a new beacon has to be sent
+   * @return Whether a beacon is due
+   */
+  bool update();
+
+  /**
+   * Fill the payload of the next beacon
+   * @param payload The payload to be filled
+   * @param channel The channel the beacon is sent on, 0 for the current one
+   */
+  void fillBeacon(QuackMeshTypes::TimeSyncPayload &payload,
+                  uint8_t channel = 0);
+
+  /**
+   * Record the time the last beacon was sent
+   * @param sentMicros The value of micros() taken in the sent callback
+   * @param channel The channel the beacon was sent on, 0 for the current one
+   */
+  void onBeaconSent(u_long sentMicros, uint8_t channel = 0);
+
+  /**
+   * Process a beacon of a neighbour
+   * @param neighbour The MAC-Address of the neighbour
+   * @param payload The payload of the beacon
+   * @param receivedMicros The value of micros() taken in the receive callback
+   */
+  void onBeaconReceived(const uint8_t neighbour[6],
+                        const QuackMeshTypes::TimeSyncPayload &payload,
+                        u_long receivedMicros);
+
+  /**
+   * Get the current mesh time
+   * @return The mesh time in microseconds
+   */
+  uint64_t meshMicros();
+
+  /**
+   * Convert a local time to the mesh time
+   * @param localTime The local time in microseconds
+   * @return The mesh time in microseconds
+   */
+  uint64_t toMeshTime(uint64_t localTime) const;
+
+  /**
+   * Check if the mesh time is available
+   * @return Whether this node is the root or synchronised to one
+   */
+  bool isSynced() const;
+
+  bool isRoot() const;
+
+  /**
+   * Get the local time without wrap-around
+   * @return The local time in microseconds
+   */
+  static uint64_t localMicros();
+
+  /**
+   * Extend a value of micros() taken in the recent past to the local time
+   * @param microsTs The value of micros()
+   * @return The local time in microseconds
+   */
+  static uint64_t toLocalTime(u_long microsTs);
+
+ private:
+  /**
+   * Add a new reference point and update the regression
+   * @param localTime The local time in microseconds
+   * @param offset The mesh time minus the local time in microseconds
+   */
+  void addPoint(int64_t localTime, int64_t offset);
+
+  /**
+   * Recalculate offset and drift from the reference points
+   */
+  void recalculate();
+
+  /**
+   * Make this node the root of the mesh time
+   */
+  void becomeRoot();
+
+  /**
+   * Follow the given root and drop all synchronisation state
+   * @param rootAddress The MAC-Address of the new root
+   */
+  void adoptRoot(const uint8_t rootAddress[6]);
+
+  uint8_t mOwnAddress[6] = {};   // The MAC-Address of this node
+  uint8_t mRootAddress[6] = {};  // The MAC-Address of the current root
+  bool mHasRoot = false;         // Whether a root is known
+
+  u_long mBeaconInterval = 10000;  // The interval in which beacons are sent
+  bool mCanBeRoot = true;          // Whether this node may become root
+  u_long mRootTimeoutFactor =
+      3;  // Beacon intervals without beacon before the root is considered lost
+  u_long mLastBeaconTs = 0;  // The timestamp of the last sent beacon
+  u_long mLastRootHeardTs =
+      0;  // The timestamp of the last beacon from the current root's tree
+  u_long mLastRoundTs = 0;  // The timestamp of the newest round heard
+  u_long mHeardBeaconInterval =
+      0;  // The longest time between rounds heard without own beacons
+
+  uint16_t mSequence = 0;  // The newest synchronisation round
+  uint16_t mLastSampleSequence =
+      0;                     // The round of the newest reference point
+  uint8_t mNextBeaconId = 0;  // The id of the next beacon
+  QuackMeshTypes::TimeSyncSendState
+      mSendStates[QuackMeshTypes::MAX_WIFI_CHANNEL + 1] =
+          {};  // The send state per channel, neighbours only hear one copy
+
+  std::vector<QuackMeshTypes::TimeSyncPoint> mPoints =
+      {};                    // The reference points of the regression
+  size_t mMaxPoints = 8;     // The maximum number of reference points
+  size_t mMinPointsToBeacon =
+      3;  // The number of points needed before beacons are re-broadcast
+  int64_t mMaxPointError =
+      20000;  // The error in us after which all points are discarded
+
+  std::vector<QuackMeshTypes::TimeSyncNeighbour> mNeighbours =
+      {};                      // The last beacon of each neighbour
+  size_t mMaxNeighbours = 4;   // The maximum number of tracked neighbours
+
+  int64_t mLocalAverage = 0;   // The average local time of the points
+  int64_t mOffsetAverage = 0;  // The average offset of the points
+  double mSkew = 0;            // The drift of the mesh time to the local time
+};
@@ -9,54 +9,136 @@ the LICENSE file.
 #include "ESPNowClient.h"
 
 #include "QuackDebug.h"
+#include "QuackRecorder.h"
 
 #ifdef ESP8266
 #include <ESP8266WiFi.h>
 #endif
 #ifdef ESP32
 #include <WiFi.h>
+#include <esp_wifi.h>
 #endif
 
 using QuackMeshESPNow::ReceivedData;
 using QuackMeshESPNow::ESPNowClient;
 using QuackMeshESPNow::ESPNowSentStatus;
+using QuackMeshESPNow::PeerLink;
 
-// PUBLIC:
+namespace {
 
-bool QuackMeshESPNow::isAddressMatching(const uint8_t actualAddress[6],
-                       const uint8_t expectedAddress[6]) {
-  return memcmp(actualAddress, expectedAddress, 6) == 0;
-}
+/**
+ * A step of the PHY rate ladder, ordered from the most robust to the fastest
+ */
+struct RateStep {
+  int8_t minRssi;  // The RSSI in dBm a peer needs for this rate
+#ifdef ESP32
+  wifi_phy_mode_t phyMode;
+  wifi_phy_rate_t rate;
+#endif
+};
+
+#ifdef ESP32
+const RateStep RATE_STEPS[] = {
+    {-128, WIFI_PHY_MODE_LR, WIFI_PHY_RATE_LORA_250K},
+    {-88, WIFI_PHY_MODE_11B, WIFI_PHY_RATE_1M_L},
+    {-78, WIFI_PHY_MODE_11B, WIFI_PHY_RATE_11M_L},
+    {-70, WIFI_PHY_MODE_11G, WIFI_PHY_RATE_24M},
+    {-62, WIFI_PHY_MODE_11G, WIFI_PHY_RATE_54M},
+};
+#else
+const RateStep RATE_STEPS[] = {{-128}, {-88}};
+#endif
+
+constexpr uint8_t RATE_STEP_COUNT = sizeof(RATE_STEPS) / sizeof(RATE_STEPS[0]);
+constexpr uint8_t LONG_RANGE_STEP = 0;  // The step only used in long range mode
+constexpr uint8_t DEFAULT_RATE_STEP = 1;  // The driver's default rate
+constexpr int8_t RATE_HYSTERESIS = 4;  // The margin in dB to raise the rate
+
+#ifdef ESP32
+// The interface the frames are sent on, the same one the MAC-Address is from
+#ifdef SOFTAP
+constexpr wifi_interface_t ESPNOW_INTERFACE = WIFI_IF_AP;
+#else
+constexpr wifi_interface_t ESPNOW_INTERFACE = WIFI_IF_STA;
+#endif
+#endif
+
+}  // namespace
+
+// PUBLIC:
 
 ReceivedData::ReceivedData(const uint8_t srcAddress[6], const uint8_t *data,
-                           uint8_t dataLength)
+                           uint16_t dataLength)
     : dataLength(dataLength) {
   memcpy(this->srcAddress, srcAddress, 6);
   memcpy(this->data, data, dataLength);
-  memcpy(this->data, data, dataLength);
 }
 
-void ESPNowClient::begin() {
-  esp_now_init();
-  FDEBUG(DEBUG_LEVEL_DEBUG, "Init: %d\n", result);
+int ESPNowClient::begin() {
+  mReceivedData.clear();
+  mSendState = ESPNowSendState::SendIdle;
+  mNextDataToSend = std::nullopt;
+
   initMacAddress();
+
+  if (mReplayMode) {
+    mCurrentChannel = mHomeChannel;
+    return 0;
+  }
+
+  // The driver is shared, only the first started client initializes it
+  int registration = registerClient();
+  if (registration != 1) {
+    return registration;
+  }
+
+  int result = esp_now_init();
+  FDEBUG(DEBUG_LEVEL_DEBUG, "Init: %d\n", result);
 #ifdef ESP8266
   esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
 #endif
 
   esp_now_register_recv_cb(ESPNowClient::onDataReceived);
   esp_now_register_send_cb(ESPNowClient::onDataSent);
+
+#ifdef ESP32
+  if (mLongRange) {
+    esp_wifi_set_protocol(ESPNOW_INTERFACE,
+                          WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G |
+                              WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR);
+  }
+  mAppliedRateStep = -1;
+#endif
+
+  if (mHomeChannel != 0) {
+    switchChannel(mHomeChannel);
+  }
+  return 0;
 }
 
 void ESPNowClient::stop() {
+  if (mReplayMode) {
+    return;
+  }
+  unregisterClient();
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    if (ACTIVE_CLIENTS[i].load() != nullptr) {
+      return;
+    }
+  }
+
   esp_now_unregister_recv_cb();
   esp_now_unregister_send_cb();
   esp_now_deinit();
 }
 
 int ESPNowClient::send(uint8_t macAddress[6], uint8_t *data,
-                                int dataLength, int maxSendTries, int channel) {
-  if (ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX) {
+                                int dataLength, int maxSendTries, int channel,
+                                bool paced, u_long deadline) {
+  if (!sendingPossible()) {
+    return -1;
+  }
+  if (dataLength > MAX_DATA_LENGTH) {
     return -1;
   }
 
@@ -64,6 +146,8 @@ int ESPNowClient::send(uint8_t macAddress[6], uint8_t *data,
   newDataToSend.dataLength = dataLength;
   newDataToSend.maxTriesLeft = maxSendTries;
   newDataToSend.channel = channel;
+  newDataToSend.paced = paced;
+  newDataToSend.deadline = deadline;
   memcpy(newDataToSend.destAddress, macAddress, 6);
   memcpy(newDataToSend.data, data, dataLength);
 
@@ -73,19 +157,39 @@ int ESPNowClient::send(uint8_t macAddress[6], uint8_t *data,
 }
 
 bool ESPNowClient::sendingPossible() const {
+  // A frame stays in mNextDataToSend until its final status was processed
   FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::sendingPossible, isPossible: %d\n",
-                !ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX);
-  return !ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX;
+                !mNextDataToSend.has_value());
+  return !mNextDataToSend.has_value();
 }
 
 int ESPNowClient::sendNow(const uint8_t macAddress[6], const uint8_t *data,
                                    int dataLength, uint8_t channel) {
-  if (ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX) {
+  if (mSendState.load(std::memory_order_acquire) != ESPNowSendState::SendIdle) {
     return -1;
   }
 
   FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::sendNow, channel: %d\n", channel);
 
+  // Channel 0 is the home channel, which is the radio's channel if unmanaged
+  if (channel == 0) {
+    channel = mHomeChannel;
+  }
+  if (mHomeChannel != 0 && channel != mCurrentChannel) {
+    switchChannel(channel);
+  }
+
+  // Has to be published before the driver can invoke the sent callback
+  mSendState.store(ESPNowSendState::SendWaitingForStatus,
+                   std::memory_order_release);
+  if (mRecorder != nullptr) {
+    mRecorder->recordTransmit(macAddress, data, dataLength, channel);
+  }
+  // The status comes from the replayer instead of the driver
+  if (mReplayMode) {
+    return 0;
+  }
+
 #ifdef ESP8266
   esp_now_add_peer(const_cast<uint8_t*>(macAddress), ESP_NOW_ROLE_COMBO, channel, NULL, 0);
   int status = esp_now_send(const_cast<uint8_t*>(macAddress), const_cast<uint8_t*>(data), dataLength);
@@ -96,7 +200,11 @@ int ESPNowClient::sendNow(const uint8_t macAddress[6], const uint8_t *data,
   memcpy(peerInfo.peer_addr, macAddress, 6);
   peerInfo.channel = channel;
   peerInfo.encrypt = false;
-  FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::sendNow, add peer: %d\n", esp_now_add_peer(&peerInfo));
+  int peerStatus = esp_now_add_peer(&peerInfo);
+  FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::sendNow, add peer: %d\n", peerStatus);
+  if (mRateAdaptation) {
+    applyPeerRate(macAddress);
+  }
   int status = esp_now_send(NULL, data, dataLength);
   esp_now_del_peer(macAddress);
   if (status == ESP_OK) {
@@ -118,12 +226,10 @@ int ESPNowClient::sendNow(const uint8_t macAddress[6], const uint8_t *data,
   }
 #endif
   FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::sendNow, sent: %d, size: %d\n", status, dataLength);
-  if (status == 0) {
-    ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX = true;
-  } else {
-    ESPNowClient::DATA_SENT_UPDATE_MUTEX = true;
-    ESPNowClient::LAST_SENT_STATUS = ESPNowSentStatus::Fail;
-    ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX = false;
+  if (status != 0) {
+    mLastSentStatus.store(ESPNowSentStatus::Fail, std::memory_order_relaxed);
+    mSendState.store(ESPNowSendState::SendStatusAvailable,
+                     std::memory_order_release);
   }
 
   return status;
@@ -132,67 +238,92 @@ int ESPNowClient::sendNow(const uint8_t macAddress[6], const uint8_t *data,
 void ESPNowClient::update() {
   u_long time = millis();
 
-  if (NEW_DATA_RECEIVED_MUTEX) {
-    ESPNowClient::RECEIVED_DATA.push(NEW_RECEIVED_DATA);
-    NEW_DATA_RECEIVED_MUTEX = false;
+  if (mSendState.load(std::memory_order_acquire) ==
+      ESPNowSendState::SendStatusAvailable) {
+    processSentStatus();
   }
 
-  if (ESPNowClient::DATA_SENT_UPDATE_MUTEX) {
-    FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::update, new sent update, status: %d\n",
-                  ESPNowClient::LAST_SENT_STATUS);
-    if (ESPNowClient::LAST_SENT_STATUS == ESPNowSentStatus::PartialFail) {
-      if (mNextDataToSend.value().maxTriesLeft == 0) {
-        ESPNowClient::LAST_SENT_STATUS = ESPNowSentStatus::Fail;
+  if (mSendState.load(std::memory_order_acquire) == ESPNowSendState::SendIdle &&
+      mNextDataToSend.has_value() &&
+      (!mNextDataToSend.value().paced ||
+       time - mLastMessageSentTs >= mMessageSendInterval)) {
+    SendingData &dataToSend = mNextDataToSend.value();
+    // A frame scheduled into a time window must not run over its end, not
+    // even with a retry
+    if (dataToSend.deadline != 0 &&
+        static_cast<long>(micros() - dataToSend.deadline) >= 0) {
+      DEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::update, deadline passed\n");
+      mNextDataToSend = std::nullopt;
+      // An earlier try may have left the radio on the channel of the peer
+      if (mHomeChannel != 0 && mCurrentChannel != mHomeChannel) {
+        switchChannel(mHomeChannel);
       }
-    }
-
-    if (ESPNowClient::LAST_SENT_STATUS == ESPNowSentStatus::Fail ||
-        ESPNowClient::LAST_SENT_STATUS == ESPNowSentStatus::SendSuccess) {
       if (mOnDataSentCallback) {
-        if (isAddressMatching(mNextDataToSend.value().destAddress,
-                              BROADCAST_ADDRESS)) {
-          ESPNowClient::LAST_SENT_STATUS = ESPNowSentStatus::SendBroadcast;
-        }
-        mOnDataSentCallback(ESPNowClient::LAST_SENT_STATUS);
+        mOnDataSentCallback(ESPNowSentStatus::Fail);
       }
-      mNextDataToSend = std::nullopt;
-      ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX = false;
+    } else {
+      mLastMessageSentTs = time;
+      dataToSend.maxTriesLeft -= 1;
+      sendNow(dataToSend.destAddress, dataToSend.data, dataToSend.dataLength,
+              dataToSend.channel);
     }
-
-    ESPNowClient::DATA_SENT_UPDATE_MUTEX = false;
-    ESPNowClient::LAST_SENT_STATUS = Undetermined;
-  }
-
-  if (!ESPNowClient::DATA_SENT_UPDATE_MUTEX &&
-      !ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX && mNextDataToSend.has_value() &&
-      time - mLastMessageSentTs >= mMessageSendInterval) {
-    mLastMessageSentTs = time;
-    const SendingData &dataToSend = mNextDataToSend.value();
-    sendNow(dataToSend.destAddress, dataToSend.data, dataToSend.dataLength, dataToSend.channel);
-    mNextDataToSend.value().maxTriesLeft -= 1;
   }
 
   if (time - mLastMessageProcessedTs >= mMessageProcessInterval &&
-      !ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX) {
-    mMessageProcessInterval = time;
+      mSendState.load(std::memory_order_acquire) !=
+          ESPNowSendState::SendWaitingForStatus) {
+    mLastMessageProcessedTs = time;
     processMessage();
   }
 }
 
-void ESPNowClient::processMessage() {
-  if (ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX) {
+void ESPNowClient::processSentStatus() {
+  ESPNowSentStatus status = static_cast<ESPNowSentStatus>(
+      mLastSentStatus.load(std::memory_order_relaxed));
+  FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::update, new sent update, status: %d\n",
+                status);
+
+  if (!mNextDataToSend.has_value()) {
+    mSendState.store(ESPNowSendState::SendIdle, std::memory_order_release);
     return;
   }
-  ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = true;
-  if (ESPNowClient::RECEIVED_DATA.empty()) {
-    ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = false;
+
+  if (status == ESPNowSentStatus::PartialFail &&
+      mNextDataToSend.value().maxTriesLeft == 0) {
+    status = ESPNowSentStatus::Fail;
+  }
+
+  if (status == ESPNowSentStatus::Fail ||
+      status == ESPNowSentStatus::SendSuccess) {
+    if (isAddressMatching(mNextDataToSend.value().destAddress,
+                          BROADCAST_ADDRESS) &&
+        status == ESPNowSentStatus::SendSuccess) {
+      status = ESPNowSentStatus::SendBroadcast;
+    }
+    mNextDataToSend = std::nullopt;
+    mSendState.store(ESPNowSendState::SendIdle, std::memory_order_release);
+    if (mHomeChannel != 0 && mCurrentChannel != mHomeChannel) {
+      switchChannel(mHomeChannel);
+    }
+    if (mOnDataSentCallback) {
+      mOnDataSentCallback(status);
+    }
     return;
   }
-  const ReceivedData &firstData = ESPNowClient::RECEIVED_DATA.front();
-  ReceivedData data{};
-  memcpy(&data, &firstData, sizeof(ReceivedData));
-  ESPNowClient::RECEIVED_DATA.pop();
-  ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = false;
+
+  // PartialFail with tries left, the frame is sent again by update()
+  if (mRateAdaptation) {
+    lowerPeerRate(mNextDataToSend.value().destAddress);
+  }
+  mSendState.store(ESPNowSendState::SendIdle, std::memory_order_release);
+}
+
+void ESPNowClient::processMessage() {
+  ReceivedData data;
+  if (!mReceivedData.pop(data)) {
+    return;
+  }
+  updatePeerLink(data);
   if (mOnDataReceivedCallback) {
     mOnDataReceivedCallback(data);
   }
@@ -202,6 +333,29 @@ void ESPNowClient::setMessageProcessInterval(u_long interval) {
   mMessageProcessInterval = interval;
 }
 
+void ESPNowClient::setHomeChannel(uint8_t channel) {
+  mHomeChannel = channel;
+  if (channel != 0 && !mNextDataToSend.has_value()) {
+    switchChannel(channel);
+  }
+}
+
+uint8_t ESPNowClient::getHomeChannel() const { return mHomeChannel; }
+
+void ESPNowClient::setMessageSendInterval(u_long interval) {
+  mMessageSendInterval = interval;
+}
+
+void ESPNowClient::enableRateAdaptation(bool longRange) {
+  mRateAdaptation = true;
+  mLongRange = longRange;
+}
+
+int8_t ESPNowClient::getPeerRssi(const uint8_t peer[6]) const {
+  const PeerLink *link = findPeerLink(peer);
+  return link != nullptr ? static_cast<int8_t>(link->rssi) : 0;
+}
+
 void ESPNowClient::setOnDataReceivedCallback(
     OnESPNowDataReceivedCallback callback) {
   mOnDataReceivedCallback = callback;
@@ -211,6 +365,25 @@ void ESPNowClient::setOnDataSentCallback(OnESPNowSentCallback callback) {
   mOnDataSentCallback = callback;
 }
 
+void ESPNowClient::setRecorder(QuackRecorder *recorder) {
+  mRecorder = recorder;
+}
+
+void ESPNowClient::setReplayMode(bool enabled) { mReplayMode = enabled; }
+
+const uint8_t *ESPNowClient::getWaitingDestination() const {
+  if (mSendState.load(std::memory_order_acquire) !=
+          ESPNowSendState::SendWaitingForStatus ||
+      !mNextDataToSend.has_value()) {
+    return nullptr;
+  }
+  return mNextDataToSend.value().destAddress;
+}
+
+u_long ESPNowClient::getLastSentTimestamp() const {
+  return mLastSentTs.load(std::memory_order_relaxed);
+}
+
 String ESPNowClient::getMacAddressAsString() const { return WiFi.macAddress(); }
 
 uint8_t *ESPNowClient::getMACAddress() { return mMACAddress; }
@@ -218,66 +391,251 @@ uint8_t *ESPNowClient::getMACAddress() { return mMACAddress; }
 #ifdef ESP8266
 void ESPNowClient::onDataReceived(uint8_t *mac_addr, uint8_t *data,
                                   uint8_t data_len) {
-  
   DEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::onDataReceived\n");
-  if (ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX) {
-    return;
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    ESPNowClient *client = ACTIVE_CLIENTS[i].load(std::memory_order_acquire);
+    if (client != nullptr && client->isFrameReceiver(nullptr)) {
+      client->processReceivedData(mac_addr, data, data_len);
+    }
   }
-  ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = true;
-  ESPNowClient::processReceivedData(mac_addr, data, data_len);
-  ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = false;
 }
 #endif
 #ifdef ESP32
+#if ESP_IDF_VERSION_MAJOR >= 5
+void ESPNowClient::onDataReceived(const esp_now_recv_info_t *info,
+                                  const uint8_t *data, int data_len) {
+  int8_t rssi = info->rx_ctrl != nullptr ? info->rx_ctrl->rssi : 0;
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    ESPNowClient *client = ACTIVE_CLIENTS[i].load(std::memory_order_acquire);
+    if (client != nullptr && client->isFrameReceiver(info->des_addr)) {
+      client->processReceivedData(info->src_addr, data, data_len, rssi);
+    }
+  }
+}
+#else
 void ESPNowClient::onDataReceived(const uint8_t *mac_addr, const uint8_t *data,
                                   int data_len) {
-  if (ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX) {
-    return;
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    ESPNowClient *client = ACTIVE_CLIENTS[i].load(std::memory_order_acquire);
+    if (client != nullptr && client->isFrameReceiver(nullptr)) {
+      client->processReceivedData(mac_addr, data, data_len);
+    }
   }
-  ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = true;
-  ESPNowClient::processReceivedData(mac_addr, data, data_len);
-  ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = false;
 }
 #endif
+#endif
 
 #ifdef ESP8266
 void ESPNowClient::onDataSent(uint8_t *mac_addr, uint8_t status) {
   FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::onDataSent, status: %d\n", status);
-  ESPNowClient::processDataSent(mac_addr, status);
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    ESPNowClient *client = ACTIVE_CLIENTS[i].load(std::memory_order_acquire);
+    // Only one frame is in flight, so its status has a single owner
+    if (client != nullptr && client->isFrameSender(mac_addr)) {
+      client->processDataSent(mac_addr, status);
+      break;
+    }
+  }
 }
 #endif
 #ifdef ESP32
 void ESPNowClient::onDataSent(const uint8_t *mac_addr,
                               esp_now_send_status_t status) {
   FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::onDataSent, status: %d\n", status);
-  ESPNowClient::processDataSent(mac_addr, status);
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    ESPNowClient *client = ACTIVE_CLIENTS[i].load(std::memory_order_acquire);
+    // Only one frame is in flight, so its status has a single owner
+    if (client != nullptr && client->isFrameSender(mac_addr)) {
+      client->processDataSent(mac_addr, status);
+      break;
+    }
+  }
 }
 #endif
 
 void ESPNowClient::processReceivedData(const uint8_t *macAddress,
                                        const uint8_t *data,
-                                       uint8_t dataLength) {
-  if (dataLength < 18) {
+                                       uint16_t dataLength, int8_t rssi) {
+  if (dataLength < 18 || dataLength > MAX_DATA_LENGTH) {
     return;
   }
-  ReceivedData newReceivedData = ReceivedData(macAddress, data, dataLength);
-  ESPNowClient::NEW_RECEIVED_DATA = newReceivedData;
-  NEW_DATA_RECEIVED_MUTEX = true;
+  if (mRecorder != nullptr) {
+    mRecorder->recordReceived(macAddress, data, dataLength, rssi);
+  }
+  ReceivedData newReceivedData(macAddress, data, dataLength);
+  newReceivedData.receivedTs = micros();
+  newReceivedData.rssi = rssi;
+  if (!mReceivedData.push(newReceivedData)) {
+    DEBUG(DEBUG_LEVEL_WARN, "ESPNowClient::processReceivedData, queue full\n");
+  }
 }
 
 void ESPNowClient::processDataSent(const uint8_t *macAddress,
                                    int status) {
   FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::processDataSent, status: %d\n", status);
-  if (status == 0) {
-    ESPNowClient::LAST_SENT_STATUS = ESPNowSentStatus::SendSuccess;
-  } else {
-    ESPNowClient::LAST_SENT_STATUS = ESPNowSentStatus::PartialFail;
+  // Only the client that handed a frame to the driver consumes the status
+  if (mSendState.load(std::memory_order_acquire) !=
+      ESPNowSendState::SendWaitingForStatus) {
+    return;
   }
-  ESPNowClient::DATA_SENT_UPDATE_MUTEX = true;
+  if (mRecorder != nullptr) {
+    mRecorder->recordSent(macAddress, status);
+  }
+  mLastSentTs.store(micros(), std::memory_order_relaxed);
+  mLastSentStatus.store(status == 0 ? ESPNowSentStatus::SendSuccess
+                                    : ESPNowSentStatus::PartialFail,
+                        std::memory_order_relaxed);
+  mSendState.store(ESPNowSendState::SendStatusAvailable,
+                   std::memory_order_release);
 }
 
 // PRIVATE:
 
+bool ESPNowClient::isFrameReceiver(const uint8_t *destAddress) const {
+  // Without the destination every client could be the receiver
+  return destAddress == nullptr ||
+         isAddressMatching(destAddress, BROADCAST_ADDRESS) ||
+         isAddressMatching(destAddress, mMACAddress);
+}
+
+bool ESPNowClient::isFrameSender(const uint8_t *macAddress) const {
+  if (mSendState.load(std::memory_order_acquire) !=
+          ESPNowSendState::SendWaitingForStatus ||
+      !mNextDataToSend.has_value()) {
+    return false;
+  }
+  return macAddress == nullptr ||
+         isAddressMatching(mNextDataToSend.value().destAddress, macAddress);
+}
+
+void ESPNowClient::switchChannel(uint8_t channel) {
+  FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::switchChannel, channel: %d\n",
+         channel);
+  mCurrentChannel = channel;
+  if (mReplayMode) {
+    return;
+  }
+#ifdef ESP8266
+  wifi_set_channel(channel);
+#endif
+#ifdef ESP32
+  esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+#endif
+}
+
+PeerLink *ESPNowClient::findPeerLink(const uint8_t peer[6]) {
+  for (PeerLink &link : mPeerLinks) {
+    if (isAddressMatching(link.address, peer)) {
+      return &link;
+    }
+  }
+  return nullptr;
+}
+
+const PeerLink *ESPNowClient::findPeerLink(const uint8_t peer[6]) const {
+  for (const PeerLink &link : mPeerLinks) {
+    if (isAddressMatching(link.address, peer)) {
+      return &link;
+    }
+  }
+  return nullptr;
+}
+
+PeerLink &ESPNowClient::getOrCreatePeerLink(const uint8_t peer[6]) {
+  PeerLink *link = findPeerLink(peer);
+  if (link != nullptr) {
+    return *link;
+  }
+
+  if (mPeerLinks.size() >= mMaxPeerLinks) {
+    auto oldest = mPeerLinks.begin();
+    for (auto it = mPeerLinks.begin(); it != mPeerLinks.end(); it++) {
+      if (it->lastSeenTs < oldest->lastSeenTs) {
+        oldest = it;
+      }
+    }
+    mPeerLinks.erase(oldest);
+  }
+
+  PeerLink newLink = {};
+  memcpy(newLink.address, peer, 6);
+  newLink.rateStep = DEFAULT_RATE_STEP;
+  newLink.lastSeenTs = millis();
+  mPeerLinks.push_back(newLink);
+  return mPeerLinks.back();
+}
+
+void ESPNowClient::updatePeerLink(const ReceivedData &data) {
+  bool knownPeer = findPeerLink(data.srcAddress) != nullptr;
+  PeerLink &link = getOrCreatePeerLink(data.srcAddress);
+  link.lastSeenTs = millis();
+
+  if (data.rssi == 0) {
+    return;
+  }
+  // Smooth the RSSI with a weight of 1/4 for the newest frame
+  link.rssi = knownPeer && link.rssi != 0
+                  ? static_cast<int16_t>((3 * link.rssi + data.rssi) / 4)
+                  : data.rssi;
+
+  uint8_t step = DEFAULT_RATE_STEP;
+  if (mLongRange && link.rssi < RATE_STEPS[DEFAULT_RATE_STEP].minRssi) {
+    step = LONG_RANGE_STEP;
+  } else {
+    while (step + 1 < RATE_STEP_COUNT &&
+           link.rssi >= RATE_STEPS[step + 1].minRssi) {
+      step++;
+    }
+  }
+
+  // Lower the rate at once, raise it only with some margin and after a hold
+  if (step < link.rateStep) {
+    link.rateStep = step;
+  } else if (step > link.rateStep &&
+             static_cast<long>(millis() - link.rateHoldTs) >= 0 &&
+             link.rssi >= RATE_STEPS[link.rateStep + 1].minRssi +
+                              RATE_HYSTERESIS) {
+    link.rateStep++;
+  }
+}
+
+void ESPNowClient::lowerPeerRate(const uint8_t peer[6]) {
+  if (isAddressMatching(peer, BROADCAST_ADDRESS)) {
+    return;
+  }
+  PeerLink &link = getOrCreatePeerLink(peer);
+  uint8_t lowestStep = mLongRange ? LONG_RANGE_STEP : DEFAULT_RATE_STEP;
+  if (link.rateStep > lowestStep) {
+    link.rateStep--;
+  }
+  link.rateHoldTs = millis() + mRateHoldTime;
+  FDEBUG(DEBUG_LEVEL_DEBUG, "ESPNowClient::lowerPeerRate, step: %d\n",
+         link.rateStep);
+}
+
+void ESPNowClient::applyPeerRate(const uint8_t peer[6]) {
+  const PeerLink *link = findPeerLink(peer);
+  uint8_t step = DEFAULT_RATE_STEP;
+  if (link != nullptr && !isAddressMatching(peer, BROADCAST_ADDRESS)) {
+    step = link->rateStep;
+  }
+#ifdef ESP32
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+  esp_now_rate_config_t rateConfig = {};
+  rateConfig.phymode = RATE_STEPS[step].phyMode;
+  rateConfig.rate = RATE_STEPS[step].rate;
+  esp_now_set_peer_rate_config(peer, &rateConfig);
+#else
+  // Older drivers only have a global rate, which is fine with one frame in
+  // flight at a time
+  if (step != mAppliedRateStep) {
+    esp_wifi_config_espnow_rate(ESPNOW_INTERFACE, RATE_STEPS[step].rate);
+  }
+#endif
+#endif
+  mAppliedRateStep = step;
+}
+
 void ESPNowClient::initMacAddress() {
   #ifdef SOFTAP
   String mac = WiFi.softAPmacAddress();
@@ -294,16 +652,38 @@ void ESPNowClient::initMacAddress() {
   }
 }
 
-std::queue<ReceivedData> ESPNowClient::RECEIVED_DATA = {};
-ReceivedData ESPNowClient::NEW_RECEIVED_DATA = {};
-bool ESPNowClient::NEW_DATA_RECEIVED_MUTEX = false;
+int ESPNowClient::registerClient() {
+  int firstClient = 1;
+  size_t freeSlot = MAX_ACTIVE_CLIENTS;
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    ESPNowClient *client = ACTIVE_CLIENTS[i].load();
+    if (client == this) {
+      return 0;
+    } else if (client != nullptr) {
+      firstClient = 0;
+    } else if (freeSlot == MAX_ACTIVE_CLIENTS) {
+      freeSlot = i;
+    }
+  }
+
+  if (freeSlot == MAX_ACTIVE_CLIENTS) {
+    DEBUG(DEBUG_LEVEL_ERR, "ESPNowClient::registerClient, no free slot\n");
+    return -1;
+  }
+  ACTIVE_CLIENTS[freeSlot].store(this, std::memory_order_release);
+  return firstClient;
+}
+
+void ESPNowClient::unregisterClient() {
+  for (size_t i = 0; i < MAX_ACTIVE_CLIENTS; i++) {
+    if (ACTIVE_CLIENTS[i].load() == this) {
+      ACTIVE_CLIENTS[i].store(nullptr, std::memory_order_release);
+    }
+  }
+}
 
-bool ESPNowClient::RECIEVED_DATA_ACCESS_MUTEX = false;
-bool ESPNowClient::WAITING_FOR_DATA_SENT_MUTEX = false;
-bool ESPNowClient::DATA_SENT_UPDATE_MUTEX = false;
+std::atomic<ESPNowClient *>
+    ESPNowClient::ACTIVE_CLIENTS[ESPNowClient::MAX_ACTIVE_CLIENTS] = {};
 
 uint8_t ESPNowClient::BROADCAST_ADDRESS[6] = {0xff, 0xff, 0xff,
                                               0xff, 0xff, 0xff};
-
-ESPNowSentStatus ESPNowClient::LAST_SENT_STATUS =
-    ESPNowSentStatus::Undetermined;
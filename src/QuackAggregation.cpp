@@ -0,0 +1,171 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackAggregation.h"
+
+#include <algorithm>
+
+#include "QuackDebug.h"
+
+using QuackMeshTypes::AggregateHeader;
+using QuackMeshTypes::AggregateMergeCallback;
+using QuackMeshTypes::CollectionHeader;
+using QuackMeshTypes::Message;
+using QuackMeshTypes::OnAggregateCallback;
+using QuackMeshTypes::PendingAggregate;
+using QuackMeshTypes::RegisteredAggregate;
+
+// PUBLIC:
+
+void QuackAggregation::configure(u_long window) { mWindow = window; }
+
+void QuackAggregation::begin(SendCallback send) { mSend = send; }
+
+void QuackAggregation::update() {
+  auto it = mPendingAggregates.begin();
+  while (it != mPendingAggregates.end()) {
+    if (millis() - it->startTs < mWindow) {
+      it++;
+      continue;
+    }
+
+    // The cost is put in by every hop on the way up
+    uint8_t payload[sizeof(Message::data)];
+    CollectionHeader collectionHeader = {
+        .cost = QuackMeshTypes::NO_COLLECTION_ROUTE,
+        .timeHasLived = it->timeHasLived};
+    memcpy(payload, &collectionHeader, sizeof(CollectionHeader));
+    memcpy(payload + sizeof(CollectionHeader), &it->header,
+           sizeof(AggregateHeader));
+    memcpy(payload + sizeof(CollectionHeader) + sizeof(AggregateHeader),
+           it->value, it->length);
+    size_t length =
+        sizeof(CollectionHeader) + sizeof(AggregateHeader) + it->length;
+    it = mPendingAggregates.erase(it);
+
+    mSend(payload, length);
+  }
+}
+
+bool QuackAggregation::hold(const Message &message) {
+  size_t headerLength = sizeof(CollectionHeader) + sizeof(AggregateHeader);
+  if (message.type != QuackMeshTypes::MESSAGE_TYPE_AGGREGATE ||
+      message.len < headerLength) {
+    return false;
+  }
+  CollectionHeader collectionHeader;
+  AggregateHeader header;
+  memcpy(&collectionHeader, message.data, sizeof(CollectionHeader));
+  memcpy(&header, message.data + sizeof(CollectionHeader),
+         sizeof(AggregateHeader));
+  const uint8_t *value = message.data + headerLength;
+  size_t valueLength = message.len - headerLength;
+
+  AggregateMergeCallback merge = nullptr;
+  if (header.op == QuackMeshTypes::AGGREGATE_CUSTOM) {
+    auto registered = std::find_if(
+        mRegisteredAggregates.begin(), mRegisteredAggregates.end(),
+        [&](const RegisteredAggregate &aggregate) {
+          return aggregate.key == header.key;
+        });
+    if (registered == mRegisteredAggregates.end()) {
+      return false;
+    }
+    merge = registered->merge;
+  } else if (header.op > QuackMeshTypes::AGGREGATE_CUSTOM ||
+             valueLength != sizeof(int32_t)) {
+    return false;
+  }
+
+  auto it = std::find_if(mPendingAggregates.begin(), mPendingAggregates.end(),
+                         [&](const PendingAggregate &pending) {
+                           return pending.header.key == header.key &&
+                                  pending.header.op == header.op;
+                         });
+  // The first report of a key opens the window
+  if (it == mPendingAggregates.end()) {
+    if (mPendingAggregates.size() >= mMaxPendingAggregates) {
+      DEBUG(DEBUG_LEVEL_WARN, "QuackAggregation::hold, too many keys\n");
+      return false;
+    }
+    PendingAggregate pending = {};
+    pending.header = header;
+    pending.timeHasLived = collectionHeader.timeHasLived;
+    pending.length = valueLength;
+    memcpy(pending.value, value, valueLength);
+    pending.startTs = millis();
+    mPendingAggregates.push_back(pending);
+    return true;
+  }
+
+  if (merge) {
+    size_t length = merge(it->value, it->length, value, valueLength);
+    if (length > sizeof(it->value)) {
+      return false;
+    }
+    it->length = length;
+  } else {
+    int32_t held;
+    int32_t incoming;
+    memcpy(&held, it->value, sizeof(int32_t));
+    memcpy(&incoming, value, sizeof(int32_t));
+    switch (header.op) {
+      case QuackMeshTypes::AGGREGATE_MIN:
+        held = std::min(held, incoming);
+        break;
+      case QuackMeshTypes::AGGREGATE_MAX:
+        held = std::max(held, incoming);
+        break;
+      default:
+        held += incoming;
+        break;
+    }
+    memcpy(it->value, &held, sizeof(int32_t));
+  }
+  it->header.count += header.count;
+  it->timeHasLived = std::max(it->timeHasLived, collectionHeader.timeHasLived);
+  return true;
+}
+
+void QuackAggregation::deliver(const Message &message) {
+  size_t headerLength = sizeof(CollectionHeader) + sizeof(AggregateHeader);
+  if (message.len < headerLength || !mOnAggregateCallback) {
+    return;
+  }
+  AggregateHeader header;
+  memcpy(&header, message.data + sizeof(CollectionHeader),
+         sizeof(AggregateHeader));
+  const uint8_t *value = message.data + headerLength;
+  size_t valueLength = message.len - headerLength;
+
+  if (header.op == QuackMeshTypes::AGGREGATE_AVERAGE &&
+      valueLength >= sizeof(int32_t) && header.count > 0) {
+    int32_t sum;
+    memcpy(&sum, value, sizeof(int32_t));
+    int32_t average = sum / header.count;
+    mOnAggregateCallback(header.key, header.count,
+                         reinterpret_cast<const uint8_t *>(&average),
+                         sizeof(int32_t));
+    return;
+  }
+  mOnAggregateCallback(header.key, header.count, value, valueLength);
+}
+
+int QuackAggregation::registerAggregate(uint16_t key,
+                                        AggregateMergeCallback merge) {
+  if (mRegisteredAggregates.size() >= mMaxRegisteredAggregates) {
+    return -1;
+  }
+  RegisteredAggregate aggregate = {.key = key, .merge = merge};
+  mRegisteredAggregates.push_back(aggregate);
+  return 0;
+}
+
+void QuackAggregation::setOnAggregateCallback(OnAggregateCallback callback) {
+  mOnAggregateCallback = callback;
+}
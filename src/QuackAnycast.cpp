@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackAnycast.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::Message;
+using QuackMeshTypes::SinkAdvertisementPayload;
+using QuackMeshTypes::SinkEntry;
+
+// PUBLIC:
+
+void QuackAnycast::enableSink(uint16_t service, u_long advertInterval) {
+  mSink = true;
+  mService = service;
+  mAdvertInterval = advertInterval;
+}
+
+void QuackAnycast::setSinkLoad(uint8_t load) { mLoad = load; }
+
+void QuackAnycast::setForwarding(bool forwarding) { mForwarding = forwarding; }
+
+void QuackAnycast::begin(const uint8_t ownAddress[6], SendCallback send) {
+  memcpy(mOwnAddress, ownAddress, 6);
+  mSend = send;
+}
+
+void QuackAnycast::update(uint8_t queueLoad) {
+  auto it = mSinks.begin();
+  while (it != mSinks.end()) {
+    // A sink that disappeared is dropped, so its traffic fails over
+    if (millis() - it->lastSeenTs > 3 * it->interval) {
+      DEBUG(DEBUG_LEVEL_DEBUG, "QuackAnycast::update, sink lost\n");
+      it = mSinks.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  if (!mSink || millis() - mLastAdvertTs < mAdvertInterval) {
+    return;
+  }
+  mLastAdvertTs = millis();
+
+  SinkAdvertisementPayload payload = {
+      .interval = static_cast<uint32_t>(mAdvertInterval),
+      .service = mService,
+      .sequence = ++mSequence,
+      .load = std::max(mLoad, queueLoad),
+      .hops = 0,
+  };
+  mSend(mOwnAddress, reinterpret_cast<const uint8_t *>(&payload),
+        sizeof(SinkAdvertisementPayload));
+}
+
+const SinkEntry *QuackAnycast::onMessageReceived(const uint8_t neighbour[6],
+                                                 const Message &message,
+                                                 uint8_t relayLoad) {
+  if (message.len < sizeof(SinkAdvertisementPayload) ||
+      isAddressMatching(message.srcAddress, mOwnAddress)) {
+    return nullptr;
+  }
+  SinkAdvertisementPayload payload;
+  memcpy(&payload, message.data, sizeof(SinkAdvertisementPayload));
+  uint8_t hops = payload.hops + 1;
+
+  auto it = std::find_if(mSinks.begin(), mSinks.end(),
+                         [&](const SinkEntry &sink) {
+                           return isAddressMatching(sink.sink,
+                                                    message.srcAddress);
+                         });
+  bool newRound =
+      it == mSinks.end() ||
+      static_cast<int16_t>(payload.sequence - it->sequence) > 0;
+  // Within a round only a shorter path replaces the route
+  if (!newRound &&
+      (payload.sequence != it->sequence || hops >= it->hops)) {
+    return nullptr;
+  }
+
+  if (it == mSinks.end()) {
+    if (mSinks.size() >= mMaxSinks) {
+      DEBUG(DEBUG_LEVEL_WARN,
+            "QuackAnycast::onMessageReceived, too many sinks\n");
+      return nullptr;
+    }
+    SinkEntry newSink = {};
+    memcpy(newSink.sink, message.srcAddress, 6);
+    mSinks.push_back(newSink);
+    it = mSinks.end() - 1;
+  }
+  memcpy(it->nextHop, neighbour, 6);
+  it->service = payload.service;
+  it->sequence = payload.sequence;
+  it->hops = hops;
+  it->load = payload.load;
+  it->interval = payload.interval;
+  it->lastSeenTs = millis();
+
+  // Every round is relayed once, with the first path it arrived over
+  if (mForwarding && newRound && it->hops < mHopLimit) {
+    relayAdvertisement(*it, relayLoad);
+  }
+  return &*it;
+}
+
+bool QuackAnycast::isSinkOf(uint16_t service) const {
+  return mSink && mService == service;
+}
+
+SinkEntry *QuackAnycast::findBestSink(uint16_t service) {
+  SinkEntry *bestSink = nullptr;
+  uint32_t bestCost = UINT32_MAX;
+  for (SinkEntry &sink : mSinks) {
+    if (sink.service != service) {
+      continue;
+    }
+    uint32_t cost = sink.hops * mHopCost + sink.load;
+    if (cost < bestCost) {
+      bestCost = cost;
+      bestSink = &sink;
+    }
+  }
+  return bestSink;
+}
+
+bool QuackAnycast::isKnownSink(uint16_t service,
+                               const uint8_t address[6]) const {
+  return std::any_of(mSinks.begin(), mSinks.end(), [&](const SinkEntry &sink) {
+    return sink.service == service && isAddressMatching(sink.sink, address);
+  });
+}
+
+// PRIVATE:
+
+void QuackAnycast::relayAdvertisement(const SinkEntry &sink,
+                                      uint8_t relayLoad) {
+  // A congested relay advertises its own load, so traffic avoids it
+  SinkAdvertisementPayload payload = {
+      .interval = static_cast<uint32_t>(sink.interval),
+      .service = sink.service,
+      .sequence = sink.sequence,
+      .load = std::max(sink.load, relayLoad),
+      .hops = sink.hops,
+  };
+  mSend(sink.sink, reinterpret_cast<const uint8_t *>(&payload),
+        sizeof(SinkAdvertisementPayload));
+}
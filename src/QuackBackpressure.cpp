@@ -0,0 +1,127 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackBackpressure.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::CongestedNeighbour;
+using QuackMeshTypes::CongestionPayload;
+using QuackMeshTypes::Message;
+
+// PUBLIC:
+
+void QuackBackpressure::configure(size_t highWatermark, size_t lowWatermark,
+                                  u_long interval) {
+  mHighWatermark = highWatermark;
+  mLowWatermark = std::min(lowWatermark, highWatermark);
+  mCongestedLinkInterval = interval;
+}
+
+void QuackBackpressure::begin(SendCallback send,
+                              OnNeighbourCallback onNeighbour) {
+  mSend = send;
+  mOnNeighbour = onNeighbour;
+}
+
+void QuackBackpressure::update(size_t queued, uint8_t load) {
+  // A lost end of a congestion must not hold the link back for good
+  auto it = mCongestedNeighbours.begin();
+  while (it != mCongestedNeighbours.end()) {
+    if (millis() - it->lastSeenTs > 3 * mSignalInterval) {
+      it = mCongestedNeighbours.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  // The watermarks keep the device from flapping around one length
+  if (!mCongested && queued >= mHighWatermark) {
+    DEBUG(DEBUG_LEVEL_DEBUG, "QuackBackpressure::update, congested\n");
+    mCongested = true;
+    sendSignal(load);
+  } else if (mCongested && queued <= mLowWatermark) {
+    DEBUG(DEBUG_LEVEL_DEBUG, "QuackBackpressure::update, drained\n");
+    mCongested = false;
+    sendSignal(load);
+  } else if (mCongested && millis() - mLastSignalTs >= mSignalInterval) {
+    sendSignal(load);
+  }
+}
+
+void QuackBackpressure::onMessageReceived(const uint8_t neighbour[6],
+                                          const Message &message) {
+  if (message.len < sizeof(CongestionPayload)) {
+    return;
+  }
+  CongestionPayload payload;
+  memcpy(&payload, message.data, sizeof(CongestionPayload));
+  bool congested = payload.congested != 0;
+  mOnNeighbour(neighbour, congested);
+
+  auto it = std::find_if(mCongestedNeighbours.begin(),
+                         mCongestedNeighbours.end(),
+                         [&](const CongestedNeighbour &entry) {
+                           return isAddressMatching(entry.address, neighbour);
+                         });
+  if (!congested) {
+    if (it != mCongestedNeighbours.end()) {
+      mCongestedNeighbours.erase(it);
+    }
+    return;
+  }
+  if (it == mCongestedNeighbours.end()) {
+    if (mCongestedNeighbours.size() >= mMaxCongestedNeighbours) {
+      DEBUG(DEBUG_LEVEL_WARN,
+            "QuackBackpressure::onMessageReceived, too many neighbours\n");
+      return;
+    }
+    // The spacing starts right away, the neighbour is full already
+    CongestedNeighbour newNeighbour = {.address = {},
+                                       .load = payload.load,
+                                       .lastSentTs = millis(),
+                                       .lastSeenTs = millis()};
+    memcpy(newNeighbour.address, neighbour, 6);
+    mCongestedNeighbours.push_back(newNeighbour);
+    return;
+  }
+  it->load = payload.load;
+  it->lastSeenTs = millis();
+}
+
+bool QuackBackpressure::mayTransmitTo(const uint8_t nextHop[6]) {
+  for (CongestedNeighbour &neighbour : mCongestedNeighbours) {
+    if (!isAddressMatching(neighbour.address, nextHop)) {
+      continue;
+    }
+    if (millis() - neighbour.lastSentTs < mCongestedLinkInterval) {
+      return false;
+    }
+    neighbour.lastSentTs = millis();
+    return true;
+  }
+  return true;
+}
+
+bool QuackBackpressure::isCongested() const { return mCongested; }
+
+// PRIVATE:
+
+void QuackBackpressure::sendSignal(uint8_t load) {
+  mLastSignalTs = millis();
+  CongestionPayload payload = {
+      .load = load,
+      .congested = static_cast<uint8_t>(mCongested ? 1 : 0),
+  };
+  mSend(reinterpret_cast<const uint8_t *>(&payload), sizeof(CongestionPayload));
+}
@@ -0,0 +1,303 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackChannels.h"
+
+#include <algorithm>
+
+#ifdef ESP8266
+#include "ESP8266WiFi.h"
+#endif
+#ifdef ESP32
+#include "WiFi.h"
+#endif
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::ChannelAnnouncePayload;
+using QuackMeshTypes::Message;
+using QuackMeshTypes::NeighbourChannel;
+
+// PUBLIC:
+
+void QuackChannels::enableMultiChannel(const uint8_t *channels,
+                                       size_t channelCount,
+                                       u_long announceInterval) {
+  mMultiChannel = true;
+  mChannels.assign(channels, channels + channelCount);
+  mAnnounceInterval = announceInterval;
+  if (!mHomeChannelFixed) {
+    mHomeChannel = mChannels.front();
+  }
+}
+
+void QuackChannels::setHomeChannel(uint8_t channel) {
+  mHomeChannelFixed = true;
+  mHomeChannelAssigned = true;
+  mHomeChannel = channel;
+}
+
+void QuackChannels::enableDiscovery(u_long announceInterval,
+                                    u_long lostTimeout) {
+  mDiscovery = true;
+  mAnnounceInterval = announceInterval;
+  mLostTimeout = lostTimeout;
+  // Stay long enough on each channel to hear at least one announcement
+  mScanDwellTime = announceInterval + announceInterval / 2;
+}
+
+void QuackChannels::begin(const uint8_t ownAddress[6],
+                          AnnounceCallback announce,
+                          SwitchCallback switchChannel) {
+  memcpy(mOwnAddress, ownAddress, 6);
+  mAnnounce = announce;
+  mSwitchChannel = switchChannel;
+
+  if (mMultiChannel) {
+    mStartedTs = millis();
+    mLastAnnounceTs = millis();
+    sendAnnouncement();
+  } else if (mDiscovery && !WiFi.isConnected()) {
+    startScan(false);
+  }
+}
+
+void QuackChannels::update() {
+  if (mMultiChannel) {
+    updateMultiChannel();
+  } else if (mDiscovery) {
+    updateDiscovery();
+  }
+}
+
+void QuackChannels::onMessageReceived(const uint8_t neighbour[6],
+                                      const Message &message) {
+  if (message.len < sizeof(ChannelAnnouncePayload)) {
+    return;
+  }
+  ChannelAnnouncePayload payload;
+  memcpy(&payload, message.data, sizeof(ChannelAnnouncePayload));
+
+  // Neighbouring channels overlap, so only the announced channel counts
+  if (mDiscovery && !mMultiChannel && !WiFi.isConnected()) {
+    if (mScanning) {
+      // The part of the mesh left behind still announces the lost round
+      if (mScanForNewerRound &&
+          (!payload.hasSource ||
+           (mSourceKnown &&
+            static_cast<int16_t>(payload.epoch - mEpoch) <= 0))) {
+        return;
+      }
+      FDEBUG(DEBUG_LEVEL_DEBUG,
+             "QuackChannels::onMessageReceived, mesh on channel %d\n",
+             payload.homeChannel);
+      mScanning = false;
+      mSourceKnown = payload.hasSource != 0;
+      mEpoch = payload.epoch;
+      switchHomeChannel(payload.homeChannel);
+      mLastMeshHeardTs = millis();
+      mLastAnnounceTs = millis();
+      sendAnnouncement();
+    } else if (payload.homeChannel == mHomeChannel) {
+      // A part of the mesh that lost the AP channel keeps the old round
+      if (payload.hasSource &&
+          (!mSourceKnown || static_cast<int16_t>(payload.epoch - mEpoch) > 0)) {
+        mSourceKnown = true;
+        mEpoch = payload.epoch;
+        mLastMeshHeardTs = millis();
+      } else if (!mSourceKnown) {
+        mLastMeshHeardTs = millis();
+      }
+    }
+  }
+
+  if (mMultiChannel) {
+    auto it = std::find_if(mNeighbourChannels.begin(), mNeighbourChannels.end(),
+                           [&](const NeighbourChannel &entry) {
+                             return isAddressMatching(entry.address, neighbour);
+                           });
+    if (it == mNeighbourChannels.end()) {
+      if (mNeighbourChannels.size() >= mMaxNeighbourChannels) {
+        mNeighbourChannels.erase(mNeighbourChannels.begin());
+      }
+      NeighbourChannel newNeighbour = {};
+      memcpy(newNeighbour.address, neighbour, 6);
+      mNeighbourChannels.push_back(newNeighbour);
+      it = mNeighbourChannels.end() - 1;
+    }
+    it->channel = payload.homeChannel;
+    it->lastSeenTs = millis();
+  }
+}
+
+void QuackChannels::onMeshHeard() {
+  // Once a device on an AP channel is known only its announcements count
+  if (!mScanning && !mSourceKnown) {
+    mLastMeshHeardTs = millis();
+  }
+}
+
+bool QuackChannels::isMultiChannel() const { return mMultiChannel; }
+
+bool QuackChannels::isScanning() const { return mScanning; }
+
+uint8_t QuackChannels::getHomeChannel() const { return mHomeChannel; }
+
+uint8_t QuackChannels::getChannelForNextHop(const uint8_t nextHop[6]) const {
+  for (const NeighbourChannel &neighbour : mNeighbourChannels) {
+    if (isAddressMatching(neighbour.address, nextHop)) {
+      return neighbour.channel;
+    }
+  }
+  return 0;
+}
+
+std::vector<uint8_t> QuackChannels::getBroadcastChannels() const {
+  std::vector<uint8_t> channels = {mHomeChannel};
+  for (const NeighbourChannel &neighbour : mNeighbourChannels) {
+    if (std::find(channels.begin(), channels.end(), neighbour.channel) ==
+        channels.end()) {
+      channels.push_back(neighbour.channel);
+    }
+  }
+  return channels;
+}
+
+// PRIVATE:
+
+void QuackChannels::updateMultiChannel() {
+  auto it = mNeighbourChannels.begin();
+  while (it != mNeighbourChannels.end()) {
+    if (millis() - it->lastSeenTs > 3 * mAnnounceInterval) {
+      it = mNeighbourChannels.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  // Pick the least used channel once the neighbours had time to announce
+  if (!mHomeChannelAssigned && millis() - mStartedTs >= 3 * mAnnounceInterval) {
+    size_t offset = mOwnAddress[5] % mChannels.size();
+    uint8_t bestChannel = mChannels[offset];
+    size_t bestUsage = SIZE_MAX;
+    for (size_t i = 0; i < mChannels.size(); i++) {
+      uint8_t channel = mChannels[(offset + i) % mChannels.size()];
+      size_t usage = 0;
+      for (const NeighbourChannel &neighbour : mNeighbourChannels) {
+        if (neighbour.channel == channel) {
+          usage++;
+        }
+      }
+      if (usage < bestUsage) {
+        bestUsage = usage;
+        bestChannel = channel;
+      }
+    }
+    FDEBUG(DEBUG_LEVEL_DEBUG,
+           "QuackChannels::updateMultiChannel, home channel %d\n", bestChannel);
+    mHomeChannelAssigned = true;
+    switchHomeChannel(bestChannel);
+    mLastAnnounceTs = millis();
+    sendAnnouncement();
+  }
+
+  if (millis() - mLastAnnounceTs >= mAnnounceInterval) {
+    mLastAnnounceTs = millis();
+    sendAnnouncement();
+  }
+}
+
+void QuackChannels::updateDiscovery() {
+  if (WiFi.isConnected()) {
+    // The station pins the radio to the channel of the access point
+    mSourceKnown = true;
+    uint8_t apChannel = WiFi.channel();
+    if (apChannel != mHomeChannel) {
+      FDEBUG(DEBUG_LEVEL_DEBUG,
+             "QuackChannels::updateDiscovery, access point channel %d\n",
+             apChannel);
+      mScanning = false;
+      switchHomeChannel(apChannel);
+      mLastAnnounceTs = 0;
+    }
+    mLastMeshHeardTs = millis();
+    if (millis() - mLastAnnounceTs >= mAnnounceInterval) {
+      mEpoch++;
+    }
+  } else if (mScanning) {
+    if (millis() - mScanChannelTs < mScanDwellTime) {
+      return;
+    }
+    mScannedChannels++;
+    if (mScannedChannels >= mScanChannelCount) {
+      // Nobody answered, so this device seeds the mesh on its last channel
+      DEBUG(DEBUG_LEVEL_DEBUG,
+            "QuackChannels::updateDiscovery, nothing found\n");
+      mScanning = false;
+      mSourceKnown = false;
+      switchHomeChannel(mScanStartChannel);
+      mLastMeshHeardTs = millis();
+      mLastAnnounceTs = millis();
+      sendAnnouncement();
+    } else {
+      uint8_t channel = mHomeChannel % mScanChannelCount + 1;
+      switchHomeChannel(channel);
+      mScanChannelTs = millis();
+    }
+    return;
+  } else if (millis() - mLastMeshHeardTs >= mLostTimeout) {
+    DEBUG(DEBUG_LEVEL_DEBUG, "QuackChannels::updateDiscovery, mesh lost\n");
+    startScan(true);
+    return;
+  }
+
+  if (millis() - mLastAnnounceTs >= mAnnounceInterval) {
+    mLastAnnounceTs = millis();
+    sendAnnouncement();
+  }
+}
+
+void QuackChannels::startScan(bool newerRoundOnly) {
+  uint8_t channel = mHomeChannel;
+  if (channel == 0) {
+    channel = WiFi.channel();
+  }
+  if (channel == 0 || channel > mScanChannelCount) {
+    channel = 1;
+  }
+  mScanning = true;
+  mScanForNewerRound = newerRoundOnly;
+  mScanStartChannel = channel;
+  mScannedChannels = 0;
+  mScanChannelTs = millis();
+  switchHomeChannel(channel);
+}
+
+void QuackChannels::switchHomeChannel(uint8_t channel) {
+  mHomeChannel = channel;
+  mSwitchChannel(channel);
+}
+
+void QuackChannels::sendAnnouncement() {
+  ChannelAnnouncePayload payload = {
+      .homeChannel = mHomeChannel,
+      .hasSource = static_cast<uint8_t>(mSourceKnown ? 1 : 0),
+      .epoch = mEpoch,
+  };
+
+  // Neighbours may listen on any of the channels, so announce on all of them
+  std::vector<uint8_t> channels =
+      mMultiChannel ? mChannels : std::vector<uint8_t>{0};
+  for (uint8_t channel : channels) {
+    mAnnounce(reinterpret_cast<const uint8_t *>(&payload),
+              sizeof(ChannelAnnouncePayload), channel);
+  }
+}
@@ -0,0 +1,334 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackCodedBroadcast.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+#include "QuackFec.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::CODED_PACKET_SIZE;
+using QuackMeshTypes::CodedGeneration;
+using QuackMeshTypes::CodedHeader;
+using QuackMeshTypes::MAX_CODED_PACKETS;
+using QuackMeshTypes::Message;
+
+// PUBLIC:
+
+void QuackCodedBroadcast::configure(u_long minInterval, u_long maxInterval) {
+  mMinStatusInterval = minInterval;
+  mMaxStatusInterval = maxInterval;
+}
+
+void QuackCodedBroadcast::begin(const uint8_t ownAddress[6],
+                                SendCallback send) {
+  memcpy(mOwnAddress, ownAddress, 6);
+  mSend = send;
+  // A restarted node must not reuse the numbers it had before
+  mNextGeneration = random(0x10000);
+}
+
+void QuackCodedBroadcast::update(bool sendingPossible) {
+  u_long now = millis();
+
+  auto it = mGenerations.begin();
+  while (it != mGenerations.end()) {
+    if (now - it->lastChangeTs >= mGenerationTimeout) {
+      it = mGenerations.erase(it);
+      continue;
+    }
+    u_long elapsed = now - it->intervalStartTs;
+    if (!it->statusSent && elapsed >= it->statusDelay) {
+      it->statusSent = true;
+      if (it->consistentStatus < mStatusRedundancy) {
+        sendStatus(*it);
+      }
+    }
+    if (elapsed >= it->statusInterval) {
+      // A node that still misses data keeps asking at the shortest interval
+      if (it->rank == it->packets) {
+        it->statusInterval =
+            std::min(it->statusInterval * 2, mMaxStatusInterval);
+      }
+      scheduleStatus(*it);
+    }
+    it++;
+  }
+
+  if (!sendingPossible) {
+    return;
+  }
+  for (CodedGeneration &generation : mGenerations) {
+    if (generation.rank == 0 ||
+        (generation.forwardCredit == 0 && generation.repairCredit == 0)) {
+      continue;
+    }
+    if (generation.forwardCredit > 0) {
+      generation.forwardCredit--;
+    } else {
+      generation.repairCredit--;
+    }
+    sendCombination(generation);
+    return;
+  }
+}
+
+void QuackCodedBroadcast::onMessageReceived(const Message &message) {
+  if (message.len < sizeof(CodedHeader)) {
+    return;
+  }
+  CodedHeader header;
+  memcpy(&header, message.data, sizeof(CodedHeader));
+  if (header.packets == 0 || header.packets > MAX_CODED_PACKETS ||
+      header.rank > header.packets || header.length == 0 ||
+      (header.length + CODED_PACKET_SIZE - 1) / CODED_PACKET_SIZE !=
+          header.packets) {
+    return;
+  }
+  CodedGeneration *generation = getGeneration(header);
+  if (generation == nullptr) {
+    return;
+  }
+
+  size_t rowLength = getRowLength(*generation);
+  bool hasData = message.len >= sizeof(CodedHeader) + rowLength;
+  uint8_t rank = generation->rank;
+  if (hasData) {
+    // A neighbour that knows as much serves the others as well
+    if (header.rank >= rank && generation->repairCredit > 0) {
+      generation->repairCredit--;
+    }
+    uint8_t row[MAX_CODED_PACKETS + CODED_PACKET_SIZE];
+    memcpy(row, message.data + sizeof(CodedHeader), rowLength);
+    if (addCombination(*generation, row)) {
+      generation->forwardCredit++;
+      generation->lastChangeTs = millis();
+      if (generation->rank == generation->packets && !generation->delivered) {
+        deliver(*generation);
+      }
+    }
+  } else if (header.rank < rank) {
+    // Only announcements ask for repairs, combinations of a neighbour with
+    // a lower rank are its own forwarding
+    generation->repairCredit =
+        std::max<uint8_t>(generation->repairCredit, rank - header.rank);
+    generation->lastChangeTs = millis();
+  }
+
+  if (header.rank == generation->rank) {
+    generation->consistentStatus++;
+  } else {
+    resetStatus(*generation);
+  }
+}
+
+int QuackCodedBroadcast::broadcast(const uint8_t *data, size_t dataLength) {
+  if (dataLength == 0 ||
+      dataLength > QuackMeshTypes::MAX_RELIABLE_BROADCAST_LENGTH) {
+    return -1;
+  }
+  CodedHeader header = {
+      .source = {},
+      .generation = mNextGeneration++,
+      .length = static_cast<uint16_t>(dataLength),
+      .packets = static_cast<uint8_t>((dataLength + CODED_PACKET_SIZE - 1) /
+                                      CODED_PACKET_SIZE),
+      .rank = 0};
+  memcpy(header.source, mOwnAddress, 6);
+  header.rank = header.packets;
+  CodedGeneration *generation = getGeneration(header);
+  if (generation == nullptr) {
+    return -1;
+  }
+
+  // The source holds the packets themselves, the rows of the identity
+  size_t rowLength = getRowLength(*generation);
+  for (uint8_t i = 0; i < generation->packets; i++) {
+    uint8_t *row = &generation->rows[i * rowLength];
+    row[i] = 1;
+    size_t offset = i * CODED_PACKET_SIZE;
+    memcpy(row + generation->packets, data + offset,
+           std::min(CODED_PACKET_SIZE, dataLength - offset));
+  }
+  generation->rank = generation->packets;
+  generation->pivots = (1UL << generation->packets) - 1;
+  generation->delivered = true;
+  generation->forwardCredit = generation->packets;
+  resetStatus(*generation);
+  return 0;
+}
+
+void QuackCodedBroadcast::setOnDataCallback(
+    QuackMeshTypes::OnReliableBroadcastCallback callback) {
+  mOnDataCallback = callback;
+}
+
+// PRIVATE:
+
+CodedGeneration *QuackCodedBroadcast::getGeneration(const CodedHeader &header) {
+  for (auto it = mGenerations.begin(); it != mGenerations.end(); it++) {
+    if (!isAddressMatching(it->source, header.source)) {
+      continue;
+    }
+    if (it->generation == header.generation) {
+      if (it->packets != header.packets || it->length != header.length) {
+        return nullptr;
+      }
+      return &*it;
+    }
+    // A newer broadcast of the same source replaces the old one
+    if (static_cast<int16_t>(header.generation - it->generation) < 0) {
+      return nullptr;
+    }
+    mGenerations.erase(it);
+    break;
+  }
+
+  // Only a neighbour that holds some of the data starts a generation
+  if (header.rank == 0) {
+    return nullptr;
+  }
+  if (mGenerations.size() >= mMaxGenerations) {
+    mGenerations.erase(std::min_element(
+        mGenerations.begin(), mGenerations.end(),
+        [](const CodedGeneration &a, const CodedGeneration &b) {
+          return a.lastChangeTs < b.lastChangeTs;
+        }));
+  }
+  CodedGeneration generation = {.source = {},
+                                .generation = header.generation,
+                                .length = header.length,
+                                .packets = header.packets,
+                                .rank = 0,
+                                .pivots = 0,
+                                .rows = {},
+                                .delivered = false,
+                                .forwardCredit = 0,
+                                .repairCredit = 0,
+                                .lastChangeTs = millis(),
+                                .statusInterval = mMinStatusInterval,
+                                .intervalStartTs = 0,
+                                .statusDelay = 0,
+                                .statusSent = false,
+                                .consistentStatus = 0};
+  memcpy(generation.source, header.source, 6);
+  generation.rows.assign(header.packets * getRowLength(generation), 0);
+  scheduleStatus(generation);
+  mGenerations.push_back(generation);
+  return &mGenerations.back();
+}
+
+bool QuackCodedBroadcast::addCombination(CodedGeneration &generation,
+                                         uint8_t *row) {
+  size_t rowLength = getRowLength(generation);
+  for (uint8_t column = 0; column < generation.packets; column++) {
+    if ((generation.pivots >> column & 1) && row[column] != 0) {
+      QuackMeshFec::addScaled(row, &generation.rows[column * rowLength],
+                              row[column], rowLength);
+    }
+  }
+  uint8_t pivot = 0;
+  while (pivot < generation.packets && row[pivot] == 0) {
+    pivot++;
+  }
+  if (pivot == generation.packets) {
+    return false;
+  }
+
+  // The new row gets a leading 1 that is removed from all other rows
+  QuackMeshFec::scale(row, QuackMeshFec::invert(row[pivot]), rowLength);
+  for (uint8_t column = 0; column < generation.packets; column++) {
+    uint8_t *other = &generation.rows[column * rowLength];
+    if ((generation.pivots >> column & 1) && other[pivot] != 0) {
+      QuackMeshFec::addScaled(other, row, other[pivot], rowLength);
+    }
+  }
+  memcpy(&generation.rows[pivot * rowLength], row, rowLength);
+  generation.pivots |= 1 << pivot;
+  generation.rank++;
+  return true;
+}
+
+void QuackCodedBroadcast::deliver(CodedGeneration &generation) {
+  generation.delivered = true;
+  if (!mOnDataCallback) {
+    return;
+  }
+  // With full rank the rows are the identity, their data are the packets
+  size_t rowLength = getRowLength(generation);
+  std::vector<uint8_t> data(generation.length);
+  for (uint8_t i = 0; i < generation.packets; i++) {
+    size_t offset = i * CODED_PACKET_SIZE;
+    memcpy(data.data() + offset,
+           &generation.rows[i * rowLength + generation.packets],
+           std::min<size_t>(CODED_PACKET_SIZE, generation.length - offset));
+  }
+  FDEBUG(DEBUG_LEVEL_DEBUG, "QuackCodedBroadcast, generation %d decoded\n",
+         generation.generation);
+  mOnDataCallback(generation.source, data.data(), data.size());
+}
+
+void QuackCodedBroadcast::resetStatus(CodedGeneration &generation) {
+  if (generation.statusInterval == mMinStatusInterval &&
+      !generation.statusSent) {
+    return;
+  }
+  generation.statusInterval = mMinStatusInterval;
+  scheduleStatus(generation);
+}
+
+void QuackCodedBroadcast::scheduleStatus(CodedGeneration &generation) {
+  generation.intervalStartTs = millis();
+  generation.statusDelay = generation.statusInterval / 2 +
+                           random(generation.statusInterval / 2 + 1);
+  generation.statusSent = false;
+  generation.consistentStatus = 0;
+}
+
+void QuackCodedBroadcast::sendCombination(CodedGeneration &generation) {
+  uint8_t payload[sizeof(Message::data)];
+  fillHeader(generation, payload);
+
+  size_t rowLength = getRowLength(generation);
+  uint8_t *row = payload + sizeof(CodedHeader);
+  memset(row, 0, rowLength);
+  for (uint8_t column = 0; column < generation.packets; column++) {
+    if (generation.pivots >> column & 1) {
+      QuackMeshFec::addScaled(row, &generation.rows[column * rowLength],
+                              1 + random(255), rowLength);
+    }
+  }
+  // The combination carries the rank, no announcement is needed as well
+  generation.statusSent = true;
+  mSend(payload, sizeof(CodedHeader) + rowLength);
+}
+
+void QuackCodedBroadcast::sendStatus(const CodedGeneration &generation) {
+  uint8_t payload[sizeof(CodedHeader)];
+  fillHeader(generation, payload);
+  mSend(payload, sizeof(CodedHeader));
+}
+
+void QuackCodedBroadcast::fillHeader(const CodedGeneration &generation,
+                                     uint8_t *payload) const {
+  CodedHeader header = {.source = {},
+                        .generation = generation.generation,
+                        .length = generation.length,
+                        .packets = generation.packets,
+                        .rank = generation.rank};
+  memcpy(header.source, generation.source, 6);
+  memcpy(payload, &header, sizeof(CodedHeader));
+}
+
+size_t QuackCodedBroadcast::getRowLength(const CodedGeneration &generation) {
+  return generation.packets + CODED_PACKET_SIZE;
+}
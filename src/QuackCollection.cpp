@@ -0,0 +1,340 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackCollection.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::CollectionBeaconPayload;
+using QuackMeshTypes::CollectionHeader;
+using QuackMeshTypes::CollectionNeighbour;
+using QuackMeshTypes::EnqueuedMessage;
+using QuackMeshTypes::Message;
+
+// PUBLIC:
+
+void QuackCollection::configure(bool root, u_long minBeaconInterval,
+                                u_long maxBeaconInterval) {
+  mRoot = root;
+  mMinBeaconInterval = minBeaconInterval;
+  mMaxBeaconInterval = maxBeaconInterval;
+  mBeaconInterval = minBeaconInterval;
+}
+
+void QuackCollection::setForwarding(bool forwarding) {
+  mForwarding = forwarding;
+}
+
+void QuackCollection::begin(const uint8_t ownAddress[6],
+                            BeaconCallback sendBeacon, ForwardCallback forward,
+                            DeliverCallback deliver) {
+  memcpy(mOwnAddress, ownAddress, 6);
+  mSendBeacon = sendBeacon;
+  mForward = forward;
+  mDeliver = deliver;
+
+  updateRoute();
+  resetBeacons();
+}
+
+void QuackCollection::update(bool congested) {
+  // The parent going silent is noticed earlier by the failed data
+  auto it = mNeighbours.begin();
+  bool expired = false;
+  while (it != mNeighbours.end()) {
+    if (millis() - it->lastSeenTs > 3 * mMaxBeaconInterval) {
+      it = mNeighbours.erase(it);
+      expired = true;
+    } else {
+      it++;
+    }
+  }
+  if (expired) {
+    updateRoute();
+  }
+
+  u_long elapsed = millis() - mIntervalStartTs;
+  if (!mBeaconSent && elapsed >= mBeaconDelay) {
+    mBeaconSent = true;
+    // Devices that do not forward only beacon to ask for a route
+    if (getAdvertisedCost() != QuackMeshTypes::NO_COLLECTION_ROUTE ||
+        mCost == QuackMeshTypes::NO_COLLECTION_ROUTE) {
+      sendBeacon(congested);
+    }
+  }
+  if (elapsed >= mBeaconInterval) {
+    mBeaconInterval = std::min(2 * mBeaconInterval, mMaxBeaconInterval);
+    scheduleBeacon();
+  }
+}
+
+void QuackCollection::onMessageReceived(const uint8_t neighbour[6],
+                                        const Message &message) {
+  if (message.len < sizeof(CollectionBeaconPayload)) {
+    return;
+  }
+  CollectionBeaconPayload payload;
+  memcpy(&payload, message.data, sizeof(CollectionBeaconPayload));
+
+  // A neighbour without a route gets the beacons right away
+  if ((payload.flags & QuackMeshTypes::COLLECTION_FLAG_PULL) &&
+      getAdvertisedCost() != QuackMeshTypes::NO_COLLECTION_ROUTE) {
+    resetBeacons();
+  }
+
+  CollectionNeighbour *entry = findNeighbour(neighbour);
+  if (entry == nullptr) {
+    if (payload.cost == QuackMeshTypes::NO_COLLECTION_ROUTE) {
+      return;
+    }
+    // The neighbour with the highest cost makes room, never the parent
+    if (mNeighbours.size() >= mMaxNeighbours) {
+      auto worst = mNeighbours.end();
+      for (auto it = mNeighbours.begin(); it != mNeighbours.end(); it++) {
+        if (mCost != QuackMeshTypes::NO_COLLECTION_ROUTE &&
+            isAddressMatching(it->address, mParent)) {
+          continue;
+        }
+        if (worst == mNeighbours.end() ||
+            it->cost + it->linkEtx > worst->cost + worst->linkEtx) {
+          worst = it;
+        }
+      }
+      if (worst == mNeighbours.end()) {
+        return;
+      }
+      mNeighbours.erase(worst);
+    }
+    // A new link is assumed to need two transmissions until measured
+    CollectionNeighbour newNeighbour = {};
+    memcpy(newNeighbour.address, neighbour, 6);
+    newNeighbour.linkEtx = 20;
+    mNeighbours.push_back(newNeighbour);
+    entry = &mNeighbours.back();
+  } else {
+    // Every lost beacon counts as another transmission
+    uint8_t lost = payload.sequence - entry->sequence - 1;
+    addLinkEtxSample(*entry, std::min(10 * (lost + 1), 50));
+  }
+  memcpy(entry->parent, payload.parent, 6);
+  entry->cost = payload.cost;
+  entry->sequence = payload.sequence;
+  entry->congested =
+      (payload.flags & QuackMeshTypes::COLLECTION_FLAG_CONGESTED) != 0;
+  entry->lastSeenTs = millis();
+
+  updateRoute();
+}
+
+bool QuackCollection::prepareForwarding(Message &message) {
+  CollectionHeader header;
+  memcpy(&header, message.data, sizeof(CollectionHeader));
+  if (header.timeHasLived >= mMaxHops) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackCollection, collection data too old\n");
+    return false;
+  }
+  // The cost decreases towards the root, a child that is not further away
+  // has an outdated route, which the beacons repair
+  if (header.cost <= mCost) {
+    DEBUG(DEBUG_LEVEL_DEBUG, "QuackCollection, collection loop detected\n");
+    resetBeacons();
+  }
+
+  header.timeHasLived++;
+  memcpy(message.data, &header, sizeof(CollectionHeader));
+  return true;
+}
+
+void QuackCollection::routeMessage(const Message &message, uint8_t retries) {
+  if (mRoot) {
+    mDeliver(message);
+    return;
+  }
+  if (mCost == QuackMeshTypes::NO_COLLECTION_ROUTE) {
+    if (mBacklog.size() >= mMaxBacklog) {
+      DEBUG(DEBUG_LEVEL_WARN,
+            "QuackCollection::routeMessage, no parent, dropping oldest\n");
+      mBacklog.pop_front();
+    }
+    mBacklog.push_back(message);
+    return;
+  }
+
+  // Every hop puts in its own cost, the parent uses it to detect loops
+  Message collectionMessage = message;
+  CollectionHeader header;
+  memcpy(&header, collectionMessage.data, sizeof(CollectionHeader));
+  header.cost = mCost;
+  memcpy(collectionMessage.data, &header, sizeof(CollectionHeader));
+  mForward(collectionMessage, mParent, retries);
+}
+
+void QuackCollection::onMessageSent(const EnqueuedMessage &message,
+                                    bool success) {
+  // The data doubles as a probe of the link to the parent
+  CollectionNeighbour *neighbour = findNeighbour(message.nextHop);
+  if (neighbour != nullptr) {
+    addLinkEtxSample(*neighbour, success ? 10 : 50);
+    updateRoute();
+  }
+  if (success) {
+    return;
+  }
+  if (message.retries >= mRetries) {
+    DEBUG(DEBUG_LEVEL_WARN,
+          "QuackCollection::onMessageSent, parent unreachable\n");
+    return;
+  }
+  routeMessage(message.message, message.retries + 1);
+}
+
+void QuackCollection::setNeighbourCongested(const uint8_t neighbour[6],
+                                            bool congested) {
+  CollectionNeighbour *entry = findNeighbour(neighbour);
+  if (entry != nullptr && entry->congested != congested) {
+    entry->congested = congested;
+    updateRoute();
+  }
+}
+
+uint16_t QuackCollection::getCost() const { return mCost; }
+
+bool QuackCollection::isRoot() const { return mRoot; }
+
+// PRIVATE:
+
+void QuackCollection::resetBeacons() {
+  if (mBeaconInterval == mMinBeaconInterval && !mBeaconSent) {
+    return;
+  }
+  mBeaconInterval = mMinBeaconInterval;
+  scheduleBeacon();
+}
+
+void QuackCollection::scheduleBeacon() {
+  // A random time in the second half keeps neighbours from colliding
+  mIntervalStartTs = millis();
+  mBeaconDelay = mBeaconInterval / 2 + random(mBeaconInterval / 2 + 1);
+  mBeaconSent = false;
+}
+
+void QuackCollection::sendBeacon(bool congested) {
+  CollectionBeaconPayload payload = {
+      .cost = getAdvertisedCost(),
+      .parent = {},
+      .sequence = ++mBeaconSequence,
+      .flags = static_cast<uint8_t>(
+          (mCost == QuackMeshTypes::NO_COLLECTION_ROUTE
+               ? QuackMeshTypes::COLLECTION_FLAG_PULL
+               : 0) |
+          (congested ? QuackMeshTypes::COLLECTION_FLAG_CONGESTED : 0)),
+  };
+  memcpy(payload.parent, mParent, 6);
+  mSendBeacon(reinterpret_cast<const uint8_t *>(&payload),
+              sizeof(CollectionBeaconPayload));
+}
+
+uint16_t QuackCollection::getAdvertisedCost() const {
+  // A device that does not forward data is only a parent as the root
+  if (mForwarding) {
+    return mCost;
+  }
+  return mRoot ? 0 : QuackMeshTypes::NO_COLLECTION_ROUTE;
+}
+
+CollectionNeighbour *QuackCollection::findNeighbour(const uint8_t address[6]) {
+  for (CollectionNeighbour &neighbour : mNeighbours) {
+    if (isAddressMatching(neighbour.address, address)) {
+      return &neighbour;
+    }
+  }
+  return nullptr;
+}
+
+void QuackCollection::addLinkEtxSample(CollectionNeighbour &neighbour,
+                                       uint16_t sample) {
+  neighbour.linkEtx = (3 * neighbour.linkEtx + sample) / 4;
+}
+
+void QuackCollection::updateRoute() {
+  if (mRoot) {
+    mCost = 0;
+    return;
+  }
+
+  // Neighbours routing through this device would form a loop
+  auto getPathCost = [this](const CollectionNeighbour &neighbour) -> uint32_t {
+    if (neighbour.cost == QuackMeshTypes::NO_COLLECTION_ROUTE ||
+        neighbour.linkEtx > mMaxLinkEtx ||
+        isAddressMatching(neighbour.parent, mOwnAddress)) {
+      return QuackMeshTypes::NO_COLLECTION_ROUTE;
+    }
+    return std::min<uint32_t>(neighbour.cost + neighbour.linkEtx,
+                              QuackMeshTypes::NO_COLLECTION_ROUTE - 1);
+  };
+
+  // A congested neighbour is only chosen if the others are clearly worse,
+  // the penalty is not part of the advertised cost
+  auto getChoiceCost = [&](const CollectionNeighbour &neighbour) -> uint32_t {
+    uint32_t cost = getPathCost(neighbour);
+    if (cost != QuackMeshTypes::NO_COLLECTION_ROUTE && neighbour.congested) {
+      cost += mCongestionPenalty;
+    }
+    return cost;
+  };
+
+  CollectionNeighbour *parent = mCost != QuackMeshTypes::NO_COLLECTION_ROUTE
+                                    ? findNeighbour(mParent)
+                                    : nullptr;
+  uint32_t parentCost = parent != nullptr ? getPathCost(*parent)
+                                          : QuackMeshTypes::NO_COLLECTION_ROUTE;
+  uint32_t parentChoiceCost = parent != nullptr
+                                  ? getChoiceCost(*parent)
+                                  : QuackMeshTypes::NO_COLLECTION_ROUTE;
+
+  CollectionNeighbour *best = nullptr;
+  uint32_t bestCost = QuackMeshTypes::NO_COLLECTION_ROUTE;
+  for (CollectionNeighbour &neighbour : mNeighbours) {
+    uint32_t cost = getChoiceCost(neighbour);
+    if (cost < bestCost) {
+      bestCost = cost;
+      best = &neighbour;
+    }
+  }
+
+  // The hysteresis keeps similar parents from taking turns
+  if (best != nullptr && best != parent &&
+      (parentCost == QuackMeshTypes::NO_COLLECTION_ROUTE ||
+       bestCost + mParentSwitchThreshold < parentChoiceCost)) {
+    DEBUG(DEBUG_LEVEL_DEBUG, "QuackCollection::updateRoute, new parent\n");
+    memcpy(mParent, best->address, 6);
+    parentCost = getPathCost(*best);
+  }
+
+  uint16_t oldCost = mCost;
+  mCost = static_cast<uint16_t>(parentCost);
+
+  // A found or lost route and big changes are announced right away
+  bool hadRoute = oldCost != QuackMeshTypes::NO_COLLECTION_ROUTE;
+  bool hasRoute = mCost != QuackMeshTypes::NO_COLLECTION_ROUTE;
+  if (hadRoute != hasRoute ||
+      (hasRoute && abs(static_cast<int32_t>(mCost) - oldCost) >
+                       mParentSwitchThreshold)) {
+    resetBeacons();
+  }
+
+  while (hasRoute && !mBacklog.empty()) {
+    routeMessage(mBacklog.front(), 0);
+    mBacklog.pop_front();
+  }
+}
@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include <Arduino.h>
+
+// The layer is optional, without C++20 coroutines nothing is built
+#if defined(__cpp_impl_coroutine)
+
+#include "QuackCoroutines.h"
+
+#include "QuackDebug.h"
+
+using QuackMeshCoroutines::DelayAwaiter;
+using QuackMeshCoroutines::RpcAwaiter;
+using QuackMeshCoroutines::SendAwaiter;
+using QuackMeshCoroutines::SleepingCoroutine;
+
+namespace {
+
+// The frames of the coroutines, handed out by allocateFrame()
+alignas(std::max_align_t) uint8_t
+    gFrames[QUACK_COROUTINE_FRAMES][QUACK_COROUTINE_FRAME_SIZE];
+bool gFrameUsed[QUACK_COROUTINE_FRAMES] = {};
+
+}  // namespace
+
+void *QuackMeshCoroutines::allocateFrame(size_t size) noexcept {
+  if (size > QUACK_COROUTINE_FRAME_SIZE) {
+    FDEBUG(DEBUG_LEVEL_WARN, "QuackCoroutines, frame of %d bytes too big\n",
+           size);
+    return nullptr;
+  }
+  for (size_t i = 0; i < QUACK_COROUTINE_FRAMES; i++) {
+    if (!gFrameUsed[i]) {
+      gFrameUsed[i] = true;
+      return gFrames[i];
+    }
+  }
+  DEBUG(DEBUG_LEVEL_WARN, "QuackCoroutines, no frame left\n");
+  return nullptr;
+}
+
+void QuackMeshCoroutines::freeFrame(void *frame) noexcept {
+  for (size_t i = 0; i < QUACK_COROUTINE_FRAMES; i++) {
+    if (frame == gFrames[i]) {
+      gFrameUsed[i] = false;
+      return;
+    }
+  }
+}
+
+size_t QuackMeshCoroutines::getFreeFrames() {
+  size_t free = 0;
+  for (size_t i = 0; i < QUACK_COROUTINE_FRAMES; i++) {
+    if (!gFrameUsed[i]) {
+      free++;
+    }
+  }
+  return free;
+}
+
+SendAwaiter::SendAwaiter(QuackMeshDevice &device, uint8_t destination[6],
+                         uint8_t *data, size_t dataLength)
+    : mDevice(device),
+      mDestination(destination),
+      mData(data),
+      mDataLength(dataLength) {}
+
+bool SendAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  // The message is copied, the buffers may change once the coroutine resumes
+  int queued = mDevice.sendConfirmedMessage(
+      mData, mDataLength, mDestination, [this, handle](int status) {
+        mStatus = status;
+        handle.resume();
+      });
+  return queued == 0;
+}
+
+RpcAwaiter::RpcAwaiter(QuackMeshDevice &device, uint8_t destination[6],
+                       uint16_t method, const uint8_t *request,
+                       size_t requestLength, u_long timeout)
+    : mDevice(device),
+      mDestination(destination),
+      mMethod(method),
+      mRequest(request),
+      mRequestLength(requestLength),
+      mTimeout(timeout) {
+  mResult.status = QuackMeshTypes::RPC_NOT_QUEUED;
+}
+
+bool RpcAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  int queued = mDevice.callRpc(
+      mDestination, mMethod, mRequest, mRequestLength,
+      [this, handle](int8_t status, const uint8_t *response,
+                     size_t responseLength) {
+        mResult.status = status;
+        mResult.length = responseLength;
+        memcpy(mResult.data, response, responseLength);
+        handle.resume();
+      },
+      mTimeout);
+  return queued == 0;
+}
+
+DelayAwaiter::DelayAwaiter(QuackCoroutineMesh &mesh, u_long duration)
+    : mMesh(mesh), mDuration(duration) {}
+
+bool DelayAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  return mMesh.addSleeper(handle, mDuration);
+}
+
+// PUBLIC:
+
+QuackCoroutineMesh::QuackCoroutineMesh(QuackMeshDevice &device)
+    : mDevice(device) {}
+
+void QuackCoroutineMesh::update() {
+  for (SleepingCoroutine &sleeper : mSleepers) {
+    if (!sleeper.handle || millis() - sleeper.startTs < sleeper.duration) {
+      continue;
+    }
+    // The slot is freed first, the coroutine may start another delay
+    std::coroutine_handle<> handle = sleeper.handle;
+    sleeper.handle = nullptr;
+    handle.resume();
+  }
+}
+
+SendAwaiter QuackCoroutineMesh::sendConfirmed(uint8_t destination[6],
+                                              uint8_t *data,
+                                              size_t dataLength) {
+  return SendAwaiter(mDevice, destination, data, dataLength);
+}
+
+RpcAwaiter QuackCoroutineMesh::call(uint8_t destination[6], uint16_t method,
+                                    const uint8_t *request,
+                                    size_t requestLength, u_long timeout) {
+  return RpcAwaiter(mDevice, destination, method, request, requestLength,
+                    timeout);
+}
+
+DelayAwaiter QuackCoroutineMesh::delay(u_long duration) {
+  return DelayAwaiter(*this, duration);
+}
+
+// PRIVATE:
+
+bool QuackCoroutineMesh::addSleeper(std::coroutine_handle<> handle,
+                                    u_long duration) {
+  for (SleepingCoroutine &sleeper : mSleepers) {
+    if (!sleeper.handle) {
+      sleeper = {.handle = handle, .startTs = millis(), .duration = duration};
+      return true;
+    }
+  }
+  DEBUG(DEBUG_LEVEL_WARN, "QuackCoroutineMesh::addSleeper, too many delays\n");
+  return false;
+}
+
+#endif
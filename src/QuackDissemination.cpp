@@ -0,0 +1,385 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackDissemination.h"
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::IMAGE_PACKET_SIZE;
+using QuackMeshTypes::IMAGE_PAGE_SIZE;
+using QuackMeshTypes::ImageDataHeader;
+using QuackMeshTypes::ImageRequestPayload;
+using QuackMeshTypes::ImageSummaryPayload;
+using QuackMeshTypes::Message;
+
+namespace {
+
+// The start value of a CRC-32, the final value is inverted
+constexpr uint32_t CRC32_INITIAL = 0xFFFFFFFF;
+
+// Continue a CRC-32 (IEEE 802.3) over a buffer
+uint32_t updateCrc32(uint32_t crc, const uint8_t *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return crc;
+}
+
+}  // namespace
+
+// PUBLIC:
+
+void QuackDissemination::configure(QuackImageStore *store,
+                                   uint16_t runningVersion,
+                                   u_long minInterval, u_long maxInterval) {
+  mStore = store;
+  mRunningVersion = runningVersion;
+  mMinSummaryInterval = minInterval;
+  mMaxSummaryInterval = maxInterval;
+}
+
+void QuackDissemination::begin(const uint8_t ownAddress[6],
+                               SendCallback send) {
+  memcpy(mOwnAddress, ownAddress, 6);
+  mSend = send;
+  mSummaryInterval = mMinSummaryInterval;
+  scheduleSummary();
+}
+
+void QuackDissemination::update(bool sendingPossible) {
+  u_long now = millis();
+
+  u_long elapsed = now - mSummaryIntervalStartTs;
+  if (!mSummarySent && elapsed >= mSummaryDelay) {
+    mSummarySent = true;
+    if (mConsistentSummaries < mSummaryRedundancy) {
+      sendSummary();
+    }
+  }
+  if (elapsed >= mSummaryInterval) {
+    mSummaryInterval = std::min(mSummaryInterval * 2, mMaxSummaryInterval);
+    scheduleSummary();
+  }
+
+  if (mReceiving && now - mLastPageActivityTs >= mRequestDelay) {
+    if (mRequests >= mMaxRequests) {
+      // The next summary of a neighbour with the page starts it again
+      DEBUG(DEBUG_LEVEL_WARN, "QuackDissemination::update, page dropped\n");
+      mReceiving = false;
+    } else {
+      sendRequest();
+    }
+  }
+
+  if (mRequestedPackets != 0 && sendingPossible) {
+    sendPacket();
+  }
+}
+
+void QuackDissemination::onMessageReceived(const uint8_t srcAddress[6],
+                                           const Message &message) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_IMAGE_SUMMARY) {
+    if (message.len >= sizeof(ImageSummaryPayload)) {
+      ImageSummaryPayload payload;
+      memcpy(&payload, message.data, sizeof(ImageSummaryPayload));
+      handleSummary(srcAddress, payload);
+    }
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_IMAGE_REQUEST) {
+    if (message.len >= sizeof(ImageRequestPayload)) {
+      ImageRequestPayload payload;
+      memcpy(&payload, message.data, sizeof(ImageRequestPayload));
+      handleRequest(payload);
+    }
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_IMAGE_DATA) {
+    handleData(srcAddress, message);
+  }
+}
+
+int QuackDissemination::publishImage(uint16_t version, size_t size) {
+  if (mStore == nullptr || size == 0 ||
+      static_cast<int16_t>(version - getVersion()) <= 0) {
+    return -1;
+  }
+  uint32_t crc = CRC32_INITIAL;
+  for (size_t offset = 0; offset < size; offset += IMAGE_PACKET_SIZE) {
+    size_t length = std::min(IMAGE_PACKET_SIZE, size - offset);
+    if (mStore->read(offset, mPage, length) != 0) {
+      return -1;
+    }
+    crc = updateCrc32(crc, mPage, length);
+  }
+
+  mHasImage = true;
+  mImageVersion = version;
+  mImageSize = size;
+  mImageCrc = ~crc;
+  mReceivedCrc = crc;
+  mTotalPages = (size + IMAGE_PAGE_SIZE - 1) / IMAGE_PAGE_SIZE;
+  mCompletePages = mTotalPages;
+  mReceiving = false;
+  mRequestedPackets = 0;
+  resetSummaries();
+  return 0;
+}
+
+void QuackDissemination::setOnImageCallback(
+    QuackMeshTypes::OnImageCallback callback) {
+  mOnImageCallback = callback;
+}
+
+uint16_t QuackDissemination::getCompletePages() const {
+  return mCompletePages;
+}
+
+uint16_t QuackDissemination::getTotalPages() const { return mTotalPages; }
+
+// PRIVATE:
+
+void QuackDissemination::resetSummaries() {
+  if (mSummaryInterval == mMinSummaryInterval && !mSummarySent) {
+    return;
+  }
+  mSummaryInterval = mMinSummaryInterval;
+  scheduleSummary();
+}
+
+void QuackDissemination::scheduleSummary() {
+  // A random time in the second half keeps neighbours from colliding
+  mSummaryIntervalStartTs = millis();
+  mSummaryDelay = mSummaryInterval / 2 + random(mSummaryInterval / 2 + 1);
+  mSummarySent = false;
+  mConsistentSummaries = 0;
+}
+
+void QuackDissemination::handleSummary(const uint8_t srcAddress[6],
+                                       const ImageSummaryPayload &payload) {
+  int16_t difference = payload.version - getVersion();
+  if (difference < 0) {
+    // The neighbour learns about the newer image from the own summary
+    if (mHasImage) {
+      resetSummaries();
+    }
+    return;
+  }
+  if (difference > 0) {
+    // A neighbour that already runs a newer firmware may hold no image
+    if (payload.size == 0 || !startImage(payload)) {
+      return;
+    }
+    resetSummaries();
+  }
+
+  // Nodes that run the version they advertise have nothing to exchange
+  if (!mHasImage || payload.size == 0 || payload.pages == mCompletePages) {
+    mConsistentSummaries++;
+    return;
+  }
+  resetSummaries();
+  if (payload.pages > mCompletePages && !mReceiving) {
+    startPage(srcAddress);
+  }
+}
+
+void QuackDissemination::handleRequest(const ImageRequestPayload &payload) {
+  if (!mHasImage || payload.version != mImageVersion) {
+    return;
+  }
+  bool forThisNode = isAddressMatching(payload.source, mOwnAddress);
+
+  // The packets another node asked for are overheard, no need to ask as well
+  if (!forThisNode && mReceiving && payload.page == mReceivingPage) {
+    mLastPageActivityTs = millis();
+    mRequestDelay = mRequestTimeout;
+  }
+
+  if (!forThisNode || payload.page >= mCompletePages) {
+    return;
+  }
+  // One page is served at a time, the other requesters ask again
+  if (mRequestedPackets != 0 && payload.page != mServedPage) {
+    return;
+  }
+  mServedPage = payload.page;
+  mRequestedPackets |= payload.missing & getPacketMask(payload.page);
+}
+
+void QuackDissemination::handleData(const uint8_t srcAddress[6],
+                                    const Message &message) {
+  if (message.len < sizeof(ImageDataHeader)) {
+    return;
+  }
+  ImageDataHeader header;
+  memcpy(&header, message.data, sizeof(ImageDataHeader));
+  if (!mHasImage || header.version != mImageVersion ||
+      header.packet >= QuackMeshTypes::IMAGE_PACKETS_PER_PAGE) {
+    return;
+  }
+
+  // A packet this node was asked for was sent by another neighbour
+  if (mRequestedPackets != 0 && header.page == mServedPage) {
+    mRequestedPackets &= ~(1 << header.packet);
+  }
+
+  // The packets of the next page are taken from any neighbour
+  if (header.page != mCompletePages || mCompletePages >= mTotalPages) {
+    return;
+  }
+  size_t offset = header.packet * IMAGE_PACKET_SIZE;
+  size_t pageLength = getPageLength(header.page);
+  size_t length = message.len - sizeof(ImageDataHeader);
+  if (offset >= pageLength ||
+      length != std::min(IMAGE_PACKET_SIZE, pageLength - offset)) {
+    return;
+  }
+  if (!mReceiving) {
+    startPage(srcAddress);
+  }
+  memcpy(mPage + offset, message.data + sizeof(ImageDataHeader), length);
+  mReceivedPackets |= 1 << header.packet;
+  mRequests = 0;
+  mLastPageActivityTs = millis();
+  mRequestDelay = mRequestTimeout;
+
+  uint8_t mask = getPacketMask(header.page);
+  if ((mReceivedPackets & mask) == mask) {
+    completePage();
+  }
+}
+
+bool QuackDissemination::startImage(const ImageSummaryPayload &payload) {
+  if (mStore == nullptr || mStore->begin(payload.version, payload.size) != 0) {
+    return false;
+  }
+  FDEBUG(DEBUG_LEVEL_INFO, "QuackDissemination, receiving image %d\n",
+         payload.version);
+  mHasImage = true;
+  mImageVersion = payload.version;
+  mImageSize = payload.size;
+  mImageCrc = payload.crc;
+  mReceivedCrc = CRC32_INITIAL;
+  mTotalPages = (payload.size + IMAGE_PAGE_SIZE - 1) / IMAGE_PAGE_SIZE;
+  mCompletePages = 0;
+  mReceiving = false;
+  mRequestedPackets = 0;
+  return true;
+}
+
+void QuackDissemination::startPage(const uint8_t srcAddress[6]) {
+  mReceiving = true;
+  memcpy(mPageSource, srcAddress, 6);
+  mReceivingPage = mCompletePages;
+  mReceivedPackets = 0;
+  mRequests = 0;
+  // A random delay lets a neighbour's request for the same page come first
+  mLastPageActivityTs = millis();
+  mRequestDelay = random(mRequestTimeout / 2 + 1);
+}
+
+void QuackDissemination::completePage() {
+  mReceiving = false;
+  size_t length = getPageLength(mReceivingPage);
+  if (mStore->write(static_cast<size_t>(mReceivingPage) * IMAGE_PAGE_SIZE,
+                    mPage, length) != 0) {
+    DEBUG(DEBUG_LEVEL_ERR, "QuackDissemination, page not written\n");
+    return;
+  }
+  mReceivedCrc = updateCrc32(mReceivedCrc, mPage, length);
+  mCompletePages++;
+  // The neighbours learn quickly that the page can be taken from here
+  resetSummaries();
+  if (mCompletePages < mTotalPages) {
+    return;
+  }
+
+  if (~mReceivedCrc != mImageCrc || mStore->finish() != 0) {
+    DEBUG(DEBUG_LEVEL_ERR, "QuackDissemination, image corrupt, restarting\n");
+    ImageSummaryPayload payload = {.size = mImageSize,
+                                   .crc = mImageCrc,
+                                   .version = mImageVersion,
+                                   .pages = 0};
+    if (!startImage(payload)) {
+      mHasImage = false;
+    }
+    return;
+  }
+  FDEBUG(DEBUG_LEVEL_INFO, "QuackDissemination, image %d complete\n",
+         mImageVersion);
+  if (mOnImageCallback) {
+    mOnImageCallback(mImageVersion, mImageSize);
+  }
+}
+
+void QuackDissemination::sendSummary() {
+  ImageSummaryPayload payload = {.size = mHasImage ? mImageSize : 0,
+                                 .crc = mHasImage ? mImageCrc : 0,
+                                 .version = getVersion(),
+                                 .pages = mHasImage ? mCompletePages
+                                                    : static_cast<uint16_t>(0)};
+  mSend(QuackMeshTypes::MESSAGE_TYPE_IMAGE_SUMMARY,
+        reinterpret_cast<const uint8_t *>(&payload),
+        sizeof(ImageSummaryPayload));
+}
+
+void QuackDissemination::sendRequest() {
+  ImageRequestPayload payload = {
+      .source = {},
+      .version = mImageVersion,
+      .page = mReceivingPage,
+      .missing = static_cast<uint8_t>(getPacketMask(mReceivingPage) &
+                                      ~mReceivedPackets)};
+  memcpy(payload.source, mPageSource, 6);
+  mRequests++;
+  mLastPageActivityTs = millis();
+  mRequestDelay = mRequestTimeout;
+  mSend(QuackMeshTypes::MESSAGE_TYPE_IMAGE_REQUEST,
+        reinterpret_cast<const uint8_t *>(&payload),
+        sizeof(ImageRequestPayload));
+}
+
+void QuackDissemination::sendPacket() {
+  uint8_t packet = 0;
+  while (!(mRequestedPackets & (1 << packet))) {
+    packet++;
+  }
+  mRequestedPackets &= ~(1 << packet);
+
+  size_t offset = static_cast<size_t>(mServedPage) * IMAGE_PAGE_SIZE +
+                  packet * IMAGE_PACKET_SIZE;
+  size_t length = std::min(IMAGE_PACKET_SIZE, mImageSize - offset);
+  uint8_t payload[sizeof(ImageDataHeader) + IMAGE_PACKET_SIZE];
+  ImageDataHeader header = {
+      .version = mImageVersion, .page = mServedPage, .packet = packet};
+  memcpy(payload, &header, sizeof(ImageDataHeader));
+  if (mStore->read(offset, payload + sizeof(ImageDataHeader), length) != 0) {
+    DEBUG(DEBUG_LEVEL_ERR, "QuackDissemination, page not readable\n");
+    return;
+  }
+  mSend(QuackMeshTypes::MESSAGE_TYPE_IMAGE_DATA, payload,
+        sizeof(ImageDataHeader) + length);
+}
+
+size_t QuackDissemination::getPageLength(uint16_t page) const {
+  return std::min(IMAGE_PAGE_SIZE,
+                  mImageSize - static_cast<size_t>(page) * IMAGE_PAGE_SIZE);
+}
+
+uint8_t QuackDissemination::getPacketMask(uint16_t page) const {
+  size_t packets =
+      (getPageLength(page) + IMAGE_PACKET_SIZE - 1) / IMAGE_PACKET_SIZE;
+  return static_cast<uint8_t>((1 << packets) - 1);
+}
+
+uint16_t QuackDissemination::getVersion() const {
+  return mHasImage ? mImageVersion : mRunningVersion;
+}
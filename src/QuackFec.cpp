@@ -0,0 +1,192 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackFec.h"
+
+#include <algorithm>
+
+namespace {
+
+// Below this loss rate no repairs are sent
+constexpr float MIN_CODED_LOSS = 0.01f;
+
+// The share of blocks that may still need a retransmission. Repairs about
+// as many as the expected losses, the rare block with more losses only
+// needs its few missing segments again
+constexpr float TARGET_BLOCK_FAILURE = 0.3f;
+
+uint8_t gExp[510] = {};  // 2^i, twice so sums of logs need no modulo
+uint8_t gLog[256] = {};  // The inverse of gExp, gLog[0] is unused
+bool gTablesBuilt = false;
+
+// Build the tables of GF(256) with the polynomial x^8+x^4+x^3+x^2+1
+void buildTables() {
+  if (gTablesBuilt) {
+    return;
+  }
+  uint16_t value = 1;
+  for (uint16_t i = 0; i < 255; i++) {
+    gExp[i] = value;
+    gExp[i + 255] = value;
+    gLog[value] = i;
+    value <<= 1;
+    if (value & 0x100) {
+      value ^= 0x11D;
+    }
+  }
+  gTablesBuilt = true;
+}
+
+// The Cauchy coefficient of a data symbol in a repair symbol, the repairs
+// and the data symbols use disjoint elements so the sum is never 0
+uint8_t getCoefficient(uint8_t index, uint8_t symbol) {
+  return QuackMeshFec::invert(index ^ (QuackMeshFec::MAX_SYMBOLS + symbol));
+}
+
+}  // namespace
+
+// PUBLIC:
+
+uint8_t QuackMeshFec::multiply(uint8_t a, uint8_t b) {
+  buildTables();
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return gExp[gLog[a] + gLog[b]];
+}
+
+uint8_t QuackMeshFec::invert(uint8_t a) {
+  buildTables();
+  return gExp[255 - gLog[a]];
+}
+
+void QuackMeshFec::addScaled(uint8_t *target, const uint8_t *source,
+                             uint8_t coefficient, size_t length) {
+  buildTables();
+  if (coefficient == 0) {
+    return;
+  }
+  uint8_t logCoefficient = gLog[coefficient];
+  for (size_t i = 0; i < length; i++) {
+    if (source[i] != 0) {
+      target[i] ^= gExp[gLog[source[i]] + logCoefficient];
+    }
+  }
+}
+
+void QuackMeshFec::scale(uint8_t *data, uint8_t coefficient, size_t length) {
+  buildTables();
+  uint8_t logCoefficient = gLog[coefficient];
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] != 0) {
+      data[i] = gExp[gLog[data[i]] + logCoefficient];
+    }
+  }
+}
+
+void QuackMeshFec::encodeRepair(const uint8_t *const *symbols, uint8_t count,
+                                uint8_t index, size_t length,
+                                uint8_t *repair) {
+  memset(repair, 0, length);
+  for (uint8_t i = 0; i < count; i++) {
+    addScaled(repair, symbols[i], getCoefficient(index, i), length);
+  }
+}
+
+int QuackMeshFec::decodeSymbols(uint8_t *const *symbols, const bool *present,
+                                uint8_t count, const uint8_t *const *repairs,
+                                const uint8_t *indices, uint8_t repairCount,
+                                size_t length) {
+  uint8_t missing[MAX_SYMBOLS];
+  uint8_t missingCount = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if (!present[i]) {
+      missing[missingCount++] = i;
+    }
+  }
+  if (missingCount > repairCount) {
+    return -1;
+  }
+
+  // Each repair minus the known symbols is a combination of the missing
+  // ones, it is kept in the buffer of a missing symbol until it is solved
+  uint8_t matrix[MAX_SYMBOLS][MAX_SYMBOLS];
+  for (uint8_t row = 0; row < missingCount; row++) {
+    uint8_t *buffer = symbols[missing[row]];
+    memcpy(buffer, repairs[row], length);
+    for (uint8_t i = 0; i < count; i++) {
+      if (present[i]) {
+        addScaled(buffer, symbols[i], getCoefficient(indices[row], i), length);
+      }
+    }
+    for (uint8_t column = 0; column < missingCount; column++) {
+      matrix[row][column] = getCoefficient(indices[row], missing[column]);
+    }
+  }
+
+  // Gauss-Jordan elimination, every square part of a Cauchy matrix is
+  // invertible, so a pivot is always found
+  for (uint8_t column = 0; column < missingCount; column++) {
+    uint8_t pivot = column;
+    while (matrix[pivot][column] == 0) {
+      pivot++;
+    }
+    if (pivot != column) {
+      std::swap_ranges(matrix[pivot], matrix[pivot] + missingCount,
+                       matrix[column]);
+      std::swap_ranges(symbols[missing[pivot]],
+                       symbols[missing[pivot]] + length,
+                       symbols[missing[column]]);
+    }
+    uint8_t inverse = invert(matrix[column][column]);
+    for (uint8_t i = 0; i < missingCount; i++) {
+      matrix[column][i] = multiply(matrix[column][i], inverse);
+    }
+    scale(symbols[missing[column]], inverse, length);
+
+    for (uint8_t row = 0; row < missingCount; row++) {
+      uint8_t factor = matrix[row][column];
+      if (row == column || factor == 0) {
+        continue;
+      }
+      for (uint8_t i = 0; i < missingCount; i++) {
+        matrix[row][i] ^= multiply(matrix[column][i], factor);
+      }
+      addScaled(symbols[missing[row]], symbols[missing[column]], factor,
+                length);
+    }
+  }
+  return missingCount;
+}
+
+uint8_t QuackMeshFec::getRepairCount(uint8_t count, float loss,
+                                     uint8_t maxRepairs) {
+  if (loss < MIN_CODED_LOSS) {
+    return 0;
+  }
+  loss = std::min(loss, 0.9f);
+  maxRepairs = std::min<uint8_t>(maxRepairs, MAX_SYMBOLS);
+  for (uint8_t repairs = 0; repairs < maxRepairs; repairs++) {
+    // The block decodes if at most `repairs` of its frames are lost
+    uint8_t frames = count + repairs;
+    float probability = 1;
+    for (uint8_t i = 0; i < frames; i++) {
+      probability *= 1 - loss;
+    }
+    float decodable = probability;
+    for (uint8_t lost = 0; lost < repairs; lost++) {
+      probability *= static_cast<float>(frames - lost) / (lost + 1) * loss /
+                     (1 - loss);
+      decodable += probability;
+    }
+    if (1 - decodable <= TARGET_BLOCK_FAILURE) {
+      return repairs;
+    }
+  }
+  return maxRepairs;
+}
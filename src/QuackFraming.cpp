@@ -0,0 +1,173 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackFraming.h"
+
+#include <algorithm>
+
+#include "QuackDebug.h"
+
+using QuackMeshGateway::BatchWriter;
+
+// PUBLIC:
+
+size_t QuackMeshGateway::encodeCOBS(const uint8_t *input, size_t length,
+                                    uint8_t *output) {
+  size_t codeIndex = 0;
+  size_t outIndex = 1;
+  uint8_t code = 1;
+
+  for (size_t i = 0; i < length; i++) {
+    if (input[i] == 0) {
+      output[codeIndex] = code;
+      codeIndex = outIndex++;
+      code = 1;
+      continue;
+    }
+    output[outIndex++] = input[i];
+    code++;
+    if (code == 0xFF) {
+      output[codeIndex] = code;
+      codeIndex = outIndex++;
+      code = 1;
+    }
+  }
+  output[codeIndex] = code;
+  output[outIndex++] = 0;
+  return outIndex;
+}
+
+size_t QuackMeshGateway::decodeCOBS(const uint8_t *input, size_t length,
+                                    uint8_t *output) {
+  size_t inIndex = 0;
+  size_t outIndex = 0;
+
+  while (inIndex < length) {
+    uint8_t code = input[inIndex++];
+    if (code == 0 || inIndex + code - 1 > length) {
+      return 0;
+    }
+    for (uint8_t i = 1; i < code; i++) {
+      output[outIndex++] = input[inIndex++];
+    }
+    if (code != 0xFF && inIndex < length) {
+      output[outIndex++] = 0;
+    }
+  }
+  return outIndex;
+}
+
+uint16_t QuackMeshGateway::crc16(const uint8_t *data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= static_cast<uint16_t>(data[i]) << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+BatchWriter::BatchWriter(uint8_t type, size_t headerSize)
+    : mType(type), mHeaderSize(COMMON_HEADER_SIZE + headerSize) {}
+
+void BatchWriter::setHeaderCallback(BatchHeaderCallback callback) {
+  mHeaderCallback = callback;
+}
+
+void BatchWriter::reset() {
+  mBatchLength = 0;
+  mOutputStart = 0;
+  mOutputLength = 0;
+  mLastBatchTs = millis();
+}
+
+uint8_t *BatchWriter::reserve(size_t length) {
+  // The CRC is appended when the batch is sent
+  if (mHeaderSize + length > MAX_PACKET_SIZE) {
+    return nullptr;
+  }
+  if (mBatchLength > 0 && mBatchLength + length > MAX_PACKET_SIZE) {
+    flush();
+  }
+
+  if (mBatchLength == 0) {
+    mBatch[0] = mType;
+    mBatch[1] = mNextSequence++;
+    mBatchLength = mHeaderSize;
+    mBatchStartedTs = millis();
+  }
+
+  uint8_t *record = mBatch + mBatchLength;
+  mBatchLength += length;
+  return record;
+}
+
+void BatchWriter::flush() {
+  if (mBatchLength == 0) {
+    return;
+  }
+
+  // The header is completed last, so it reports the newest state
+  mBatch[2] = mUnreportedDrops & 0xFF;
+  mBatch[3] = mUnreportedDrops >> 8;
+  if (mHeaderCallback) {
+    mHeaderCallback(mBatch + COMMON_HEADER_SIZE);
+  }
+  uint16_t crc = crc16(mBatch, mBatchLength);
+  mBatch[mBatchLength] = crc & 0xFF;
+  mBatch[mBatchLength + 1] = crc >> 8;
+
+  uint8_t encoded[MAX_PACKET_SIZE + 8];
+  size_t encodedLength = encodeCOBS(mBatch, mBatchLength + 2, encoded);
+  mBatchLength = 0;
+  mLastBatchTs = millis();
+
+  if (mOutputLength + encodedLength > sizeof(mOutput)) {
+    DEBUG(DEBUG_LEVEL_WARN, "BatchWriter::flush, output full\n");
+    mDroppedBatches++;
+    if (mUnreportedDrops < UINT16_MAX) {
+      mUnreportedDrops++;
+    }
+    return;
+  }
+  mUnreportedDrops = 0;
+
+  for (size_t i = 0; i < encodedLength; i++) {
+    mOutput[(mOutputStart + mOutputLength + i) % sizeof(mOutput)] = encoded[i];
+  }
+  mOutputLength += encodedLength;
+}
+
+bool BatchWriter::isBatchOpen() const { return mBatchLength > 0; }
+
+u_long BatchWriter::getBatchAge() const { return millis() - mBatchStartedTs; }
+
+u_long BatchWriter::getIdleTime() const { return millis() - mLastBatchTs; }
+
+void BatchWriter::writeTo(Print &stream, bool blocking) {
+  while (mOutputLength > 0) {
+    int writable = blocking ? static_cast<int>(mOutputLength)
+                            : stream.availableForWrite();
+    if (writable <= 0) {
+      return;
+    }
+    // Write up to the end of the buffer, the rest in the next round
+    size_t chunk = std::min(static_cast<size_t>(writable),
+                            std::min(mOutputLength,
+                                     sizeof(mOutput) - mOutputStart));
+    size_t written = stream.write(mOutput + mOutputStart, chunk);
+    if (written == 0) {
+      return;
+    }
+    mOutputStart = (mOutputStart + written) % sizeof(mOutput);
+    mOutputLength -= written;
+  }
+}
+
+uint32_t BatchWriter::getDroppedBatches() const { return mDroppedBatches; }
@@ -0,0 +1,217 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackGateway.h"
+
+#include "QuackDebug.h"
+
+using QuackMeshGateway::HostCommand;
+
+// PUBLIC:
+
+QuackGateway::QuackGateway(QuackMeshDevice &device, Stream &stream)
+    : mDevice(device), mStream(stream) {}
+
+void QuackGateway::begin() {
+  mWriter.reset();
+  mWriter.setHeaderCallback(
+      [this](uint8_t *header) { header[0] = getCredits(); });
+  mInputLength = 0;
+  mCommandCount = 0;
+  mPaused = false;
+
+  // The callbacks of the application keep being called after the records
+  QuackMeshTypes::OnNewMessageReceivedCallback onMessage =
+      mDevice.getOnMessageCallback();
+  mDevice.setOnMessageCallback([this, onMessage](uint8_t type,
+                                                 const uint8_t srcAddress[6],
+                                                 const uint8_t *data,
+                                                 size_t dataLength) {
+    uint8_t record[7 + 232];
+    record[0] = type;
+    memcpy(record + 1, srcAddress, 6);
+    memcpy(record + 7, data, dataLength);
+    appendRecord(QuackMeshGateway::RECORD_MESSAGE, record, 7 + dataLength);
+    if (onMessage) {
+      onMessage(type, srcAddress, data, dataLength);
+    }
+  });
+  QuackMeshTypes::OnESPNowDataSentStatusCallback onStatus =
+      mDevice.getOnMessageStatusCallback();
+  mDevice.setOnMessageStatusCallback([this, onStatus](int status) {
+    uint8_t record = static_cast<uint8_t>(status);
+    appendRecord(QuackMeshGateway::RECORD_STATUS, &record, 1);
+    if (onStatus) {
+      onStatus(status);
+    }
+  });
+  QuackMeshTypes::OnFrameReceivedCallback onFrame =
+      mDevice.getOnFrameCallback();
+  mDevice.setOnFrameCallback(
+      [this, onFrame](const uint8_t *frame, size_t frameLength) {
+        if (mFrameBridging) {
+          appendRecord(QuackMeshGateway::RECORD_FRAME, frame, frameLength);
+        }
+        if (onFrame) {
+          onFrame(frame, frameLength);
+        }
+      });
+}
+
+void QuackGateway::update() {
+  readInput();
+  processCommand();
+
+  if (mWriter.isBatchOpen() && mWriter.getBatchAge() >= mBatchTimeout) {
+    mWriter.flush();
+  } else if (!mWriter.isBatchOpen() &&
+             mWriter.getIdleTime() >= mKeepAliveInterval) {
+    // An empty batch reports the credits and the drops
+    mWriter.reserve(0);
+    mWriter.flush();
+  }
+
+  if (!mPaused) {
+    mWriter.writeTo(mStream);
+  }
+}
+
+void QuackGateway::setFrameBridging(bool enabled) { mFrameBridging = enabled; }
+
+void QuackGateway::setBatchTimeout(u_long timeout) { mBatchTimeout = timeout; }
+
+uint32_t QuackGateway::getDroppedBatches() const {
+  return mWriter.getDroppedBatches();
+}
+
+// PRIVATE:
+
+void QuackGateway::appendRecord(uint8_t kind, const uint8_t *data,
+                                size_t length) {
+  uint8_t *record = mWriter.reserve(2 + length);
+  if (record == nullptr) {
+    return;
+  }
+  record[0] = kind;
+  record[1] = static_cast<uint8_t>(length);
+  memcpy(record + 2, data, length);
+}
+
+void QuackGateway::readInput() {
+  while (mStream.available() > 0) {
+    int value = mStream.read();
+    if (value < 0) {
+      return;
+    }
+
+    if (value != 0) {
+      if (mInputLength < sizeof(mInput)) {
+        mInput[mInputLength++] = static_cast<uint8_t>(value);
+      } else {
+        mInputOverflow = true;
+      }
+      continue;
+    }
+
+    // A delimiter ends the packet, broken packets are skipped
+    if (!mInputOverflow && mInputLength > 0) {
+      uint8_t packet[sizeof(mInput)];
+      size_t length = QuackMeshGateway::decodeCOBS(mInput, mInputLength, packet);
+      processPacket(packet, length);
+    }
+    mInputLength = 0;
+    mInputOverflow = false;
+  }
+}
+
+void QuackGateway::processPacket(const uint8_t *packet, size_t length) {
+  if (length < 4) {
+    return;
+  }
+  uint16_t crc = packet[length - 2] | (packet[length - 1] << 8);
+  if (crc != QuackMeshGateway::crc16(packet, length - 2)) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackGateway::processPacket, wrong crc\n");
+    return;
+  }
+
+  uint8_t type = packet[0];
+  uint8_t sequence = packet[1];
+  const uint8_t *payload = packet + 2;
+  size_t payloadLength = length - 4;
+
+  switch (type) {
+    case QuackMeshGateway::PACKET_SEND: {
+      if (payloadLength < 7 || payloadLength - 7 > 232) {
+        sendResult(sequence, -1);
+        break;
+      }
+      if (mCommandCount >= MAX_COMMANDS) {
+        sendResult(sequence, -2);
+        break;
+      }
+      HostCommand &command =
+          mCommands[(mCommandStart + mCommandCount) % MAX_COMMANDS];
+      command.sequence = sequence;
+      command.flags = payload[0];
+      memcpy(command.destination, payload + 1, 6);
+      command.dataLength = payloadLength - 7;
+      memcpy(command.data, payload + 7, command.dataLength);
+      mCommandCount++;
+      break;
+    }
+    case QuackMeshGateway::PACKET_PAUSE:
+      mPaused = true;
+      break;
+    case QuackMeshGateway::PACKET_RESUME:
+      mPaused = false;
+      break;
+    case QuackMeshGateway::PACKET_PING:
+      sendResult(sequence, 0);
+      break;
+    default:
+      sendResult(sequence, -1);
+      break;
+  }
+}
+
+void QuackGateway::processCommand() {
+  if (mCommandCount == 0) {
+    return;
+  }
+
+  HostCommand &command = mCommands[mCommandStart];
+  int result;
+  if (command.flags & QuackMeshGateway::SEND_FLAG_CONTROL) {
+    result = mDevice.sendControlMessage(command.data, command.dataLength,
+                                        command.destination);
+  } else if (command.flags & QuackMeshGateway::SEND_FLAG_CONFIRMED) {
+    result = mDevice.sendConfirmedMessage(command.data, command.dataLength,
+                                          command.destination);
+  } else {
+    result = mDevice.sendMessage(command.data, command.dataLength,
+                                 command.destination);
+  }
+
+  // The mesh is busy, the command is tried again in the next round. Any
+  // other error would come back every round, so it is reported instead
+  if (result == -2) {
+    return;
+  }
+  sendResult(command.sequence, result);
+  mCommandStart = (mCommandStart + 1) % MAX_COMMANDS;
+  mCommandCount--;
+}
+
+void QuackGateway::sendResult(uint8_t sequence, int8_t result) {
+  uint8_t record[2] = {sequence, static_cast<uint8_t>(result)};
+  appendRecord(QuackMeshGateway::RECORD_RESULT, record, 2);
+}
+
+uint8_t QuackGateway::getCredits() const {
+  return static_cast<uint8_t>(MAX_COMMANDS - mCommandCount);
+}
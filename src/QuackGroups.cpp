@@ -0,0 +1,256 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackGroups.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::GroupAdvertisement;
+using QuackMeshTypes::GroupMembership;
+using QuackMeshTypes::GroupNeighbour;
+using QuackMeshTypes::JoinedGroup;
+using QuackMeshTypes::Message;
+
+// PUBLIC:
+
+void QuackGroups::configure(u_long advertInterval) {
+  mAdvertInterval = advertInterval;
+}
+
+void QuackGroups::setForwarding(bool forwarding) { mForwarding = forwarding; }
+
+void QuackGroups::begin(SendCallback send) { mSend = send; }
+
+void QuackGroups::update() {
+  for (size_t i = 0; i < QuackMeshTypes::MAX_GROUP_NEIGHBOURS; i++) {
+    GroupNeighbour &neighbour = mNeighbours[i];
+    if (!neighbour.active ||
+        millis() - neighbour.lastSeenTs <= 3 * mAdvertInterval) {
+      continue;
+    }
+    neighbour.active = false;
+    for (GroupMembership &membership : mMemberships) {
+      for (uint32_t &members : membership.members) {
+        members &= ~(1UL << i);
+      }
+    }
+  }
+  mMemberships.erase(
+      std::remove_if(mMemberships.begin(), mMemberships.end(),
+                     [](const GroupMembership &membership) {
+                       return std::all_of(std::begin(membership.members),
+                                          std::end(membership.members),
+                                          [](uint32_t members) {
+                                            return members == 0;
+                                          });
+                     }),
+      mMemberships.end());
+
+  std::vector<GroupAdvertisement> groups;
+  fillAdvertisement(groups);
+  std::sort(groups.begin(), groups.end(),
+            [](const GroupAdvertisement &a, const GroupAdvertisement &b) {
+              return a.group < b.group;
+            });
+  size_t maxGroups = sizeof(Message::data) / sizeof(GroupAdvertisement);
+  if (groups.size() > maxGroups) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackGroups::update, too many groups\n");
+    groups.resize(maxGroups);
+  }
+
+  bool changed =
+      groups.size() != mLastAdvertisement.size() ||
+      !std::equal(groups.begin(), groups.end(), mLastAdvertisement.begin(),
+                  [](const GroupAdvertisement &a, const GroupAdvertisement &b) {
+                    return a.group == b.group && a.distance == b.distance;
+                  });
+  if (!isAdvertisementDue(changed, groups.empty())) {
+    return;
+  }
+  mLastAdvertTs = millis();
+  mLastAdvertisement = groups;
+
+  mSend(reinterpret_cast<const uint8_t *>(groups.data()),
+        groups.size() * sizeof(GroupAdvertisement));
+}
+
+void QuackGroups::onMessageReceived(const uint8_t neighbour[6],
+                                    const Message &message) {
+  // The neighbour keeps its bit as long as it advertises
+  size_t index = QuackMeshTypes::MAX_GROUP_NEIGHBOURS;
+  for (size_t i = 0; i < QuackMeshTypes::MAX_GROUP_NEIGHBOURS; i++) {
+    if (mNeighbours[i].active &&
+        isAddressMatching(mNeighbours[i].address, neighbour)) {
+      index = i;
+      break;
+    }
+    if (!mNeighbours[i].active &&
+        index == QuackMeshTypes::MAX_GROUP_NEIGHBOURS) {
+      index = i;
+    }
+  }
+  if (index == QuackMeshTypes::MAX_GROUP_NEIGHBOURS) {
+    DEBUG(DEBUG_LEVEL_WARN,
+          "QuackGroups::onMessageReceived, too many neighbours\n");
+    return;
+  }
+  GroupNeighbour &groupNeighbour = mNeighbours[index];
+  groupNeighbour.active = true;
+  memcpy(groupNeighbour.address, neighbour, 6);
+  groupNeighbour.lastSeenTs = millis();
+
+  uint32_t bit = 1UL << index;
+  for (GroupMembership &membership : mMemberships) {
+    for (uint32_t &members : membership.members) {
+      members &= ~bit;
+    }
+  }
+
+  size_t count = message.len / sizeof(GroupAdvertisement);
+  for (size_t i = 0; i < count; i++) {
+    GroupAdvertisement group;
+    memcpy(&group, message.data + i * sizeof(GroupAdvertisement),
+           sizeof(GroupAdvertisement));
+    if (group.distance >= QuackMeshTypes::GROUP_HOP_COUNT) {
+      continue;
+    }
+    auto it = std::find_if(mMemberships.begin(), mMemberships.end(),
+                           [&](const GroupMembership &membership) {
+                             return membership.group == group.group;
+                           });
+    if (it == mMemberships.end()) {
+      if (mMemberships.size() >= mMaxMemberships) {
+        DEBUG(DEBUG_LEVEL_WARN,
+              "QuackGroups::onMessageReceived, too many groups\n");
+        continue;
+      }
+      GroupMembership membership = {.group = group.group, .members = {}};
+      mMemberships.push_back(membership);
+      it = mMemberships.end() - 1;
+    }
+    it->members[group.distance] |= bit;
+  }
+}
+
+int QuackGroups::join(uint16_t group,
+                      QuackMeshTypes::OnGroupMessageCallback callback) {
+  if (mJoinedGroups.size() >= mMaxJoinedGroups) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackGroups::join, too many groups\n");
+    return -1;
+  }
+  JoinedGroup joinedGroup = {.group = group, .callback = callback};
+  mJoinedGroups.push_back(joinedGroup);
+  return 0;
+}
+
+void QuackGroups::leave(uint16_t group) {
+  mJoinedGroups.erase(std::remove_if(mJoinedGroups.begin(),
+                                     mJoinedGroups.end(),
+                                     [&](const JoinedGroup &joinedGroup) {
+                                       return joinedGroup.group == group;
+                                     }),
+                      mJoinedGroups.end());
+}
+
+void QuackGroups::deliver(const Message &message) {
+  uint16_t group = (message.destAddress[4] << 8) | message.destAddress[5];
+  for (const JoinedGroup &joinedGroup : mJoinedGroups) {
+    if (joinedGroup.group == group && joinedGroup.callback) {
+      joinedGroup.callback(group, message.srcAddress, message.data,
+                           message.len);
+    }
+  }
+}
+
+std::vector<const uint8_t *> QuackGroups::getLinks(
+    const Message &message, const uint8_t *previousHop) const {
+  std::vector<const uint8_t *> links;
+  uint16_t group = (message.destAddress[4] << 8) | message.destAddress[5];
+  auto it = std::find_if(mMemberships.begin(), mMemberships.end(),
+                         [&](const GroupMembership &membership) {
+                           return membership.group == group;
+                         });
+  if (it == mMemberships.end()) {
+    return links;
+  }
+
+  // Only members the message can still reach count
+  uint32_t members = 0;
+  for (uint8_t distance = 0;
+       distance < message.hopCount && distance < QuackMeshTypes::GROUP_HOP_COUNT;
+       distance++) {
+    members |= it->members[distance];
+  }
+
+  for (size_t i = 0; i < QuackMeshTypes::MAX_GROUP_NEIGHBOURS; i++) {
+    const GroupNeighbour &neighbour = mNeighbours[i];
+    if (!(members & (1UL << i)) ||
+        (previousHop != nullptr &&
+         isAddressMatching(neighbour.address, previousHop)) ||
+        isAddressMatching(neighbour.address, message.srcAddress)) {
+      continue;
+    }
+    links.push_back(neighbour.address);
+  }
+  return links;
+}
+
+// PRIVATE:
+
+void QuackGroups::fillAdvertisement(
+    std::vector<GroupAdvertisement> &groups) const {
+  for (const JoinedGroup &joinedGroup : mJoinedGroups) {
+    auto it = std::find_if(groups.begin(), groups.end(),
+                           [&](const GroupAdvertisement &group) {
+                             return group.group == joinedGroup.group;
+                           });
+    if (it == groups.end()) {
+      GroupAdvertisement group = {.group = joinedGroup.group, .distance = 0};
+      groups.push_back(group);
+    }
+  }
+  if (!mForwarding) {
+    return;
+  }
+
+  // Every group is advertised with the distance of its nearest member
+  for (const GroupMembership &membership : mMemberships) {
+    uint8_t distance = 0;
+    while (distance < QuackMeshTypes::GROUP_HOP_COUNT &&
+           membership.members[distance] == 0) {
+      distance++;
+    }
+    distance++;
+    if (distance >= QuackMeshTypes::GROUP_HOP_COUNT) {
+      continue;
+    }
+    auto it = std::find_if(groups.begin(), groups.end(),
+                           [&](const GroupAdvertisement &group) {
+                             return group.group == membership.group;
+                           });
+    if (it == groups.end()) {
+      GroupAdvertisement group = {.group = membership.group,
+                                  .distance = distance};
+      groups.push_back(group);
+    }
+  }
+}
+
+bool QuackGroups::isAdvertisementDue(bool changed, bool empty) const {
+  u_long sinceLastAdvert = millis() - mLastAdvertTs;
+  // Changes are advertised at once, nothing at all is only advertised once
+  if (changed) {
+    return sinceLastAdvert >= mMinAdvertGap;
+  }
+  return !empty && sinceLastAdvert >= mAdvertInterval;
+}
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackImageStore.h"
+
+#include "QuackDebug.h"
+
+#ifdef ESP32
+
+// PUBLIC:
+
+QuackOtaStore::~QuackOtaStore() {
+  if (mUpdating) {
+    esp_ota_abort(mHandle);
+  }
+}
+
+int QuackOtaStore::begin(uint16_t version, size_t size) {
+  if (mUpdating) {
+    esp_ota_abort(mHandle);
+    mUpdating = false;
+  }
+  mPartition = esp_ota_get_next_update_partition(nullptr);
+  if (mPartition == nullptr || size > mPartition->size) {
+    DEBUG(DEBUG_LEVEL_ERR, "QuackOtaStore::begin, image does not fit\n");
+    return -1;
+  }
+  // Erases the partition up to the size of the image
+  if (esp_ota_begin(mPartition, size, &mHandle) != ESP_OK) {
+    DEBUG(DEBUG_LEVEL_ERR, "QuackOtaStore::begin, update not started\n");
+    return -1;
+  }
+  mUpdating = true;
+  return 0;
+}
+
+int QuackOtaStore::write(size_t offset, const uint8_t *data, size_t length) {
+  if (!mUpdating ||
+      esp_ota_write_with_offset(mHandle, data, length, offset) != ESP_OK) {
+    return -1;
+  }
+  return 0;
+}
+
+int QuackOtaStore::read(size_t offset, uint8_t *data, size_t length) {
+  if (mPartition == nullptr ||
+      esp_partition_read(mPartition, offset, data, length) != ESP_OK) {
+    return -1;
+  }
+  return 0;
+}
+
+int QuackOtaStore::finish() {
+  if (!mUpdating) {
+    return -1;
+  }
+  mUpdating = false;
+  // Checks the image header and its SHA-256 before it may boot
+  if (esp_ota_end(mHandle) != ESP_OK ||
+      esp_ota_set_boot_partition(mPartition) != ESP_OK) {
+    DEBUG(DEBUG_LEVEL_ERR, "QuackOtaStore::finish, image rejected\n");
+    return -1;
+  }
+  return 0;
+}
+
+#endif
@@ -9,71 +9,380 @@ the LICENSE file.
 #include <Arduino.h>
 #include "QuackMeshDevice.h"
 
+#include <algorithm>
+#include <cmath>
+
 #ifdef ESP8266
 #include "ESP8266WiFi.h"
 #endif
 #ifdef ESP32
 #include "WiFi.h"
+#include <esp_sleep.h>
+#include <esp_wifi.h>
 #endif
 
 #include "QuackDebug.h"
 
 using QuackMeshTypes::Acknowledgement;
+using QuackMeshTypes::AggregateHeader;
+using QuackMeshTypes::CollectionHeader;
 using QuackMeshTypes::ConfirmedMessage;
+using QuackMeshTypes::CriticalSectionGuard;
 using QuackMeshTypes::EnqueuedMessage;
 using QuackMeshTypes::EnqueuedMessageType;
 using QuackMeshTypes::Message;
+using QuackMeshTypes::MessageCompletion;
+using QuackMeshTypes::OnAggregateCallback;
 using QuackMeshTypes::OnESPNowDataSentStatusCallback;
+using QuackMeshTypes::OnFrameReceivedCallback;
+using QuackMeshTypes::OnGroupMessageCallback;
 using QuackMeshTypes::OnNewMessageReceivedCallback;
+using QuackMeshTypes::OnPublicationCallback;
+using QuackMeshTypes::PollPayload;
+using QuackMeshTypes::PublicationHeader;
+using QuackMeshTypes::SinkEntry;
+using QuackMeshTypes::SubmittedMessage;
+using QuackMeshTypes::TimeSyncPayload;
 using QuackMeshTypes::SeenMessageEntry;
 
 using QuackMeshESPNow::ESPNowClient;
 using QuackMeshESPNow::ESPNowSentStatus;
 using QuackMeshESPNow::isAddressMatching;
 using QuackMeshESPNow::ReceivedData;
+using QuackMeshESPNow::SendingData;
+
+namespace {
+
+// The next hop of a message that is routed by its destination
+const uint8_t NO_NEXT_HOP[6] = {};
+
+// Whether a message travels up the collection tree
+bool isCollectionMessage(const Message &message) {
+  return message.type == QuackMeshTypes::MESSAGE_TYPE_COLLECTION_DATA ||
+         message.type == QuackMeshTypes::MESSAGE_TYPE_AGGREGATE;
+}
+
+// Whether a message is a request or a response of a call
+bool isRpcMessage(const Message &message) {
+  return message.type == QuackMeshTypes::MESSAGE_TYPE_RPC_REQUEST ||
+         message.type == QuackMeshTypes::MESSAGE_TYPE_RPC_RESPONSE;
+}
+
+// Whether a message belongs to a stream
+bool isStreamMessage(const Message &message) {
+  return message.type == QuackMeshTypes::MESSAGE_TYPE_STREAM_DATA ||
+         message.type == QuackMeshTypes::MESSAGE_TYPE_STREAM_ACK ||
+         message.type == QuackMeshTypes::MESSAGE_TYPE_STREAM_REPAIR;
+}
 
-uint8_t idid;
+}  // namespace
 
 // PUBLIC:
 
-void QuackMeshDevice::begin() {
-  mClient.setOnDataReceivedCallback(std::bind(
-      &QuackMeshDevice::onMessageReceived, this, std::placeholders::_1));
+int QuackMeshDevice::begin() {
+#ifdef ESP32
+  if (mPipelineEnabled) {
+    // The client callbacks run on the radio task, only hand over the data
+    mClient.setOnDataReceivedCallback([this](ReceivedData data) {
+      if (!mRadioRxRing.push(data)) {
+        DEBUG(DEBUG_LEVEL_WARN, "MeshDevice, rx ring full, dropping frame\n");
+      }
+    });
 
-  mClient.setOnDataSentCallback(
-      std::bind(&QuackMeshDevice::onMessageSent, this, std::placeholders::_1));
+    mClient.setOnDataSentCallback([this](ESPNowSentStatus status) {
+      mRadioSentRing.push(status);
+    });
+  } else {
+#endif
+    mClient.setOnDataReceivedCallback(std::bind(
+        &QuackMeshDevice::onMessageReceived, this, std::placeholders::_1));
 
-  mClient.begin();
+    mClient.setOnDataSentCallback(std::bind(&QuackMeshDevice::onMessageSent,
+                                            this, std::placeholders::_1));
+#ifdef ESP32
+  }
+#endif
+
+  int result = mClient.begin();
+  if (result != 0) {
+    DEBUG(DEBUG_LEVEL_ERR, "MeshDevice::begin, radio client not started\n");
+    return result;
+  }
 
   mSeenMessagesCleanupUpdateTs = millis();
   mLastTimeoutCheckTs = millis();
+
+  if (mSleepInterval > 0) {
+    mLastActivityTs = millis();
+    sendPoll();
+  }
+
+  if (mTimeSyncEnabled) {
+    mTimeSync.begin(getMACAddress());
+  }
+
+  // Streams and calls are between two devices, like the own messages
+  auto sendToDevice = [this](uint8_t type, const uint8_t destination[6],
+                             const uint8_t *payload, size_t length) {
+    uint8_t networkID[2] = {0, 0};
+    Message message = Message(networkID, type, getNewMessageId(), 3,
+                              getMACAddress(), destination, length, payload);
+    EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                       .channel = 0,
+                                       .message = message};
+    enqueueMessage(newEnqueuedMessage);
+  };
+  mStreams.begin(sendToDevice);
+  mRpc.begin(sendToDevice);
+
+  // The state of the services is only for the direct neighbours
+  auto sendToNeighbours = [this](uint8_t type, const uint8_t *payload,
+                                 size_t length) {
+    uint8_t networkID[2] = {0, 0};
+    Message message = Message(networkID, type, getNewMessageId(), 1,
+                              getMACAddress(), ESPNowClient::BROADCAST_ADDRESS,
+                              length, payload);
+    EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                       .channel = 0,
+                                       .message = message};
+    enqueueMessage(newEnqueuedMessage);
+  };
+
+  if (mDisseminationEnabled) {
+    mDissemination.begin(getMACAddress(), sendToNeighbours);
+  }
+
+  if (mReliableBroadcastEnabled) {
+    mCodedBroadcast.begin(getMACAddress(), [sendToNeighbours](
+                                               const uint8_t *payload,
+                                               size_t length) {
+      sendToNeighbours(QuackMeshTypes::MESSAGE_TYPE_CODED_BROADCAST, payload,
+                       length);
+    });
+  }
+
+  if (mGroupsEnabled) {
+    mGroups.begin([sendToNeighbours](const uint8_t *payload, size_t length) {
+      sendToNeighbours(QuackMeshTypes::MESSAGE_TYPE_GROUP_MEMBERSHIP, payload,
+                       length);
+    });
+  }
+
+  if (mPublishSubscribeEnabled) {
+    mPublishSubscribe.begin([sendToNeighbours](const uint8_t *payload,
+                                               size_t length) {
+      sendToNeighbours(QuackMeshTypes::MESSAGE_TYPE_SUBSCRIBE, payload, length);
+    });
+  }
+
+  // Relayed advertisements keep the sink as their source
+  mAnycast.begin(getMACAddress(), [this](const uint8_t sink[6],
+                                         const uint8_t *payload,
+                                         size_t length) {
+    uint8_t networkID[2] = {0, 0};
+    Message message = Message(
+        networkID, QuackMeshTypes::MESSAGE_TYPE_SINK_ADVERTISEMENT,
+        getNewMessageId(), 1, sink, ESPNowClient::BROADCAST_ADDRESS, length,
+        payload);
+    EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                       .channel = 0,
+                                       .message = message};
+    enqueueMessage(newEnqueuedMessage);
+  });
+
+  if (mCollectionEnabled) {
+    mCollection.begin(
+        getMACAddress(),
+        [sendToNeighbours](const uint8_t *payload, size_t length) {
+          sendToNeighbours(QuackMeshTypes::MESSAGE_TYPE_COLLECTION_BEACON,
+                           payload, length);
+        },
+        [this](const Message &message, const uint8_t parent[6],
+               uint8_t retries) {
+          EnqueuedMessage newEnqueuedMessage{
+              .type = EnqueuedMessageType::Forwarded,
+              .channel = 0,
+              .message = message,
+              .nextHop = {},
+              .retries = retries};
+          memcpy(newEnqueuedMessage.nextHop, parent, 6);
+          enqueueMessage(newEnqueuedMessage);
+        },
+        [this](const Message &message) { deliverCollectionMessage(message); });
+  }
+
+  // A congested parent is avoided by the collection tree
+  if (mBackpressureEnabled) {
+    mBackpressure.begin(
+        [sendToNeighbours](const uint8_t *payload, size_t length) {
+          sendToNeighbours(QuackMeshTypes::MESSAGE_TYPE_CONGESTION, payload,
+                           length);
+        },
+        [this](const uint8_t neighbour[6], bool congested) {
+          if (mCollectionEnabled) {
+            mCollection.setNeighbourCongested(neighbour, congested);
+          }
+        });
+  }
+
+  // Claims are sent in the contention period, a shared slot would swallow
+  // them
+  if (mSlotsEnabled) {
+    mSlots.begin(getMACAddress(),
+                 [sendToNeighbours](const uint8_t *payload, size_t length) {
+                   sendToNeighbours(QuackMeshTypes::MESSAGE_TYPE_SLOT_CLAIM,
+                                    payload, length);
+                 });
+  }
+
+  // A combined report starts at this device
+  if (mAggregationEnabled) {
+    mAggregation.begin([this](const uint8_t *payload, size_t length) {
+      uint8_t networkID[2] = {0, 0};
+      Message report = Message(
+          networkID, QuackMeshTypes::MESSAGE_TYPE_AGGREGATE, getNewMessageId(),
+          1, getMACAddress(), ESPNowClient::BROADCAST_ADDRESS, length, payload);
+      rememberMessage(report);
+      mCollection.routeMessage(report, 0);
+    });
+  }
+
+  mChannels.begin(
+      getMACAddress(),
+      [this](const uint8_t *payload, size_t length, uint8_t channel) {
+        uint8_t networkID[2] = {0, 0};
+        Message announcement = Message(
+            networkID, QuackMeshTypes::MESSAGE_TYPE_CHANNEL_ANNOUNCE,
+            getNewMessageId(), 1, getMACAddress(),
+            ESPNowClient::BROADCAST_ADDRESS, length, payload);
+        EnqueuedMessage newEnqueuedMessage{
+            .type = EnqueuedMessageType::Unconfirmed,
+            .channel = channel,
+            .message = announcement};
+        enqueueMessage(newEnqueuedMessage);
+      },
+      [this](uint8_t channel) { switchHomeChannel(channel); });
+
+#ifdef ESP32
+  if (mPipelineEnabled) {
+    mRadioTaskRunning = true;
+    mRadioTaskActive = true;
+    if (xTaskCreatePinnedToCore(QuackMeshDevice::radioTask, "quackRadio", 4096,
+                                this, 5, nullptr, mRadioCore) != pdPASS) {
+      DEBUG(DEBUG_LEVEL_ERR, "MeshDevice::begin, radio task not started\n");
+      mRadioTaskRunning = false;
+      mRadioTaskActive = false;
+      mClient.stop();
+      return -1;
+    }
+  }
+#endif
+  return 0;
 }
 
 void QuackMeshDevice::stop() {
+#ifdef ESP32
+  mRadioTaskRunning = false;
+  while (mRadioTaskActive) {
+    delay(1);
+  }
+#endif
   mClient.setOnDataSentCallback(nullptr);
   mClient.setOnDataReceivedCallback(nullptr);
   mClient.stop();
 }
 
+#ifdef ESP32
+void QuackMeshDevice::enablePipeline(BaseType_t radioCore) {
+  mPipelineEnabled = true;
+  mRadioCore = radioCore;
+}
+#endif
+
 void QuackMeshDevice::update() {
+#ifdef ESP32
+  if (mPipelineEnabled) {
+    drainRadioRings();
+  } else {
+    mClient.update();
+  }
+#else
   mClient.update();
+#endif
   yield();
 
+  drainSubmissionQueue();
+
   updateSeenMessages();
   checkForConfirmationTimeout();
+  mRpc.update();
+  // Repairs are handed over one at a time, so acknowledgements can stop them
+  mStreams.update(mMessageQueue.empty());
+  if (mTimeSyncEnabled && mTimeSync.update()) {
+    sendTimeSyncBeacon();
+  }
+  mChannels.update();
+  if (mPublishSubscribeEnabled) {
+    mPublishSubscribe.update();
+  }
+  if (mGroupsEnabled) {
+    mGroups.update();
+  }
+  mAnycast.update(getQueueLoad());
+  if (mCollectionEnabled) {
+    mCollection.update(mBackpressure.isCongested());
+  }
+  if (mAggregationEnabled) {
+    mAggregation.update();
+  }
+  if (mBackpressureEnabled) {
+    mBackpressure.update(mMessageQueue.size(), getQueueLoad());
+  }
+  if (mSlotsEnabled) {
+    mSlots.update();
+  }
+  if (mDisseminationEnabled) {
+    // Packets are handed over one at a time so other traffic is not starved
+    mDissemination.update(mMessageQueue.empty());
+  }
+  if (mReliableBroadcastEnabled) {
+    mCodedBroadcast.update(mMessageQueue.empty());
+  }
   yield();
 
   processNextMessage();
+
+  updateSleepSchedule();
+}
+
+int QuackMeshDevice::sendMessage(uint8_t data[232], size_t dataLength,
+                                 uint8_t destination[6]) {
+  return enqueueNewMessage(data, dataLength, destination, false);
+}
+
+int QuackMeshDevice::sendConfirmedMessage(uint8_t data[232], size_t dataLength,
+                                          uint8_t destination[6]) {
+  return enqueueNewMessage(data, dataLength, destination, true);
 }
 
-void QuackMeshDevice::sendMessage(uint8_t data[232], size_t dataLength,
-                                  uint8_t destination[6]) {
-  enqueueNewMessage(data, dataLength, destination, false);
+int QuackMeshDevice::sendConfirmedMessage(
+    uint8_t data[232], size_t dataLength, uint8_t destination[6],
+    OnESPNowDataSentStatusCallback callback) {
+  if (isGroupAddress(destination)) {
+    return -1;
+  }
+  if (mBackpressure.isCongested()) {
+    return -2;
+  }
+  return submitNewMessage(QuackMeshTypes::MESSAGE_TYPE_CONFIRMED, data,
+                          dataLength, destination, callback);
 }
 
-void QuackMeshDevice::sendConfirmedMessage(uint8_t data[232], size_t dataLength,
-                                           uint8_t destination[6]) {
-  enqueueNewMessage(data, dataLength, destination, true);
+int QuackMeshDevice::sendControlMessage(uint8_t data[232], size_t dataLength,
+                                        uint8_t destination[6]) {
+  // Control traffic is never held back by a congestion
+  return submitNewMessage(QuackMeshTypes::MESSAGE_TYPE_CONTROL, data,
+                          dataLength, destination);
 }
 
 void QuackMeshDevice::setOnMessageStatusCallback(
@@ -86,56 +395,741 @@ void QuackMeshDevice::setOnMessageCallback(
   mOnMessageCallback = callback;
 }
 
+OnESPNowDataSentStatusCallback QuackMeshDevice::getOnMessageStatusCallback()
+    const {
+  return mSentStatusCallback;
+}
+
+OnNewMessageReceivedCallback QuackMeshDevice::getOnMessageCallback() const {
+  return mOnMessageCallback;
+}
+
+void QuackMeshDevice::setOnFrameCallback(OnFrameReceivedCallback callback) {
+  mOnFrameCallback = callback;
+}
+
+OnFrameReceivedCallback QuackMeshDevice::getOnFrameCallback() const {
+  return mOnFrameCallback;
+}
+
 uint8_t *QuackMeshDevice::getMACAddress() { return mClient.getMACAddress(); }
 
+void QuackMeshDevice::setSleepSchedule(uint8_t parent[6], u_long sleepInterval,
+                                       u_long awakeWindow) {
+  memcpy(mParentAddress, parent, 6);
+  mSleepInterval = sleepInterval;
+  mAwakeWindow = awakeWindow;
+  mLastActivityTs = millis();
+}
+
+void QuackMeshDevice::setConfirmationTimeout(u_long timeout) {
+  mConfirmationTimeout = timeout;
+}
+
+void QuackMeshDevice::enableTimeSync(u_long beaconInterval, bool canBeRoot) {
+  mTimeSyncEnabled = true;
+  mTimeSync.configure(beaconInterval, canBeRoot);
+}
+
+u_long QuackMeshDevice::meshMillis() {
+  return static_cast<u_long>(meshMicros() / 1000);
+}
+
+uint64_t QuackMeshDevice::meshMicros() {
+  if (!mTimeSyncEnabled) {
+    return QuackTimeSync::localMicros();
+  }
+  return mTimeSync.meshMicros();
+}
+
+bool QuackMeshDevice::isTimeSynced() const {
+  return mTimeSyncEnabled && mTimeSync.isSynced();
+}
+
+int QuackMeshDevice::enableSlottedMode(uint8_t slotCount, u_long slotLength,
+                                       u_long contentionLength) {
+  if (mSlots.configure(slotCount, slotLength, contentionLength) != 0) {
+    return -1;
+  }
+  mSlotsEnabled = true;
+  return 0;
+}
+
+int QuackMeshDevice::setTransmitSlot(uint8_t slot) {
+  if (!mSlotsEnabled) {
+    return -1;
+  }
+  return mSlots.setTransmitSlot(slot);
+}
+
+int16_t QuackMeshDevice::getTransmitSlot() const {
+  return mSlots.getTransmitSlot();
+}
+
+void QuackMeshDevice::enableMultiChannel(const uint8_t *channels,
+                                         size_t channelCount,
+                                         u_long announceInterval) {
+  if (channelCount == 0) {
+    return;
+  }
+  mChannels.enableMultiChannel(channels, channelCount, announceInterval);
+  switchHomeChannel(mChannels.getHomeChannel());
+}
+
+void QuackMeshDevice::setHomeChannel(uint8_t channel) {
+  mChannels.setHomeChannel(channel);
+  switchHomeChannel(channel);
+}
+
+void QuackMeshDevice::enableChannelDiscovery(u_long announceInterval,
+                                             u_long lostTimeout) {
+  mChannels.enableDiscovery(announceInterval, lostTimeout);
+}
+
+bool QuackMeshDevice::isChannelScanning() const {
+  return mChannels.isScanning();
+}
+
+void QuackMeshDevice::enableRateAdaptation(bool longRange) {
+  mClient.enableRateAdaptation(longRange);
+}
+
+void QuackMeshDevice::setRecorder(QuackRecorder *recorder) {
+  mClient.setRecorder(recorder);
+}
+
+void QuackMeshDevice::enablePublishSubscribe(u_long advertInterval) {
+  mPublishSubscribeEnabled = true;
+  mPublishSubscribe.configure(advertInterval);
+}
+
+int QuackMeshDevice::subscribe(const char *topic,
+                               OnPublicationCallback callback) {
+  return mPublishSubscribe.subscribe(topic, callback);
+}
+
+void QuackMeshDevice::unsubscribe(const char *topic) {
+  mPublishSubscribe.unsubscribe(topic);
+}
+
+int QuackMeshDevice::publish(const char *topic, const uint8_t *data,
+                             size_t dataLength) {
+  if (!mPublishSubscribeEnabled ||
+      dataLength > sizeof(Message::data) - sizeof(PublicationHeader)) {
+    return -1;
+  }
+  uint8_t payload[sizeof(Message::data)];
+  PublicationHeader header = {.topicHash = hashTopic(topic)};
+  memcpy(payload, &header, sizeof(PublicationHeader));
+  memcpy(payload + sizeof(PublicationHeader), data, dataLength);
+
+  uint8_t networkID[2] = {0, 0};
+  Message publication = Message(
+      networkID, QuackMeshTypes::MESSAGE_TYPE_PUBLISH, getNewMessageId(),
+      mPublishSubscribe.getHopCount(), getMACAddress(),
+      ESPNowClient::BROADCAST_ADDRESS,
+      sizeof(PublicationHeader) + dataLength, payload);
+
+  EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                     .channel = 0,
+                                     .message = publication};
+
+  if (!mSubmissionQueue.push(
+          {.message = newEnqueuedMessage, .callbackSlot = -1})) {
+    DEBUG(DEBUG_LEVEL_WARN, "MeshDevice::publish, queue full\n");
+    return -2;
+  }
+  return 0;
+}
+
+void QuackMeshDevice::enableGroups(u_long advertInterval) {
+  mGroupsEnabled = true;
+  mGroups.configure(advertInterval);
+}
+
+int QuackMeshDevice::joinGroup(uint16_t group,
+                               OnGroupMessageCallback callback) {
+  return mGroups.join(group, callback);
+}
+
+void QuackMeshDevice::leaveGroup(uint16_t group) { mGroups.leave(group); }
+
+int QuackMeshDevice::sendGroupMessage(uint16_t group, uint8_t data[232],
+                                      size_t dataLength) {
+  uint8_t groupAddress[6];
+  getGroupAddress(group, groupAddress);
+  return enqueueNewMessage(data, dataLength, groupAddress, false);
+}
+
+void QuackMeshDevice::getGroupAddress(uint16_t group, uint8_t address[6]) {
+  memcpy(address, QuackMeshTypes::GROUP_ADDRESS_PREFIX, 4);
+  address[4] = group >> 8;
+  address[5] = group & 0xFF;
+}
+
+void QuackMeshDevice::enableSink(uint16_t service, u_long advertInterval) {
+  mAnycast.enableSink(service, advertInterval);
+}
+
+void QuackMeshDevice::setSinkLoad(uint8_t load) { mAnycast.setSinkLoad(load); }
+
+int QuackMeshDevice::sendAnycastMessage(uint16_t service, uint8_t data[232],
+                                        size_t dataLength, bool confirmed) {
+  uint8_t anycastAddress[6];
+  getAnycastAddress(service, anycastAddress);
+  return enqueueNewMessage(data, dataLength, anycastAddress, confirmed);
+}
+
+void QuackMeshDevice::getAnycastAddress(uint16_t service, uint8_t address[6]) {
+  memcpy(address, QuackMeshTypes::ANYCAST_ADDRESS_PREFIX, 4);
+  address[4] = service >> 8;
+  address[5] = service & 0xFF;
+}
+
+uint32_t QuackMeshDevice::hashTopic(const char *topic) {
+  return QuackPublishSubscribe::hashTopic(topic);
+}
+
+void QuackMeshDevice::enableCollection(bool root, u_long minBeaconInterval,
+                                       u_long maxBeaconInterval) {
+  mCollectionEnabled = true;
+  mCollection.configure(root, minBeaconInterval, maxBeaconInterval);
+}
+
+int QuackMeshDevice::sendCollectionMessage(const uint8_t *data,
+                                           size_t dataLength) {
+  if (!mCollectionEnabled ||
+      dataLength > sizeof(Message::data) - sizeof(CollectionHeader)) {
+    return -1;
+  }
+  if (mBackpressure.isCongested()) {
+    return -2;
+  }
+  uint8_t payload[sizeof(Message::data)];
+  CollectionHeader header = {.cost = QuackMeshTypes::NO_COLLECTION_ROUTE,
+                             .timeHasLived = 0};
+  memcpy(payload, &header, sizeof(CollectionHeader));
+  memcpy(payload + sizeof(CollectionHeader), data, dataLength);
+
+  // Collection data is for whichever root the tree leads to
+  uint8_t networkID[2] = {0, 0};
+  Message collectionMessage = Message(
+      networkID, QuackMeshTypes::MESSAGE_TYPE_COLLECTION_DATA,
+      getNewMessageId(), 1, getMACAddress(), ESPNowClient::BROADCAST_ADDRESS,
+      sizeof(CollectionHeader) + dataLength, payload);
+
+  EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                     .channel = 0,
+                                     .message = collectionMessage};
+
+  if (!mSubmissionQueue.push(
+          {.message = newEnqueuedMessage, .callbackSlot = -1})) {
+    DEBUG(DEBUG_LEVEL_WARN, "MeshDevice::sendCollectionMessage, queue full\n");
+    return -2;
+  }
+  return 0;
+}
+
+uint16_t QuackMeshDevice::getCollectionCost() const {
+  return mCollection.getCost();
+}
+
+void QuackMeshDevice::enableAggregation(u_long window) {
+  mAggregationEnabled = true;
+  mAggregation.configure(window);
+}
+
+int QuackMeshDevice::registerAggregate(
+    uint16_t key, QuackMeshTypes::AggregateMergeCallback merge) {
+  return mAggregation.registerAggregate(key, merge);
+}
+
+void QuackMeshDevice::setOnAggregateCallback(OnAggregateCallback callback) {
+  mAggregation.setOnAggregateCallback(callback);
+}
+
+int QuackMeshDevice::sendAggregateReport(uint16_t key, uint8_t op,
+                                         int32_t value) {
+  if (op >= QuackMeshTypes::AGGREGATE_CUSTOM) {
+    return -1;
+  }
+  // A report counts itself, so the count is the sum of the values
+  if (op == QuackMeshTypes::AGGREGATE_COUNT) {
+    value = 1;
+  }
+  return enqueueAggregateReport(key, op, reinterpret_cast<uint8_t *>(&value),
+                                sizeof(int32_t));
+}
+
+int QuackMeshDevice::sendAggregateReport(uint16_t key, const uint8_t *data,
+                                         size_t dataLength) {
+  return enqueueAggregateReport(key, QuackMeshTypes::AGGREGATE_CUSTOM, data,
+                                dataLength);
+}
+
+int QuackMeshDevice::registerRpcMethod(uint16_t method,
+                                       QuackMeshTypes::RpcHandler handler) {
+  return mRpc.registerMethod(method, handler);
+}
+
+int QuackMeshDevice::callRpc(uint8_t destination[6], uint16_t method,
+                             const uint8_t *request, size_t requestLength,
+                             QuackMeshTypes::OnRpcCompletedCallback callback,
+                             u_long timeout) {
+  return mRpc.call(destination, method, request, requestLength, callback,
+                   timeout);
+}
+
+int QuackMeshDevice::openStream(
+    uint8_t destination[6], QuackMeshTypes::OnStreamClosedCallback callback) {
+  return mStreams.open(destination, callback);
+}
+
+int QuackMeshDevice::writeStream(uint8_t streamId, const uint8_t *data,
+                                 size_t dataLength) {
+  return mStreams.write(streamId, data, dataLength);
+}
+
+int QuackMeshDevice::closeStream(uint8_t streamId) {
+  return mStreams.close(streamId);
+}
+
+void QuackMeshDevice::setOnStreamDataCallback(
+    QuackMeshTypes::OnStreamDataCallback callback) {
+  mStreams.setOnDataCallback(callback);
+}
+
+void QuackMeshDevice::setStreamWindow(uint8_t segments) {
+  mStreams.setWindow(segments);
+}
+
+void QuackMeshDevice::enableStreamFec(uint8_t blockSegments,
+                                      uint8_t maxRepairs) {
+  mStreams.enableFec(blockSegments, maxRepairs);
+}
+
+void QuackMeshDevice::enableDissemination(QuackImageStore &store,
+                                          uint16_t runningVersion,
+                                          u_long minInterval,
+                                          u_long maxInterval) {
+  mDisseminationEnabled = true;
+  mDissemination.configure(&store, runningVersion, minInterval, maxInterval);
+}
+
+int QuackMeshDevice::publishImage(uint16_t version, size_t size) {
+  if (!mDisseminationEnabled) {
+    return -1;
+  }
+  return mDissemination.publishImage(version, size);
+}
+
+void QuackMeshDevice::setOnImageCallback(
+    QuackMeshTypes::OnImageCallback callback) {
+  mDissemination.setOnImageCallback(callback);
+}
+
+void QuackMeshDevice::enableReliableBroadcast(u_long minInterval,
+                                              u_long maxInterval) {
+  mReliableBroadcastEnabled = true;
+  mCodedBroadcast.configure(minInterval, maxInterval);
+}
+
+int QuackMeshDevice::sendReliableBroadcast(const uint8_t *data,
+                                           size_t dataLength) {
+  if (!mReliableBroadcastEnabled) {
+    return -1;
+  }
+  return mCodedBroadcast.broadcast(data, dataLength);
+}
+
+void QuackMeshDevice::setOnReliableBroadcastCallback(
+    QuackMeshTypes::OnReliableBroadcastCallback callback) {
+  mCodedBroadcast.setOnDataCallback(callback);
+}
+
+void QuackMeshDevice::enableBackpressure(size_t highWatermark,
+                                         size_t lowWatermark,
+                                         u_long interval) {
+  mBackpressureEnabled = true;
+  mBackpressure.configure(highWatermark, lowWatermark, interval);
+}
+
+bool QuackMeshDevice::isCongested() const {
+  return mBackpressure.isCongested();
+}
+
+void QuackMeshDevice::enableQueueManagement(u_long target, u_long interval) {
+  mQueueManagement = true;
+  mQueueTarget = target;
+  mQueueInterval = interval;
+}
+
+uint32_t QuackMeshDevice::getDroppedMessages() const {
+  return mDroppedMessages;
+}
+
 // PRIVATE:
-void QuackMeshDevice::enqueueNewMessage(uint8_t *data, size_t dataLength,
-                                        uint8_t destination[6],
-                                        bool confirmed) {
+int QuackMeshDevice::enqueueNewMessage(uint8_t *data, size_t dataLength,
+                                       uint8_t destination[6],
+                                       bool confirmed) {
+  // Nobody would acknowledge a message to a group
+  if (confirmed && isGroupAddress(destination)) {
+    return -1;
+  }
+  // The application holds back until the queue drained
+  if (mBackpressure.isCongested()) {
+    return -2;
+  }
+  return submitNewMessage(confirmed ? QuackMeshTypes::MESSAGE_TYPE_CONFIRMED
+                                    : QuackMeshTypes::MESSAGE_TYPE_UNCONFIRMED,
+                          data, dataLength, destination);
+}
+
+int QuackMeshDevice::submitNewMessage(
+    uint8_t type, uint8_t *data, size_t dataLength, uint8_t destination[6],
+    OnESPNowDataSentStatusCallback callback) {
+  if (dataLength > sizeof(Message::data)) {
+    return -1;
+  }
+  // The callbacks are counted here, so a full list is reported to the
+  // caller. Every counted callback finds a free slot
+  int8_t callbackSlot = -1;
+  if (callback) {
+    if (mPendingCompletions.fetch_add(1) >=
+        QuackMeshTypes::MAX_MESSAGE_COMPLETIONS) {
+      mPendingCompletions--;
+      return -2;
+    }
+    for (size_t i = 0; i < QuackMeshTypes::MAX_MESSAGE_COMPLETIONS; i++) {
+      bool used = false;
+      if (mSubmittedCallbackUsed[i].compare_exchange_strong(used, true)) {
+        callbackSlot = i;
+        mSubmittedCallbacks[i] = callback;
+        break;
+      }
+    }
+  }
   uint8_t networkID[2] = {0, 0};
-  Message newMessage = Message(networkID, confirmed ? 1 : 0, getNewMessageId(), 3,
-                     getMACAddress(), destination, dataLength, data);
+  Message newMessage = Message(networkID, type, getNewMessageId(), 3,
+                               getMACAddress(), destination, dataLength, data);
 
-  EnqueuedMessage newEnqueuedMessage {
-      .type = confirmed ? EnqueuedMessageType::Confirmed
-                        : EnqueuedMessageType::Unconfirmed,
+  EnqueuedMessage newEnqueuedMessage{
+      .type = type == QuackMeshTypes::MESSAGE_TYPE_CONFIRMED
+                  ? EnqueuedMessageType::Confirmed
+                  : EnqueuedMessageType::Unconfirmed,
       .channel = 0,
       .message = newMessage};
 
-  mMessageQueue.push(newEnqueuedMessage);
+  if (!mSubmissionQueue.push({.message = newEnqueuedMessage,
+                              .callbackSlot = callbackSlot})) {
+    DEBUG(DEBUG_LEVEL_WARN, "MeshDevice::submitNewMessage, queue full\n");
+    if (callbackSlot >= 0) {
+      mSubmittedCallbacks[callbackSlot] = nullptr;
+      mSubmittedCallbackUsed[callbackSlot] = false;
+      mPendingCompletions--;
+    }
+    return -2;
+  }
+  return 0;
+}
+
+int QuackMeshDevice::enqueueAggregateReport(uint16_t key, uint8_t op,
+                                            const uint8_t *data,
+                                            size_t dataLength) {
+  size_t headerLength = sizeof(CollectionHeader) + sizeof(AggregateHeader);
+  if (!mCollectionEnabled ||
+      dataLength > sizeof(Message::data) - headerLength) {
+    return -1;
+  }
+  uint8_t payload[sizeof(Message::data)];
+  CollectionHeader collectionHeader = {
+      .cost = QuackMeshTypes::NO_COLLECTION_ROUTE, .timeHasLived = 0};
+  AggregateHeader aggregateHeader = {.key = key, .count = 1, .op = op};
+  memcpy(payload, &collectionHeader, sizeof(CollectionHeader));
+  memcpy(payload + sizeof(CollectionHeader), &aggregateHeader,
+         sizeof(AggregateHeader));
+  memcpy(payload + headerLength, data, dataLength);
+
+  uint8_t networkID[2] = {0, 0};
+  Message report = Message(networkID, QuackMeshTypes::MESSAGE_TYPE_AGGREGATE,
+                           getNewMessageId(), 1, getMACAddress(),
+                           ESPNowClient::BROADCAST_ADDRESS,
+                           headerLength + dataLength, payload);
+
+  EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                     .channel = 0,
+                                     .message = report};
+
+  if (!mSubmissionQueue.push(
+          {.message = newEnqueuedMessage, .callbackSlot = -1})) {
+    DEBUG(DEBUG_LEVEL_WARN, "MeshDevice::enqueueAggregateReport, queue full\n");
+    return -2;
+  }
+  return 0;
+}
+
+void QuackMeshDevice::drainSubmissionQueue() {
+  SubmittedMessage submission;
+  while (mSubmissionQueue.pop(submission)) {
+    EnqueuedMessage &submittedMessage = submission.message;
+    if (submission.callbackSlot >= 0) {
+      MessageCompletion completion = {
+          .id = submittedMessage.message.id,
+          .destAddress = {},
+          .callback = mSubmittedCallbacks[submission.callbackSlot]};
+      memcpy(completion.destAddress, submittedMessage.message.destAddress, 6);
+      mMessageCompletions.push_back(completion);
+      mSubmittedCallbacks[submission.callbackSlot] = nullptr;
+      mSubmittedCallbackUsed[submission.callbackSlot] = false;
+    }
+    // Publications are routed by the subscriptions, owned by the mesh task
+    if (submittedMessage.message.type ==
+        QuackMeshTypes::MESSAGE_TYPE_PUBLISH) {
+      rememberMessage(submittedMessage.message);
+      mPublishSubscribe.deliver(submittedMessage.message);
+      routePublication(submittedMessage.message, nullptr);
+      continue;
+    }
+    // Collection data goes to the parent, owned by the mesh task
+    if (isCollectionMessage(submittedMessage.message)) {
+      rememberMessage(submittedMessage.message);
+      if (!mAggregationEnabled ||
+          !mAggregation.hold(submittedMessage.message)) {
+        mCollection.routeMessage(submittedMessage.message, 0);
+      }
+      continue;
+    }
+    // Group messages are replicated by the memberships, confirmed ones are
+    // rejected when they are submitted
+    if (isGroupAddress(submittedMessage.message.destAddress)) {
+      rememberMessage(submittedMessage.message);
+      mGroups.deliver(submittedMessage.message);
+      routeGroupMessage(submittedMessage.message, nullptr);
+      continue;
+    }
+    enqueueMessage(submittedMessage);
+  }
+}
+
+void QuackMeshDevice::enqueueMessage(const EnqueuedMessage &message) {
+  EnqueuedMessage queuedMessage = message;
+  queuedMessage.enqueuedTs = millis();
+  // A congestion signal must not wait behind the messages that caused it
+  if (message.message.type == QuackMeshTypes::MESSAGE_TYPE_CONTROL ||
+      message.message.type == QuackMeshTypes::MESSAGE_TYPE_CONGESTION) {
+    mControlQueue.push(queuedMessage);
+  } else {
+    mMessageQueue.push(queuedMessage);
+  }
+}
+
+void QuackMeshDevice::manageQueue() {
+  if (!mQueueManagement) {
+    return;
+  }
+  u_long now = millis();
+  while (!mMessageQueue.empty()) {
+    const EnqueuedMessage &head = mMessageQueue.front();
+    // Collection data of this device is queued as forwarded as well
+    if (head.type != EnqueuedMessageType::Forwarded ||
+        isAddressMatching(head.message.srcAddress, getMACAddress())) {
+      return;
+    }
+    u_long sojourn = now - head.enqueuedTs;
+    // The source of a confirmed message gave up on it already
+    bool expired =
+        head.message.type == QuackMeshTypes::MESSAGE_TYPE_CONFIRMED &&
+        sojourn >= mConfirmationTimeout;
+    if (!isQueueDropDue(now, sojourn) && !expired) {
+      return;
+    }
+    FDEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::manageQueue, dropped after %lu\n",
+           sojourn);
+    mMessageQueue.pop();
+    mDroppedMessages++;
+  }
+  // An empty queue has no standing delay
+  mQueueAboveTarget = false;
+}
+
+bool QuackMeshDevice::isQueueDropDue(u_long now, u_long sojourn) {
+  // A short delay or a message that waits alone is no standing queue
+  bool dropAllowed = false;
+  if (sojourn < mQueueTarget || mMessageQueue.size() <= 1) {
+    mQueueAboveTarget = false;
+  } else if (!mQueueAboveTarget) {
+    mQueueAboveTarget = true;
+    mQueueDropAllowedTs = now + mQueueInterval;
+  } else if (static_cast<long>(now - mQueueDropAllowedTs) >= 0) {
+    dropAllowed = true;
+  }
+
+  // The drops get closer with the square root of their number until the
+  // delay is below the target
+  if (mQueueDropping) {
+    if (!dropAllowed) {
+      mQueueDropping = false;
+      return false;
+    }
+    if (static_cast<long>(now - mQueueNextDropTs) < 0) {
+      return false;
+    }
+    mQueueDropCount++;
+    mQueueNextDropTs +=
+        static_cast<u_long>(mQueueInterval / std::sqrt(mQueueDropCount));
+    return true;
+  }
+  if (!dropAllowed) {
+    return false;
+  }
+
+  // Dropping that starts again soon continues at about the last rate
+  mQueueDropping = true;
+  uint32_t delta = mQueueDropCount - mQueueLastDropCount;
+  mQueueDropCount = delta > 1 && static_cast<long>(now - mQueueNextDropTs) <
+                                     static_cast<long>(16 * mQueueInterval)
+                        ? delta
+                        : 1;
+  mQueueLastDropCount = mQueueDropCount;
+  mQueueNextDropTs =
+      now + static_cast<u_long>(mQueueInterval / std::sqrt(mQueueDropCount));
+  return true;
+}
+
+std::queue<EnqueuedMessage> *QuackMeshDevice::selectNextQueue() {
+  if (mChannels.isScanning()) {
+    return nullptr;
+  }
+  // A broadcast that is repeated on several channels is finished first
+  if (mBroadcastChannelIndex > 0 && mInFlightQueue != nullptr) {
+    return isTransmissionAllowed(mInFlightQueue == &mControlQueue)
+               ? mInFlightQueue
+               : nullptr;
+  }
+  if (!mControlQueue.empty() && isTransmissionAllowed(true)) {
+    return &mControlQueue;
+  }
+  if (!mMailboxQueue.empty() && isTransmissionAllowed(false)) {
+    return &mMailboxQueue;
+  }
+  if (!mMessageQueue.empty() && isTransmissionAllowed(false)) {
+    return &mMessageQueue;
+  }
+  return nullptr;
+}
+
+bool QuackMeshDevice::isTransmissionAllowed(bool control) {
+  if (!mSlotsEnabled || !isTimeSynced()) {
+    return true;
+  }
+  return mSlots.getTimeLeft(meshMicros(), control) > 0;
+}
+
+uint8_t QuackMeshDevice::getQueueLoad() const {
+  size_t queued = mMessageQueue.size() + mControlQueue.size();
+  return queued >= 8 ? 255 : static_cast<uint8_t>(queued * 32);
+}
+
+void QuackMeshDevice::switchHomeChannel(uint8_t channel) {
+#ifdef ESP32
+  // The radio task owns the client while it runs
+  if (mRadioTaskRunning) {
+    mPendingHomeChannel = channel;
+    return;
+  }
+#endif
+  mClient.setHomeChannel(channel);
 }
 
 void QuackMeshDevice::processNextMessage() {
   if (mMessageSendingInProgress) {
     return;
   }
-  if (mMessageQueue.empty()) {
+  std::queue<EnqueuedMessage> *queue = selectNextQueue();
+  if (queue == nullptr) {
     return;
-  } else if (!mClient.sendingPossible()) {
+  } else if (!radioSendingPossible()) {
     DEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::processNextMessage, not possible\n");
     return;
   }
 
+  // Forwarded messages that waited too long do not get any airtime
+  if (queue == &mMessageQueue && mBroadcastChannelIndex == 0) {
+    manageQueue();
+    if (queue->empty()) {
+      return;
+    }
+  }
+
   DEBUG(DEBUG_LEVEL_DEBUG,
         "MeshDevice::processNextMessage\n");
 
-  EnqueuedMessage nextMessage = mMessageQueue.front();
+  EnqueuedMessage nextMessage;
+  uint8_t *nextHop = nullptr;
+
+  // Messages to a neighbour that asked to slow down are spaced out. While
+  // they wait they move behind the other messages, which keeps their order
+  // and only holds back the traffic to that neighbour
+  size_t candidates = queue == &mMessageQueue ? queue->size() : 1;
+  for (size_t i = 0; i < candidates; i++) {
+    nextMessage = queue->front();
+    // A next hop picked when the message was queued overrides the routing
+    nextHop = isAddressMatching(nextMessage.nextHop, NO_NEXT_HOP)
+                  ? getMACAddressForDestination(nextMessage.message.destAddress)
+                  : nextMessage.nextHop;
+    if (queue != &mMessageQueue || mBackpressure.mayTransmitTo(nextHop)) {
+      break;
+    }
+    queue->push(nextMessage);
+    queue->pop();
+    nextHop = nullptr;
+  }
+  // Every queued message waits for a congested neighbour
+  if (nextHop == nullptr) {
+    return;
+  }
 
   size_t msgSize = 18 + nextMessage.message.len;
+  mInFlightQueue = queue;
+  int channel = nextMessage.channel;
+  if (mChannels.isMultiChannel() && channel == 0) {
+    if (isAddressMatching(nextHop, ESPNowClient::BROADCAST_ADDRESS)) {
+      if (mBroadcastChannels.empty()) {
+        mBroadcastChannels = mChannels.getBroadcastChannels();
+      }
+      channel = mBroadcastChannels[mBroadcastChannelIndex];
+    } else {
+      channel = mChannels.getChannelForNextHop(nextHop);
+    }
+  }
 
-  int sent =
-      mClient.send(getMACAddressForDestination(nextMessage.message.destAddress),
-                   reinterpret_cast<uint8_t *>(&nextMessage.message), msgSize,
-                   2, nextMessage.channel);
+  // The own slot already keeps the neighbours off the air, control frames
+  // in it do not wait for the pacing. Streams are paced by their window and
+  // by the send status of each frame, mailboxes by the awake window of the
+  // child
+  bool paced =
+      !(mSlotsEnabled && queue == &mControlQueue && isTimeSynced()) &&
+      queue != &mMailboxQueue && !isStreamMessage(nextMessage.message);
+  // Retries and the way to the radio task must not leave the window either
+  u_long deadline = 0;
+  if (mSlotsEnabled && isTimeSynced()) {
+    deadline = (micros() + static_cast<u_long>(mSlots.getTimeLeft(
+                               meshMicros(), queue == &mControlQueue))) |
+               1;
+  }
+  int sent = submitToRadio(nextHop,
+                           reinterpret_cast<uint8_t *>(&nextMessage.message),
+                           msgSize, 2, channel, paced, deadline);
   mMessageSendingInProgress = true;
   FDEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::processNextMessage, sent: %d\n", sent);
   FDEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::processNextMessage, type: %d\n", nextMessage.type);
   if (sent == 0) {
     DEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::processNextMessage, sent successfully\n");
-    if (nextMessage.type == EnqueuedMessageType::Confirmed) {
+    if (nextMessage.type == EnqueuedMessageType::Confirmed &&
+        mBroadcastChannelIndex == 0) {
       ConfirmedMessage confirmedMessage = {
           .isSent = true,
-          .timestamp = 1000,
+          .timestamp = static_cast<int32_t>(mConfirmationTimeout),
           .id = nextMessage.message.id,
       };
       memcpy(confirmedMessage.destAddress, nextMessage.message.destAddress, 6);
@@ -143,7 +1137,15 @@ void QuackMeshDevice::processNextMessage() {
     }
   } else {
     mMessageSendingInProgress = false;
-    mMessageQueue.pop();
+    mBroadcastChannels.clear();
+    mBroadcastChannelIndex = 0;
+    queue->pop();
+    // A confirmed message the radio refused would never get a status
+    if (nextMessage.type == EnqueuedMessageType::Confirmed) {
+      reportMessageStatus(nextMessage.message.id,
+                          nextMessage.message.destAddress,
+                          ESPNowSentStatus::Fail);
+    }
   }
 }
 
@@ -171,9 +1173,17 @@ void QuackMeshDevice::handleOwnMessage(const Message &message) {
     case 3:
       processReceivedAcknowledgement(message);
       break;
+    case QuackMeshTypes::MESSAGE_TYPE_CONTROL:
+      if (mOnMessageCallback) {
+        mOnMessageCallback(message.type, message.srcAddress, message.data,
+                           message.len);
+      }
+      break;
     default:
-      mOnMessageCallback(message.type, message.srcAddress, message.data,
-                         message.len);
+      if (!handleControlMessage(message) && mOnMessageCallback) {
+        mOnMessageCallback(message.type, message.srcAddress, message.data,
+                           message.len);
+      }
   }
 }
 
@@ -183,6 +1193,232 @@ void QuackMeshDevice::handleForeignMessage(const Message &message) {
                           "me, throwing away\n");
 }
 
+bool QuackMeshDevice::handleControlMessage(const Message &message) {
+  if (isRpcMessage(message)) {
+    mRpc.onMessageReceived(message);
+    return true;
+  }
+  if (isStreamMessage(message)) {
+    mStreams.onMessageReceived(message);
+    return true;
+  }
+  // A MeshDevice does not serve any other protocol messages, e.g. polls
+  return message.type == QuackMeshTypes::MESSAGE_TYPE_POLL;
+}
+
+bool QuackMeshDevice::handleNeighbourMessage(const ReceivedData &data,
+                                             const Message &message) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_TIME_SYNC) {
+    if (mTimeSyncEnabled && message.len >= sizeof(TimeSyncPayload)) {
+      TimeSyncPayload payload;
+      memcpy(&payload, message.data, sizeof(TimeSyncPayload));
+      mTimeSync.onBeaconReceived(data.srcAddress, payload, data.receivedTs);
+    }
+    // Beacons are re-originated by every synchronised node, never forwarded
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_SUBSCRIBE) {
+    if (mPublishSubscribeEnabled) {
+      mPublishSubscribe.onMessageReceived(data.srcAddress, message);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_GROUP_MEMBERSHIP) {
+    if (mGroupsEnabled) {
+      mGroups.onMessageReceived(data.srcAddress, message);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_SINK_ADVERTISEMENT) {
+    // With backpressure a relay advertises its own load as well
+    const SinkEntry *sink = mAnycast.onMessageReceived(
+        data.srcAddress, message, mBackpressureEnabled ? getQueueLoad() : 0);
+    if (sink != nullptr) {
+      onSinkRouteUpdated(*sink);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_COLLECTION_BEACON) {
+    if (mCollectionEnabled) {
+      mCollection.onMessageReceived(data.srcAddress, message);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_IMAGE_SUMMARY ||
+      message.type == QuackMeshTypes::MESSAGE_TYPE_IMAGE_REQUEST ||
+      message.type == QuackMeshTypes::MESSAGE_TYPE_IMAGE_DATA) {
+    if (mDisseminationEnabled) {
+      mDissemination.onMessageReceived(data.srcAddress, message);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_CODED_BROADCAST) {
+    if (mReliableBroadcastEnabled) {
+      mCodedBroadcast.onMessageReceived(message);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_CONGESTION) {
+    if (mBackpressureEnabled) {
+      mBackpressure.onMessageReceived(data.srcAddress, message);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_SLOT_CLAIM) {
+    if (mSlotsEnabled) {
+      mSlots.onMessageReceived(data.srcAddress, message);
+    }
+    return true;
+  }
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_CHANNEL_ANNOUNCE) {
+    mChannels.onMessageReceived(data.srcAddress, message);
+    return true;
+  }
+  return false;
+}
+
+void QuackMeshDevice::handlePublication(const ReceivedData &data,
+                                        const Message &message) {
+  if (!mPublishSubscribeEnabled || message.len < sizeof(PublicationHeader) ||
+      isMessageAlreadySeen(message)) {
+    return;
+  }
+  rememberMessage(message);
+  mPublishSubscribe.deliver(message);
+}
+
+void QuackMeshDevice::routePublication(const Message &message,
+                                       const uint8_t *previousHop) {
+  EnqueuedMessage newEnqueuedMessage{
+      .type = previousHop == nullptr ? EnqueuedMessageType::Unconfirmed
+                                     : EnqueuedMessageType::Forwarded,
+      .channel = 0,
+      .message = message};
+
+  // A duty-cycled device hands everything to its parent
+  if (mSleepInterval > 0) {
+    enqueueReplicas(newEnqueuedMessage, {mParentAddress});
+    return;
+  }
+
+  std::vector<const uint8_t *> links =
+      mPublishSubscribe.getLinks(message, previousHop);
+  if (links.empty()) {
+    DEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::routePublication, no subscriber\n");
+  }
+  enqueueReplicas(newEnqueuedMessage, links);
+}
+
+void QuackMeshDevice::enqueueReplicas(const EnqueuedMessage &message,
+                                      const std::vector<const uint8_t *> &links) {
+  EnqueuedMessage replica = message;
+  if (links.size() > mMaxUnicastReplicas) {
+    memcpy(replica.nextHop, ESPNowClient::BROADCAST_ADDRESS, 6);
+    enqueueMessage(replica);
+    return;
+  }
+  // Unicasts are acknowledged on the link-layer and retried, broadcasts not
+  for (const uint8_t *link : links) {
+    memcpy(replica.nextHop, link, 6);
+    enqueueMessage(replica);
+  }
+}
+
+bool QuackMeshDevice::isGroupAddress(const uint8_t address[6]) {
+  return memcmp(address, QuackMeshTypes::GROUP_ADDRESS_PREFIX, 4) == 0;
+}
+
+void QuackMeshDevice::handleGroupMessage(const ReceivedData &data,
+                                         const Message &message) {
+  if (!mGroupsEnabled || isMessageAlreadySeen(message)) {
+    return;
+  }
+  rememberMessage(message);
+  mGroups.deliver(message);
+}
+
+void QuackMeshDevice::routeGroupMessage(const Message &message,
+                                        const uint8_t *previousHop) {
+  EnqueuedMessage newEnqueuedMessage{
+      .type = previousHop == nullptr ? EnqueuedMessageType::Unconfirmed
+                                     : EnqueuedMessageType::Forwarded,
+      .channel = 0,
+      .message = message};
+
+  // A duty-cycled device hands everything to its parent
+  if (mSleepInterval > 0) {
+    enqueueReplicas(newEnqueuedMessage, {mParentAddress});
+    return;
+  }
+
+  std::vector<const uint8_t *> links = mGroups.getLinks(message, previousHop);
+  if (links.empty()) {
+    DEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::routeGroupMessage, no members\n");
+  }
+  enqueueReplicas(newEnqueuedMessage, links);
+}
+
+bool QuackMeshDevice::isAnycastAddress(const uint8_t address[6]) {
+  return memcmp(address, QuackMeshTypes::ANYCAST_ADDRESS_PREFIX, 4) == 0;
+}
+
+void QuackMeshDevice::onSinkRouteUpdated(const SinkEntry &sink) {
+  // A MeshDevice keeps no routing table
+}
+
+void QuackMeshDevice::handleCollectionData(const ReceivedData &data,
+                                           const Message &message) {
+  if (!mCollectionEnabled || message.len < sizeof(CollectionHeader) ||
+      isMessageAlreadySeen(message)) {
+    return;
+  }
+  rememberMessage(message);
+
+  // A MeshDevice does not forward data, only the root takes it
+  if (mCollection.isRoot() &&
+      (!mAggregationEnabled || !mAggregation.hold(message))) {
+    deliverCollectionMessage(message);
+  }
+}
+
+void QuackMeshDevice::deliverCollectionMessage(const Message &message) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_AGGREGATE) {
+    mAggregation.deliver(message);
+    return;
+  }
+  if (mOnMessageCallback) {
+    mOnMessageCallback(message.type, message.srcAddress,
+                       message.data + sizeof(CollectionHeader),
+                       message.len - sizeof(CollectionHeader));
+  }
+}
+
+void QuackMeshDevice::sendTimeSyncBeacon() {
+  // Every copy carries the send time of the last copy on the same channel
+  std::vector<uint8_t> channels = {0};
+  if (mChannels.isMultiChannel()) {
+    channels = mChannels.getBroadcastChannels();
+  }
+
+  uint8_t networkID[2] = {0, 0};
+  for (uint8_t channel : channels) {
+    TimeSyncPayload payload = {};
+    mTimeSync.fillBeacon(payload, channel);
+
+    Message beacon = Message(networkID, QuackMeshTypes::MESSAGE_TYPE_TIME_SYNC,
+                             getNewMessageId(), 1, getMACAddress(),
+                             ESPNowClient::BROADCAST_ADDRESS,
+                             sizeof(TimeSyncPayload),
+                             reinterpret_cast<const uint8_t *>(&payload));
+
+    EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                       .channel = channel,
+                                       .message = beacon};
+
+    enqueueMessage(newEnqueuedMessage);
+  }
+}
+
 void QuackMeshDevice::sendAcknowledgement(const Message &message) {
   uint8_t networkID[2] = {0, 0};
   Message acknowledgementMessage = Message(networkID, 3, message.id, 3, this->getMACAddress(), message.srcAddress, 0, nullptr);
@@ -193,24 +1429,54 @@ void QuackMeshDevice::sendAcknowledgement(const Message &message) {
       .message = acknowledgementMessage
   };
 
-  mMessageQueue.push(newEnqueuedMessage);
+  enqueueMessage(newEnqueuedMessage);
 }
 
 void QuackMeshDevice::processReceivedAcknowledgement(const Message &message) {
   auto it = mMessagesLeftToConfirm.begin();
   while (it != mMessagesLeftToConfirm.end()) {
-    if (it->id == message.id && isAddressMatching(it->destAddress, message.srcAddress)) {
+    // Any known sink of an anycast service may acknowledge a message to it
+    if (it->id == message.id &&
+        (isAddressMatching(it->destAddress, message.srcAddress) ||
+         (isAnycastAddress(it->destAddress) &&
+          mAnycast.isKnownSink((it->destAddress[4] << 8) | it->destAddress[5],
+                               message.srcAddress)))) {
+        ConfirmedMessage confirmedMessage = *it;
         mMessagesLeftToConfirm.erase(it);
-        if (mSentStatusCallback) {
-          DEBUG(DEBUG_LEVEL_DEBUG, "QuackMeshDevice::processReceivedAcknowledgement ack\n");
-          mSentStatusCallback(ESPNowSentStatus::SendSuccess);
-        }
+        DEBUG(DEBUG_LEVEL_DEBUG, "QuackMeshDevice::processReceivedAcknowledgement ack\n");
+        reportMessageStatus(confirmedMessage.id, confirmedMessage.destAddress,
+                            ESPNowSentStatus::SendSuccess);
         break;
     }
     it++;
   }
 }
 
+void QuackMeshDevice::reportMessageStatus(uint8_t id,
+                                          const uint8_t destAddress[6],
+                                          int status) {
+  if (mSentStatusCallback) {
+    mSentStatusCallback(status);
+  }
+
+  auto it = std::find_if(mMessageCompletions.begin(), mMessageCompletions.end(),
+                         [&](const MessageCompletion &completion) {
+                           return completion.id == id &&
+                                  isAddressMatching(completion.destAddress,
+                                                    destAddress);
+                         });
+  if (it == mMessageCompletions.end()) {
+    return;
+  }
+  // The callback may send the next message right away
+  OnESPNowDataSentStatusCallback callback = it->callback;
+  mMessageCompletions.erase(it);
+  mPendingCompletions--;
+  if (callback) {
+    callback(status);
+  }
+}
+
 void QuackMeshDevice::updateSeenMessages() {
   if (millis() - mSeenMessagesCleanupUpdateTs < mSeenMessagesCleanupInterval) {
     return;
@@ -232,11 +1498,11 @@ void QuackMeshDevice::updateSeenMessages() {
 
 bool QuackMeshDevice::isMessageAlreadySeen(const Message &message) {
   EnqueuedMessageType type;
-  if (message.type == 0) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_UNCONFIRMED) {
     type = EnqueuedMessageType::Unconfirmed;
-  } else if (message.type == 1) {
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_CONFIRMED) {
     type = EnqueuedMessageType::Confirmed;
-  } else if (message.type == 3)  {
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_ACKNOWLEDGEMENT) {
     type = EnqueuedMessageType::Acknowledgement;
   } else {
     type = EnqueuedMessageType::Forwarded;
@@ -263,29 +1529,110 @@ void QuackMeshDevice::checkForConfirmationTimeout() {
   while (it != mMessagesLeftToConfirm.end()) {
     it->timestamp -= diff;
     if (it->timestamp <= 0) {
+      ConfirmedMessage confirmedMessage = *it;
       it = mMessagesLeftToConfirm.erase(it);
-      if (mSentStatusCallback) {
-        mSentStatusCallback(ESPNowSentStatus::Fail);
-      }
+      reportMessageStatus(confirmedMessage.id, confirmedMessage.destAddress,
+                          ESPNowSentStatus::Fail);
     } else {
       it++;
     }
   }
 }
 
-uint8_t QuackMeshDevice::getNewMessageId() { return idid++; }
+uint8_t QuackMeshDevice::getNewMessageId() {
+  CriticalSectionGuard guard(mMessageIdLock);
+  return mNextMessageId++;
+}
 
 uint8_t *QuackMeshDevice::getMACAddressForDestination(uint8_t destination[6]) {
+  // A duty-cycled device reaches the mesh through its parent
+  if (mSleepInterval > 0) {
+    return mParentAddress;
+  }
+  if (isAnycastAddress(destination)) {
+    SinkEntry *sink =
+        mAnycast.findBestSink((destination[4] << 8) | destination[5]);
+    if (sink != nullptr) {
+      return sink->nextHop;
+    }
+  }
   return ESPNowClient::BROADCAST_ADDRESS;
 }
 
+void QuackMeshDevice::sendPoll() {
+  PollPayload payload = {.sleepInterval = static_cast<uint32_t>(mSleepInterval),
+                         .awakeWindow = static_cast<uint32_t>(mAwakeWindow)};
+
+  uint8_t networkID[2] = {0, 0};
+  Message pollMessage = Message(
+      networkID, QuackMeshTypes::MESSAGE_TYPE_POLL, getNewMessageId(), 1,
+      getMACAddress(), mParentAddress, sizeof(PollPayload),
+      reinterpret_cast<const uint8_t *>(&payload));
+
+  EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Unconfirmed,
+                                     .channel = 0,
+                                     .message = pollMessage};
+
+  enqueueMessage(newEnqueuedMessage);
+}
+
+void QuackMeshDevice::updateSleepSchedule() {
+  if (mSleepInterval == 0) {
+    return;
+  }
+  if (millis() - mLastActivityTs < mAwakeWindow) {
+    return;
+  }
+
+  // Stay awake until everything is sent and all confirmations are resolved
+  if (!mMessageQueue.empty() || !mControlQueue.empty() ||
+      mMessageSendingInProgress ||
+      !mMessagesLeftToConfirm.empty() || mSubmissionQueue.size() > 0) {
+    return;
+  }
+
+  DEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::updateSleepSchedule, sleeping\n");
+  if (sleepRadio(mSleepInterval) != 0) {
+    // Without a radio there is nothing to poll, the next cycle tries again
+    DEBUG(DEBUG_LEVEL_ERR,
+          "MeshDevice::updateSleepSchedule, radio client not restarted\n");
+    return;
+  }
+
+  mLastActivityTs = millis();
+  sendPoll();
+}
+
+int QuackMeshDevice::sleepRadio(u_long duration) {
+  mClient.stop();
+#ifdef ESP32
+  esp_wifi_stop();
+  esp_sleep_enable_timer_wakeup(static_cast<uint64_t>(duration) * 1000);
+  esp_light_sleep_start();
+  esp_wifi_start();
+#endif
+#ifdef ESP8266
+  WiFi.forceSleepBegin();
+  delay(duration);
+  WiFi.forceSleepWake();
+#endif
+  return mClient.begin();
+}
+
 void QuackMeshDevice::onMessageReceived(ReceivedData data) {
   Message message = {};
 
   DEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::onMessageReceived, received message\n");
 
+  if (data.dataLength > sizeof(Message)) {
+    return;
+  }
   memcpy(&message, data.data, data.dataLength);
 
+  if (mOnFrameCallback) {
+    mOnFrameCallback(data.data, data.dataLength);
+  }
+
   // Debug print the message struct
   DEBUG(DEBUG_LEVEL_DEBUG, "Received Message:\n");
   DEBUG(DEBUG_LEVEL_DEBUG, "Type: ");
@@ -309,7 +1656,36 @@ void QuackMeshDevice::onMessageReceived(ReceivedData data) {
   }
   DEBUG(DEBUG_LEVEL_DEBUG, "\n");
 
-  if (isAddressMatching(message.destAddress, mClient.getMACAddress())) {
+  if (message.type != QuackMeshTypes::MESSAGE_TYPE_CHANNEL_ANNOUNCE) {
+    mChannels.onMeshHeard();
+  }
+
+  if (handleNeighbourMessage(data, message)) {
+    return;
+  }
+
+  // Publications are addressed to all subscribers, not to a device
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_PUBLISH) {
+    handlePublication(data, message);
+    return;
+  }
+  if (isGroupAddress(message.destAddress)) {
+    handleGroupMessage(data, message);
+    return;
+  }
+  // Collection data is unicast to the parent, whatever its destination
+  if (isCollectionMessage(message)) {
+    handleCollectionData(data, message);
+    return;
+  }
+
+  // A sink takes the messages to its service like its own ones
+  bool ownAnycast =
+      isAnycastAddress(message.destAddress) &&
+      mAnycast.isSinkOf((message.destAddress[4] << 8) | message.destAddress[5]);
+  if (isAddressMatching(message.destAddress, mClient.getMACAddress()) ||
+      ownAnycast) {
+    mLastActivityTs = millis();
     handleOwnMessage(message);
   } else {
     handleForeignMessage(message);
@@ -318,28 +1694,54 @@ void QuackMeshDevice::onMessageReceived(ReceivedData data) {
 
 void QuackMeshDevice::onMessageSent(ESPNowSentStatus status) {
   FDEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::onMessageSent status %d\n", status);
-  if (mMessageQueue.front().type == EnqueuedMessageType::Confirmed) {
+  if (mInFlightQueue == nullptr || mInFlightQueue->empty()) {
+    mMessageSendingInProgress = false;
+    return;
+  }
+  std::queue<EnqueuedMessage> &queue = *mInFlightQueue;
+
+  // A broadcast is repeated on every channel a neighbour listens on
+  if (mBroadcastChannelIndex + 1 < mBroadcastChannels.size()) {
+    mBroadcastChannelIndex++;
+    mMessageSendingInProgress = false;
+    return;
+  }
+  mBroadcastChannels.clear();
+  mBroadcastChannelIndex = 0;
+
+  if (queue.front().type == EnqueuedMessageType::Confirmed) {
     if (status == ESPNowSentStatus::Fail) {
       auto it = mMessagesLeftToConfirm.begin();
       while (it != mMessagesLeftToConfirm.end()) {
-        if (it->id == mMessageQueue.front().message.id &&
+        if (it->id == queue.front().message.id &&
             isAddressMatching(it->destAddress,
-                              mMessageQueue.front().message.destAddress)) {
+                              queue.front().message.destAddress)) {
           mMessagesLeftToConfirm.erase(it);
           break;
         }
         it++;
       }
-      if (mSentStatusCallback) {
-        mSentStatusCallback(status);
-      }
+      reportMessageStatus(queue.front().message.id,
+                          queue.front().message.destAddress, status);
     }
   } else {
     FDEBUG(DEBUG_LEVEL_DEBUG, "MeshDevice::onMessageSent, status: %d\n", status);
   }
 
+  if (mCollectionEnabled && isCollectionMessage(queue.front().message)) {
+    mCollection.onMessageSent(queue.front(),
+                              status != ESPNowSentStatus::Fail);
+  }
+
+  if (queue.front().message.type == QuackMeshTypes::MESSAGE_TYPE_TIME_SYNC &&
+      status != ESPNowSentStatus::Fail) {
+    mTimeSync.onBeaconSent(mClient.getLastSentTimestamp(),
+                           queue.front().channel);
+  }
+
   mMessageSendingInProgress = false;
-  mMessageQueue.pop();
+  queue.pop();
+  mInFlightQueue = nullptr;
 }
 
 void QuackMeshDevice::rememberMessage(const Message &message) {
@@ -348,11 +1750,11 @@ void QuackMeshDevice::rememberMessage(const Message &message) {
   }
 
   EnqueuedMessageType type;
-  if (message.type == 0) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_UNCONFIRMED) {
     type = EnqueuedMessageType::Unconfirmed;
-  } else if (message.type == 1) {
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_CONFIRMED) {
     type = EnqueuedMessageType::Confirmed;
-  } else if (message.type == 3)  {
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_ACKNOWLEDGEMENT) {
     type = EnqueuedMessageType::Acknowledgement;
   } else {
     type = EnqueuedMessageType::Forwarded;
@@ -374,3 +1776,81 @@ void QuackMeshDevice::rememberMessage(const Message &message) {
 
   mSeenMessages.push_back(newSeenMessage);
 }
+
+bool QuackMeshDevice::radioSendingPossible() const {
+#ifdef ESP32
+  if (mPipelineEnabled) {
+    return !mRadioTxRing.full();
+  }
+#endif
+  return mClient.sendingPossible();
+}
+
+int QuackMeshDevice::submitToRadio(uint8_t macAddress[6], uint8_t *data,
+                                   int dataLength, int maxSendTries,
+                                   int channel, bool paced, u_long deadline) {
+#ifdef ESP32
+  if (mPipelineEnabled) {
+    SendingData frame = {};
+    memcpy(frame.destAddress, macAddress, 6);
+    memcpy(frame.data, data, dataLength);
+    frame.dataLength = dataLength;
+    frame.maxTriesLeft = maxSendTries;
+    frame.channel = channel;
+    frame.paced = paced;
+    frame.deadline = deadline;
+    return mRadioTxRing.push(frame) ? 0 : -1;
+  }
+#endif
+  return mClient.send(macAddress, data, dataLength, maxSendTries, channel,
+                      paced, deadline);
+}
+
+#ifdef ESP32
+void QuackMeshDevice::drainRadioRings() {
+  ReceivedData data;
+  while (mRadioRxRing.pop(data)) {
+    onMessageReceived(data);
+  }
+
+  ESPNowSentStatus status;
+  while (mRadioSentRing.pop(status)) {
+    onMessageSent(status);
+  }
+}
+
+void QuackMeshDevice::serviceRadio() {
+  // Channel changes of the mesh task are applied between two frames
+  uint8_t channel = mPendingHomeChannel.exchange(0);
+  if (channel != 0) {
+    mClient.setHomeChannel(channel);
+  }
+
+  if (mClient.sendingPossible()) {
+    SendingData frame;
+    if (mRadioTxRing.pop(frame) &&
+        mClient.send(frame.destAddress, frame.data, frame.dataLength,
+                     frame.maxTriesLeft, frame.channel, frame.paced,
+                     frame.deadline) != 0) {
+      // The mesh task waits for a status of every frame it handed over
+      if (!mRadioSentRing.push(ESPNowSentStatus::Fail)) {
+        DEBUG(DEBUG_LEVEL_ERR, "MeshDevice::serviceRadio, status ring full\n");
+      }
+    }
+  }
+
+  mClient.update();
+}
+
+void QuackMeshDevice::radioTask(void *parameter) {
+  QuackMeshDevice *device = static_cast<QuackMeshDevice *>(parameter);
+
+  while (device->mRadioTaskRunning) {
+    device->serviceRadio();
+    vTaskDelay(1);
+  }
+
+  device->mRadioTaskActive = false;
+  vTaskDelete(nullptr);
+}
+#endif
@@ -8,31 +8,58 @@ the LICENSE file.
 
 #include "QuackMeshRouter.h"
 
+#include <algorithm>
+
 #include "ESPNowClient.h"
 
 #include "QuackDebug.h"
 
 using QuackMeshESPNow::ESPNowClient;
 using QuackMeshESPNow::isAddressMatching;
+using QuackMeshESPNow::ReceivedData;
 
+using QuackMeshTypes::CollectionHeader;
 using QuackMeshTypes::EnqueuedMessage;
 using QuackMeshTypes::EnqueuedMessageType;
 using QuackMeshTypes::Message;
+using QuackMeshTypes::MailboxEntry;
+using QuackMeshTypes::PollPayload;
+using QuackMeshTypes::PublicationHeader;
 using QuackMeshTypes::RoutingEntry;
+using QuackMeshTypes::SinkEntry;
+using QuackMeshTypes::SleepingChild;
 
 // PUBLIC:
 
-void QuackMeshRouter::begin() {
+int QuackMeshRouter::begin() {
   DEBUG(DEBUG_LEVEL_DEBUG, "QuackMeshRouter::begin\n");
-  QuackMeshDevice::begin();
+  // A router advertises what its branches need as well
+  mPublishSubscribe.setForwarding(true);
+  mGroups.setForwarding(true);
+  mAnycast.setForwarding(true);
+  mCollection.setForwarding(true);
+
+  int result = QuackMeshDevice::begin();
+  if (result != 0) {
+    return result;
+  }
 
   mLastRoutingTableUpdateTs = millis();
+  return 0;
 }
 
 void QuackMeshRouter::update() {
   QuackMeshDevice::update();
 
   updateRoutingTable();
+  updateSleepingChildren();
+  deliverMailboxes();
+}
+
+void QuackMeshRouter::setMailboxSize(size_t size) { mMaxMailboxSize = size; }
+
+uint32_t QuackMeshRouter::getDroppedMailboxMessages() const {
+  return mDroppedMailboxMessages;
 }
 
 // PRIVATE:
@@ -42,26 +69,27 @@ void QuackMeshRouter::handleForeignMessage(const Message &message) {
   forwardMessage(message);
 }
 
-void QuackMeshRouter::addOrUpdateRoutingInfo(uint8_t destination[6],
-                                             uint8_t link[6], uint8_t hops) {
-  std::vector<RoutingEntry>::iterator oldestEntry = mRoutingTable.begin();
+void QuackMeshRouter::addOrUpdateRoutingInfo(const uint8_t destination[6],
+                                             const uint8_t link[6],
+                                             uint8_t hops) {
+  std::vector<RoutingEntry>::iterator oldestEntry = mRoutingTable.end();
 
   auto it = mRoutingTable.begin();
   while (it != mRoutingTable.end()) {
     if (isAddressMatching(it->destination, destination)) {
-      if (hops < it->hops) {
+      // A route that is not longer or news over the same link refresh it
+      if (hops <= it->hops || isAddressMatching(it->link, link)) {
         it->hops = hops;
         it->timestamp = mRoutingTableUpdateTimeout;
         memcpy(it->link, link, 6);
-
-        oldestEntry = mRoutingTable.end();
-        return;
       }
+      return;
+    }
 
-      // Find the oldest entry
-      if (it->timestamp < oldestEntry->timestamp) {
-        oldestEntry = it;
-      }
+    // Find the oldest entry
+    if (oldestEntry == mRoutingTable.end() ||
+        it->timestamp < oldestEntry->timestamp) {
+      oldestEntry = it;
     }
     it++;
   }
@@ -70,6 +98,10 @@ void QuackMeshRouter::addOrUpdateRoutingInfo(uint8_t destination[6],
    * If the routing table is full and we didn't find an entry to update
    * remove the oldest entry
    */
+  if (mRoutingTable.size() >= mMaxRoutingEntries &&
+      oldestEntry != mRoutingTable.end()) {
+    mRoutingTable.erase(oldestEntry);
+  }
   RoutingEntry newRoutingInfo{.destination = {},
                               .link = {},
                               .hops = hops,
@@ -87,7 +119,9 @@ void QuackMeshRouter::forwardMessage(const Message &message) {
     return;
   }
 
-  if (isMessageAlreadySeen(message)) {
+  // A flooded message of this router comes back from its neighbours
+  if (isMessageAlreadySeen(message) ||
+      isAddressMatching(message.srcAddress, getMACAddress())) {
     return;
   }
 
@@ -102,7 +136,7 @@ void QuackMeshRouter::forwardMessage(const Message &message) {
   EnqueuedMessage newEnqueuedMessage{.type = EnqueuedMessageType::Forwarded,
                                      .message = forwardingMessage};
 
-  mMessageQueue.push(newEnqueuedMessage);
+  enqueueMessage(newEnqueuedMessage);
 }
 
 void QuackMeshRouter::updateRoutingTable() {
@@ -126,6 +160,16 @@ void QuackMeshRouter::updateRoutingTable() {
 }
 
 uint8_t *QuackMeshRouter::getMACAddressForDestination(uint8_t destination[6]) {
+  // Sleeping children are direct neighbours, no need to flood their frames
+  SleepingChild *child = findSleepingChild(destination);
+  if (child != nullptr) {
+    return child->address;
+  }
+
+  if (isAnycastAddress(destination)) {
+    return QuackMeshDevice::getMACAddressForDestination(destination);
+  }
+
   auto it = mRoutingTable.begin();
   while (it != mRoutingTable.end()) {
     if (isAddressMatching(destination, it->destination)) {
@@ -135,3 +179,169 @@ uint8_t *QuackMeshRouter::getMACAddressForDestination(uint8_t destination[6]) {
   }
   return ESPNowClient::BROADCAST_ADDRESS;
 }
+
+bool QuackMeshRouter::handleControlMessage(const Message &message) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_POLL) {
+    handlePoll(message);
+    return true;
+  }
+  return QuackMeshDevice::handleControlMessage(message);
+}
+
+void QuackMeshRouter::handlePublication(const ReceivedData &data,
+                                        const Message &message) {
+  if (!mPublishSubscribeEnabled || message.len < sizeof(PublicationHeader) ||
+      isMessageAlreadySeen(message)) {
+    return;
+  }
+  QuackMeshDevice::handlePublication(data, message);
+
+  if (message.hopCount - 1 == 0) {
+    return;
+  }
+  Message forwardingMessage = message;
+  forwardingMessage.hopCount--;
+  routePublication(forwardingMessage, data.srcAddress);
+}
+
+void QuackMeshRouter::handleGroupMessage(const ReceivedData &data,
+                                         const Message &message) {
+  if (!mGroupsEnabled || isMessageAlreadySeen(message)) {
+    return;
+  }
+  QuackMeshDevice::handleGroupMessage(data, message);
+
+  if (message.hopCount - 1 == 0) {
+    return;
+  }
+  Message forwardingMessage = message;
+  forwardingMessage.hopCount--;
+  routeGroupMessage(forwardingMessage, data.srcAddress);
+}
+
+void QuackMeshRouter::onSinkRouteUpdated(const SinkEntry &sink) {
+  addOrUpdateRoutingInfo(sink.sink, sink.nextHop, sink.hops);
+}
+
+void QuackMeshRouter::handleCollectionData(const ReceivedData &data,
+                                           const Message &message) {
+  if (mCollection.isRoot()) {
+    QuackMeshDevice::handleCollectionData(data, message);
+    return;
+  }
+  if (!mCollectionEnabled || message.len < sizeof(CollectionHeader) ||
+      isMessageAlreadySeen(message)) {
+    return;
+  }
+  rememberMessage(message);
+
+  Message forwardingMessage = message;
+  if (!mCollection.prepareForwarding(forwardingMessage) ||
+      (mAggregationEnabled && mAggregation.hold(forwardingMessage))) {
+    return;
+  }
+  mCollection.routeMessage(forwardingMessage, 0);
+}
+
+void QuackMeshRouter::handlePoll(const Message &message) {
+  if (message.len < sizeof(PollPayload)) {
+    return;
+  }
+  PollPayload payload;
+  memcpy(&payload, message.data, sizeof(PollPayload));
+
+  SleepingChild *child = findSleepingChild(message.srcAddress);
+  if (child == nullptr) {
+    if (mSleepingChildren.size() >= mMaxSleepingChildren) {
+      DEBUG(DEBUG_LEVEL_WARN, "QuackMeshRouter::handlePoll, no room\n");
+      return;
+    }
+    SleepingChild newChild = {};
+    memcpy(newChild.address, message.srcAddress, 6);
+    mSleepingChildren.push_back(newChild);
+    child = &mSleepingChildren.back();
+  }
+
+  child->sleepInterval = payload.sleepInterval;
+  child->awakeWindow = payload.awakeWindow;
+  child->lastPollTs = millis();
+
+  FDEBUG(DEBUG_LEVEL_DEBUG, "QuackMeshRouter::handlePoll, delivering %d\n",
+         child->mailbox.size());
+}
+
+void QuackMeshRouter::enqueueMessage(const EnqueuedMessage &message) {
+  // Own and forwarded frames for a sleeping child wait for its next poll
+  if (message.message.type != QuackMeshTypes::MESSAGE_TYPE_CONTROL &&
+      storeForSleepingChild(message)) {
+    return;
+  }
+  QuackMeshDevice::enqueueMessage(message);
+}
+
+bool QuackMeshRouter::storeForSleepingChild(const EnqueuedMessage &message) {
+  SleepingChild *child = findSleepingChild(message.message.destAddress);
+  if (child == nullptr) {
+    return false;
+  }
+  // Frames for an awake child wait behind the ones still in its mailbox
+  if (millis() - child->lastPollTs < child->awakeWindow &&
+      child->mailbox.empty()) {
+    return false;
+  }
+
+  if (child->mailbox.size() >= mMaxMailboxSize) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackMeshRouter, mailbox full, dropping oldest\n");
+    const EnqueuedMessage &oldest = child->mailbox.front().message;
+    if (oldest.type == EnqueuedMessageType::Confirmed) {
+      reportMessageStatus(oldest.message.id, oldest.message.destAddress,
+                          QuackMeshESPNow::ESPNowSentStatus::Fail);
+    }
+    child->mailbox.pop_front();
+    mDroppedMailboxMessages++;
+  }
+
+  MailboxEntry entry = {.storedTs = millis(), .message = message};
+  child->mailbox.push_back(entry);
+  return true;
+}
+
+void QuackMeshRouter::updateSleepingChildren() {
+  auto it = mSleepingChildren.begin();
+  while (it != mSleepingChildren.end()) {
+    // A child missing several polls in a row is considered gone
+    u_long pollPeriod = it->sleepInterval + it->awakeWindow;
+    if (millis() - it->lastPollTs > 3 * pollPeriod) {
+      it = mSleepingChildren.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+void QuackMeshRouter::deliverMailboxes() {
+  // One frame at a time, so nothing is sent after the child fell asleep
+  if (!mMailboxQueue.empty()) {
+    return;
+  }
+  for (SleepingChild &child : mSleepingChildren) {
+    if (child.mailbox.empty() ||
+        millis() - child.lastPollTs >= child.awakeWindow) {
+      continue;
+    }
+    EnqueuedMessage message = child.mailbox.front().message;
+    message.enqueuedTs = millis();
+    mMailboxQueue.push(message);
+    child.mailbox.pop_front();
+    return;
+  }
+}
+
+SleepingChild *QuackMeshRouter::findSleepingChild(const uint8_t address[6]) {
+  for (SleepingChild &child : mSleepingChildren) {
+    if (isAddressMatching(child.address, address)) {
+      return &child;
+    }
+  }
+  return nullptr;
+}
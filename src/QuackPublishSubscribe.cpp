@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackPublishSubscribe.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::LocalSubscription;
+using QuackMeshTypes::Message;
+using QuackMeshTypes::PublicationHeader;
+using QuackMeshTypes::SubscriptionEntry;
+using QuackMeshTypes::TopicAdvertisement;
+
+// PUBLIC:
+
+void QuackPublishSubscribe::configure(u_long advertInterval) {
+  mAdvertInterval = advertInterval;
+}
+
+void QuackPublishSubscribe::setForwarding(bool forwarding) {
+  mForwarding = forwarding;
+}
+
+void QuackPublishSubscribe::begin(SendCallback send) { mSend = send; }
+
+void QuackPublishSubscribe::update() {
+  auto it = mSubscriptionTable.begin();
+  while (it != mSubscriptionTable.end()) {
+    if (millis() - it->lastSeenTs > 3 * mAdvertInterval) {
+      it = mSubscriptionTable.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  std::vector<TopicAdvertisement> topics;
+  fillAdvertisement(topics);
+  std::sort(topics.begin(), topics.end(),
+            [](const TopicAdvertisement &a, const TopicAdvertisement &b) {
+              return a.topicHash < b.topicHash;
+            });
+  size_t maxTopics = sizeof(Message::data) / sizeof(TopicAdvertisement);
+  if (topics.size() > maxTopics) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackPublishSubscribe::update, too many\n");
+    topics.resize(maxTopics);
+  }
+
+  bool changed =
+      topics.size() != mLastAdvertisement.size() ||
+      !std::equal(topics.begin(), topics.end(), mLastAdvertisement.begin(),
+                  [](const TopicAdvertisement &a, const TopicAdvertisement &b) {
+                    return a.topicHash == b.topicHash &&
+                           a.distance == b.distance;
+                  });
+  if (!isAdvertisementDue(changed, topics.empty())) {
+    return;
+  }
+  mLastAdvertTs = millis();
+  mLastAdvertisement = topics;
+
+  mSend(reinterpret_cast<const uint8_t *>(topics.data()),
+        topics.size() * sizeof(TopicAdvertisement));
+}
+
+void QuackPublishSubscribe::onMessageReceived(const uint8_t neighbour[6],
+                                              const Message &message) {
+  mSubscriptionTable.erase(
+      std::remove_if(mSubscriptionTable.begin(), mSubscriptionTable.end(),
+                     [&](const SubscriptionEntry &entry) {
+                       return isAddressMatching(entry.neighbour, neighbour);
+                     }),
+      mSubscriptionTable.end());
+
+  size_t count = message.len / sizeof(TopicAdvertisement);
+  for (size_t i = 0; i < count; i++) {
+    if (mSubscriptionTable.size() >= mMaxSubscriptionEntries) {
+      DEBUG(DEBUG_LEVEL_WARN,
+            "QuackPublishSubscribe::onMessageReceived, table full\n");
+      return;
+    }
+    TopicAdvertisement topic;
+    memcpy(&topic, message.data + i * sizeof(TopicAdvertisement),
+           sizeof(TopicAdvertisement));
+    SubscriptionEntry entry = {.topicHash = topic.topicHash,
+                               .neighbour = {},
+                               .distance = topic.distance,
+                               .lastSeenTs = millis()};
+    memcpy(entry.neighbour, neighbour, 6);
+    mSubscriptionTable.push_back(entry);
+  }
+}
+
+int QuackPublishSubscribe::subscribe(
+    const char *topic, QuackMeshTypes::OnPublicationCallback callback) {
+  if (mLocalSubscriptions.size() >= mMaxLocalSubscriptions) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackPublishSubscribe::subscribe, too many\n");
+    return -1;
+  }
+  LocalSubscription subscription = {.topicHash = hashTopic(topic),
+                                    .callback = callback};
+  mLocalSubscriptions.push_back(subscription);
+  return 0;
+}
+
+void QuackPublishSubscribe::unsubscribe(const char *topic) {
+  uint32_t topicHash = hashTopic(topic);
+  mLocalSubscriptions.erase(
+      std::remove_if(mLocalSubscriptions.begin(), mLocalSubscriptions.end(),
+                     [&](const LocalSubscription &subscription) {
+                       return subscription.topicHash == topicHash;
+                     }),
+      mLocalSubscriptions.end());
+}
+
+void QuackPublishSubscribe::deliver(const Message &message) {
+  PublicationHeader header;
+  memcpy(&header, message.data, sizeof(PublicationHeader));
+  for (const LocalSubscription &subscription : mLocalSubscriptions) {
+    if (subscription.topicHash == header.topicHash && subscription.callback) {
+      subscription.callback(message.srcAddress,
+                            message.data + sizeof(PublicationHeader),
+                            message.len - sizeof(PublicationHeader));
+    }
+  }
+}
+
+std::vector<const uint8_t *> QuackPublishSubscribe::getLinks(
+    const Message &message, const uint8_t *previousHop) const {
+  PublicationHeader header;
+  memcpy(&header, message.data, sizeof(PublicationHeader));
+
+  // Every neighbour has at most one entry per topic
+  std::vector<const uint8_t *> links;
+  for (const SubscriptionEntry &entry : mSubscriptionTable) {
+    if (entry.topicHash != header.topicHash ||
+        entry.distance >= message.hopCount ||
+        (previousHop != nullptr &&
+         isAddressMatching(entry.neighbour, previousHop)) ||
+        isAddressMatching(entry.neighbour, message.srcAddress)) {
+      continue;
+    }
+    links.push_back(entry.neighbour);
+  }
+  return links;
+}
+
+uint8_t QuackPublishSubscribe::getHopCount() const { return mHopCount; }
+
+uint32_t QuackPublishSubscribe::hashTopic(const char *topic) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = topic; *c != '\0'; c++) {
+    hash ^= static_cast<uint8_t>(*c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// PRIVATE:
+
+void QuackPublishSubscribe::fillAdvertisement(
+    std::vector<TopicAdvertisement> &topics) const {
+  for (const LocalSubscription &subscription : mLocalSubscriptions) {
+    auto it = std::find_if(topics.begin(), topics.end(),
+                           [&](const TopicAdvertisement &topic) {
+                             return topic.topicHash == subscription.topicHash;
+                           });
+    if (it == topics.end()) {
+      TopicAdvertisement topic = {.topicHash = subscription.topicHash,
+                                  .distance = 0};
+      topics.push_back(topic);
+    }
+  }
+  if (!mForwarding) {
+    return;
+  }
+
+  // The branches are advertised with the distance to their nearest subscriber,
+  // topics further away than a publication travels are left out
+  for (const SubscriptionEntry &entry : mSubscriptionTable) {
+    uint8_t distance = entry.distance + 1;
+    if (distance >= mHopCount) {
+      continue;
+    }
+    auto it = std::find_if(topics.begin(), topics.end(),
+                           [&](const TopicAdvertisement &topic) {
+                             return topic.topicHash == entry.topicHash;
+                           });
+    if (it == topics.end()) {
+      TopicAdvertisement topic = {.topicHash = entry.topicHash,
+                                  .distance = distance};
+      topics.push_back(topic);
+    } else if (distance < it->distance) {
+      it->distance = distance;
+    }
+  }
+}
+
+bool QuackPublishSubscribe::isAdvertisementDue(bool changed, bool empty) const {
+  u_long sinceLastAdvert = millis() - mLastAdvertTs;
+  // Changes are advertised at once, nothing at all is only advertised once
+  if (changed) {
+    return sinceLastAdvert >= mMinAdvertGap;
+  }
+  return !empty && sinceLastAdvert >= mAdvertInterval;
+}
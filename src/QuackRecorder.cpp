@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackRecorder.h"
+
+using QuackMeshGateway::RecordedEvent;
+
+// PUBLIC:
+
+QuackRecorder::QuackRecorder(Print &stream, bool blocking)
+    : mStream(stream), mBlocking(blocking) {}
+
+void QuackRecorder::begin() {
+  RecordedEvent event;
+  while (mEvents.pop(event)) {
+  }
+  mDroppedEvents = 0;
+  mWriter.reset();
+  mWriter.setHeaderCallback([this](uint8_t *header) {
+    uint32_t dropped = mDroppedEvents.load(std::memory_order_relaxed);
+    memcpy(header, &dropped, 4);
+  });
+}
+
+void QuackRecorder::update() {
+  RecordedEvent event;
+  while (mEvents.pop(event)) {
+    appendRecord(event);
+  }
+
+  if (mWriter.isBatchOpen() && mWriter.getBatchAge() >= mBatchTimeout) {
+    mWriter.flush();
+  }
+  mWriter.writeTo(mStream, mBlocking);
+}
+
+void QuackRecorder::setBatchTimeout(u_long timeout) { mBatchTimeout = timeout; }
+
+uint32_t QuackRecorder::getDroppedEvents() const {
+  return mDroppedEvents.load(std::memory_order_relaxed);
+}
+
+void QuackRecorder::recordReceived(const uint8_t srcAddress[6],
+                                   const uint8_t *data, uint16_t dataLength,
+                                   int8_t rssi) {
+  if (dataLength > QuackMeshGateway::MAX_RECORDED_DATA_LENGTH) {
+    mDroppedEvents.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  RecordedEvent event;
+  event.kind = QuackMeshGateway::EVENT_RECEIVED;
+  event.timestamp = micros();
+  memcpy(event.address, srcAddress, 6);
+  event.value = static_cast<uint8_t>(rssi);
+  event.dataLength = dataLength;
+  memcpy(event.data, data, dataLength);
+  pushEvent(event);
+}
+
+void QuackRecorder::recordTransmit(const uint8_t destAddress[6],
+                                   const uint8_t *data, uint16_t dataLength,
+                                   uint8_t channel) {
+  if (dataLength > QuackMeshGateway::MAX_RECORDED_DATA_LENGTH) {
+    mDroppedEvents.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  RecordedEvent event;
+  event.kind = QuackMeshGateway::EVENT_TRANSMIT;
+  event.timestamp = micros();
+  memcpy(event.address, destAddress, 6);
+  event.value = channel;
+  event.dataLength = dataLength;
+  memcpy(event.data, data, dataLength);
+  pushEvent(event);
+}
+
+void QuackRecorder::recordSent(const uint8_t destAddress[6], int status) {
+  RecordedEvent event;
+  event.kind = QuackMeshGateway::EVENT_SENT;
+  event.timestamp = micros();
+  memcpy(event.address, destAddress, 6);
+  event.value = status == 0 ? 0 : 1;
+  event.dataLength = 0;
+  pushEvent(event);
+}
+
+// PRIVATE:
+
+void QuackRecorder::pushEvent(const RecordedEvent &event) {
+  if (!mEvents.push(event)) {
+    mDroppedEvents.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void QuackRecorder::appendRecord(const RecordedEvent &event) {
+  uint16_t length =
+      QuackMeshGateway::EVENT_RECORD_HEADER_SIZE + event.dataLength;
+  uint8_t *record = mWriter.reserve(2 + length);
+  if (record == nullptr) {
+    return;
+  }
+  record[0] = length & 0xFF;
+  record[1] = length >> 8;
+  record[2] = event.kind;
+  memcpy(record + 3, &event.timestamp, 4);
+  memcpy(record + 7, event.address, 6);
+  record[13] = event.value;
+  memcpy(record + 14, event.data, event.dataLength);
+}
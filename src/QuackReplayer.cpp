@@ -0,0 +1,162 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackReplayer.h"
+
+#include "QuackDebug.h"
+
+using QuackMeshGateway::RecordedEvent;
+
+// PUBLIC:
+
+QuackReplayer::QuackReplayer(QuackMeshDevice &device) : mDevice(device) {
+  // Live frames and real send statuses would mix with the recorded ones
+  mDevice.mClient.setReplayMode(true);
+}
+
+int QuackReplayer::load(const uint8_t *recording, size_t length) {
+  mEvents.clear();
+  mOffsets.clear();
+  mDroppedEvents = 0;
+
+  uint8_t packet[QuackMeshGateway::MAX_PACKET_SIZE + 8];
+  size_t frameStart = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (recording[i] != 0) {
+      continue;
+    }
+    size_t frameLength = i - frameStart;
+    if (frameLength > 0 && frameLength <= sizeof(packet)) {
+      size_t packetLength =
+          QuackMeshGateway::decodeCOBS(recording + frameStart, frameLength,
+                                       packet);
+      parseBatch(packet, packetLength);
+    }
+    frameStart = i + 1;
+  }
+
+  if (mEvents.empty()) {
+    return -1;
+  }
+
+  // The offsets are summed up from deltas, so a wrap of micros() is harmless
+  uint64_t offset = 0;
+  mOffsets.push_back(0);
+  for (size_t i = 1; i < mEvents.size(); i++) {
+    offset += static_cast<uint32_t>(mEvents[i].timestamp -
+                                    mEvents[i - 1].timestamp);
+    mOffsets.push_back(offset);
+  }
+  return static_cast<int>(mEvents.size());
+}
+
+void QuackReplayer::start(float speed) {
+  mSpeed = speed;
+  mNextEvent = 0;
+  mReplayedEvents = 0;
+  mSkippedStatuses = 0;
+  mDueStatuses.clear();
+  mElapsed = 0;
+  mLastUpdateTs = micros();
+}
+
+bool QuackReplayer::update() {
+  u_long now = micros();
+  mElapsed += now - mLastUpdateTs;
+  mLastUpdateTs = now;
+  uint64_t replayedTime = static_cast<uint64_t>(mElapsed * mSpeed);
+
+  QuackMeshESPNow::ESPNowClient &client = mDevice.mClient;
+  while (mNextEvent < mEvents.size()) {
+    if (mSpeed > 0 && mOffsets[mNextEvent] > replayedTime) {
+      break;
+    }
+    const RecordedEvent &event = mEvents[mNextEvent++];
+    if (event.kind == QuackMeshGateway::EVENT_RECEIVED) {
+      client.processReceivedData(event.address, event.data, event.dataLength,
+                                 static_cast<int8_t>(event.value));
+      mReplayedEvents++;
+    } else if (event.kind == QuackMeshGateway::EVENT_SENT) {
+      mDueStatuses.push_back(event);
+    }
+    // As fast as possible means one event per update, so the device keeps up
+    if (mSpeed == 0) {
+      break;
+    }
+  }
+
+  // The oldest due status to the same destination completes the frame the
+  // device is sending, statuses of frames it did not send are skipped
+  const uint8_t *destination = client.getWaitingDestination();
+  if (destination != nullptr) {
+    for (auto it = mDueStatuses.begin(); it != mDueStatuses.end(); it++) {
+      if (!QuackMeshESPNow::isAddressMatching(it->address, destination)) {
+        continue;
+      }
+      client.processDataSent(it->address, it->value);
+      mSkippedStatuses += it - mDueStatuses.begin();
+      mDueStatuses.erase(mDueStatuses.begin(), it + 1);
+      mReplayedEvents++;
+      break;
+    }
+  }
+
+  return mNextEvent < mEvents.size();
+}
+
+size_t QuackReplayer::getReplayedEvents() const { return mReplayedEvents; }
+
+uint32_t QuackReplayer::getDroppedEvents() const { return mDroppedEvents; }
+
+size_t QuackReplayer::getSkippedStatuses() const { return mSkippedStatuses; }
+
+// PRIVATE:
+
+void QuackReplayer::parseBatch(const uint8_t *packet, size_t length) {
+  size_t headerSize = QuackMeshGateway::COMMON_HEADER_SIZE + 4;
+  if (length < headerSize + 2) {
+    return;
+  }
+  uint16_t crc = packet[length - 2] | (packet[length - 1] << 8);
+  if (crc != QuackMeshGateway::crc16(packet, length - 2) ||
+      packet[0] != QuackMeshGateway::PACKET_RECORDING) {
+    DEBUG(DEBUG_LEVEL_WARN, "QuackReplayer::parseBatch, skipped batch\n");
+    return;
+  }
+
+  uint32_t dropped;
+  memcpy(&dropped, packet + QuackMeshGateway::COMMON_HEADER_SIZE, 4);
+  // The recorder writes its running total into every batch
+  if (dropped > mDroppedEvents) {
+    mDroppedEvents = dropped;
+  }
+
+  size_t position = headerSize;
+  size_t end = length - 2;
+  while (position + 2 <= end) {
+    uint16_t recordLength = packet[position] | (packet[position + 1] << 8);
+    position += 2;
+    if (recordLength < QuackMeshGateway::EVENT_RECORD_HEADER_SIZE ||
+        recordLength - QuackMeshGateway::EVENT_RECORD_HEADER_SIZE >
+            QuackMeshGateway::MAX_RECORDED_DATA_LENGTH ||
+        position + recordLength > end) {
+      return;
+    }
+    const uint8_t *record = packet + position;
+    RecordedEvent event;
+    event.kind = record[0];
+    memcpy(&event.timestamp, record + 1, 4);
+    memcpy(event.address, record + 5, 6);
+    event.value = record[11];
+    event.dataLength =
+        recordLength - QuackMeshGateway::EVENT_RECORD_HEADER_SIZE;
+    memcpy(event.data, record + 12, event.dataLength);
+    mEvents.push_back(event);
+    position += recordLength;
+  }
+}
@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackRpc.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::Message;
+using QuackMeshTypes::OnRpcCompletedCallback;
+using QuackMeshTypes::PendingRpcCall;
+using QuackMeshTypes::RpcHeader;
+using QuackMeshTypes::RpcMethod;
+
+// PUBLIC:
+
+void QuackRpc::begin(SendCallback send) { mSend = send; }
+
+void QuackRpc::update() {
+  // The callbacks are called afterwards, they may start new calls
+  std::vector<OnRpcCompletedCallback> timedOut;
+  auto it = mPendingCalls.begin();
+  while (it != mPendingCalls.end()) {
+    if (millis() - it->startTs < it->timeout) {
+      it++;
+      continue;
+    }
+    timedOut.push_back(it->callback);
+    it = mPendingCalls.erase(it);
+  }
+  for (const OnRpcCompletedCallback &callback : timedOut) {
+    if (callback) {
+      callback(QuackMeshTypes::RPC_TIMEOUT, nullptr, 0);
+    }
+  }
+}
+
+void QuackRpc::onMessageReceived(const Message &message) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_RPC_REQUEST) {
+    handleRequest(message);
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_RPC_RESPONSE) {
+    handleResponse(message);
+  }
+}
+
+int QuackRpc::registerMethod(uint16_t method,
+                             QuackMeshTypes::RpcHandler handler) {
+  if (mMethods.size() >= mMaxMethods) {
+    return -1;
+  }
+  RpcMethod newMethod = {.method = method, .handler = handler};
+  mMethods.push_back(newMethod);
+  return 0;
+}
+
+int QuackRpc::call(const uint8_t destination[6], uint16_t method,
+                   const uint8_t *request, size_t requestLength,
+                   OnRpcCompletedCallback callback, u_long timeout) {
+  if (requestLength > QuackMeshTypes::MAX_RPC_DATA_LENGTH) {
+    return -1;
+  }
+  if (mPendingCalls.size() >= mMaxPendingCalls) {
+    return -2;
+  }
+  uint8_t payload[sizeof(Message::data)];
+  RpcHeader header = {.callId = mNextCallId++, .method = method, .status = 0};
+  memcpy(payload, &header, sizeof(RpcHeader));
+  memcpy(payload + sizeof(RpcHeader), request, requestLength);
+
+  PendingRpcCall call = {.callId = header.callId,
+                         .destination = {},
+                         .startTs = millis(),
+                         .timeout = timeout,
+                         .callback = callback};
+  memcpy(call.destination, destination, 6);
+  mPendingCalls.push_back(call);
+
+  mSend(QuackMeshTypes::MESSAGE_TYPE_RPC_REQUEST, destination, payload,
+        sizeof(RpcHeader) + requestLength);
+  return 0;
+}
+
+// PRIVATE:
+
+void QuackRpc::handleRequest(const Message &message) {
+  if (message.len < sizeof(RpcHeader)) {
+    return;
+  }
+  RpcHeader header;
+  memcpy(&header, message.data, sizeof(RpcHeader));
+
+  uint8_t payload[sizeof(Message::data)];
+  size_t responseLength = 0;
+  auto it = std::find_if(mMethods.begin(), mMethods.end(),
+                         [&](const RpcMethod &method) {
+                           return method.method == header.method;
+                         });
+  if (it == mMethods.end()) {
+    header.status = QuackMeshTypes::RPC_UNKNOWN_METHOD;
+  } else {
+    header.status = it->handler(
+        message.srcAddress, message.data + sizeof(RpcHeader),
+        message.len - sizeof(RpcHeader), payload + sizeof(RpcHeader),
+        responseLength);
+    if (responseLength > QuackMeshTypes::MAX_RPC_DATA_LENGTH) {
+      responseLength = QuackMeshTypes::MAX_RPC_DATA_LENGTH;
+    }
+  }
+  memcpy(payload, &header, sizeof(RpcHeader));
+
+  // The response is the acknowledgement, the request is never acknowledged
+  mSend(QuackMeshTypes::MESSAGE_TYPE_RPC_RESPONSE, message.srcAddress, payload,
+        sizeof(RpcHeader) + responseLength);
+}
+
+void QuackRpc::handleResponse(const Message &message) {
+  if (message.len < sizeof(RpcHeader)) {
+    return;
+  }
+  RpcHeader header;
+  memcpy(&header, message.data, sizeof(RpcHeader));
+
+  auto it = std::find_if(mPendingCalls.begin(), mPendingCalls.end(),
+                         [&](const PendingRpcCall &call) {
+                           return call.callId == header.callId &&
+                                  isAddressMatching(call.destination,
+                                                    message.srcAddress);
+                         });
+  // A late response of a call that already timed out is dropped
+  if (it == mPendingCalls.end()) {
+    return;
+  }
+  OnRpcCompletedCallback callback = it->callback;
+  mPendingCalls.erase(it);
+  if (callback) {
+    callback(header.status, message.data + sizeof(RpcHeader),
+             message.len - sizeof(RpcHeader));
+  }
+}
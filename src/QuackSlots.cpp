@@ -0,0 +1,219 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackSlots.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::Message;
+using QuackMeshTypes::SlotClaimEntry;
+using QuackMeshTypes::SlotClaimPayload;
+using QuackMeshTypes::SlotNeighbour;
+
+// PUBLIC:
+
+int QuackSlots::configure(uint8_t slotCount, u_long slotLength,
+                          u_long contentionLength) {
+  // Every slot and the contention period need time left between their
+  // guard times, otherwise their messages are never sent
+  if (slotCount == 0 || slotLength <= 2 * mGuardTime ||
+      contentionLength <= mGuardTime) {
+    return -1;
+  }
+  mSlotCount = slotCount;
+  mSlotLength = slotLength;
+  mContentionLength = contentionLength;
+  return 0;
+}
+
+int QuackSlots::setTransmitSlot(uint8_t slot) {
+  if (slot >= mSlotCount) {
+    return -1;
+  }
+  mTransmitSlot = slot;
+  mTransmitSlotFixed = true;
+  return 0;
+}
+
+int16_t QuackSlots::getTransmitSlot() const { return mTransmitSlot; }
+
+void QuackSlots::begin(const uint8_t ownAddress[6], SendCallback send) {
+  memcpy(mOwnAddress, ownAddress, 6);
+  mSend = send;
+  // The first guess spreads the devices, claims sort out the collisions
+  if (mTransmitSlot < 0) {
+    mTransmitSlot = (mOwnAddress[4] ^ mOwnAddress[5]) % mSlotCount;
+  }
+}
+
+void QuackSlots::update() {
+  auto it = mNeighbours.begin();
+  while (it != mNeighbours.end()) {
+    if (millis() - it->lastSeenTs > 3 * mClaimInterval) {
+      it = mNeighbours.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  if (mLastClaimTs == 0 || millis() - mLastClaimTs >= mClaimInterval) {
+    sendClaim();
+  }
+}
+
+void QuackSlots::onMessageReceived(const uint8_t neighbour[6],
+                                   const Message &message) {
+  if (message.len < sizeof(SlotClaimPayload)) {
+    return;
+  }
+  SlotClaimPayload claim;
+  memcpy(&claim, message.data, sizeof(SlotClaimPayload));
+  updateNeighbour(neighbour, claim.slot, 1);
+
+  size_t count = std::min<size_t>(
+      claim.count,
+      (message.len - sizeof(SlotClaimPayload)) / sizeof(SlotClaimEntry));
+  for (size_t i = 0; i < count; i++) {
+    SlotClaimEntry entry;
+    memcpy(&entry,
+           message.data + sizeof(SlotClaimPayload) + i * sizeof(SlotClaimEntry),
+           sizeof(SlotClaimEntry));
+    if (!isAddressMatching(entry.address, mOwnAddress)) {
+      updateNeighbour(entry.address, entry.slot, 2);
+    }
+  }
+
+  resolveCollision();
+}
+
+uint64_t QuackSlots::getTimeLeft(uint64_t meshTime, bool control) const {
+  uint64_t slotLength = static_cast<uint64_t>(mSlotLength) * 1000;
+  uint64_t slotsLength = slotLength * mSlotCount;
+  uint64_t superframeLength =
+      slotsLength + static_cast<uint64_t>(mContentionLength) * 1000;
+  uint64_t position = meshTime % superframeLength;
+  uint64_t guardTime = static_cast<uint64_t>(mGuardTime) * 1000;
+
+  // The contention period ends where the first slot of the next superframe
+  // begins
+  if (!control) {
+    if (position < slotsLength ||
+        position + guardTime >= superframeLength) {
+      return 0;
+    }
+    return superframeLength - guardTime - position;
+  }
+
+  if (mTransmitSlot < 0) {
+    return 0;
+  }
+  uint64_t slotStart = static_cast<uint64_t>(mTransmitSlot) * slotLength;
+  if (position < slotStart + guardTime ||
+      position + guardTime >= slotStart + slotLength) {
+    return 0;
+  }
+  return slotStart + slotLength - guardTime - position;
+}
+
+// PRIVATE:
+
+void QuackSlots::sendClaim() {
+  mLastClaimTs = millis();
+  uint8_t payload[sizeof(Message::data)];
+  SlotClaimPayload claim = {.slot = static_cast<uint8_t>(mTransmitSlot),
+                            .count = 0};
+  size_t length = sizeof(SlotClaimPayload);
+
+  // The neighbours' slots let the devices two hops away avoid them as well
+  for (const SlotNeighbour &neighbour : mNeighbours) {
+    if (neighbour.hops != 1 ||
+        claim.count >= QuackMeshTypes::MAX_SLOT_CLAIM_ENTRIES) {
+      continue;
+    }
+    SlotClaimEntry entry = {.address = {}, .slot = neighbour.slot};
+    memcpy(entry.address, neighbour.address, 6);
+    memcpy(payload + length, &entry, sizeof(SlotClaimEntry));
+    length += sizeof(SlotClaimEntry);
+    claim.count++;
+  }
+  memcpy(payload, &claim, sizeof(SlotClaimPayload));
+
+  // Sent in the contention period, a shared slot would swallow it
+  mSend(payload, length);
+}
+
+void QuackSlots::updateNeighbour(const uint8_t address[6], uint8_t slot,
+                                 uint8_t hops) {
+  auto oldest = mNeighbours.end();
+  for (auto it = mNeighbours.begin(); it != mNeighbours.end(); it++) {
+    if (isAddressMatching(it->address, address)) {
+      // The own claim of a neighbour is newer than what others relay of it
+      if (hops > it->hops) {
+        return;
+      }
+      it->slot = slot;
+      it->hops = hops;
+      it->lastSeenTs = millis();
+      return;
+    }
+    if (oldest == mNeighbours.end() || it->lastSeenTs < oldest->lastSeenTs) {
+      oldest = it;
+    }
+  }
+
+  if (mNeighbours.size() >= mMaxNeighbours && oldest != mNeighbours.end()) {
+    mNeighbours.erase(oldest);
+  }
+  SlotNeighbour newNeighbour = {.address = {},
+                                .slot = slot,
+                                .hops = hops,
+                                .lastSeenTs = millis()};
+  memcpy(newNeighbour.address, address, 6);
+  mNeighbours.push_back(newNeighbour);
+}
+
+void QuackSlots::resolveCollision() {
+  // Of two devices in the same slot, the one with the higher address moves
+  bool collision = std::any_of(
+      mNeighbours.begin(), mNeighbours.end(),
+      [&](const SlotNeighbour &neighbour) {
+        return neighbour.slot == mTransmitSlot &&
+               memcmp(neighbour.address, mOwnAddress, 6) < 0;
+      });
+  if (!collision) {
+    return;
+  }
+  if (mTransmitSlotFixed) {
+    DEBUG(DEBUG_LEVEL_WARN,
+          "QuackSlots::resolveCollision, fixed slot used by a neighbour\n");
+    return;
+  }
+
+  std::vector<bool> used(mSlotCount, false);
+  for (const SlotNeighbour &neighbour : mNeighbours) {
+    if (neighbour.slot < mSlotCount) {
+      used[neighbour.slot] = true;
+    }
+  }
+  auto freeSlot = std::find(used.begin(), used.end(), false);
+  if (freeSlot == used.end()) {
+    DEBUG(DEBUG_LEVEL_WARN,
+          "QuackSlots::resolveCollision, no free slot within two hops\n");
+    return;
+  }
+  mTransmitSlot = freeSlot - used.begin();
+  FDEBUG(DEBUG_LEVEL_DEBUG, "QuackSlots::resolveCollision, moved to slot %d\n",
+         mTransmitSlot);
+  // The neighbours have to learn the new slot before it collides again
+  sendClaim();
+}
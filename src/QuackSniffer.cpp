@@ -0,0 +1,174 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackSniffer.h"
+
+#ifdef ESP32
+#include <WiFi.h>
+#endif
+
+#include "QuackDebug.h"
+
+using QuackMeshGateway::CaptureRecord;
+
+std::atomic<QuackSniffer *> QuackSniffer::ACTIVE_SNIFFER = {nullptr};
+
+namespace {
+
+// The OUI of Espressif in the action frames of ESP-Now
+const uint8_t ESPRESSIF_OUI[3] = {0x18, 0xFE, 0x34};
+
+}  // namespace
+
+// PUBLIC:
+
+QuackSniffer::QuackSniffer(Stream &stream) : mStream(stream) {}
+
+int QuackSniffer::begin(uint8_t channel) {
+  QuackSniffer *expected = nullptr;
+  if (!ACTIVE_SNIFFER.compare_exchange_strong(expected, this)) {
+    return -1;
+  }
+
+  mCaptures.clear();
+  mDroppedFrames = 0;
+  mWriter.reset();
+  mWriter.setHeaderCallback([this](uint8_t *header) {
+    uint32_t dropped = mDroppedFrames.load(std::memory_order_relaxed);
+    memcpy(header, &dropped, 4);
+  });
+  mChannel = channel;
+
+#ifdef ESP32
+  // ESP-Now frames are vendor specific action frames
+  wifi_promiscuous_filter_t filter = {};
+  filter.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT;
+  esp_wifi_set_promiscuous_filter(&filter);
+  esp_wifi_set_promiscuous_rx_cb(QuackSniffer::onPromiscuousFrame);
+  esp_wifi_set_promiscuous(true);
+  esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+  return 0;
+#else
+  DEBUG(DEBUG_LEVEL_ERR, "QuackSniffer::begin, not supported\n");
+  ACTIVE_SNIFFER = nullptr;
+  return -1;
+#endif
+}
+
+void QuackSniffer::stop() {
+#ifdef ESP32
+  esp_wifi_set_promiscuous(false);
+  esp_wifi_set_promiscuous_rx_cb(nullptr);
+#endif
+  QuackSniffer *expected = this;
+  ACTIVE_SNIFFER.compare_exchange_strong(expected, nullptr);
+}
+
+void QuackSniffer::update() {
+  CaptureRecord capture;
+  while (mCaptures.pop(capture)) {
+    appendRecord(capture);
+  }
+
+  if (mWriter.isBatchOpen() && mWriter.getBatchAge() >= mBatchTimeout) {
+    mWriter.flush();
+  }
+  mWriter.writeTo(mStream);
+}
+
+void QuackSniffer::setChannel(uint8_t channel) {
+  mChannel = channel;
+#ifdef ESP32
+  esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+#endif
+}
+
+void QuackSniffer::setBatchTimeout(u_long timeout) { mBatchTimeout = timeout; }
+
+uint32_t QuackSniffer::getDroppedFrames() const {
+  return mDroppedFrames.load(std::memory_order_relaxed);
+}
+
+void QuackSniffer::processFrame(const uint8_t destAddress[6],
+                                const uint8_t srcAddress[6],
+                                const uint8_t *data, uint8_t dataLength,
+                                int8_t rssi, uint8_t channel,
+                                uint32_t timestamp) {
+  CaptureRecord capture;
+  capture.timestamp = timestamp;
+  capture.rssi = rssi;
+  capture.channel = channel;
+  memcpy(capture.destAddress, destAddress, 6);
+  memcpy(capture.srcAddress, srcAddress, 6);
+  capture.dataLength = dataLength;
+  memcpy(capture.data, data, dataLength);
+  if (!mCaptures.push(capture)) {
+    mDroppedFrames.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// PRIVATE:
+
+#ifdef ESP32
+void QuackSniffer::onPromiscuousFrame(void *buffer,
+                                      wifi_promiscuous_pkt_type_t type) {
+  QuackSniffer *sniffer = ACTIVE_SNIFFER.load(std::memory_order_acquire);
+  if (sniffer == nullptr || type != WIFI_PKT_MGMT) {
+    return;
+  }
+
+  const wifi_promiscuous_pkt_t *packet =
+      static_cast<const wifi_promiscuous_pkt_t *>(buffer);
+  const uint8_t *frame = packet->payload;
+  // The signal length includes the FCS
+  size_t length = packet->rx_ctrl.sig_len;
+  if (length < 24 + 15 + 4) {
+    return;
+  }
+  length -= 4;
+
+  // Action frame: category vendor specific, OUI, random bytes, then a vendor
+  // specific element with OUI, type 4 (ESP-Now) and version
+  const uint8_t *body = frame + 24;
+  if (frame[0] != 0xD0 || body[0] != 0x7F ||
+      memcmp(body + 1, ESPRESSIF_OUI, 3) != 0 || body[8] != 0xDD ||
+      memcmp(body + 10, ESPRESSIF_OUI, 3) != 0 || body[13] != 0x04) {
+    return;
+  }
+  uint8_t elementLength = body[9];
+  if (elementLength < 5) {
+    return;
+  }
+  size_t dataLength = elementLength - 5;
+  if (24 + 15 + dataLength > length || dataLength > 250) {
+    return;
+  }
+
+  sniffer->processFrame(frame + 4, frame + 10, body + 15,
+                        static_cast<uint8_t>(dataLength),
+                        packet->rx_ctrl.rssi, packet->rx_ctrl.channel,
+                        packet->rx_ctrl.timestamp);
+}
+#endif
+
+void QuackSniffer::appendRecord(const CaptureRecord &capture) {
+  uint16_t length =
+      QuackMeshGateway::CAPTURE_RECORD_HEADER_SIZE + capture.dataLength;
+  uint8_t *record = mWriter.reserve(2 + length);
+  if (record == nullptr) {
+    return;
+  }
+  record[0] = length & 0xFF;
+  record[1] = length >> 8;
+  memcpy(record + 2, &capture.timestamp, 4);
+  record[6] = static_cast<uint8_t>(capture.rssi);
+  record[7] = capture.channel;
+  memcpy(record + 8, capture.destAddress, 6);
+  memcpy(record + 14, capture.srcAddress, 6);
+  memcpy(record + 20, capture.data, capture.dataLength);
+}
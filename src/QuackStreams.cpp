@@ -0,0 +1,727 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackStreams.h"
+
+#include <algorithm>
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+#include "QuackFec.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::IncomingStream;
+using QuackMeshTypes::Message;
+using QuackMeshTypes::OutgoingStream;
+using QuackMeshTypes::StreamAckPayload;
+using QuackMeshTypes::StreamHeader;
+using QuackMeshTypes::StreamRepair;
+using QuackMeshTypes::StreamRepairHeader;
+using QuackMeshTypes::StreamSegment;
+
+namespace {
+
+// The bounds of the retransmission timeout in milliseconds
+constexpr u_long INITIAL_TIMEOUT = 1000;
+constexpr u_long MIN_TIMEOUT = 200;
+constexpr u_long MAX_TIMEOUT = 8000;
+
+}  // namespace
+
+// PUBLIC:
+
+void QuackStreams::setWindow(uint8_t segments) {
+  mWindow = std::min(std::max<uint8_t>(segments, 1),
+                     QuackMeshTypes::MAX_STREAM_WINDOW);
+  mBufferSegments = std::max<size_t>(mBufferSegments, segments);
+}
+
+void QuackStreams::enableFec(uint8_t blockSegments, uint8_t maxRepairs) {
+  // Blocks are aligned to their size, so they stay aligned when the
+  // sequence wraps
+  uint8_t size = 1;
+  while (size * 2 <= std::min(blockSegments,
+                              QuackMeshTypes::MAX_STREAM_CODING_BLOCK)) {
+    size *= 2;
+  }
+  mCodingBlock = size;
+  mMaxRepairs = std::min<uint8_t>(maxRepairs, QuackMeshFec::MAX_SYMBOLS);
+}
+
+void QuackStreams::begin(SendCallback send) { mSend = send; }
+
+void QuackStreams::update(bool sendingPossible) {
+  u_long now = millis();
+
+  // The callbacks are called afterwards, they may open new streams
+  std::vector<OutgoingStream> failed;
+  auto it = mOutgoingStreams.begin();
+  while (it != mOutgoingStreams.end()) {
+    uint16_t inFlight = it->sendSequence - it->firstSequence;
+    if (inFlight > 0 && now - it->retransmitTs >= it->retransmitTimeout) {
+      if (++it->timeouts >= mMaxTimeouts) {
+        DEBUG(DEBUG_LEVEL_WARN, "QuackStreams::update, stream failed\n");
+        failed.push_back(*it);
+        it = mOutgoingStreams.erase(it);
+        continue;
+      }
+      // The segments the receiver did not report are sent again
+      for (size_t i = 0; i < inFlight; i++) {
+        if (!it->segments[i].received) {
+          sendSegment(*it, it->segments[i]);
+        }
+      }
+      it->retransmitTimeout =
+          std::min(it->retransmitTimeout * 2, MAX_TIMEOUT);
+      it->retransmitTs = now;
+    }
+
+    if (it->repairsLeft > 0 && updateRepairs(*it, sendingPossible)) {
+      it++;
+      continue;
+    }
+
+    uint8_t window = std::min(mWindow, it->peerWindow);
+    while (inFlight < window && inFlight < it->segments.size()) {
+      StreamSegment &segment = it->segments[inFlight];
+      // A partial segment waits for more data while others are in flight
+      if (inFlight > 0 &&
+          segment.length < QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH &&
+          !(segment.flags & QuackMeshTypes::STREAM_FLAG_FIN)) {
+        break;
+      }
+      if (inFlight == 0) {
+        it->retransmitTs = now;
+      }
+      sendSegment(*it, segment);
+      it->sendSequence++;
+      inFlight++;
+      // The repairs of a complete block go out before new segments
+      if (mCodingBlock > 0 &&
+          it->sendSequence % mCodingBlock == 0) {
+        startRepairs(*it, it->sendSequence - mCodingBlock);
+        if (it->repairsLeft > 0) {
+          break;
+        }
+      }
+    }
+    it++;
+  }
+
+  auto incoming = mIncomingStreams.begin();
+  while (incoming != mIncomingStreams.end()) {
+    if (incoming->unacknowledged > 0 &&
+        now - incoming->ackDueTs >= mAckDelay) {
+      sendAck(*incoming);
+    }
+    if (now - incoming->lastSeenTs >= mIdleTimeout) {
+      incoming = mIncomingStreams.erase(incoming);
+      continue;
+    }
+    incoming++;
+  }
+
+  for (const OutgoingStream &stream : failed) {
+    if (stream.callback) {
+      stream.callback(stream.streamId, QuackMeshTypes::STREAM_FAILED);
+    }
+  }
+}
+
+void QuackStreams::onMessageReceived(const Message &message) {
+  if (message.type == QuackMeshTypes::MESSAGE_TYPE_STREAM_DATA) {
+    handleData(message);
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_STREAM_ACK) {
+    handleAck(message);
+  } else if (message.type == QuackMeshTypes::MESSAGE_TYPE_STREAM_REPAIR) {
+    handleRepair(message);
+  }
+}
+
+int QuackStreams::open(const uint8_t destination[6],
+                       QuackMeshTypes::OnStreamClosedCallback callback) {
+  if (mOutgoingStreams.size() >= mMaxStreams) {
+    return -1;
+  }
+  // Skip the ids of streams that are still open after the ids wrapped
+  while (std::any_of(mOutgoingStreams.begin(), mOutgoingStreams.end(),
+                     [&](const OutgoingStream &stream) {
+                       return stream.streamId == mNextStreamId;
+                     })) {
+    mNextStreamId++;
+  }
+  OutgoingStream stream = {.streamId = mNextStreamId++,
+                           .destination = {},
+                           .segments = {},
+                           .firstSequence = 0,
+                           .sendSequence = 0,
+                           .nextSequence = 0,
+                           .peerWindow = mWindow,
+                           .timeouts = 0,
+                           .closing = false,
+                           .smoothedRtt = 0,
+                           .rttVariation = 0,
+                           .retransmitTimeout = INITIAL_TIMEOUT,
+                           .retransmitTs = 0,
+                           .lossRate = 0,
+                           .recovered = 0,
+                           .repairSequence = 0,
+                           .repairIndex = 0,
+                           .repairsLeft = 0,
+                           .callback = callback};
+  memcpy(stream.destination, destination, 6);
+  mOutgoingStreams.push_back(stream);
+  return stream.streamId;
+}
+
+int QuackStreams::write(uint8_t streamId, const uint8_t *data,
+                        size_t dataLength) {
+  auto it = std::find_if(
+      mOutgoingStreams.begin(), mOutgoingStreams.end(),
+      [&](const OutgoingStream &stream) { return stream.streamId == streamId; });
+  if (it == mOutgoingStreams.end() || it->closing) {
+    return -1;
+  }
+  size_t written = 0;
+  while (written < dataLength) {
+    // Data is appended to the last segment as long as it was not sent
+    if (!it->segments.empty() && it->segments.back().transmissions == 0 &&
+        it->segments.back().length < QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH) {
+      StreamSegment &segment = it->segments.back();
+      size_t length =
+          std::min(QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH - segment.length,
+                   dataLength - written);
+      memcpy(segment.data + segment.length, data + written, length);
+      segment.length += length;
+      written += length;
+      continue;
+    }
+    if (it->segments.size() >= mBufferSegments) {
+      break;
+    }
+    StreamSegment segment = {.sequence = it->nextSequence++,
+                             .flags = 0,
+                             .length = 0,
+                             .data = {},
+                             .transmissions = 0,
+                             .received = false,
+                             .sentTs = 0};
+    it->segments.push_back(segment);
+  }
+  return written;
+}
+
+int QuackStreams::close(uint8_t streamId) {
+  auto it = std::find_if(
+      mOutgoingStreams.begin(), mOutgoingStreams.end(),
+      [&](const OutgoingStream &stream) { return stream.streamId == streamId; });
+  if (it == mOutgoingStreams.end() || it->closing) {
+    return -1;
+  }
+  it->closing = true;
+  if (!it->segments.empty() && it->segments.back().transmissions == 0) {
+    it->segments.back().flags |= QuackMeshTypes::STREAM_FLAG_FIN;
+    return 0;
+  }
+  // The end of the stream gets a segment of its own, even if the buffer is
+  // full
+  StreamSegment segment = {.sequence = it->nextSequence++,
+                           .flags = QuackMeshTypes::STREAM_FLAG_FIN,
+                           .length = 0,
+                           .data = {},
+                           .transmissions = 0,
+                           .received = false,
+                           .sentTs = 0};
+  it->segments.push_back(segment);
+  return 0;
+}
+
+void QuackStreams::setOnDataCallback(
+    QuackMeshTypes::OnStreamDataCallback callback) {
+  mOnDataCallback = callback;
+}
+
+// PRIVATE:
+
+void QuackStreams::sendSegment(OutgoingStream &stream,
+                               StreamSegment &segment) {
+  if (segment.transmissions > 0) {
+    addLossSample(stream, true);
+  }
+
+  uint8_t payload[sizeof(Message::data)];
+  StreamHeader header = {.sequence = segment.sequence,
+                         .streamId = stream.streamId,
+                         .flags = segment.flags};
+  memcpy(payload, &header, sizeof(StreamHeader));
+  memcpy(payload + sizeof(StreamHeader), segment.data, segment.length);
+
+  segment.transmissions++;
+  segment.sentTs = millis();
+
+  mSend(QuackMeshTypes::MESSAGE_TYPE_STREAM_DATA, stream.destination, payload,
+        sizeof(StreamHeader) + segment.length);
+}
+
+void QuackStreams::startRepairs(OutgoingStream &stream,
+                                uint16_t firstSequence) {
+  uint16_t first = firstSequence - stream.firstSequence;
+  if (first >= stream.segments.size()) {
+    return;
+  }
+  for (uint8_t i = 0; i < mCodingBlock; i++) {
+    const StreamSegment &segment = stream.segments[first + i];
+    if (segment.length < QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH ||
+        segment.flags & QuackMeshTypes::STREAM_FLAG_FIN) {
+      return;
+    }
+  }
+  stream.repairSequence = firstSequence;
+  stream.repairIndex = 0;
+  stream.repairsLeft = QuackMeshFec::getRepairCount(
+      mCodingBlock, stream.lossRate / 1024.0f, mMaxRepairs);
+}
+
+bool QuackStreams::updateRepairs(OutgoingStream &stream,
+                                 bool sendingPossible) {
+  // A block that arrived completely or was partly acknowledged already is
+  // not repaired any more
+  uint16_t first = stream.repairSequence - stream.firstSequence;
+  bool missing = false;
+  for (uint8_t i = 0; i < mCodingBlock && first < stream.segments.size();
+       i++) {
+    missing |= !stream.segments[first + i].received;
+  }
+  if (!missing) {
+    stream.repairsLeft = 0;
+    return false;
+  }
+  // The repairs are handed over one at a time, so the acknowledgements that
+  // make them unnecessary can still stop them
+  if (!sendingPossible) {
+    return true;
+  }
+
+  const uint8_t *symbols[QuackMeshTypes::MAX_STREAM_CODING_BLOCK];
+  for (uint8_t i = 0; i < mCodingBlock; i++) {
+    symbols[i] = stream.segments[first + i].data;
+  }
+  uint8_t payload[sizeof(Message::data)];
+  StreamRepairHeader header = {
+      .firstSequence = stream.repairSequence,
+      .streamId = stream.streamId,
+      .coding =
+          static_cast<uint8_t>(mCodingBlock << 4 | stream.repairIndex)};
+  memcpy(payload, &header, sizeof(StreamRepairHeader));
+  QuackMeshFec::encodeRepair(symbols, mCodingBlock, stream.repairIndex,
+                             QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH,
+                             payload + sizeof(StreamRepairHeader));
+  stream.repairIndex++;
+  stream.repairsLeft--;
+
+  mSend(QuackMeshTypes::MESSAGE_TYPE_STREAM_REPAIR, stream.destination, payload,
+        sizeof(StreamRepairHeader) + QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH);
+  return stream.repairsLeft > 0;
+}
+
+void QuackStreams::addLossSample(OutgoingStream &stream, bool lost) {
+  // A moving average over roughly the last 16 frames, it decays to 0
+  if (lost) {
+    stream.lossRate += (1024 - stream.lossRate) / 16;
+  } else {
+    stream.lossRate -= (stream.lossRate + 15) / 16;
+  }
+}
+
+IncomingStream *QuackStreams::getIncomingStream(const uint8_t source[6],
+                                                uint8_t streamId) {
+  auto it = std::find_if(mIncomingStreams.begin(), mIncomingStreams.end(),
+                         [&](const IncomingStream &stream) {
+                           return stream.streamId == streamId &&
+                                  isAddressMatching(stream.source, source);
+                         });
+  if (it != mIncomingStreams.end()) {
+    return &*it;
+  }
+  if (mIncomingStreams.size() >= mMaxStreams) {
+    DEBUG(DEBUG_LEVEL_WARN,
+          "QuackStreams::getIncomingStream, too many streams\n");
+    return nullptr;
+  }
+  IncomingStream stream = {.streamId = streamId,
+                           .source = {},
+                           .nextSequence = 0,
+                           .reordered = {},
+                           .unacknowledged = 0,
+                           .finished = false,
+                           .ackDueTs = 0,
+                           .lastSeenTs = 0,
+                           .blockSegments = 0,
+                           .delivered = {},
+                           .repairs = {},
+                           .recovered = 0};
+  memcpy(stream.source, source, 6);
+  mIncomingStreams.push_back(stream);
+  return &mIncomingStreams.back();
+}
+
+void QuackStreams::handleData(const Message &message) {
+  if (message.len < sizeof(StreamHeader)) {
+    return;
+  }
+  StreamHeader header;
+  memcpy(&header, message.data, sizeof(StreamHeader));
+
+  IncomingStream *stream =
+      getIncomingStream(message.srcAddress, header.streamId);
+  if (stream == nullptr) {
+    return;
+  }
+  stream->lastSeenTs = millis();
+  acceptSegment(*stream, header.sequence, header.flags,
+                      message.data + sizeof(StreamHeader),
+                      message.len - sizeof(StreamHeader));
+  if (!stream->repairs.empty()) {
+    recoverSegments(*stream);
+  }
+}
+
+void QuackStreams::acceptSegment(IncomingStream &stream, uint16_t sequence,
+                                 uint8_t flags, const uint8_t *data,
+                                 uint8_t length) {
+  // Segments that were delivered already or lie beyond the window are only
+  // acknowledged again, an early segment is buffered. Both tell the sender
+  // which segment is missing
+  uint16_t offset = sequence - stream.nextSequence;
+  if (offset > 0) {
+    bool buffered = std::any_of(
+        stream.reordered.begin(), stream.reordered.end(),
+        [&](const StreamSegment &segment) {
+          return segment.sequence == sequence;
+        });
+    if (offset < mWindow && !buffered) {
+      StreamSegment segment = {.sequence = sequence,
+                               .flags = flags,
+                               .length = length,
+                               .data = {},
+                               .transmissions = 0,
+                               .received = false,
+                               .sentTs = 0};
+      memcpy(segment.data, data, length);
+      stream.reordered.push_back(segment);
+    }
+    sendAck(stream);
+    return;
+  }
+
+  bool gapFilled = !stream.reordered.empty();
+  deliverSegment(stream, flags, data, length);
+
+  auto next = stream.reordered.begin();
+  while (next != stream.reordered.end()) {
+    if (next->sequence != stream.nextSequence) {
+      next++;
+      continue;
+    }
+    deliverSegment(stream, next->flags, next->data, next->length);
+    stream.reordered.erase(next);
+    next = stream.reordered.begin();
+  }
+
+  // Every second segment is acknowledged, a filled gap and the end of the
+  // stream right away
+  if (stream.unacknowledged++ == 0) {
+    stream.ackDueTs = millis();
+  }
+  if (gapFilled || stream.finished || stream.unacknowledged >= 2) {
+    sendAck(stream);
+  }
+}
+
+void QuackStreams::deliverSegment(IncomingStream &stream, uint8_t flags,
+                                  const uint8_t *data, uint8_t length) {
+  bool finished = flags & QuackMeshTypes::STREAM_FLAG_FIN;
+  if (!stream.finished && mOnDataCallback) {
+    mOnDataCallback(stream.source, stream.streamId, data, length,
+                          finished);
+  }
+  stream.finished |= finished;
+
+  // The segment may be needed to decode the rest of its block
+  if (stream.blockSegments > 0) {
+    StreamSegment segment = {.sequence = stream.nextSequence,
+                             .flags = flags,
+                             .length = length,
+                             .data = {},
+                             .transmissions = 0,
+                             .received = false,
+                             .sentTs = 0};
+    memcpy(segment.data, data, length);
+    stream.delivered.push_back(segment);
+  }
+  stream.nextSequence++;
+  if (stream.blockSegments > 0 &&
+      stream.nextSequence % stream.blockSegments == 0) {
+    stream.delivered.clear();
+  }
+}
+
+void QuackStreams::handleRepair(const Message &message) {
+  if (message.len < sizeof(StreamRepairHeader) +
+                        QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH) {
+    return;
+  }
+  StreamRepairHeader header;
+  memcpy(&header, message.data, sizeof(StreamRepairHeader));
+  uint8_t blockSegments = header.coding >> 4;
+  if (blockSegments == 0 ||
+      blockSegments > QuackMeshTypes::MAX_STREAM_CODING_BLOCK) {
+    return;
+  }
+
+  IncomingStream *stream =
+      getIncomingStream(message.srcAddress, header.streamId);
+  if (stream == nullptr) {
+    return;
+  }
+  stream->lastSeenTs = millis();
+  if (stream->blockSegments != blockSegments) {
+    stream->blockSegments = blockSegments;
+    stream->delivered.clear();
+  }
+
+  // Blocks that were delivered or lie beyond the window are not decoded
+  int16_t offset = header.firstSequence - stream->nextSequence;
+  if (offset + blockSegments <= 0 || offset >= mWindow) {
+    return;
+  }
+  uint8_t index = header.coding & 0x0F;
+  bool known = std::any_of(stream->repairs.begin(), stream->repairs.end(),
+                           [&](const StreamRepair &repair) {
+                             return repair.firstSequence ==
+                                        header.firstSequence &&
+                                    repair.index == index;
+                           });
+  if (known) {
+    return;
+  }
+  if (stream->repairs.size() >= mMaxRepairsBuffered) {
+    stream->repairs.erase(stream->repairs.begin());
+  }
+  StreamRepair repair = {.firstSequence = header.firstSequence,
+                         .blockSegments = blockSegments,
+                         .index = index,
+                         .data = {}};
+  memcpy(repair.data, message.data + sizeof(StreamRepairHeader),
+         QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH);
+  stream->repairs.push_back(repair);
+  recoverSegments(*stream);
+}
+
+void QuackStreams::recoverSegments(IncomingStream &stream) {
+  constexpr size_t LENGTH = QuackMeshTypes::MAX_STREAM_SEGMENT_LENGTH;
+
+  // Repairs of delivered blocks are dropped, the others decoded if possible
+  std::vector<uint16_t> blocks;
+  auto it = stream.repairs.begin();
+  while (it != stream.repairs.end()) {
+    int16_t end = it->firstSequence + it->blockSegments - stream.nextSequence;
+    if (end <= 0) {
+      it = stream.repairs.erase(it);
+      continue;
+    }
+    if (std::find(blocks.begin(), blocks.end(), it->firstSequence) ==
+        blocks.end()) {
+      blocks.push_back(it->firstSequence);
+    }
+    it++;
+  }
+
+  for (uint16_t firstSequence : blocks) {
+    const uint8_t *repairs[QuackMeshFec::MAX_SYMBOLS];
+    uint8_t indices[QuackMeshFec::MAX_SYMBOLS];
+    uint8_t repairCount = 0;
+    uint8_t blockSegments = 0;
+    for (const StreamRepair &repair : stream.repairs) {
+      if (repair.firstSequence == firstSequence &&
+          repairCount < QuackMeshFec::MAX_SYMBOLS) {
+        repairs[repairCount] = repair.data;
+        indices[repairCount++] = repair.index;
+        blockSegments = repair.blockSegments;
+      }
+    }
+
+    // The known segments are delivered ones of the current block or
+    // buffered ones, a partial segment means the block was not coded
+    uint8_t *symbols[QuackMeshTypes::MAX_STREAM_CODING_BLOCK];
+    bool present[QuackMeshTypes::MAX_STREAM_CODING_BLOCK];
+    std::vector<uint8_t> recovered(blockSegments * LENGTH);
+    uint8_t missing = 0;
+    bool coded = true;
+    for (uint8_t i = 0; i < blockSegments; i++) {
+      uint16_t sequence = firstSequence + i;
+      auto matches = [&](const StreamSegment &segment) {
+        return segment.sequence == sequence;
+      };
+      StreamSegment *segment = nullptr;
+      auto delivered = std::find_if(stream.delivered.begin(),
+                                    stream.delivered.end(), matches);
+      auto reordered = std::find_if(stream.reordered.begin(),
+                                    stream.reordered.end(), matches);
+      if (delivered != stream.delivered.end()) {
+        segment = &*delivered;
+      } else if (reordered != stream.reordered.end()) {
+        segment = &*reordered;
+      }
+      present[i] = segment != nullptr;
+      if (segment == nullptr) {
+        symbols[i] = recovered.data() + i * LENGTH;
+        missing++;
+      } else if (segment->length < LENGTH) {
+        coded = false;
+      } else {
+        symbols[i] = segment->data;
+      }
+    }
+    if (!coded || missing > repairCount) {
+      continue;
+    }
+    if (missing > 0 &&
+        QuackMeshFec::decodeSymbols(symbols, present, blockSegments, repairs,
+                                    indices, repairCount, LENGTH) < 0) {
+      continue;
+    }
+    stream.repairs.erase(
+        std::remove_if(stream.repairs.begin(), stream.repairs.end(),
+                       [&](const StreamRepair &repair) {
+                         return repair.firstSequence == firstSequence;
+                       }),
+        stream.repairs.end());
+
+    // Segments delivered before the repairs were kept are skipped
+    for (uint8_t i = 0; i < blockSegments; i++) {
+      uint16_t sequence = firstSequence + i;
+      if (present[i] ||
+          static_cast<int16_t>(sequence - stream.nextSequence) < 0) {
+        continue;
+      }
+      stream.recovered++;
+      acceptSegment(stream, sequence, 0, symbols[i], LENGTH);
+    }
+  }
+}
+
+void QuackStreams::handleAck(const Message &message) {
+  if (message.len < sizeof(StreamAckPayload)) {
+    return;
+  }
+  StreamAckPayload payload;
+  memcpy(&payload, message.data, sizeof(StreamAckPayload));
+
+  auto it = std::find_if(mOutgoingStreams.begin(), mOutgoingStreams.end(),
+                         [&](const OutgoingStream &stream) {
+                           return stream.streamId == payload.streamId &&
+                                  isAddressMatching(stream.destination,
+                                                    message.srcAddress);
+                         });
+  if (it == mOutgoingStreams.end()) {
+    return;
+  }
+  uint16_t acknowledged = payload.nextSequence - it->firstSequence;
+  uint16_t inFlight = it->sendSequence - it->firstSequence;
+  // Acknowledgements overtaken by newer ones are ignored
+  if (acknowledged > inFlight) {
+    return;
+  }
+  it->peerWindow = std::max<uint8_t>(payload.window, 1);
+  u_long now = millis();
+
+  // Every segment the receiver recovered was lost on the way
+  for (uint8_t lost = payload.recovered - it->recovered; lost > 0; lost--) {
+    addLossSample(*it, true);
+  }
+  it->recovered = payload.recovered;
+
+  // The round trip time is measured with the newest segment the receiver
+  // reports for the first time, if it was sent only once
+  const StreamSegment *measured = nullptr;
+  for (size_t i = 0; i < inFlight; i++) {
+    StreamSegment &segment = it->segments[i];
+    bool received =
+        i < acknowledged || (i > acknowledged &&
+                             (payload.received >> (i - acknowledged - 1)) & 1);
+    if (received && !segment.received) {
+      segment.received = true;
+      addLossSample(*it, false);
+      measured = segment.transmissions == 1 ? &segment : nullptr;
+    }
+  }
+  if (measured != nullptr) {
+    u_long rtt = now - measured->sentTs;
+    if (it->smoothedRtt == 0) {
+      it->smoothedRtt = rtt;
+      it->rttVariation = rtt / 2;
+    } else {
+      u_long deviation = it->smoothedRtt > rtt ? it->smoothedRtt - rtt
+                                               : rtt - it->smoothedRtt;
+      it->rttVariation = (3 * it->rttVariation + deviation) / 4;
+      it->smoothedRtt = (7 * it->smoothedRtt + rtt) / 8;
+    }
+    it->retransmitTimeout = std::min(
+        std::max(it->smoothedRtt + 4 * it->rttVariation, MIN_TIMEOUT),
+        MAX_TIMEOUT);
+  }
+
+  if (acknowledged > 0) {
+    it->segments.erase(it->segments.begin(),
+                       it->segments.begin() + acknowledged);
+    it->firstSequence += acknowledged;
+    inFlight -= acknowledged;
+    it->timeouts = 0;
+    it->retransmitTs = now;
+  }
+
+  // A segment is missing if a later one arrived, it is sent again at most
+  // once per round trip
+  u_long lossDelay =
+      it->smoothedRtt > 0 ? it->smoothedRtt : it->retransmitTimeout / 2;
+  bool laterReceived = false;
+  for (size_t i = inFlight; i-- > 0;) {
+    StreamSegment &segment = it->segments[i];
+    if (segment.received) {
+      laterReceived = true;
+    } else if (laterReceived && now - segment.sentTs >= lossDelay) {
+      sendSegment(*it, segment);
+    }
+  }
+
+  if (it->closing && it->segments.empty()) {
+    OutgoingStream stream = *it;
+    mOutgoingStreams.erase(it);
+    if (stream.callback) {
+      stream.callback(stream.streamId, QuackMeshTypes::STREAM_CLOSED);
+    }
+  }
+}
+
+void QuackStreams::sendAck(IncomingStream &stream) {
+  StreamAckPayload payload = {.nextSequence = stream.nextSequence,
+                              .streamId = stream.streamId,
+                              .window = mWindow,
+                              .received = 0,
+                              .recovered = stream.recovered};
+  for (const StreamSegment &segment : stream.reordered) {
+    uint16_t offset = segment.sequence - stream.nextSequence;
+    payload.received |= 1 << (offset - 1);
+  }
+  stream.unacknowledged = 0;
+
+  mSend(QuackMeshTypes::MESSAGE_TYPE_STREAM_ACK, stream.source,
+        reinterpret_cast<uint8_t *>(&payload), sizeof(StreamAckPayload));
+}
@@ -0,0 +1,268 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "QuackTimeSync.h"
+
+#include <algorithm>
+
+#ifdef ESP32
+#include <esp_timer.h>
+#endif
+
+#include "ESPNowClient.h"
+#include "QuackDebug.h"
+
+using QuackMeshESPNow::isAddressMatching;
+
+using QuackMeshTypes::TimeSyncNeighbour;
+using QuackMeshTypes::TimeSyncPayload;
+using QuackMeshTypes::TimeSyncPoint;
+using QuackMeshTypes::TimeSyncSendState;
+
+// PUBLIC:
+
+void QuackTimeSync::configure(u_long beaconInterval, bool canBeRoot) {
+  mBeaconInterval = beaconInterval;
+  mCanBeRoot = canBeRoot;
+}
+
+void QuackTimeSync::begin(const uint8_t ownAddress[6]) {
+  memcpy(mOwnAddress, ownAddress, 6);
+  mHasRoot = false;
+  mPoints.clear();
+  mNeighbours.clear();
+  for (TimeSyncSendState &state : mSendStates) {
+    state.lastSendTimeValid = false;
+  }
+
+  // Give an existing root the chance to be heard before taking over
+  mLastRootHeardTs = millis();
+  mLastBeaconTs = millis();
+}
+
+bool QuackTimeSync::update() {
+  u_long now = millis();
+
+  // A node that only listens uses the interval it heard the root's rounds in
+  u_long interval =
+      mBeaconInterval != 0 ? mBeaconInterval : mHeardBeaconInterval;
+  if (!isRoot() && interval != 0 &&
+      now - mLastRootHeardTs > mRootTimeoutFactor * interval) {
+    if (mCanBeRoot && mBeaconInterval != 0) {
+      becomeRoot();
+    } else {
+      mHasRoot = false;
+      mPoints.clear();
+      mHeardBeaconInterval = 0;
+      mLastRootHeardTs = now;
+    }
+  }
+
+  if (mBeaconInterval == 0) {
+    return false;
+  }
+
+  if (now - mLastBeaconTs < mBeaconInterval) {
+    return false;
+  }
+  if (!isRoot() && mPoints.size() < mMinPointsToBeacon) {
+    return false;
+  }
+
+  mLastBeaconTs = now;
+  if (isRoot()) {
+    mSequence++;
+  }
+  return true;
+}
+
+void QuackTimeSync::fillBeacon(TimeSyncPayload &payload, uint8_t channel) {
+  TimeSyncSendState &state =
+      mSendStates[channel <= QuackMeshTypes::MAX_WIFI_CHANNEL ? channel : 0];
+
+  payload.previousSendTime = state.lastSendTime;
+  memcpy(payload.rootAddress, mRootAddress, 6);
+  payload.sequence = mSequence;
+  payload.beaconId = mNextBeaconId;
+  payload.previousBeaconId = state.lastSentBeaconId;
+  payload.hasPrevious = state.lastSendTimeValid ? 1 : 0;
+
+  state.inFlightBeaconId = mNextBeaconId++;
+  state.lastSendTimeValid = false;
+}
+
+void QuackTimeSync::onBeaconSent(u_long sentMicros, uint8_t channel) {
+  TimeSyncSendState &state =
+      mSendStates[channel <= QuackMeshTypes::MAX_WIFI_CHANNEL ? channel : 0];
+
+  state.lastSendTime = toMeshTime(toLocalTime(sentMicros));
+  state.lastSentBeaconId = state.inFlightBeaconId;
+  state.lastSendTimeValid = true;
+}
+
+void QuackTimeSync::onBeaconReceived(const uint8_t neighbour[6],
+                                     const TimeSyncPayload &payload,
+                                     u_long receivedMicros) {
+  uint64_t receivedTime = toLocalTime(receivedMicros);
+
+  if (isAddressMatching(payload.rootAddress, mOwnAddress)) {
+    // A beacon of our own tree, nothing to learn for the root
+    if (isRoot()) {
+      return;
+    }
+  } else if (!mHasRoot || memcmp(payload.rootAddress, mRootAddress, 6) < 0) {
+    adoptRoot(payload.rootAddress);
+  } else if (!isAddressMatching(payload.rootAddress, mRootAddress)) {
+    // The sender follows a root with a higher address, it will switch to ours
+    return;
+  }
+
+  if (isRoot()) {
+    return;
+  }
+
+  u_long now = millis();
+  mLastRootHeardTs = now;
+  if (mPoints.empty() ||
+      static_cast<int16_t>(payload.sequence - mSequence) > 0) {
+    // The longest gap between rounds covers rounds missed while asleep
+    if (mBeaconInterval == 0 && !mPoints.empty()) {
+      mHeardBeaconInterval = std::max(mHeardBeaconInterval, now - mLastRoundTs);
+    }
+    mLastRoundTs = now;
+    mSequence = payload.sequence;
+  }
+
+  TimeSyncNeighbour *lastBeacon = nullptr;
+  for (TimeSyncNeighbour &entry : mNeighbours) {
+    if (isAddressMatching(entry.address, neighbour)) {
+      lastBeacon = &entry;
+      break;
+    }
+  }
+
+  // Pair the send time of the previous beacon with its receive time
+  if (lastBeacon != nullptr && payload.hasPrevious &&
+      payload.previousBeaconId == lastBeacon->beaconId &&
+      (mPoints.empty() ||
+       static_cast<int16_t>(lastBeacon->sequence - mLastSampleSequence) > 0)) {
+    int64_t localTime = static_cast<int64_t>(lastBeacon->receivedTime);
+    int64_t offset = static_cast<int64_t>(payload.previousSendTime) - localTime;
+    mLastSampleSequence = lastBeacon->sequence;
+    addPoint(localTime, offset);
+  }
+
+  if (lastBeacon == nullptr) {
+    if (mNeighbours.size() >= mMaxNeighbours) {
+      mNeighbours.erase(mNeighbours.begin());
+    }
+    TimeSyncNeighbour newNeighbour = {};
+    memcpy(newNeighbour.address, neighbour, 6);
+    mNeighbours.push_back(newNeighbour);
+    lastBeacon = &mNeighbours.back();
+  }
+  lastBeacon->beaconId = payload.beaconId;
+  lastBeacon->sequence = payload.sequence;
+  lastBeacon->receivedTime = receivedTime;
+}
+
+uint64_t QuackTimeSync::meshMicros() { return toMeshTime(localMicros()); }
+
+uint64_t QuackTimeSync::toMeshTime(uint64_t localTime) const {
+  if (isRoot() || mPoints.empty()) {
+    return localTime;
+  }
+  int64_t elapsed = static_cast<int64_t>(localTime) - mLocalAverage;
+  return localTime + mOffsetAverage + static_cast<int64_t>(mSkew * elapsed);
+}
+
+bool QuackTimeSync::isSynced() const { return isRoot() || !mPoints.empty(); }
+
+bool QuackTimeSync::isRoot() const {
+  return mHasRoot && isAddressMatching(mRootAddress, mOwnAddress);
+}
+
+uint64_t QuackTimeSync::localMicros() {
+#ifdef ESP32
+  return esp_timer_get_time();
+#elif defined(ESP8266)
+  return micros64();
+#else
+  return micros();
+#endif
+}
+
+uint64_t QuackTimeSync::toLocalTime(u_long microsTs) {
+  uint32_t age = static_cast<uint32_t>(micros()) - static_cast<uint32_t>(microsTs);
+  return localMicros() - age;
+}
+
+// PRIVATE:
+
+void QuackTimeSync::addPoint(int64_t localTime, int64_t offset) {
+  // A point far off the estimate means the root or our clock jumped
+  if (mPoints.size() >= mMinPointsToBeacon) {
+    int64_t predicted = static_cast<int64_t>(toMeshTime(localTime)) - localTime;
+    int64_t error = offset - predicted;
+    if (error > mMaxPointError || error < -mMaxPointError) {
+      DEBUG(DEBUG_LEVEL_WARN, "QuackTimeSync::addPoint, resynchronising\n");
+      mPoints.clear();
+    }
+  }
+
+  if (mPoints.size() >= mMaxPoints) {
+    mPoints.erase(mPoints.begin());
+  }
+  mPoints.push_back(TimeSyncPoint{.localTime = localTime, .offset = offset});
+
+  recalculate();
+}
+
+void QuackTimeSync::recalculate() {
+  int64_t localSum = 0;
+  int64_t offsetSum = 0;
+  int64_t localBase = mPoints.front().localTime;
+  int64_t offsetBase = mPoints.front().offset;
+  for (const TimeSyncPoint &point : mPoints) {
+    localSum += point.localTime - localBase;
+    offsetSum += point.offset - offsetBase;
+  }
+  int64_t count = static_cast<int64_t>(mPoints.size());
+  mLocalAverage = localBase + localSum / count;
+  mOffsetAverage = offsetBase + offsetSum / count;
+
+  double covariance = 0;
+  double variance = 0;
+  for (const TimeSyncPoint &point : mPoints) {
+    double localDiff = static_cast<double>(point.localTime - mLocalAverage);
+    double offsetDiff = static_cast<double>(point.offset - mOffsetAverage);
+    covariance += localDiff * offsetDiff;
+    variance += localDiff * localDiff;
+  }
+  mSkew = variance > 0 ? covariance / variance : 0;
+}
+
+void QuackTimeSync::becomeRoot() {
+  DEBUG(DEBUG_LEVEL_DEBUG, "QuackTimeSync::becomeRoot\n");
+  adoptRoot(mOwnAddress);
+}
+
+void QuackTimeSync::adoptRoot(const uint8_t rootAddress[6]) {
+  memcpy(mRootAddress, rootAddress, 6);
+  mHasRoot = true;
+  mSequence = 0;
+  mLastSampleSequence = 0;
+  mPoints.clear();
+  mNeighbours.clear();
+  for (TimeSyncSendState &state : mSendStates) {
+    state.lastSendTimeValid = false;
+  }
+  mSkew = 0;
+  mHeardBeaconInterval = 0;
+  mLastRootHeardTs = millis();
+}
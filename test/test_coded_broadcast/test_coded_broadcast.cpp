@@ -0,0 +1,168 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include <ArduinoFake.h>
+#include <unity.h>
+
+#include <random>
+#include <vector>
+
+#include "QuackCodedBroadcast.h"
+
+using namespace fakeit;
+
+using QuackMeshTypes::Message;
+
+namespace {
+
+unsigned long gNow = 0;  // The time millis() returns
+std::mt19937 gRandom;    // Backs random() and the losses of the links
+
+/**
+ * A node that keeps what it sends until it is handed to the other node
+ */
+struct Node {
+  uint8_t address[6];
+  QuackCodedBroadcast broadcast;
+  std::vector<std::vector<uint8_t>> outbox;
+  std::vector<uint8_t> data;
+  uint8_t source[6] = {};
+  int deliveries = 0;
+
+  explicit Node(uint8_t id) : address{0x02, 0, 0, 0, 0, id} {
+    broadcast.begin(address, [this](const uint8_t *payload, size_t length) {
+      outbox.emplace_back(payload, payload + length);
+    });
+    broadcast.setOnDataCallback([this](const uint8_t srcAddress[6],
+                                       const uint8_t *received,
+                                       size_t length) {
+      memcpy(source, srcAddress, 6);
+      data.assign(received, received + length);
+      deliveries++;
+    });
+  }
+
+  // Hand everything sent so far to another node, each message is lost with
+  // the given probability
+  void sendTo(Node &other, float loss) {
+    uint8_t networkID[2] = {0, 0};
+    uint8_t broadcastAddress[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    for (const std::vector<uint8_t> &payload : outbox) {
+      if (std::uniform_real_distribution<float>(0, 1)(gRandom) < loss) {
+        continue;
+      }
+      Message message(networkID, QuackMeshTypes::MESSAGE_TYPE_CODED_BROADCAST,
+                      0, 1, address, broadcastAddress, payload.size(),
+                      payload.data());
+      other.broadcast.onMessageReceived(message);
+    }
+    outbox.clear();
+  }
+};
+
+std::vector<uint8_t> makeData(size_t length) {
+  std::vector<uint8_t> data(length);
+  for (uint8_t &byte : data) {
+    byte = gRandom();
+  }
+  return data;
+}
+
+// Let the nodes talk until the receiver decoded the data or gives up
+void run(Node &sender, Node &receiver, float loss) {
+  for (int step = 0; step < 10000 && receiver.deliveries == 0; step++) {
+    gNow += 10;
+    sender.broadcast.update(true);
+    receiver.broadcast.update(true);
+    sender.sendTo(receiver, loss);
+    receiver.sendTo(sender, 0);
+  }
+}
+
+}  // namespace
+
+void setUp() {
+  ArduinoFakeReset();
+  gNow = 0;
+  gRandom.seed(0xC0DE);
+  When(Method(ArduinoFake(), millis)).AlwaysDo([]() -> unsigned long {
+    return gNow;
+  });
+  When(OverloadedMethod(ArduinoFake(), random, long(long)))
+      .AlwaysDo([](long max) -> long {
+        return std::uniform_int_distribution<long>(0, max - 1)(gRandom);
+      });
+}
+
+void tearDown() {}
+
+void test_rejects_invalid_length() {
+  Node sender(1);
+  TEST_ASSERT_EQUAL_INT(-1, sender.broadcast.broadcast(nullptr, 0));
+  std::vector<uint8_t> data =
+      makeData(QuackMeshTypes::MAX_RELIABLE_BROADCAST_LENGTH + 1);
+  TEST_ASSERT_EQUAL_INT(-1,
+                        sender.broadcast.broadcast(data.data(), data.size()));
+}
+
+void test_single_packet() {
+  Node sender(1);
+  Node receiver(2);
+  std::vector<uint8_t> data = makeData(50);
+  TEST_ASSERT_EQUAL_INT(0, sender.broadcast.broadcast(data.data(), data.size()));
+  run(sender, receiver, 0);
+  TEST_ASSERT_EQUAL_INT(1, receiver.deliveries);
+  TEST_ASSERT_TRUE(receiver.data == data);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(sender.address, receiver.source, 6);
+}
+
+void test_full_generation_without_loss() {
+  Node sender(1);
+  Node receiver(2);
+  // The last packet is only partly filled
+  std::vector<uint8_t> data =
+      makeData(QuackMeshTypes::MAX_RELIABLE_BROADCAST_LENGTH - 77);
+  TEST_ASSERT_EQUAL_INT(0, sender.broadcast.broadcast(data.data(), data.size()));
+  run(sender, receiver, 0);
+  TEST_ASSERT_EQUAL_INT(1, receiver.deliveries);
+  TEST_ASSERT_TRUE(receiver.data == data);
+}
+
+void test_random_losses_are_repaired() {
+  for (int round = 0; round < 20; round++) {
+    Node sender(1);
+    Node receiver(2);
+    std::vector<uint8_t> data = makeData(
+        1 + gRandom() % QuackMeshTypes::MAX_RELIABLE_BROADCAST_LENGTH);
+    TEST_ASSERT_EQUAL_INT(0,
+                          sender.broadcast.broadcast(data.data(), data.size()));
+    run(sender, receiver, 0.4f);
+    TEST_ASSERT_EQUAL_INT(1, receiver.deliveries);
+    TEST_ASSERT_TRUE(receiver.data == data);
+
+    // Further combinations are not innovative and deliver nothing again
+    run(sender, receiver, 0);
+    for (int step = 0; step < 100; step++) {
+      gNow += 10;
+      sender.broadcast.update(true);
+      receiver.broadcast.update(true);
+      sender.sendTo(receiver, 0);
+      receiver.sendTo(sender, 0);
+    }
+    TEST_ASSERT_EQUAL_INT(1, receiver.deliveries);
+  }
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_rejects_invalid_length);
+  RUN_TEST(test_single_packet);
+  RUN_TEST(test_full_generation_without_loss);
+  RUN_TEST(test_random_losses_are_repaired);
+  return UNITY_END();
+}
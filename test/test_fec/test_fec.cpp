@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include <unity.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "QuackFec.h"
+
+using QuackMeshFec::MAX_SYMBOLS;
+
+namespace {
+
+constexpr size_t SYMBOL_LENGTH = 37;  // Odd, so no loop relies on words
+
+std::mt19937 gRandom;  // Seeded in setUp(), every run sees the same blocks
+
+}  // namespace
+
+void setUp() { gRandom.seed(0x51C0); }
+
+void tearDown() {}
+
+void test_multiply_and_invert() {
+  TEST_ASSERT_EQUAL_UINT8(0, QuackMeshFec::multiply(0, 0x53));
+  TEST_ASSERT_EQUAL_UINT8(0x53, QuackMeshFec::multiply(1, 0x53));
+  for (uint16_t a = 1; a < 256; a++) {
+    TEST_ASSERT_EQUAL_UINT8(
+        1, QuackMeshFec::multiply(a, QuackMeshFec::invert(a)));
+  }
+}
+
+void test_random_erasures_are_recovered() {
+  for (int round = 0; round < 200; round++) {
+    uint8_t count = 1 + gRandom() % MAX_SYMBOLS;
+    uint8_t repairCount = 1 + gRandom() % MAX_SYMBOLS;
+
+    std::vector<std::vector<uint8_t>> data(
+        count, std::vector<uint8_t>(SYMBOL_LENGTH));
+    std::vector<const uint8_t *> dataPointers;
+    for (std::vector<uint8_t> &symbol : data) {
+      std::generate(symbol.begin(), symbol.end(),
+                    [] { return static_cast<uint8_t>(gRandom()); });
+      dataPointers.push_back(symbol.data());
+    }
+
+    // Any subset of the repairs works, not only the first ones
+    std::vector<uint8_t> allIndices(MAX_SYMBOLS);
+    for (uint8_t i = 0; i < MAX_SYMBOLS; i++) {
+      allIndices[i] = i;
+    }
+    std::shuffle(allIndices.begin(), allIndices.end(), gRandom);
+    std::vector<uint8_t> indices(allIndices.begin(),
+                                 allIndices.begin() + repairCount);
+    std::vector<std::vector<uint8_t>> repairs(
+        repairCount, std::vector<uint8_t>(SYMBOL_LENGTH));
+    std::vector<const uint8_t *> repairPointers;
+    for (uint8_t i = 0; i < repairCount; i++) {
+      QuackMeshFec::encodeRepair(dataPointers.data(), count, indices[i],
+                                 SYMBOL_LENGTH, repairs[i].data());
+      repairPointers.push_back(repairs[i].data());
+    }
+
+    // The lost symbols are filled with garbage, the decoder must not read it
+    uint8_t lost = gRandom() % (std::min(count, repairCount) + 1);
+    std::vector<uint8_t> order(count);
+    for (uint8_t i = 0; i < count; i++) {
+      order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), gRandom);
+    std::vector<std::vector<uint8_t>> received = data;
+    std::vector<uint8_t *> receivedPointers;
+    bool present[MAX_SYMBOLS];
+    std::fill(present, present + MAX_SYMBOLS, true);
+    for (uint8_t i = 0; i < lost; i++) {
+      present[order[i]] = false;
+      std::fill(received[order[i]].begin(), received[order[i]].end(), 0xA5);
+    }
+    for (std::vector<uint8_t> &symbol : received) {
+      receivedPointers.push_back(symbol.data());
+    }
+
+    int recovered = QuackMeshFec::decodeSymbols(
+        receivedPointers.data(), present, count, repairPointers.data(),
+        indices.data(), repairCount, SYMBOL_LENGTH);
+    TEST_ASSERT_EQUAL_INT(lost, recovered);
+    for (uint8_t i = 0; i < count; i++) {
+      TEST_ASSERT_EQUAL_UINT8_ARRAY(data[i].data(), received[i].data(),
+                                    SYMBOL_LENGTH);
+    }
+  }
+}
+
+void test_too_many_erasures_fail() {
+  uint8_t symbols[3][SYMBOL_LENGTH] = {};
+  uint8_t *symbolPointers[3] = {symbols[0], symbols[1], symbols[2]};
+  uint8_t repair[SYMBOL_LENGTH] = {};
+  const uint8_t *repairPointers[1] = {repair};
+  uint8_t indices[1] = {0};
+  bool present[3] = {false, true, false};
+  TEST_ASSERT_EQUAL_INT(
+      -1, QuackMeshFec::decodeSymbols(symbolPointers, present, 3,
+                                      repairPointers, indices, 1,
+                                      SYMBOL_LENGTH));
+}
+
+void test_repair_count() {
+  TEST_ASSERT_EQUAL_UINT8(0, QuackMeshFec::getRepairCount(8, 0, 4));
+  uint8_t light = QuackMeshFec::getRepairCount(8, 0.05f, MAX_SYMBOLS);
+  uint8_t heavy = QuackMeshFec::getRepairCount(8, 0.3f, MAX_SYMBOLS);
+  TEST_ASSERT_TRUE(light <= heavy);
+  TEST_ASSERT_EQUAL_UINT8(2, QuackMeshFec::getRepairCount(8, 0.9f, 2));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_multiply_and_invert);
+  RUN_TEST(test_random_erasures_are_recovered);
+  RUN_TEST(test_too_many_erasures_fail);
+  RUN_TEST(test_repair_count);
+  return UNITY_END();
+}
@@ -0,0 +1,130 @@
+/*
+Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+
+This work is licensed under the terms of the MIT license.
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include <unity.h>
+
+#include <vector>
+
+#include "QuackFraming.h"
+
+using QuackMeshGateway::crc16;
+using QuackMeshGateway::decodeCOBS;
+using QuackMeshGateway::encodeCOBS;
+
+namespace {
+
+// Encode a buffer, check the frame and decode it again
+std::vector<uint8_t> roundTrip(const std::vector<uint8_t> &input) {
+  std::vector<uint8_t> frame(input.size() + input.size() / 254 + 2);
+  size_t frameLength = encodeCOBS(input.data(), input.size(), frame.data());
+  TEST_ASSERT_TRUE(frameLength <= frame.size());
+  TEST_ASSERT_EQUAL_UINT8(0, frame[frameLength - 1]);
+  for (size_t i = 0; i + 1 < frameLength; i++) {
+    TEST_ASSERT_TRUE(frame[i] != 0);
+  }
+
+  std::vector<uint8_t> output(frameLength);
+  size_t outputLength = decodeCOBS(frame.data(), frameLength - 1, output.data());
+  output.resize(outputLength);
+  return output;
+}
+
+// A run of non-zero bytes that does not repeat within a block
+std::vector<uint8_t> makeRun(size_t length) {
+  std::vector<uint8_t> run(length);
+  for (size_t i = 0; i < length; i++) {
+    run[i] = 1 + i % 255;
+  }
+  return run;
+}
+
+}  // namespace
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_empty_buffer() {
+  uint8_t frame[2];
+  TEST_ASSERT_EQUAL(2, encodeCOBS(nullptr, 0, frame));
+  TEST_ASSERT_EQUAL_UINT8(0x01, frame[0]);
+  TEST_ASSERT_EQUAL_UINT8(0x00, frame[1]);
+}
+
+void test_zeros() {
+  std::vector<uint8_t> input = {0x00, 0x11, 0x00, 0x00, 0x22};
+  TEST_ASSERT_TRUE(roundTrip(input) == input);
+}
+
+void test_trailing_zero() {
+  std::vector<uint8_t> input = {0x11, 0x22, 0x00};
+  uint8_t frame[5];
+  TEST_ASSERT_EQUAL(5, encodeCOBS(input.data(), input.size(), frame));
+  const uint8_t expected[5] = {0x03, 0x11, 0x22, 0x01, 0x00};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, frame, 5);
+  TEST_ASSERT_TRUE(roundTrip(input) == input);
+  TEST_ASSERT_TRUE(roundTrip({0x00}) == std::vector<uint8_t>({0x00}));
+}
+
+void test_run_of_254() {
+  std::vector<uint8_t> input = makeRun(254);
+  TEST_ASSERT_TRUE(roundTrip(input) == input);
+
+  // Other encoders end a full block without an empty one after it
+  std::vector<uint8_t> frame = {0xFF};
+  frame.insert(frame.end(), input.begin(), input.end());
+  uint8_t output[255];
+  TEST_ASSERT_EQUAL(254, decodeCOBS(frame.data(), frame.size(), output));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(input.data(), output, 254);
+
+  // A zero right after a full block must not be swallowed
+  input.push_back(0x00);
+  TEST_ASSERT_TRUE(roundTrip(input) == input);
+}
+
+void test_run_of_255() {
+  std::vector<uint8_t> input = makeRun(255);
+  std::vector<uint8_t> frame(input.size() + input.size() / 254 + 2);
+  TEST_ASSERT_EQUAL(258, encodeCOBS(input.data(), input.size(), frame.data()));
+  TEST_ASSERT_EQUAL_UINT8(0xFF, frame[0]);
+  TEST_ASSERT_EQUAL_UINT8(0x02, frame[255]);
+  TEST_ASSERT_EQUAL_UINT8(0xFF, frame[256]);
+  TEST_ASSERT_TRUE(roundTrip(input) == input);
+
+  std::vector<uint8_t> longRun = makeRun(QuackMeshGateway::MAX_PACKET_SIZE);
+  TEST_ASSERT_TRUE(roundTrip(longRun) == longRun);
+}
+
+void test_malformed_frame() {
+  // The first block claims more bytes than the frame has
+  const uint8_t frame[3] = {0x05, 0x11, 0x22};
+  uint8_t output[3];
+  TEST_ASSERT_EQUAL(0, decodeCOBS(frame, sizeof(frame), output));
+  // A code byte is never 0
+  const uint8_t zero[3] = {0x02, 0x11, 0x00};
+  TEST_ASSERT_EQUAL(0, decodeCOBS(zero, sizeof(zero), output));
+}
+
+void test_crc16() {
+  // The check value of CRC-16/CCITT-FALSE
+  const uint8_t check[9] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  TEST_ASSERT_EQUAL_HEX16(0x29B1, crc16(check, sizeof(check)));
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF, crc16(nullptr, 0));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_buffer);
+  RUN_TEST(test_zeros);
+  RUN_TEST(test_trailing_zero);
+  RUN_TEST(test_run_of_254);
+  RUN_TEST(test_run_of_255);
+  RUN_TEST(test_malformed_frame);
+  RUN_TEST(test_crc16);
+  return UNITY_END();
+}
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+# Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+#
+# This work is licensed under the terms of the MIT license.
+# For a copy, see <https://opensource.org/licenses/MIT> or
+# the LICENSE file.
+
+"""Convert the capture stream of a QuackSniffer into a pcap file.
+
+The stream is read from a serial port (requires pyserial) or from a file with
+the raw bytes. Every captured ESP-Now frame becomes a pcap record with the
+link-layer type DLT_USER0 (147) and this pseudo header in front of the frame:
+
+    version (1), channel, rssi (i8), reserved, destination (6), source (6)
+
+Open the file in Wireshark with tools/quackmesh.lua to decode the QuackMesh
+header.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+DLT_USER0 = 147
+PACKET_CAPTURE = 0x02
+PSEUDO_HEADER_VERSION = 1
+
+
+def decode_cobs(data):
+    """Decode a COBS frame without its delimiter, None if it is malformed."""
+    output = bytearray()
+    index = 0
+    while index < len(data):
+        code = data[index]
+        index += 1
+        if code == 0 or index + code - 1 > len(data):
+            return None
+        output += data[index:index + code - 1]
+        index += code - 1
+        if code != 0xFF and index < len(data):
+            output.append(0)
+    return bytes(output)
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE as used by the QuackMesh framing."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def read_packets(stream):
+    """Yield the verified packets of a COBS framed byte stream."""
+    buffer = bytearray()
+    while True:
+        chunk = stream.read(4096)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            end = buffer.find(b"\x00")
+            if end < 0:
+                break
+            frame = bytes(buffer[:end])
+            del buffer[:end + 1]
+            packet = decode_cobs(frame) if frame else None
+            if packet is None or len(packet) < 6:
+                continue
+            crc, = struct.unpack_from("<H", packet, len(packet) - 2)
+            if crc != crc16(packet[:-2]):
+                print("skipping packet with a wrong crc", file=sys.stderr)
+                continue
+            yield packet[:-2]
+
+
+def read_captures(packet):
+    """Yield the captures of a batch and report the dropped frames."""
+    # type, sequence, dropped batches (u16), dropped frames (u32)
+    _, _, dropped_batches, dropped_frames = struct.unpack_from("<BBHI", packet)
+    offset = 8
+    while offset + 2 <= len(packet):
+        length, = struct.unpack_from("<H", packet, offset)
+        record = packet[offset + 2:offset + 2 + length]
+        offset += 2 + length
+        if len(record) < 18:
+            break
+        timestamp, rssi, channel = struct.unpack_from("<IbB", record)
+        destination = record[6:12]
+        source = record[12:18]
+        yield timestamp, rssi, channel, destination, source, record[18:]
+    if dropped_batches or dropped_frames:
+        print(f"sniffer dropped {dropped_batches} batches, "
+              f"{dropped_frames} frames in total", file=sys.stderr)
+
+
+class PcapWriter:
+    """Writes pcap records, extending the 32 bit timestamps of the radio."""
+
+    def __init__(self, output, start_time):
+        self.output = output
+        self.start_time = start_time
+        self.last_timestamp = None
+        self.elapsed = 0
+        output.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535,
+                                 DLT_USER0))
+
+    def write(self, timestamp, rssi, channel, destination, source, frame):
+        if self.last_timestamp is not None:
+            self.elapsed += (timestamp - self.last_timestamp) & 0xFFFFFFFF
+        self.last_timestamp = timestamp
+        seconds, micros = divmod(int(self.start_time * 1e6) + self.elapsed,
+                                 1000000)
+
+        data = struct.pack("<BBbB", PSEUDO_HEADER_VERSION, channel, rssi, 0)
+        data += destination + source + frame
+        self.output.write(struct.pack("<IIII", seconds, micros, len(data),
+                                      len(data)))
+        self.output.write(data)
+        self.output.flush()
+
+
+def open_input(args):
+    if args.serial:
+        import serial  # pylint: disable=import-outside-toplevel
+        port = serial.Serial(args.serial, args.baud, timeout=0.1)
+
+        class SerialReader:
+            def read(self, size):
+                while True:
+                    data = port.read(size)
+                    if data:
+                        return data
+
+        return SerialReader()
+    if args.input == "-":
+        return sys.stdin.buffer
+    return open(args.input, "rb")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", nargs="?", default="-",
+                        help="file with the raw stream, - for stdin")
+    parser.add_argument("-o", "--output", required=True,
+                        help="the pcap file to write")
+    parser.add_argument("--serial", help="read from this serial port")
+    parser.add_argument("--baud", type=int, default=921600)
+    parser.add_argument("--relative", action="store_true",
+                        help="start the timestamps at 0 instead of now")
+    args = parser.parse_args()
+
+    stream = open_input(args)
+    count = 0
+    with open(args.output, "wb") as output:
+        writer = PcapWriter(output, 0 if args.relative else time.time())
+        try:
+            for packet in read_packets(stream):
+                if packet[0] != PACKET_CAPTURE:
+                    continue
+                for capture in read_captures(packet):
+                    writer.write(*capture)
+                    count += 1
+        except KeyboardInterrupt:
+            pass
+    print(f"wrote {count} frames to {args.output}", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,361 @@
+-- Copyright (c) 2023 Valentin Purrucker. All rights reserved.
+--
+-- This work is licensed under the terms of the MIT license.
+-- For a copy, see <https://opensource.org/licenses/MIT> or
+-- the LICENSE file.
+
+-- Wireshark dissector for captures written by tools/quack_pcap.py.
+-- Copy it into the Wireshark plugin folder or start Wireshark with
+--   wireshark -X lua_script:tools/quackmesh.lua capture.pcap
+-- The captures use the link-layer type DLT_USER0 (147).
+
+local capture = Proto("quackcap", "QuackMesh Capture")
+local mesh = Proto("quackmesh", "QuackMesh")
+
+local message_types = {
+  [0] = "Unconfirmed",
+  [1] = "Confirmed",
+  [3] = "Acknowledgement",
+  [4] = "Poll",
+  [5] = "Time Sync",
+  [6] = "Control",
+  [7] = "Channel Announce",
+  [8] = "Publish",
+  [9] = "Subscribe",
+  [10] = "Group Membership",
+  [11] = "Sink Advertisement",
+  [12] = "Collection Beacon",
+  [13] = "Collection Data",
+  [14] = "Aggregate",
+  [15] = "RPC Request",
+  [16] = "RPC Response",
+  [17] = "Stream Data",
+  [18] = "Stream Ack",
+  [19] = "Image Summary",
+  [20] = "Image Request",
+  [21] = "Image Data",
+  [22] = "Stream Repair",
+  [23] = "Coded Broadcast",
+  [24] = "Congestion",
+  [25] = "Slot Claim",
+}
+
+local cf = {
+  version = ProtoField.uint8("quackcap.version", "Version"),
+  channel = ProtoField.uint8("quackcap.channel", "Channel"),
+  rssi = ProtoField.int8("quackcap.rssi", "RSSI (dBm)"),
+  dest = ProtoField.ether("quackcap.dst", "Receiver"),
+  src = ProtoField.ether("quackcap.src", "Transmitter"),
+}
+capture.fields = { cf.version, cf.channel, cf.rssi, cf.dest, cf.src }
+
+local mf = {
+  network = ProtoField.uint16("quackmesh.network", "Network ID", base.HEX),
+  type = ProtoField.uint8("quackmesh.type", "Type", base.DEC, message_types),
+  id = ProtoField.uint8("quackmesh.id", "ID"),
+  hops = ProtoField.uint8("quackmesh.hops", "Hop Count"),
+  src = ProtoField.ether("quackmesh.src", "Source"),
+  dest = ProtoField.ether("quackmesh.dst", "Destination"),
+  len = ProtoField.uint8("quackmesh.len", "Length"),
+  data = ProtoField.bytes("quackmesh.data", "Data"),
+  sleep = ProtoField.uint32("quackmesh.poll.sleep", "Sleep Interval (ms)"),
+  awake = ProtoField.uint32("quackmesh.poll.awake", "Awake Window (ms)"),
+  sync_time = ProtoField.uint64("quackmesh.sync.previous_send_time",
+                                "Previous Send Time (us)"),
+  sync_root = ProtoField.ether("quackmesh.sync.root", "Root"),
+  sync_seq = ProtoField.uint16("quackmesh.sync.sequence", "Sequence"),
+  sync_beacon = ProtoField.uint8("quackmesh.sync.beacon", "Beacon ID"),
+  sync_previous = ProtoField.uint8("quackmesh.sync.previous_beacon",
+                                   "Previous Beacon ID"),
+  sync_has_previous = ProtoField.bool("quackmesh.sync.has_previous",
+                                      "Has Previous"),
+  channel = ProtoField.uint8("quackmesh.announce.channel", "Home Channel"),
+  has_source = ProtoField.bool("quackmesh.announce.has_source", "Has Source"),
+  epoch = ProtoField.uint16("quackmesh.announce.epoch", "Epoch"),
+  topic = ProtoField.uint32("quackmesh.topic", "Topic Hash", base.HEX),
+  distance = ProtoField.uint8("quackmesh.subscribe.distance", "Distance"),
+  group = ProtoField.uint16("quackmesh.group", "Group"),
+  group_distance = ProtoField.uint8("quackmesh.group.distance", "Distance"),
+  sink_interval = ProtoField.uint32("quackmesh.sink.interval", "Interval (ms)"),
+  sink_service = ProtoField.uint16("quackmesh.sink.service", "Service"),
+  sink_seq = ProtoField.uint16("quackmesh.sink.sequence", "Sequence"),
+  sink_load = ProtoField.uint8("quackmesh.sink.load", "Load"),
+  sink_hops = ProtoField.uint8("quackmesh.sink.hops", "Hops"),
+  ctp_cost = ProtoField.uint16("quackmesh.collection.cost", "Cost (ETX/10)"),
+  ctp_parent = ProtoField.ether("quackmesh.collection.parent", "Parent"),
+  ctp_seq = ProtoField.uint8("quackmesh.collection.sequence", "Sequence"),
+  ctp_pull = ProtoField.bool("quackmesh.collection.pull", "Pull", 8, nil, 0x01),
+  ctp_congested = ProtoField.bool("quackmesh.collection.congested",
+                                  "Congested", 8, nil, 0x02),
+  ctp_thl = ProtoField.uint8("quackmesh.collection.thl", "Time Has Lived"),
+  agg_key = ProtoField.uint16("quackmesh.aggregate.key", "Key"),
+  agg_count = ProtoField.uint16("quackmesh.aggregate.count", "Count"),
+  agg_op = ProtoField.uint8("quackmesh.aggregate.op", "Operator", base.DEC, {
+    [0] = "Min", [1] = "Max", [2] = "Sum", [3] = "Count", [4] = "Average",
+    [5] = "Custom",
+  }),
+  agg_value = ProtoField.int32("quackmesh.aggregate.value", "Value"),
+  rpc_call = ProtoField.uint16("quackmesh.rpc.call_id", "Call ID"),
+  rpc_method = ProtoField.uint16("quackmesh.rpc.method", "Method"),
+  rpc_status = ProtoField.int8("quackmesh.rpc.status", "Status"),
+  stream_seq = ProtoField.uint16("quackmesh.stream.sequence", "Sequence"),
+  stream_id = ProtoField.uint8("quackmesh.stream.id", "Stream ID"),
+  stream_fin = ProtoField.bool("quackmesh.stream.fin", "FIN", 8, nil, 0x01),
+  stream_window = ProtoField.uint8("quackmesh.stream.window", "Window"),
+  stream_received = ProtoField.uint16("quackmesh.stream.received",
+                                      "Received", base.HEX),
+  stream_recovered = ProtoField.uint8("quackmesh.stream.recovered",
+                                      "Recovered"),
+  stream_block = ProtoField.uint8("quackmesh.stream.block", "Block Segments",
+                                  base.DEC, nil, 0xF0),
+  stream_repair = ProtoField.uint8("quackmesh.stream.repair", "Repair Index",
+                                   base.DEC, nil, 0x0F),
+  image_size = ProtoField.uint32("quackmesh.image.size", "Size"),
+  image_crc = ProtoField.uint32("quackmesh.image.crc", "CRC-32", base.HEX),
+  image_version = ProtoField.uint16("quackmesh.image.version", "Version"),
+  image_pages = ProtoField.uint16("quackmesh.image.pages", "Complete Pages"),
+  image_source = ProtoField.ether("quackmesh.image.source", "Asked Neighbour"),
+  image_page = ProtoField.uint16("quackmesh.image.page", "Page"),
+  image_missing = ProtoField.uint8("quackmesh.image.missing", "Missing",
+                                   base.HEX),
+  image_packet = ProtoField.uint8("quackmesh.image.packet", "Packet"),
+  coded_source = ProtoField.ether("quackmesh.coded.source", "Source"),
+  coded_generation = ProtoField.uint16("quackmesh.coded.generation",
+                                       "Generation"),
+  coded_length = ProtoField.uint16("quackmesh.coded.length", "Length"),
+  coded_packets = ProtoField.uint8("quackmesh.coded.packets", "Packets"),
+  coded_rank = ProtoField.uint8("quackmesh.coded.rank", "Rank"),
+  coded_coefficients = ProtoField.bytes("quackmesh.coded.coefficients",
+                                        "Coefficients"),
+  congestion_load = ProtoField.uint8("quackmesh.congestion.load", "Load"),
+  congestion_congested = ProtoField.bool("quackmesh.congestion.congested",
+                                         "Congested"),
+  slot = ProtoField.uint8("quackmesh.slot.slot", "Slot"),
+  slot_count = ProtoField.uint8("quackmesh.slot.count", "Neighbours"),
+  slot_neighbour = ProtoField.ether("quackmesh.slot.neighbour", "Neighbour"),
+}
+mesh.fields = {
+  mf.network, mf.type, mf.id, mf.hops, mf.src, mf.dest, mf.len, mf.data,
+  mf.sleep, mf.awake, mf.sync_time, mf.sync_root, mf.sync_seq, mf.sync_beacon,
+  mf.sync_previous, mf.sync_has_previous, mf.channel, mf.has_source, mf.epoch,
+  mf.topic, mf.distance, mf.group, mf.group_distance, mf.sink_interval,
+  mf.sink_service, mf.sink_seq, mf.sink_load, mf.sink_hops, mf.ctp_cost,
+  mf.ctp_parent, mf.ctp_seq, mf.ctp_pull, mf.ctp_congested, mf.ctp_thl,
+  mf.agg_key, mf.agg_count, mf.agg_op, mf.agg_value, mf.rpc_call,
+  mf.rpc_method, mf.rpc_status, mf.stream_seq, mf.stream_id, mf.stream_fin,
+  mf.stream_window, mf.stream_received, mf.stream_recovered,
+  mf.stream_block, mf.stream_repair, mf.image_size, mf.image_crc,
+  mf.image_version, mf.image_pages, mf.image_source, mf.image_page,
+  mf.image_missing, mf.image_packet, mf.coded_source, mf.coded_generation,
+  mf.coded_length, mf.coded_packets, mf.coded_rank, mf.coded_coefficients,
+  mf.congestion_load, mf.congestion_congested, mf.slot, mf.slot_count,
+  mf.slot_neighbour,
+}
+
+-- The payloads of the protocol messages, all little endian
+local function dissect_payload(msg_type, buffer, tree)
+  local len = buffer:len()
+  if msg_type == 4 and len >= 8 then
+    tree:add_le(mf.sleep, buffer(0, 4))
+    tree:add_le(mf.awake, buffer(4, 4))
+  elseif msg_type == 5 and len >= 19 then
+    tree:add_le(mf.sync_time, buffer(0, 8))
+    tree:add(mf.sync_root, buffer(8, 6))
+    tree:add_le(mf.sync_seq, buffer(14, 2))
+    tree:add(mf.sync_beacon, buffer(16, 1))
+    tree:add(mf.sync_previous, buffer(17, 1))
+    tree:add(mf.sync_has_previous, buffer(18, 1))
+  elseif msg_type == 7 and len >= 4 then
+    tree:add(mf.channel, buffer(0, 1))
+    tree:add(mf.has_source, buffer(1, 1))
+    tree:add_le(mf.epoch, buffer(2, 2))
+  elseif msg_type == 8 and len >= 4 then
+    tree:add_le(mf.topic, buffer(0, 4))
+    if len > 4 then
+      tree:add(mf.data, buffer(4))
+    end
+  elseif msg_type == 9 then
+    -- Topic advertisements of 8 bytes each (hash, distance, padding)
+    for offset = 0, len - 8, 8 do
+      tree:add_le(mf.topic, buffer(offset, 4))
+      tree:add(mf.distance, buffer(offset + 4, 1))
+    end
+  elseif msg_type == 10 then
+    -- Group advertisements of 4 bytes each (group, distance, padding)
+    for offset = 0, len - 4, 4 do
+      tree:add_le(mf.group, buffer(offset, 2))
+      tree:add(mf.group_distance, buffer(offset + 2, 1))
+    end
+  elseif msg_type == 11 and len >= 10 then
+    tree:add_le(mf.sink_interval, buffer(0, 4))
+    tree:add_le(mf.sink_service, buffer(4, 2))
+    tree:add_le(mf.sink_seq, buffer(6, 2))
+    tree:add(mf.sink_load, buffer(8, 1))
+    tree:add(mf.sink_hops, buffer(9, 1))
+  elseif msg_type == 12 and len >= 10 then
+    tree:add_le(mf.ctp_cost, buffer(0, 2))
+    tree:add(mf.ctp_parent, buffer(2, 6))
+    tree:add(mf.ctp_seq, buffer(8, 1))
+    tree:add(mf.ctp_pull, buffer(9, 1))
+    tree:add(mf.ctp_congested, buffer(9, 1))
+  elseif msg_type == 13 and len >= 4 then
+    -- Cost, time has lived and padding, followed by the data of the origin
+    tree:add_le(mf.ctp_cost, buffer(0, 2))
+    tree:add(mf.ctp_thl, buffer(2, 1))
+    if len > 4 then
+      tree:add(mf.data, buffer(4))
+    end
+  elseif msg_type == 14 and len >= 10 then
+    -- The collection header, then key, count, operator and padding
+    tree:add_le(mf.ctp_cost, buffer(0, 2))
+    tree:add(mf.ctp_thl, buffer(2, 1))
+    tree:add_le(mf.agg_key, buffer(4, 2))
+    tree:add_le(mf.agg_count, buffer(6, 2))
+    tree:add(mf.agg_op, buffer(8, 1))
+    if buffer(8, 1):uint() < 5 and len >= 14 then
+      tree:add_le(mf.agg_value, buffer(10, 4))
+    elseif len > 10 then
+      tree:add(mf.data, buffer(10))
+    end
+  elseif (msg_type == 15 or msg_type == 16) and len >= 6 then
+    -- Call id, method, status and padding, followed by the data
+    tree:add_le(mf.rpc_call, buffer(0, 2))
+    tree:add_le(mf.rpc_method, buffer(2, 2))
+    if msg_type == 16 then
+      tree:add(mf.rpc_status, buffer(4, 1))
+    end
+    if len > 6 then
+      tree:add(mf.data, buffer(6))
+    end
+  elseif msg_type == 22 and len >= 4 then
+    -- The first segment of the block, the repair data follows
+    tree:add_le(mf.stream_seq, buffer(0, 2))
+    tree:add(mf.stream_id, buffer(2, 1))
+    tree:add(mf.stream_block, buffer(3, 1))
+    tree:add(mf.stream_repair, buffer(3, 1))
+    if len > 4 then
+      tree:add(mf.data, buffer(4))
+    end
+  elseif msg_type == 17 and len >= 4 then
+    tree:add_le(mf.stream_seq, buffer(0, 2))
+    tree:add(mf.stream_id, buffer(2, 1))
+    tree:add(mf.stream_fin, buffer(3, 1))
+    if len > 4 then
+      tree:add(mf.data, buffer(4))
+    end
+  elseif msg_type == 18 and len >= 7 then
+    -- The next expected sequence, the segments after it are bits
+    tree:add_le(mf.stream_seq, buffer(0, 2))
+    tree:add(mf.stream_id, buffer(2, 1))
+    tree:add(mf.stream_window, buffer(3, 1))
+    tree:add_le(mf.stream_received, buffer(4, 2))
+    tree:add(mf.stream_recovered, buffer(6, 1))
+  elseif msg_type == 19 and len >= 12 then
+    tree:add_le(mf.image_size, buffer(0, 4))
+    tree:add_le(mf.image_crc, buffer(4, 4))
+    tree:add_le(mf.image_version, buffer(8, 2))
+    tree:add_le(mf.image_pages, buffer(10, 2))
+  elseif msg_type == 20 and len >= 11 then
+    tree:add(mf.image_source, buffer(0, 6))
+    tree:add_le(mf.image_version, buffer(6, 2))
+    tree:add_le(mf.image_page, buffer(8, 2))
+    tree:add(mf.image_missing, buffer(10, 1))
+  elseif msg_type == 21 and len >= 6 then
+    -- The header is padded to 6 bytes
+    tree:add_le(mf.image_version, buffer(0, 2))
+    tree:add_le(mf.image_page, buffer(2, 2))
+    tree:add(mf.image_packet, buffer(4, 1))
+    if len > 6 then
+      tree:add(mf.data, buffer(6))
+    end
+  elseif msg_type == 23 and len >= 12 then
+    -- Without the coefficients and data it only announces the rank
+    local packets = buffer(10, 1):uint()
+    tree:add(mf.coded_source, buffer(0, 6))
+    tree:add_le(mf.coded_generation, buffer(6, 2))
+    tree:add_le(mf.coded_length, buffer(8, 2))
+    tree:add(mf.coded_packets, buffer(10, 1))
+    tree:add(mf.coded_rank, buffer(11, 1))
+    if packets > 0 and len >= 12 + packets then
+      tree:add(mf.coded_coefficients, buffer(12, packets))
+      if len > 12 + packets then
+        tree:add(mf.data, buffer(12 + packets))
+      end
+    end
+  elseif msg_type == 24 and len >= 2 then
+    tree:add(mf.congestion_load, buffer(0, 1))
+    tree:add(mf.congestion_congested, buffer(1, 1))
+  elseif msg_type == 25 and len >= 2 then
+    -- The slot of the sender, then the neighbours with their slots
+    tree:add(mf.slot, buffer(0, 1))
+    tree:add(mf.slot_count, buffer(1, 1))
+    local offset = 2
+    for _ = 1, buffer(1, 1):uint() do
+      if offset + 7 > len then
+        break
+      end
+      local neighbour = tree:add(mf.slot_neighbour, buffer(offset, 6))
+      neighbour:add(mf.slot, buffer(offset + 6, 1))
+      offset = offset + 7
+    end
+  else
+    tree:add(mf.data, buffer)
+  end
+end
+
+function mesh.dissector(buffer, pinfo, tree)
+  if buffer:len() < 18 then
+    return 0
+  end
+  pinfo.cols.protocol = "QuackMesh"
+
+  local msg_type = buffer(2, 1):uint()
+  local len = buffer(17, 1):uint()
+  local subtree = tree:add(mesh, buffer(0, math.min(18 + len, buffer:len())))
+  subtree:add(mf.network, buffer(0, 2))
+  subtree:add(mf.type, buffer(2, 1))
+  subtree:add(mf.id, buffer(3, 1))
+  subtree:add(mf.hops, buffer(4, 1))
+  subtree:add(mf.src, buffer(5, 6))
+  subtree:add(mf.dest, buffer(11, 6))
+  -- Group addresses start with 03:51:4d:47 and end with the group
+  if buffer(11, 4):uint() == 0x03514d47 then
+    subtree:add(mf.group, buffer(15, 2))
+  end
+  subtree:add(mf.len, buffer(17, 1))
+
+  pinfo.cols.src = tostring(buffer(5, 6):ether())
+  pinfo.cols.dst = tostring(buffer(11, 6):ether())
+  pinfo.cols.info = string.format("%s id=%d hops=%d len=%d",
+                                  message_types[msg_type] or "Unknown",
+                                  buffer(3, 1):uint(), buffer(4, 1):uint(),
+                                  len)
+
+  if len > 0 and buffer:len() >= 18 + len then
+    dissect_payload(msg_type, buffer(18, len), subtree)
+  end
+  return buffer:len()
+end
+
+function capture.dissector(buffer, pinfo, tree)
+  if buffer:len() < 16 then
+    return 0
+  end
+  local subtree = tree:add(capture, buffer(0, 16))
+  subtree:add(cf.version, buffer(0, 1))
+  subtree:add(cf.channel, buffer(1, 1))
+  subtree:add(cf.rssi, buffer(2, 1))
+  subtree:add(cf.dest, buffer(4, 6))
+  subtree:add(cf.src, buffer(10, 6))
+  pinfo.cols.protocol = "QuackCap"
+  pinfo.cols.dl_src = tostring(buffer(10, 6):ether())
+  pinfo.cols.dl_dst = tostring(buffer(4, 6):ether())
+
+  if buffer:len() > 16 then
+    mesh.dissector(buffer(16):tvb(), pinfo, tree)
+  end
+  return buffer:len()
+end
+
+local encap = (wtap_encaps and wtap_encaps.USER0) or wtap.USER0
+DissectorTable.get("wtap_encap"):add(encap, capture)